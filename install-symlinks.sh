@@ -4,7 +4,7 @@ bindir="$1"
 
 mkdir -p "${DESTDIR}/${MESON_INSTALL_PREFIX}/$bindir"
 
-for cmd in df dl get ls test export mkdir put reg rm copy
+for cmd in df dl get ls test export mkdir put reg rm mv cp copy batch shell
 do
   ln -snf megatools "${DESTDIR}/${MESON_INSTALL_PREFIX}/$bindir/mega$cmd"
 done
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <openssl/aes.h>
 #include <openssl/modes.h>
 #include <openssl/bn.h>
@@ -36,6 +37,15 @@
 #include <openssl/err.h>
 #include <openssl/evp.h>
 
+#ifndef G_OS_WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gio/gfiledescriptorbased.h>
+#else
+#include <malloc.h>
+#endif
+
 DEFINE_CLEANUP_FUNCTION(struct http *, http_free)
 #define gc_http_free CLEANUP(http_free)
 
@@ -45,7 +55,7 @@ DEFINE_CLEANUP_FUNCTION_NULL(BN_CTX *, BN_CTX_free)
 DEFINE_CLEANUP_FUNCTION_NULL(BIGNUM *, BN_free)
 #define gc_bn_free CLEANUP(BN_free)
 
-#define CACHE_FORMAT_VERSION 4
+#define CACHE_FORMAT_VERSION 6
 
 gint mega_debug = 0;
 
@@ -103,7 +113,12 @@ struct mega_session {
 	gint max_dl;
 	gchar *proxy;
 	gint max_workers;
+	gint progress_interval; // ms
+	gint schedule_policy;
+	gint max_host_connections; // 0 means unlimited
 
+	// serializes API requests, preview jobs call the API from the pool
+	GMutex api_lock;
 	gint id;
 	gchar *sid;
 	gchar *rid;
@@ -122,14 +137,30 @@ struct mega_session {
 	GHashTable *share_keys;
 
 	GSList *fs_nodes;
+	GHashTable *nodes_by_handle; // handle -> struct mega_node, NULL until it's needed again
+	GHashTable *fingerprints; // "size:fingerprint" -> handle of a file node
 
 	// progress reporting
 	mega_status_callback status_callback;
 	gpointer status_userdata;
 
+	// asynchronous uploads
+	GQueue uploads; // struct mega_upload, in submission order
+	GAsyncQueue *upload_mailbox; // messages from the transfer manager
+	guint uploads_pending; // not completed yet
+	guint uploads_transfering; // owned by the transfer manager
+	goffset uploads_total; // aggregate progress of the pending uploads
+	goffset uploads_done;
+	GThreadPool *preview_pool; // created on first use
+	gint preview_timeout; // ms
+
 	gint64 last_refresh;
+	gchar *sn; // sequence number of the filesystem state, for incremental refresh
 	gboolean create_preview;
 	gboolean resume_enabled;
+	gboolean upload_resume_enabled;
+	gboolean dedup_enabled;
+	gboolean dedup_verify;
 };
 
 // }}}
@@ -1080,6 +1111,168 @@ static gboolean chunked_cbc_mac_finish8(struct chunked_cbc_mac *mac, guchar mac_
 	return TRUE;
 }
 
+// }}}
+// {{{ file fingerprint
+//
+// Fingerprint of the file data as computed by the official clients and
+// stored in the "c" node attribute: four CRC32 values (big endian) of sparse
+// samples of the data, followed by the modification time (length byte and
+// little endian value without trailing zeros), base64url encoded. Files up
+// to 16 bytes are stored verbatim instead of the CRCs.
+
+#define FINGERPRINT_CRC_SIZE 16
+#define FINGERPRINT_MAX_FULL 8192
+
+static guint32 crc32_table[256];
+
+static void crc32_init(void)
+{
+	static gsize initialized = 0;
+
+	if (g_once_init_enter(&initialized)) {
+		for (guint32 i = 0; i < 256; i++) {
+			guint32 c = i;
+
+			for (gint k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+
+			crc32_table[i] = c;
+		}
+
+		g_once_init_leave(&initialized, 1);
+	}
+}
+
+static guint32 crc32_update(guint32 crc, const guchar *data, gsize len)
+{
+	crc = ~crc;
+	while (len--)
+		crc = crc32_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static gboolean stream_read_at(GInputStream *stream, goffset offset, guchar *buf, gsize len, GError **err)
+{
+	gsize bytes_read = 0;
+
+	if (!g_seekable_seek(G_SEEKABLE(stream), offset, G_SEEK_SET, NULL, err))
+		return FALSE;
+
+	if (!g_input_stream_read_all(stream, buf, len, &bytes_read, NULL, err))
+		return FALSE;
+
+	if (bytes_read != len) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File is shorter than expected");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gchar *file_fingerprint_compute(GInputStream *stream, goffset size, guint64 mtime, GError **err)
+{
+	guchar fp[FINGERPRINT_CRC_SIZE + 1 + 8] = { 0 };
+	gsize fp_len = FINGERPRINT_CRC_SIZE;
+	guint32 crc[4];
+
+	g_return_val_if_fail(G_IS_SEEKABLE(stream), NULL);
+
+	crc32_init();
+
+	if (size <= FINGERPRINT_CRC_SIZE) {
+		if (size > 0 && !stream_read_at(stream, 0, fp, size, err))
+			return NULL;
+	} else if (size <= FINGERPRINT_MAX_FULL) {
+		// CRCs of the four quarters of the data
+		gc_free guchar *buf = g_malloc(size);
+
+		if (!stream_read_at(stream, 0, buf, size, err))
+			return NULL;
+
+		for (gint i = 0; i < 4; i++) {
+			goffset begin = i * size / 4;
+			goffset end = (i + 1) * size / 4;
+
+			crc[i] = GUINT32_TO_BE(crc32_update(0, buf + begin, end - begin));
+		}
+
+		memcpy(fp, crc, sizeof crc);
+	} else {
+		// CRCs of 4 x 32 blocks of 64 bytes spread evenly over the data
+		guchar block[4 * sizeof crc];
+		const guint blocks = FINGERPRINT_MAX_FULL / (sizeof block * 4);
+
+		for (guint i = 0; i < 4; i++) {
+			guint32 c = 0;
+
+			for (guint j = 0; j < blocks; j++) {
+				goffset offset = (size - sizeof block) * (i * blocks + j) / (4 * blocks - 1);
+
+				if (!stream_read_at(stream, offset, block, sizeof block, err))
+					return NULL;
+
+				c = crc32_update(c, block, sizeof block);
+			}
+
+			crc[i] = GUINT32_TO_BE(c);
+		}
+
+		memcpy(fp, crc, sizeof crc);
+	}
+
+	guchar n = 0;
+	for (guint64 v = mtime; v; v >>= 8)
+		fp[fp_len + 1 + n++] = v & 0xff;
+	fp[fp_len] = n;
+	fp_len += 1 + n;
+
+	return base64urlencode(fp, fp_len);
+}
+
+// fingerprint of 10000 bytes of (i * 31 + 7) & 0xff modified at 1600000000,
+// as computed by the official SDK
+#define FINGERPRINT_CHECK_SIZE 10000
+#define FINGERPRINT_CHECK_MTIME 1600000000
+#define FINGERPRINT_CHECK_VALUE "c63xcKI6MoWUT7UdHAxKTQQAEF5f"
+
+// fingerprints that other clients don't produce would break deduplication
+// both ways, so they are not stored at all if the known value doesn't match
+static gboolean file_fingerprint_check(void)
+{
+	static gsize result = 0;
+
+	if (g_once_init_enter(&result)) {
+		guchar *data = g_malloc(FINGERPRINT_CHECK_SIZE);
+
+		for (guint i = 0; i < FINGERPRINT_CHECK_SIZE; i++)
+			data[i] = (i * 31 + 7) & 0xff;
+
+		gc_object_unref GInputStream *stream =
+			g_memory_input_stream_new_from_data(data, FINGERPRINT_CHECK_SIZE, g_free);
+		gc_free gchar *fp =
+			file_fingerprint_compute(stream, FINGERPRINT_CHECK_SIZE, FINGERPRINT_CHECK_MTIME, NULL);
+		gboolean ok = !g_strcmp0(fp, FINGERPRINT_CHECK_VALUE);
+
+		if (!ok)
+			g_printerr("WARNING: File fingerprint check failed, fingerprints are disabled\n");
+
+		g_once_init_leave(&result, ok ? 1 : 2);
+	}
+
+	return result == 1;
+}
+
+static gchar *file_fingerprint(GInputStream *stream, goffset size, guint64 mtime, GError **err)
+{
+	if (!file_fingerprint_check()) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File fingerprints are disabled");
+		return NULL;
+	}
+
+	return file_fingerprint_compute(stream, size, mtime, err);
+}
+
 // }}}
 // {{{ chunked CBC-MAC (simpler interface)
 
@@ -1263,13 +1456,27 @@ static void pack_node_key(guchar node_key[32], guchar aes_key[16], guchar nonce[
 // }}}
 // {{{ encode_node_attrs
 
-static gchar *encode_node_attrs(const gchar *name)
+static gchar *encode_node_attrs(const gchar *name, const gchar *fingerprint, const gchar *other)
 {
 	g_return_val_if_fail(name != NULL, NULL);
 
 	SJsonGen *gen = s_json_gen_new();
 	s_json_gen_start_object(gen);
 	s_json_gen_member_string(gen, "n", name);
+	if (fingerprint)
+		s_json_gen_member_string(gen, "c", fingerprint);
+
+	// keep attributes set by other clients
+	if (other) {
+		S_JSON_FOREACH_MEMBER(other, k, v)
+		gc_free gchar *key = s_json_get_string(k);
+		gc_free gchar *value = s_json_get(v);
+
+		if (key && value && strcmp(key, "n") && (!fingerprint || strcmp(key, "c")))
+			s_json_gen_member_json(gen, key, value);
+		S_JSON_FOREACH_END()
+	}
+
 	s_json_gen_end_object(gen);
 	gc_free gchar *attrs_json = s_json_gen_done(gen);
 
@@ -1279,7 +1486,9 @@ static gchar *encode_node_attrs(const gchar *name)
 // }}}
 // {{{ decode_node_attrs
 
-static gboolean decode_node_attrs(const gchar *attrs, gchar **name)
+// other gets all attributes but n (and c if fingerprint is requested), or
+// NULL if there are none
+static gboolean decode_node_attrs(const gchar *attrs, gchar **name, gchar **fingerprint, gchar **other)
 {
 	g_return_val_if_fail(attrs != NULL, FALSE);
 	g_return_val_if_fail(name != NULL, FALSE);
@@ -1293,6 +1502,35 @@ static gboolean decode_node_attrs(const gchar *attrs, gchar **name)
 		return FALSE;
 
 	*name = s_json_get_member_string(attrs + 4, "n");
+	if (fingerprint)
+		*fingerprint = s_json_get_member_string(attrs + 4, "c");
+
+	if (other) {
+		SJsonGen *gen = s_json_gen_new();
+		gboolean empty = TRUE;
+
+		s_json_gen_start_object(gen);
+		S_JSON_FOREACH_MEMBER(attrs + 4, k, v)
+		if (s_json_string_match(k, "n") || (fingerprint && s_json_string_match(k, "c")))
+			continue;
+
+		gc_free gchar *key = s_json_get_string(k);
+		gc_free gchar *value = s_json_get(v);
+		if (key && value) {
+			s_json_gen_member_json(gen, key, value);
+			empty = FALSE;
+		}
+		S_JSON_FOREACH_END()
+		s_json_gen_end_object(gen);
+
+		gchar *other_json = s_json_gen_done(gen);
+		if (empty) {
+			g_free(other_json);
+			other_json = NULL;
+		}
+
+		*other = other_json;
+	}
 
 	return TRUE;
 }
@@ -1300,7 +1538,8 @@ static gboolean decode_node_attrs(const gchar *attrs, gchar **name)
 // }}}
 // {{{ decrypt_node_attrs
 
-static gboolean decrypt_node_attrs(const gchar *encrypted_attrs, const guchar *key, gchar **name)
+static gboolean decrypt_node_attrs(const gchar *encrypted_attrs, const guchar *key, gchar **name,
+				   gchar **fingerprint, gchar **other)
 {
 	g_return_val_if_fail(encrypted_attrs != NULL, FALSE);
 	g_return_val_if_fail(key != NULL, FALSE);
@@ -1308,7 +1547,7 @@ static gboolean decrypt_node_attrs(const gchar *encrypted_attrs, const guchar *k
 
 	gc_free guchar *attrs = b64_aes128_cbc_decrypt(encrypted_attrs, key, NULL);
 
-	return decode_node_attrs(attrs, name);
+	return decode_node_attrs(attrs, name, fingerprint, other);
 }
 
 // }}}
@@ -1460,7 +1699,10 @@ static gchar *api_request(struct mega_session *s, const gchar *req_node, GError
 	g_usleep(20000);
 
 again:
+	// preview jobs call the API from their own threads
+	g_mutex_lock(&s->api_lock);
 	response = api_request_unsafe(s, req_node, &local_err);
+	g_mutex_unlock(&s->api_lock);
 	if (!response) {
 		g_propagate_error(err, local_err);
 		return NULL;
@@ -1603,6 +1845,90 @@ static gchar *api_call(struct mega_session *s, gchar expects, gint *error_code,
 	return s_json_get(node);
 }
 
+// }}}
+// {{{ api_call_batch
+
+// sends many commands (JSON objects) in one request, the response array has
+// one result per command and is checked by api_batch_result()
+static gchar *api_call_batch(struct mega_session *s, GPtrArray *commands, GError **err)
+{
+	g_return_val_if_fail(err != NULL && *err == NULL, NULL);
+	g_return_val_if_fail(commands != NULL && commands->len > 0, NULL);
+
+	gc_string_free GString *request = g_string_new("[");
+	for (guint i = 0; i < commands->len; i++) {
+		if (i > 0)
+			g_string_append_c(request, ',');
+		g_string_append(request, commands->pdata[i]);
+	}
+	g_string_append_c(request, ']');
+
+	gchar *response = api_request(s, request->str, err);
+	if (!response) {
+		if (*err == NULL)
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Null response");
+		goto err;
+	}
+
+	SJsonType response_type = s_json_get_type(response);
+
+	// request level error
+	if (response_type == S_JSON_TYPE_NUMBER && s_json_get_int(response, 0) < 0) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned error %s",
+			    srv_error_to_string(s_json_get_int(response, 0)));
+		goto err;
+	}
+
+	if (response_type != S_JSON_TYPE_ARRAY) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Unexpected response");
+		goto err;
+	}
+
+	return response;
+
+err:
+	g_free(response);
+	g_prefix_error(err, "API call failed: ");
+	return NULL;
+}
+
+// returns the result object of the index-th command of a batch
+static gchar *api_batch_result(const gchar *response, guint index, gint *error_code, GError **err)
+{
+	const gchar *node = s_json_get_element(response, index);
+
+	if (error_code)
+		*error_code = 0;
+
+	if (node && s_json_get_type(node) == S_JSON_TYPE_OBJECT)
+		return s_json_get(node);
+
+	if (node && s_json_get_type(node) == S_JSON_TYPE_NUMBER && s_json_get_int(node, 0) < 0) {
+		gint v = s_json_get_int(node, 0);
+
+		if (error_code)
+			*error_code = v;
+
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned error %s", srv_error_to_string(v));
+		return NULL;
+	}
+
+	g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Unexpected response");
+	return NULL;
+}
+
+// returns the result of the index-th command of a batch for commands that
+// return a number (0 on success), unexpected results are EINTERNAL
+static gint api_batch_result_code(const gchar *response, guint index)
+{
+	const gchar *node = s_json_get_element(response, index);
+
+	if (node && s_json_get_type(node) == S_JSON_TYPE_NUMBER)
+		return s_json_get_int(node, -1);
+
+	return -1;
+}
+
 // }}}
 
 // Remote filesystem helpers
@@ -1611,18 +1937,50 @@ static gchar *api_call(struct mega_session *s, gchar expects, gint *error_code,
 
 static void mega_node_free(struct mega_node *n);
 
+static gchar *fingerprint_index_key(guint64 size, const gchar *fingerprint)
+{
+	return g_strdup_printf("%" G_GUINT64_FORMAT ":%s", size, fingerprint);
+}
+
+static void fingerprint_index_add(struct mega_session *s, struct mega_node *n)
+{
+	if (n->type == MEGA_NODE_FILE && n->fingerprint)
+		g_hash_table_insert(s->fingerprints, fingerprint_index_key(n->size, n->fingerprint),
+				    g_strdup(n->handle));
+}
+
+// Nodes are indexed by handle in the session, so that nodes created one by
+// one can find their parents quickly. The index is dropped before any node
+// is freed and built again from fs_nodes when it's needed, nodes added to
+// fs_nodes must be added to it.
+
+static void node_index_clear(struct mega_session *s)
+{
+	g_clear_pointer(&s->nodes_by_handle, g_hash_table_unref);
+}
+
+static void node_index_add(struct mega_session *s, struct mega_node *n)
+{
+	if (s->nodes_by_handle)
+		g_hash_table_insert(s->nodes_by_handle, n->handle, n);
+}
+
 static void build_node_tree(struct mega_session *s)
 {
 	GSList *i, *next;
 	g_return_if_fail(s != NULL);
 
 	// node handles are assumed to be unique
-	GHashTable *handle_map = g_hash_table_new(g_str_hash, g_str_equal);
+	node_index_clear(s);
+	s->nodes_by_handle = g_hash_table_new(g_str_hash, g_str_equal);
+	GHashTable *handle_map = s->nodes_by_handle;
 	for (i = s->fs_nodes; i; i = i->next) {
 		struct mega_node *n = i->data;
 
-		if (!g_hash_table_insert(handle_map, n->handle, n))
+		if (g_hash_table_contains(handle_map, n->handle))
 			g_printerr("WARNING: Dup node handle detected %s\n", n->handle);
+		else
+			g_hash_table_insert(handle_map, n->handle, n);
 	}
 
 	for (i = s->fs_nodes; i;) {
@@ -1640,7 +1998,12 @@ static void build_node_tree(struct mega_session *s)
 		i = next;
 	}
 
-	g_hash_table_unref(handle_map);
+	// index files by fingerprint for upload deduplication
+	if (s->fingerprints)
+		g_hash_table_destroy(s->fingerprints);
+	s->fingerprints = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	for (i = s->fs_nodes; i; i = i->next)
+		fingerprint_index_add(s, i->data);
 }
 
 // }}}
@@ -1667,6 +2030,8 @@ static gboolean rebase_node_tree(struct mega_session *s, const gchar *new_root)
 	if (root_node == NULL)
 		return FALSE;
 
+	node_index_clear(s);
+
 	if (root_node->type == MEGA_NODE_FILE) {
 		// if the new root is a file, just place it under a newly
 		// created root and remove everything else
@@ -1969,7 +2334,10 @@ static struct mega_node *mega_node_parse(struct mega_session *s, const gchar *no
 		memcpy(aes_key, node_key, 16);
 
 	gc_free gchar *node_name = NULL;
-	if (!decrypt_node_attrs(node_a, aes_key, &node_name)) {
+	gc_free gchar *node_fingerprint = NULL;
+	gc_free gchar *node_attrs = NULL;
+	if (!decrypt_node_attrs(node_a, aes_key, &node_name, node_t == MEGA_NODE_FILE ? &node_fingerprint : NULL,
+				&node_attrs)) {
 		g_printerr("WARNING: Skipping FS node %s because it has malformed attributes\n", node_h);
 		return NULL;
 	}
@@ -2007,6 +2375,8 @@ static struct mega_node *mega_node_parse(struct mega_session *s, const gchar *no
 	n->su_handle = TAKE(node_su);
 	n->key_len = node_key_len;
 	n->key = TAKE(node_key);
+	n->fingerprint = TAKE(node_fingerprint);
+	n->attrs = TAKE(node_attrs);
 	n->size = node_s;
 	n->timestamp = node_ts;
 	n->type = node_t;
@@ -2071,6 +2441,8 @@ static void mega_node_free(struct mega_node *n)
 		g_free(n->user_handle);
 		g_free(n->su_handle);
 		g_free(n->key);
+		g_free(n->fingerprint);
+		g_free(n->attrs);
 		g_free(n->link);
 		memset(n, 0, sizeof(struct mega_node));
 		g_free(n);
@@ -2105,6 +2477,12 @@ struct mega_session *mega_session_new(void)
 
 	s->share_keys = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 	s->resume_enabled = TRUE;
+	s->upload_resume_enabled = TRUE;
+	s->dedup_enabled = TRUE;
+	s->schedule_policy = MEGA_SCHEDULE_ROUND_ROBIN;
+	s->progress_interval = 200;
+	s->preview_timeout = 5000;
+	g_mutex_init(&s->api_lock);
 
 	return s;
 }
@@ -2130,6 +2508,28 @@ void mega_session_set_workers(struct mega_session *s, gint workers)
 	s->max_workers = workers;
 }
 
+// }}}
+// {{{ mega_session_set_scheduling
+
+void mega_session_set_scheduling(struct mega_session *s, gint policy, gint max_host_connections)
+{
+	g_return_if_fail(s != NULL);
+	g_return_if_fail(policy >= MEGA_SCHEDULE_FIFO && policy <= MEGA_SCHEDULE_DEADLINE);
+
+	s->schedule_policy = policy;
+	s->max_host_connections = MAX(max_host_connections, 0);
+}
+
+// }}}
+// {{{ mega_session_set_progress_interval
+
+void mega_session_set_progress_interval(struct mega_session *s, gint ms)
+{
+	g_return_if_fail(s != NULL);
+
+	s->progress_interval = ms;
+}
+
 // }}}
 // {{{ mega_session_set_proxy
 
@@ -2152,24 +2552,86 @@ void mega_session_set_resume(struct mega_session *s, gboolean enabled)
 	s->resume_enabled = enabled;
 }
 
+// }}}
+// {{{ mega_session_set_upload_resume
+
+void mega_session_set_upload_resume(struct mega_session *s, gboolean enabled)
+{
+	g_return_if_fail(s != NULL);
+
+	s->upload_resume_enabled = enabled;
+}
+
+// }}}
+// {{{ mega_session_set_dedup
+
+// uploads of files that already exist in the account (same size and
+// fingerprint) are replaced by server-side copies, verify makes sure the
+// local data has the same MAC before that
+void mega_session_set_dedup(struct mega_session *s, gboolean enabled, gboolean verify)
+{
+	g_return_if_fail(s != NULL);
+
+	s->dedup_enabled = enabled;
+	s->dedup_verify = verify;
+}
+
+// }}}
+// {{{ mega_session_set_preview_timeout
+
+void mega_session_set_preview_timeout(struct mega_session *s, gint ms)
+{
+	g_return_if_fail(s != NULL);
+
+	s->preview_timeout = ms;
+}
+
 // }}}
 // {{{ mega_session_free
 
+struct transfer_msg;
+static void upload_free(struct mega_upload *up);
+static void upload_msg_free(struct transfer_msg *msg);
+
 void mega_session_free(struct mega_session *s)
 {
 	if (s) {
+		// finish uploads, transfer manager must not be left with
+		// references to them
+		while (mega_session_upload_poll(s, TRUE))
+			;
+		struct mega_upload *up;
+		while ((up = g_queue_pop_head(&s->uploads)))
+			upload_free(up);
+
+		// abandoned preview jobs still use the session and the mailbox
+		if (s->preview_pool)
+			g_thread_pool_free(s->preview_pool, FALSE, TRUE);
+		if (s->upload_mailbox) {
+			struct transfer_msg *msg;
+
+			while ((msg = g_async_queue_try_pop(s->upload_mailbox)))
+				upload_msg_free(msg);
+			g_async_queue_unref(s->upload_mailbox);
+		}
+
 		http_free(s->http);
+		node_index_clear(s);
 		g_slist_free_full(s->fs_nodes, (GDestroyNotify)mega_node_free);
 		g_hash_table_destroy(s->share_keys);
 		g_hash_table_destroy(s->api_url_params);
+		if (s->fingerprints)
+			g_hash_table_destroy(s->fingerprints);
 		g_free(s->sid);
 		g_free(s->rid);
+		g_free(s->sn);
 		g_free(s->password_key);
 		g_free(s->master_key);
 		rsa_key_free(&s->rsa_key);
 		g_free(s->user_handle);
 		g_free(s->user_name);
 		g_free(s->user_email);
+		g_mutex_clear(&s->api_lock);
 		memset(s, 0, sizeof(struct mega_session));
 		g_free(s);
 	}
@@ -2257,6 +2719,7 @@ gboolean mega_session_open_exp_folder(struct mega_session *s, const gchar *n, co
 		}
 	}
 
+	node_index_clear(s);
 	g_slist_free_full(s->fs_nodes, (GDestroyNotify)mega_node_free);
 	s->fs_nodes = g_slist_reverse(list);
 
@@ -2462,6 +2925,7 @@ void mega_session_close(struct mega_session *s)
 	g_free(s->user_name);
 	g_free(s->user_email);
 
+	node_index_clear(s);
 	g_slist_free_full(s->fs_nodes, (GDestroyNotify)mega_node_free);
 
 	g_hash_table_remove_all(s->share_keys);
@@ -2477,6 +2941,7 @@ void mega_session_close(struct mega_session *s)
 	s->user_name = NULL;
 	s->fs_nodes = NULL;
 	s->last_refresh = 0;
+	g_clear_pointer(&s->sn, g_free);
 
 	s->status_callback = NULL;
 }
@@ -2661,78 +3126,343 @@ gboolean mega_session_refresh(struct mega_session *s, GError **err)
 	}
 
 	// replace existing nodes
+	node_index_clear(s);
 	g_slist_free_full(s->fs_nodes, (GDestroyNotify)mega_node_free);
 	s->fs_nodes = g_slist_reverse(list);
 
 	build_node_tree(s);
 
 	s->last_refresh = time(NULL);
+	g_free(s->sn);
+	s->sn = s_json_get_member_string(f_node, "sn");
 
 	return TRUE;
 }
 
 // }}}
-// {{{ mega_session_addlinks
-
-gboolean mega_session_addlinks(struct mega_session *s, GSList *nodes, GError **err)
-{
-	GError *local_err = NULL;
-	GSList *i;
-	gc_ptr_array_unref GPtrArray *rnodes = NULL;
-
-	g_return_val_if_fail(s != NULL, FALSE);
-	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+// {{{ mega_session_refresh_incremental
 
-	if (g_slist_length(nodes) == 0)
-		return TRUE;
+// Filesystem changes since the last refresh are read from the server-client
+// channel as action packets. Packets for added, removed and updated nodes
+// are applied to the node list; anything else that may affect the
+// filesystem (shares, keys) or an error makes us fall back to a full
+// refresh.
 
-	rnodes = g_ptr_array_sized_new(g_slist_length(nodes));
+#define SC_MAX_REQUESTS 64
 
-	// prepare request
-	SJsonGen *gen = s_json_gen_new();
-	s_json_gen_start_array(gen);
-	for (i = nodes; i; i = i->next) {
-		struct mega_node *n = i->data;
+static gchar *sc_request(struct mega_session *s, GError **err)
+{
+	GError *local_err = NULL;
+	gc_free gchar *url = g_strdup_printf("https://g.api.mega.co.nz/sc?sn=%s&sid=%s", s->sn, s->sid);
 
-		if (n->type == MEGA_NODE_FILE) {
-			s_json_gen_start_object(gen);
-			s_json_gen_member_string(gen, "a", "l");
-			s_json_gen_member_string(gen, "n", n->handle);
-			s_json_gen_end_object(gen);
+	g_mutex_lock(&s->api_lock);
+	GString *res_str = http_post(s->http, url, "", 0, &local_err);
+	g_mutex_unlock(&s->api_lock);
 
-			g_ptr_array_add(rnodes, n);
-		}
+	if (!res_str) {
+		g_propagate_prefixed_error(err, local_err, "HTTP POST failed: ");
+		return NULL;
 	}
-	s_json_gen_end_array(gen);
-	gc_free gchar *request = s_json_gen_done(gen);
-
-	// perform request
-	gc_free gchar *response = api_request(s, request, &local_err);
 
-	// process response
-	if (!response) {
-		g_propagate_prefixed_error(err, local_err, "API call 'l' failed: ");
-		return FALSE;
+	if (!s_json_is_valid(res_str->str)) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response JSON");
+		g_string_free(res_str, TRUE);
+		return NULL;
 	}
 
-	if (s_json_get_type(response) == S_JSON_TYPE_ARRAY) {
-		gc_free gchar **nodes_arr = s_json_get_elements(response);
-		gint i, l = g_strv_length(nodes_arr);
-
-		if (l != rnodes->len) {
-			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "API call 'l' results mismatch");
-			return FALSE;
-		}
+	gchar *res_node = g_string_free(res_str, FALSE);
 
-		for (i = 0; i < l; i++) {
-			gchar *link = s_json_get_string(nodes_arr[i]);
+	if (mega_debug & MEGA_DEBUG_API)
+		print_node(res_node, "<SC ");
 
-			struct mega_node *n = g_ptr_array_index(rnodes, i);
+	return res_node;
+}
 
-			g_free(n->link);
-			n->link = link;
-		}
-	}
+// key the node attributes are encrypted with
+static gboolean node_get_attrs_key(struct mega_node *n, guchar aes_key[16])
+{
+	if (n->type == MEGA_NODE_FILE && n->key_len == 32)
+		unpack_node_key(n->key, aes_key, NULL, NULL);
+	else if (n->type == MEGA_NODE_FOLDER && n->key_len == 16)
+		memcpy(aes_key, n->key, 16);
+	else
+		return FALSE;
+
+	return TRUE;
+}
+
+// replaces the name, fingerprint and other attributes of the node from new
+// attributes
+static gboolean node_update_attrs(struct mega_node *n, const gchar *attrs)
+{
+	guchar aes_key[16];
+	gc_free gchar *name = NULL;
+	gc_free gchar *fingerprint = NULL;
+	gc_free gchar *other = NULL;
+
+	if (!node_get_attrs_key(n, aes_key))
+		return FALSE;
+
+	if (!decrypt_node_attrs(attrs, aes_key, &name, n->type == MEGA_NODE_FILE ? &fingerprint : NULL, &other) ||
+	    !name)
+		return FALSE;
+
+	g_free(n->name);
+	g_free(n->name_collate_key);
+	g_free(n->fingerprint);
+	g_free(n->attrs);
+	n->name = name;
+	n->name_collate_key = g_utf8_collate_key_for_filename(name, -1);
+	n->fingerprint = fingerprint;
+	n->attrs = other;
+	name = fingerprint = other = NULL;
+	return TRUE;
+}
+
+// node or one of its ancestors was removed
+static gboolean sc_node_is_removed(GHashTable *nodes, GHashTable *removed, struct mega_node *n)
+{
+	const gchar *handle = n->parent_handle;
+	gint depth = 0;
+
+	while (handle && depth++ < 1000) {
+		if (g_hash_table_contains(removed, handle))
+			return TRUE;
+
+		struct mega_node *p = g_hash_table_lookup(nodes, handle);
+		handle = p ? p->parent_handle : NULL;
+	}
+
+	return FALSE;
+}
+
+// applies the packets to the node map, returns FALSE if full refresh is
+// needed
+static gboolean sc_apply_packets(struct mega_session *s, const gchar *packets, GHashTable *nodes, GHashTable *removed,
+				 gboolean *changed)
+{
+	gboolean ok = TRUE;
+
+	S_JSON_FOREACH_ELEMENT(packets, packet)
+	if (!ok || s_json_get_type(packet) != S_JSON_TYPE_OBJECT)
+		continue;
+
+	gc_free gchar *a = s_json_get_member_string(packet, "a");
+	if (!a) {
+		continue;
+	} else if (!strcmp(a, "t")) {
+		// new nodes, also the second half of a move
+		const gchar *f_arr = s_json_path(packet, "$.t.f");
+		if (s_json_get_type(f_arr) != S_JSON_TYPE_ARRAY)
+			continue;
+
+		S_JSON_FOREACH_ELEMENT(f_arr, f)
+		struct mega_node *n = s_json_get_type(f) == S_JSON_TYPE_OBJECT ? mega_node_parse(s, f) : NULL;
+		if (n) {
+			g_hash_table_remove(removed, n->handle);
+			g_hash_table_replace(nodes, n->handle, n);
+			*changed = TRUE;
+		}
+		S_JSON_FOREACH_END()
+	} else if (!strcmp(a, "d")) {
+		gc_free gchar *handle = s_json_get_member_string(packet, "n");
+		if (handle && g_hash_table_remove(nodes, handle)) {
+			g_hash_table_add(removed, g_strdup(handle));
+			*changed = TRUE;
+		}
+	} else if (!strcmp(a, "u")) {
+		gc_free gchar *handle = s_json_get_member_string(packet, "n");
+		gc_free gchar *attrs = s_json_get_member_string(packet, "at");
+		struct mega_node *n = handle ? g_hash_table_lookup(nodes, handle) : NULL;
+
+		if (n && attrs) {
+			if (!node_update_attrs(n, attrs))
+				ok = FALSE;
+			*changed = TRUE;
+		}
+	} else if (!strcmp(a, "ua") || !strcmp(a, "psts") || !strcmp(a, "la") || !strcmp(a, "fa") ||
+		   !strcmp(a, "ph") || !strcmp(a, "c")) {
+		// user attributes, payments, file attributes and public links
+		// don't change the filesystem
+	} else {
+		ok = FALSE;
+	}
+	S_JSON_FOREACH_END()
+
+	return ok;
+}
+
+// reads and applies the changes, returns FALSE if full refresh is needed
+static gboolean sc_refresh(struct mega_session *s, gboolean *changed, GError **err)
+{
+	gboolean ok = TRUE;
+	GSList *l, *list = NULL, *orphans = NULL;
+	GHashTableIter iter;
+	struct mega_node *n;
+	gint i;
+
+	// nodes are owned by the map while the packets are applied
+	GHashTable *nodes = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)mega_node_free);
+	gc_hash_table_unref GHashTable *removed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	node_index_clear(s);
+
+	for (l = s->fs_nodes; l; l = l->next) {
+		n = l->data;
+
+		// contacts are not filesystem nodes, keep them as they are
+		if (n->type == MEGA_NODE_CONTACT || n->type == MEGA_NODE_NETWORK)
+			list = g_slist_prepend(list, n);
+		else
+			g_hash_table_insert(nodes, n->handle, n);
+	}
+
+	g_slist_free(s->fs_nodes);
+	s->fs_nodes = NULL;
+
+	for (i = 0; ok && i < SC_MAX_REQUESTS; i++) {
+		gc_free gchar *response = sc_request(s, err);
+		if (!response) {
+			ok = FALSE;
+			break;
+		}
+
+		// error codes mean the sequence number is too old or invalid
+		if (s_json_get_type(response) != S_JSON_TYPE_OBJECT) {
+			ok = FALSE;
+			break;
+		}
+
+		// we're up to date, the rest is for long polling
+		if (s_json_get_member(response, "w"))
+			break;
+
+		gc_free gchar *sn = s_json_get_member_string(response, "sn");
+		const gchar *packets = s_json_get_member(response, "a");
+		if (!sn || s_json_get_type(packets) != S_JSON_TYPE_ARRAY) {
+			ok = FALSE;
+			break;
+		}
+
+		ok = sc_apply_packets(s, packets, nodes, removed, changed);
+
+		g_free(s->sn);
+		s->sn = sn;
+		sn = NULL;
+	}
+
+	if (i == SC_MAX_REQUESTS)
+		ok = FALSE;
+
+	// rebuild the node list without the removed subtrees
+	g_hash_table_iter_init(&iter, nodes);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&n)) {
+		if (sc_node_is_removed(nodes, removed, n))
+			orphans = g_slist_prepend(orphans, n);
+		else
+			list = g_slist_prepend(list, n);
+	}
+
+	g_hash_table_steal_all(nodes);
+	g_hash_table_unref(nodes);
+	g_slist_free_full(orphans, (GDestroyNotify)mega_node_free);
+
+	s->fs_nodes = list;
+	build_node_tree(s);
+	s->last_refresh = time(NULL);
+
+	return ok;
+}
+
+gboolean mega_session_refresh_incremental(struct mega_session *s, gboolean *changed, GError **err)
+{
+	GError *local_err = NULL;
+	gboolean any_change = FALSE;
+
+	g_return_val_if_fail(s != NULL, FALSE);
+	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+	if (s->sn && s->sid) {
+		if (sc_refresh(s, &any_change, &local_err)) {
+			if (changed)
+				*changed = any_change;
+			return TRUE;
+		}
+
+		if (mega_debug & MEGA_DEBUG_FS)
+			g_printerr("FS: Incremental refresh failed, reloading the filesystem: %s\n",
+				   local_err ? local_err->message : "unsupported change");
+		g_clear_error(&local_err);
+	}
+
+	if (changed)
+		*changed = TRUE;
+
+	return mega_session_refresh(s, err);
+}
+
+// }}}
+// {{{ mega_session_addlinks
+
+gboolean mega_session_addlinks(struct mega_session *s, GSList *nodes, GError **err)
+{
+	GError *local_err = NULL;
+	GSList *i;
+	gc_ptr_array_unref GPtrArray *rnodes = NULL;
+
+	g_return_val_if_fail(s != NULL, FALSE);
+	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+	if (g_slist_length(nodes) == 0)
+		return TRUE;
+
+	rnodes = g_ptr_array_sized_new(g_slist_length(nodes));
+
+	// prepare request
+	SJsonGen *gen = s_json_gen_new();
+	s_json_gen_start_array(gen);
+	for (i = nodes; i; i = i->next) {
+		struct mega_node *n = i->data;
+
+		if (n->type == MEGA_NODE_FILE) {
+			s_json_gen_start_object(gen);
+			s_json_gen_member_string(gen, "a", "l");
+			s_json_gen_member_string(gen, "n", n->handle);
+			s_json_gen_end_object(gen);
+
+			g_ptr_array_add(rnodes, n);
+		}
+	}
+	s_json_gen_end_array(gen);
+	gc_free gchar *request = s_json_gen_done(gen);
+
+	// perform request
+	gc_free gchar *response = api_request(s, request, &local_err);
+
+	// process response
+	if (!response) {
+		g_propagate_prefixed_error(err, local_err, "API call 'l' failed: ");
+		return FALSE;
+	}
+
+	if (s_json_get_type(response) == S_JSON_TYPE_ARRAY) {
+		gc_free gchar **nodes_arr = s_json_get_elements(response);
+		gint i, l = g_strv_length(nodes_arr);
+
+		if (l != rnodes->len) {
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "API call 'l' results mismatch");
+			return FALSE;
+		}
+
+		for (i = 0; i < l; i++) {
+			gchar *link = s_json_get_string(nodes_arr[i]);
+
+			struct mega_node *n = g_ptr_array_index(rnodes, i);
+
+			g_free(n->link);
+			n->link = link;
+		}
+	}
 
 	return TRUE;
 }
@@ -2929,7 +3659,7 @@ struct mega_node *mega_session_mkdir(struct mega_session *s, const gchar *path,
 	} else {
 		gc_free guchar *node_key = make_random_key();
 		gc_free gchar *basename = g_path_get_basename(tmp);
-		gc_free gchar *attrs = encode_node_attrs(basename);
+		gc_free gchar *attrs = encode_node_attrs(basename, NULL, NULL);
 		gc_free gchar *dir_attrs = b64_aes128_cbc_encrypt_str(attrs, node_key);
 		gc_free gchar *dir_key = b64_aes128_encrypt(node_key, 16, s->master_key);
 
@@ -2969,1176 +3699,4205 @@ struct mega_node *mega_session_mkdir(struct mega_session *s, const gchar *path,
 }
 
 // }}}
-// {{{ mega_session_rm
+// {{{ mega_session_mkdir_p
 
-gboolean mega_session_rm(struct mega_session *s, const gchar *path, GError **err)
-{
-	GError *local_err = NULL;
+// Missing directories are grouped by their closest existing ancestor, each
+// group is created by one a:p command, where the new directories reference
+// their new parents by temporary handles. All commands are sent in a single
+// request.
 
-	g_return_val_if_fail(s != NULL, FALSE);
-	g_return_val_if_fail(path != NULL, FALSE);
-	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+struct mkdir_dir {
+	gchar *path;
+	struct mega_node *node; // existing or created directory
+	gint parent; // index of the parent if it's created too, or -1
+	gint command; // index of the a:p command, -1 if the directory exists
+	gchar handle[16]; // temporary handle
+};
 
-	struct mega_node *mn = mega_session_stat(s, path);
-	if (!mn) {
-		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File not found: %s", path);
-		return FALSE;
-	}
+struct mkdir_p {
+	struct mega_session *s;
+	GHashTable *existing; // path -> struct mega_node
+	GHashTable *dirs_by_path; // path -> index of the dir + 1
+	GArray *dirs; // struct mkdir_dir
+	GPtrArray *targets; // struct mega_node, existing parent for each command
+	GHashTable *commands_by_target; // struct mega_node -> index of the command + 1
+};
 
-	if (!mega_node_is_writable(s, mn)) {
-		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File is not removable: %s", path);
-		return FALSE;
-	}
+// returns the index of the directory, adds the missing parents first
+static gint mkdir_p_resolve(struct mkdir_p *m, const gchar *path, GError **err)
+{
+	struct mkdir_dir d = { .parent = -1, .command = -1 };
+	gint index = GPOINTER_TO_INT(g_hash_table_lookup(m->dirs_by_path, path)) - 1;
 
-	if (mn->type == MEGA_NODE_FILE || mn->type == MEGA_NODE_FOLDER) {
-		// prepare request
-		gc_free gchar *rm_node = api_call(s, 'i', NULL, &local_err, "[{a:d, i:%s, n:%s}]", s->rid, mn->handle);
-		if (!rm_node) {
-			g_propagate_error(err, local_err);
-			return FALSE;
-		}
-	} else if (mn->type == MEGA_NODE_CONTACT) {
-		gc_free gchar *ur_node =
-			api_call(s, 'i', NULL, &local_err, "[{a:ur, u:%s, l:0, i:%s}]", mn->handle, s->rid);
-		if (!ur_node) {
-			g_propagate_error(err, local_err);
-			return FALSE;
+	if (index >= 0)
+		return index;
+
+	d.node = g_hash_table_lookup(m->existing, path);
+	if (d.node) {
+		if (d.node->type == MEGA_NODE_FILE) {
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File already exists: %s", path);
+			return -1;
 		}
 	} else {
-		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't remove system dir %s", path);
-		return FALSE;
-	}
-
-	GSList *i, *i_next, **i_prev_next = &s->fs_nodes;
-	GSList *free_list = NULL;
-
-	// remove node and all the children from the list
-	for (i = s->fs_nodes; i; i = i_next) {
-		struct mega_node *n = i->data;
+		gc_free gchar *parent_path = g_path_get_dirname(path);
 
-		i_next = i->next;
+		if (!strcmp(parent_path, "/")) {
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't create toplevel dir: %s", path);
+			return -1;
+		}
 
-		if (n == mn || mega_node_has_ancestor(n, mn)) {
-			// drop link
-			*i_prev_next = i_next;
-			g_slist_free_1(i);
+		gint parent = mkdir_p_resolve(m, parent_path, err);
+		if (parent < 0)
+			return -1;
 
-			// we can't free the node right here, because it
-			// needs to be available for
-			// mega_node_has_ancestor checks
-			free_list = g_slist_prepend(free_list, n);
+		struct mkdir_dir *p = &g_array_index(m->dirs, struct mkdir_dir, parent);
+		if (p->command >= 0) {
+			d.parent = parent;
+			d.command = p->command;
 		} else {
-			// move next address of previously kept node
-			i_prev_next = &i->next;
+			if (p->node->type == MEGA_NODE_NETWORK || p->node->type == MEGA_NODE_INBOX ||
+			    !mega_node_is_writable(m->s, p->node)) {
+				g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Parent directory is not writable: %s",
+					    parent_path);
+				return -1;
+			}
+
+			d.command = GPOINTER_TO_INT(g_hash_table_lookup(m->commands_by_target, p->node)) - 1;
+			if (d.command < 0) {
+				g_ptr_array_add(m->targets, p->node);
+				d.command = m->targets->len - 1;
+				g_hash_table_insert(m->commands_by_target, p->node, GINT_TO_POINTER(m->targets->len));
+			}
 		}
-	}
 
-	g_slist_free_full(free_list, (GDestroyNotify)mega_node_free);
+		g_snprintf(d.handle, sizeof d.handle, "%08x", m->dirs->len);
+	}
 
-	return TRUE;
+	d.path = g_strdup(path);
+	g_array_append_val(m->dirs, d);
+	g_hash_table_insert(m->dirs_by_path, d.path, GINT_TO_POINTER(m->dirs->len));
+	return m->dirs->len - 1;
 }
 
-// }}}
-// {{{ mega_session_new_node_attribute
-
-gchar *mega_session_new_node_attribute(struct mega_session *s, const guchar *data, gsize len, const gchar *type,
-				       const guchar *key, GError **err)
+static gchar *mkdir_p_command(struct mkdir_p *m, gint command)
 {
-	GError *local_err = NULL;
-	AES_KEY k;
-	guchar iv[AES_BLOCK_SIZE] = { 0 };
-	gsize pad = len % 16 ? 16 - (len % 16) : 0;
+	struct mega_node *target = m->targets->pdata[command];
+	SJsonGen *gen = s_json_gen_new();
 
-	g_return_val_if_fail(s != NULL, NULL);
-	g_return_val_if_fail(data != NULL, NULL);
-	g_return_val_if_fail(len > 0, NULL);
-	g_return_val_if_fail(type != NULL, NULL);
-	g_return_val_if_fail(key != NULL, NULL);
-	g_return_val_if_fail(err == NULL || *err == NULL, NULL);
+	s_json_gen_start_object(gen);
+	s_json_gen_member_string(gen, "a", "p");
+	s_json_gen_member_string(gen, "t", target->handle);
+	s_json_gen_member_array(gen, "n");
 
-	gc_free gchar *ufa_node = api_call(s, 'o', NULL, &local_err, "[{a:ufa, s:%i, ssl:0}]", (gint64)len + pad);
-	if (!ufa_node) {
-		g_propagate_error(err, local_err);
-		return NULL;
-	}
+	for (guint i = 0; i < m->dirs->len; i++) {
+		struct mkdir_dir *d = &g_array_index(m->dirs, struct mkdir_dir, i);
 
-	gc_free gchar *p_url = s_json_get_member_string(ufa_node, "p");
+		if (d->command != command)
+			continue;
 
-	// encrypt
-	AES_set_encrypt_key(key, 128, &k);
-	gc_free guchar *plain = g_memdup2(data, len);
-	plain = g_realloc(plain, len + pad);
-	memset(plain + len, 0, pad);
-	gc_free guchar *cipher = g_malloc0(len + pad);
-	AES_cbc_encrypt(plain, cipher, len + pad, &k, iv, 1);
+		gc_free guchar *node_key = make_random_key();
+		gc_free gchar *basename = g_path_get_basename(d->path);
+		gc_free gchar *attrs = encode_node_attrs(basename, NULL, NULL);
+		gc_free gchar *dir_attrs = b64_aes128_cbc_encrypt_str(attrs, node_key);
+		gc_free gchar *dir_key = b64_aes128_encrypt(node_key, 16, m->s->master_key);
 
-	// upload
-	gc_http_free struct http *h = http_new();
-	http_set_proxy(h, s->proxy);
-	http_set_content_type(h, "application/octet-stream");
-	gc_string_free GString *handle = http_post(h, p_url, cipher, len + pad, &local_err);
+		s_json_gen_start_object(gen);
+		s_json_gen_member_string(gen, "h", d->handle);
+		if (d->parent >= 0)
+			s_json_gen_member_string(gen, "p", g_array_index(m->dirs, struct mkdir_dir, d->parent).handle);
+		s_json_gen_member_int(gen, "t", 1);
+		s_json_gen_member_string(gen, "k", dir_key);
+		s_json_gen_member_string(gen, "a", dir_attrs);
+		s_json_gen_end_object(gen);
+	}
 
-	if (!handle) {
+	s_json_gen_end_array(gen);
+	s_json_gen_end_object(gen);
+	return s_json_gen_done(gen);
+}
+
+// adds the directories created by the command to the filesystem, nodes
+// are returned in the order they were sent
+static gboolean mkdir_p_result(struct mkdir_p *m, gint command, const gchar *put_node, GError **err)
+{
+	const gchar *f_arr = s_json_get_member(put_node, "f");
+	GSList *added = NULL;
+	guint f_index = 0;
+	gboolean ok = TRUE;
+
+	if (s_json_get_type(f_arr) != S_JSON_TYPE_ARRAY) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
+		return FALSE;
+	}
+
+	for (guint i = 0; i < m->dirs->len; i++) {
+		struct mkdir_dir *d = &g_array_index(m->dirs, struct mkdir_dir, i);
+
+		if (d->command != command)
+			continue;
+
+		const gchar *f_el = s_json_get_element(f_arr, f_index++);
+		struct mega_node *n =
+			f_el && s_json_get_type(f_el) == S_JSON_TYPE_OBJECT ? mega_node_parse(m->s, f_el) : NULL;
+		if (!n) {
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
+			ok = FALSE;
+			break;
+		}
+
+		added = g_slist_prepend(added, n);
+		node_index_add(m->s, n);
+		n->parent = d->parent >= 0 ? g_array_index(m->dirs, struct mkdir_dir, d->parent).node :
+					     m->targets->pdata[command];
+		d->node = n;
+	}
+
+	// one walk over the filesystem list for all the nodes
+	m->s->fs_nodes = g_slist_concat(m->s->fs_nodes, g_slist_reverse(added));
+	return ok;
+}
+
+static void mkdir_p_keep_error(GError **first_err, GError *error)
+{
+	if (*first_err)
+		g_error_free(error);
+	else
+		*first_err = error;
+}
+
+gboolean mega_session_mkdir_p(struct mega_session *s, GPtrArray *paths, GPtrArray *nodes, GPtrArray *errors,
+			      GError **err)
+{
+	GError *local_err = NULL, *first_err = NULL;
+	GSList *i;
+	gchar n_path[4096];
+	struct mkdir_p m = { .s = s };
+
+	g_return_val_if_fail(s != NULL, FALSE);
+	g_return_val_if_fail(paths != NULL, FALSE);
+	g_return_val_if_fail(nodes != NULL, FALSE);
+	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+	gc_hash_table_unref GHashTable *existing = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	gc_hash_table_unref GHashTable *dirs_by_path = g_hash_table_new(g_str_hash, g_str_equal);
+	gc_array_unref GArray *dirs = g_array_new(FALSE, FALSE, sizeof(struct mkdir_dir));
+	gc_ptr_array_unref GPtrArray *targets = g_ptr_array_new();
+	gc_hash_table_unref GHashTable *commands_by_target = g_hash_table_new(NULL, NULL);
+	gc_ptr_array_unref GPtrArray *commands = g_ptr_array_new_with_free_func(g_free);
+	gc_array_unref GArray *path_dirs = g_array_new(FALSE, FALSE, sizeof(gint));
+	gc_ptr_array_unref GPtrArray *path_errors = g_ptr_array_new_with_free_func(g_free);
+	gc_ptr_array_unref GPtrArray *command_errors = g_ptr_array_new_with_free_func(g_free);
+
+	m.existing = existing;
+	m.dirs_by_path = dirs_by_path;
+	m.dirs = dirs;
+	m.targets = targets;
+	m.commands_by_target = commands_by_target;
+
+	// paths of all nodes are resolved once, not per directory
+	for (i = s->fs_nodes; i; i = i->next) {
+		struct mega_node *n = i->data;
+
+		if (mega_node_get_path(n, n_path, sizeof(n_path)))
+			g_hash_table_insert(existing, g_strdup(n_path), n);
+	}
+
+	for (guint j = 0; j < paths->len; j++) {
+		gc_free gchar *path = path_simplify(paths->pdata[j]);
+		gint index = -1;
+
+		// parents of relative paths never reach the root
+		if (path[0] != '/')
+			g_set_error(&local_err, MEGA_ERROR, MEGA_ERROR_OTHER, "Path must be absolute: %s", path);
+		else
+			index = mkdir_p_resolve(&m, path, &local_err);
+
+		g_ptr_array_add(path_errors, index < 0 ? g_strdup(local_err->message) : NULL);
+		if (index < 0) {
+			mkdir_p_keep_error(&first_err, local_err);
+			local_err = NULL;
+		}
+
+		g_array_append_val(path_dirs, index);
+	}
+
+	for (guint j = 0; j < targets->len; j++)
+		g_ptr_array_add(commands, mkdir_p_command(&m, j));
+
+	g_ptr_array_set_size(command_errors, commands->len);
+
+	if (commands->len > 0) {
+		gc_free gchar *response = api_call_batch(s, commands, &local_err);
+
+		for (guint j = 0; j < commands->len && response; j++) {
+			gc_free gchar *put_node = api_batch_result(response, j, NULL, &local_err);
+
+			if (!put_node || !mkdir_p_result(&m, j, put_node, &local_err)) {
+				g_prefix_error(&local_err, "API call 'p' failed: ");
+				command_errors->pdata[j] = g_strdup(local_err->message);
+				mkdir_p_keep_error(&first_err, local_err);
+				local_err = NULL;
+			}
+		}
+
+		if (!response) {
+			for (guint j = 0; j < commands->len; j++)
+				command_errors->pdata[j] = g_strdup(local_err->message);
+
+			mkdir_p_keep_error(&first_err, local_err);
+		}
+	}
+
+	for (guint j = 0; j < path_dirs->len; j++) {
+		gint index = g_array_index(path_dirs, gint, j);
+		struct mkdir_dir *d = index >= 0 ? &g_array_index(dirs, struct mkdir_dir, index) : NULL;
+
+		g_ptr_array_add(nodes, d ? d->node : NULL);
+
+		if (errors) {
+			const gchar *error = path_errors->pdata[j];
+
+			// a directory is missing only if the command that created it failed
+			if (d && !d->node)
+				error = d->command >= 0 ? command_errors->pdata[d->command] : NULL;
+
+			g_ptr_array_add(errors, d && d->node ? NULL : g_strdup(error ? error : "Unknown error"));
+		}
+	}
+
+	for (guint j = 0; j < dirs->len; j++)
+		g_free(g_array_index(dirs, struct mkdir_dir, j).path);
+
+	if (first_err) {
+		g_propagate_error(err, first_err);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// }}}
+// {{{ mega_session_rm
+
+gboolean mega_session_rm(struct mega_session *s, const gchar *path, GError **err)
+{
+	GError *local_err = NULL;
+
+	g_return_val_if_fail(s != NULL, FALSE);
+	g_return_val_if_fail(path != NULL, FALSE);
+	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+	struct mega_node *mn = mega_session_stat(s, path);
+	if (!mn) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File not found: %s", path);
+		return FALSE;
+	}
+
+	if (!mega_node_is_writable(s, mn)) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File is not removable: %s", path);
+		return FALSE;
+	}
+
+	if (mn->type == MEGA_NODE_FILE || mn->type == MEGA_NODE_FOLDER) {
+		// prepare request
+		gc_free gchar *rm_node = api_call(s, 'i', NULL, &local_err, "[{a:d, i:%s, n:%s}]", s->rid, mn->handle);
+		if (!rm_node) {
+			g_propagate_error(err, local_err);
+			return FALSE;
+		}
+	} else if (mn->type == MEGA_NODE_CONTACT) {
+		gc_free gchar *ur_node =
+			api_call(s, 'i', NULL, &local_err, "[{a:ur, u:%s, l:0, i:%s}]", mn->handle, s->rid);
+		if (!ur_node) {
+			g_propagate_error(err, local_err);
+			return FALSE;
+		}
+	} else {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't remove system dir %s", path);
+		return FALSE;
+	}
+
+	GSList *i, *i_next, **i_prev_next = &s->fs_nodes;
+	GSList *free_list = NULL;
+
+	// remove node and all the children from the list
+	for (i = s->fs_nodes; i; i = i_next) {
+		struct mega_node *n = i->data;
+
+		i_next = i->next;
+
+		if (n == mn || mega_node_has_ancestor(n, mn)) {
+			// drop link
+			*i_prev_next = i_next;
+			g_slist_free_1(i);
+
+			// we can't free the node right here, because it
+			// needs to be available for
+			// mega_node_has_ancestor checks
+			free_list = g_slist_prepend(free_list, n);
+		} else {
+			// move next address of previously kept node
+			i_prev_next = &i->next;
+		}
+	}
+
+	node_index_clear(s);
+	g_slist_free_full(free_list, (GDestroyNotify)mega_node_free);
+
+	return TRUE;
+}
+
+// }}}
+// {{{ mega_session_rm_nodes
+
+#define RM_BATCH_SIZE 256
+
+// node or one of its ancestors is in the set
+static gboolean node_is_in_set(GHashTable *set, struct mega_node *n)
+{
+	for (; n; n = n->parent)
+		if (g_hash_table_contains(set, n))
+			return TRUE;
+
+	return FALSE;
+}
+
+// removes the nodes and their subtrees from the filesystem in one pass
+static void remove_node_subtrees(struct mega_session *s, GHashTable *set)
+{
+	GSList *i, *i_next, **i_prev_next = &s->fs_nodes;
+	GSList *free_list = NULL;
+
+	for (i = s->fs_nodes; i; i = i_next) {
+		struct mega_node *n = i->data;
+
+		i_next = i->next;
+
+		if (node_is_in_set(set, n)) {
+			*i_prev_next = i_next;
+			g_slist_free_1(i);
+
+			// parents must stay valid for the checks above
+			free_list = g_slist_prepend(free_list, n);
+		} else {
+			i_prev_next = &i->next;
+		}
+	}
+
+	node_index_clear(s);
+	g_slist_free_full(free_list, (GDestroyNotify)mega_node_free);
+}
+
+gboolean mega_session_rm_nodes(struct mega_session *s, GPtrArray *nodes, gboolean *removed, GPtrArray *errors,
+			       GError **err)
+{
+	GError *local_err = NULL, *first_err = NULL;
+
+	g_return_val_if_fail(s != NULL, FALSE);
+	g_return_val_if_fail(nodes != NULL, FALSE);
+	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+	gc_hash_table_unref GHashTable *set = g_hash_table_new(NULL, NULL);
+
+	for (guint start = 0; start < nodes->len; start += RM_BATCH_SIZE) {
+		guint n = MIN(nodes->len - start, RM_BATCH_SIZE);
+		gc_ptr_array_unref GPtrArray *commands = g_ptr_array_new_with_free_func(g_free);
+
+		for (guint j = 0; j < n; j++) {
+			struct mega_node *node = nodes->pdata[start + j];
+
+			g_ptr_array_add(commands, s_json_build("{a:d, n:%s, i:%s}", node->handle, s->rid));
+		}
+
+		gc_free gchar *response = api_call_batch(s, commands, &local_err);
+
+		for (guint j = 0; j < n; j++) {
+			struct mega_node *node = nodes->pdata[start + j];
+			gint error_code = response ? api_batch_result_code(response, j) : 0;
+			gboolean ok = response && error_code == 0;
+
+			if (removed)
+				removed[start + j] = ok;
+
+			if (ok) {
+				g_hash_table_add(set, node);
+				if (errors)
+					g_ptr_array_add(errors, NULL);
+				continue;
+			}
+
+			gchar path[4096];
+			gchar *error;
+
+			if (!mega_node_get_path(node, path, sizeof path))
+				g_strlcpy(path, node->handle, sizeof path);
+
+			if (response)
+				error = g_strdup_printf("API call 'd' failed for %s: Server returned error %s", path,
+							srv_error_to_string(error_code));
+			else
+				error = g_strdup(local_err->message);
+
+			if (!first_err)
+				g_set_error(&first_err, MEGA_ERROR, MEGA_ERROR_OTHER, "%s", error);
+
+			if (errors)
+				g_ptr_array_add(errors, error);
+			else
+				g_free(error);
+		}
+
+		g_clear_error(&local_err);
+	}
+
+	if (g_hash_table_size(set) > 0)
+		remove_node_subtrees(s, set);
+
+	if (first_err) {
+		g_propagate_error(err, first_err);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// }}}
+// {{{ mega_session_move
+
+#define MOVE_BATCH_SIZE 256
+
+static gchar *node_get_display_path(struct mega_node *n)
+{
+	gchar path[4096];
+
+	return g_strdup(mega_node_get_path(n, path, sizeof path) ? path : n->handle);
+}
+
+// node can be moved or copied into the directory
+static gboolean node_check_target(struct mega_session *s, struct mega_node *n, struct mega_node *dest, GError **err)
+{
+	gc_free gchar *path = node_get_display_path(n);
+
+	if (n->type != MEGA_NODE_FILE && n->type != MEGA_NODE_FOLDER) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't move or copy system dir %s", path);
+		return FALSE;
+	}
+
+	if (dest == n || mega_node_has_ancestor(dest, n)) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't move or copy %s into itself", path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean dest_check(struct mega_session *s, struct mega_node *dest, GError **err)
+{
+	if ((dest->type != MEGA_NODE_FOLDER && dest->type != MEGA_NODE_ROOT && dest->type != MEGA_NODE_TRASH) ||
+	    !mega_node_is_writable(s, dest)) {
+		gc_free gchar *path = node_get_display_path(dest);
+
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Destination is not a writable directory: %s", path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean mega_session_move(struct mega_session *s, GPtrArray *nodes, struct mega_node *dest, GPtrArray *errors,
+			   GError **err)
+{
+	GError *local_err = NULL, *first_err = NULL;
+
+	g_return_val_if_fail(s != NULL, FALSE);
+	g_return_val_if_fail(nodes != NULL, FALSE);
+	g_return_val_if_fail(dest != NULL, FALSE);
+	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+	if (!dest_check(s, dest, &local_err)) {
+		for (guint i = 0; i < nodes->len && errors; i++)
+			g_ptr_array_add(errors, g_strdup(local_err->message));
+
+		g_propagate_error(err, local_err);
+		return FALSE;
+	}
+
+	gc_ptr_array_unref GPtrArray *node_errors = g_ptr_array_new_with_free_func(g_free);
+	gc_array_unref GArray *valid = g_array_new(FALSE, FALSE, sizeof(guint));
+
+	g_ptr_array_set_size(node_errors, nodes->len);
+
+	for (guint i = 0; i < nodes->len; i++) {
+		if (node_check_target(s, nodes->pdata[i], dest, &local_err)) {
+			g_array_append_val(valid, i);
+			continue;
+		}
+
+		// without per-node errors nothing is moved
+		if (!errors) {
+			g_propagate_error(err, local_err);
+			return FALSE;
+		}
+
+		node_errors->pdata[i] = g_strdup(local_err->message);
+		if (!first_err)
+			first_err = local_err;
+		else
+			g_error_free(local_err);
+		local_err = NULL;
+	}
+
+	for (guint start = 0; start < valid->len; start += MOVE_BATCH_SIZE) {
+		guint n = MIN(valid->len - start, MOVE_BATCH_SIZE);
+		gc_ptr_array_unref GPtrArray *commands = g_ptr_array_new_with_free_func(g_free);
+
+		for (guint j = 0; j < n; j++) {
+			struct mega_node *node = nodes->pdata[g_array_index(valid, guint, start + j)];
+
+			g_ptr_array_add(commands,
+					s_json_build("{a:m, n:%s, t:%s, i:%s}", node->handle, dest->handle, s->rid));
+		}
+
+		gc_free gchar *response = api_call_batch(s, commands, &local_err);
+
+		for (guint j = 0; j < n; j++) {
+			guint index = g_array_index(valid, guint, start + j);
+			struct mega_node *node = nodes->pdata[index];
+			gint error_code = response ? api_batch_result_code(response, j) : 0;
+			gchar *error;
+
+			if (response && error_code == 0) {
+				// children follow their parent
+				g_free(node->parent_handle);
+				node->parent_handle = g_strdup(dest->handle);
+				node->parent = dest;
+				continue;
+			}
+
+			if (response) {
+				gc_free gchar *path = node_get_display_path(node);
+
+				error = g_strdup_printf("API call 'm' failed for %s: Server returned error %s", path,
+							srv_error_to_string(error_code));
+			} else {
+				error = g_strdup(local_err->message);
+			}
+
+			if (!first_err)
+				g_set_error(&first_err, MEGA_ERROR, MEGA_ERROR_OTHER, "%s", error);
+
+			node_errors->pdata[index] = error;
+		}
+
+		g_clear_error(&local_err);
+	}
+
+	for (guint i = 0; i < nodes->len && errors; i++) {
+		g_ptr_array_add(errors, node_errors->pdata[i]);
+		node_errors->pdata[i] = NULL;
+	}
+
+	if (first_err) {
+		g_propagate_error(err, first_err);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// }}}
+// {{{ mega_session_rename
+
+// node name is only stored in its encrypted attributes, which are replaced
+// by the a:a command
+gboolean mega_session_rename(struct mega_session *s, GPtrArray *nodes, GPtrArray *names, GError **err)
+{
+	GError *local_err = NULL, *first_err = NULL;
+
+	g_return_val_if_fail(s != NULL, FALSE);
+	g_return_val_if_fail(nodes != NULL, FALSE);
+	g_return_val_if_fail(names != NULL && names->len == nodes->len, FALSE);
+	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+	for (guint i = 0; i < nodes->len; i++) {
+		struct mega_node *n = nodes->pdata[i];
+		const gchar *name = names->pdata[i];
+		guchar aes_key[16];
+
+		if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid name: %s", name);
+			return FALSE;
+		}
+
+		if (!mega_node_is_writable(s, n) || !node_get_attrs_key(n, aes_key)) {
+			gc_free gchar *path = node_get_display_path(n);
+
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't rename %s", path);
+			return FALSE;
+		}
+	}
+
+	for (guint start = 0; start < nodes->len; start += MOVE_BATCH_SIZE) {
+		guint n_commands = MIN(nodes->len - start, MOVE_BATCH_SIZE);
+		gc_ptr_array_unref GPtrArray *commands = g_ptr_array_new_with_free_func(g_free);
+
+		for (guint j = 0; j < n_commands; j++) {
+			struct mega_node *n = nodes->pdata[start + j];
+			guchar aes_key[16];
+
+			node_get_attrs_key(n, aes_key);
+
+			gc_free gchar *attrs = encode_node_attrs(names->pdata[start + j], n->fingerprint, n->attrs);
+			gc_free gchar *attrs_enc = b64_aes128_cbc_encrypt_str(attrs, aes_key);
+
+			g_ptr_array_add(commands, s_json_build("{a:a, n:%s, at:%s, i:%s}", n->handle, attrs_enc, s->rid));
+		}
+
+		gc_free gchar *response = api_call_batch(s, commands, &local_err);
+		if (!response) {
+			g_propagate_error(&first_err, local_err);
+			break;
+		}
+
+		for (guint j = 0; j < n_commands; j++) {
+			struct mega_node *n = nodes->pdata[start + j];
+			gint error_code = api_batch_result_code(response, j);
+
+			if (error_code == 0) {
+				g_free(n->name);
+				g_free(n->name_collate_key);
+				n->name = g_strdup(names->pdata[start + j]);
+				n->name_collate_key = g_utf8_collate_key_for_filename(n->name, -1);
+			} else if (!first_err) {
+				gc_free gchar *path = node_get_display_path(n);
+
+				g_set_error(&first_err, MEGA_ERROR, MEGA_ERROR_OTHER,
+					    "API call 'a' failed for %s: Server returned error %s", path,
+					    srv_error_to_string(error_code));
+			}
+		}
+	}
+
+	if (first_err) {
+		g_propagate_error(err, first_err);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// }}}
+// {{{ mega_session_copy
+
+// Every node of the copied subtree is sent in the a:p command with its own
+// handle (the server clones file data from it) and the handle of its parent
+// for all but the topmost node, with the key and attributes encrypted for
+// the new node.
+
+// adds the node and its subtree to the n array of the a:p command
+static gboolean copy_add_node(struct mega_session *s, SJsonGen *gen, GHashTable *children, struct mega_node *n,
+			      const gchar *name, gboolean top, GError **err)
+{
+	guchar aes_key[16];
+
+	if (!node_get_attrs_key(n, aes_key)) {
+		gc_free gchar *path = node_get_display_path(n);
+
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't copy %s: Node key is not available", path);
+		return FALSE;
+	}
+
+	gc_free gchar *attrs = encode_node_attrs(name ? name : n->name, n->fingerprint, n->attrs);
+	gc_free gchar *attrs_enc = b64_aes128_cbc_encrypt_str(attrs, aes_key);
+	gc_free gchar *key_enc = b64_aes128_encrypt(n->key, n->key_len, s->master_key);
+
+	s_json_gen_start_object(gen);
+	s_json_gen_member_string(gen, "h", n->handle);
+	if (!top)
+		s_json_gen_member_string(gen, "p", n->parent->handle);
+	s_json_gen_member_int(gen, "t", n->type);
+	s_json_gen_member_string(gen, "a", attrs_enc);
+	s_json_gen_member_string(gen, "k", key_enc);
+	s_json_gen_end_object(gen);
+
+	GPtrArray *list = g_hash_table_lookup(children, n);
+	for (guint i = 0; list && i < list->len; i++)
+		if (!copy_add_node(s, gen, children, list->pdata[i], NULL, FALSE, err))
+			return FALSE;
+
+	return TRUE;
+}
+
+// adds the copied nodes to the filesystem, returns the topmost one
+static struct mega_node *copy_result(struct mega_session *s, struct mega_node *dest, const gchar *put_node,
+				     GError **err)
+{
+	const gchar *f_arr = s_json_get_member(put_node, "f");
+	struct mega_node *top = NULL;
+	GSList *added = NULL, *i;
+
+	if (s_json_get_type(f_arr) != S_JSON_TYPE_ARRAY) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
+		return NULL;
+	}
+
+	gc_hash_table_unref GHashTable *by_handle = g_hash_table_new(g_str_hash, g_str_equal);
+
+	S_JSON_FOREACH_ELEMENT(f_arr, f)
+	struct mega_node *n = s_json_get_type(f) == S_JSON_TYPE_OBJECT ? mega_node_parse(s, f) : NULL;
+	if (n) {
+		g_hash_table_insert(by_handle, n->handle, n);
+		added = g_slist_prepend(added, n);
+	}
+	S_JSON_FOREACH_END()
+
+	added = g_slist_reverse(added);
+
+	for (i = added; i; i = i->next) {
+		struct mega_node *n = i->data;
+
+		if (n->parent_handle && !strcmp(n->parent_handle, dest->handle)) {
+			n->parent = dest;
+			if (!top)
+				top = n;
+		} else if (n->parent_handle) {
+			n->parent = g_hash_table_lookup(by_handle, n->parent_handle);
+		}
+
+		fingerprint_index_add(s, n);
+		node_index_add(s, n);
+	}
+
+	s->fs_nodes = g_slist_concat(s->fs_nodes, added);
+
+	if (!top)
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
+
+	return top;
+}
+
+gboolean mega_session_copy(struct mega_session *s, GPtrArray *nodes, struct mega_node *dest, const gchar *name,
+			   GPtrArray *copies, GError **err)
+{
+	GError *local_err = NULL, *first_err = NULL;
+	GSList *i;
+
+	g_return_val_if_fail(s != NULL, FALSE);
+	g_return_val_if_fail(nodes != NULL, FALSE);
+	g_return_val_if_fail(dest != NULL, FALSE);
+	g_return_val_if_fail(name == NULL || nodes->len == 1, FALSE);
+	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+	if (!dest_check(s, dest, err))
+		return FALSE;
+
+	for (guint j = 0; j < nodes->len; j++)
+		if (!node_check_target(s, nodes->pdata[j], dest, err))
+			return FALSE;
+
+	// children of all folders, in one pass over the filesystem
+	gc_hash_table_unref GHashTable *children =
+		g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)g_ptr_array_unref);
+	for (i = s->fs_nodes; i; i = i->next) {
+		struct mega_node *n = i->data;
+
+		if (!n->parent || (n->type != MEGA_NODE_FILE && n->type != MEGA_NODE_FOLDER))
+			continue;
+
+		GPtrArray *list = g_hash_table_lookup(children, n->parent);
+		if (!list) {
+			list = g_ptr_array_new();
+			g_hash_table_insert(children, n->parent, list);
+		}
+
+		g_ptr_array_add(list, n);
+	}
+
+	// one a:p command per copied subtree
+	gc_ptr_array_unref GPtrArray *commands = g_ptr_array_new_with_free_func(g_free);
+	for (guint j = 0; j < nodes->len; j++) {
+		SJsonGen *gen = s_json_gen_new();
+
+		s_json_gen_start_object(gen);
+		s_json_gen_member_string(gen, "a", "p");
+		s_json_gen_member_string(gen, "t", dest->handle);
+		s_json_gen_member_array(gen, "n");
+		gboolean ok = copy_add_node(s, gen, children, nodes->pdata[j], name, TRUE, &local_err);
+		s_json_gen_end_array(gen);
+		s_json_gen_end_object(gen);
+
+		gchar *command = s_json_gen_done(gen);
+		if (!ok) {
+			g_free(command);
+			g_propagate_error(err, local_err);
+			return FALSE;
+		}
+
+		g_ptr_array_add(commands, command);
+	}
+
+	gc_free gchar *response = commands->len > 0 ? api_call_batch(s, commands, &local_err) : NULL;
+	if (commands->len > 0 && !response) {
+		g_propagate_error(err, local_err);
+		return FALSE;
+	}
+
+	for (guint j = 0; j < commands->len; j++) {
+		gc_free gchar *put_node = api_batch_result(response, j, NULL, &local_err);
+		struct mega_node *copy = put_node ? copy_result(s, dest, put_node, &local_err) : NULL;
+
+		if (!copy && !first_err) {
+			gc_free gchar *path = node_get_display_path(nodes->pdata[j]);
+
+			g_propagate_prefixed_error(&first_err, local_err, "API call 'p' failed for %s: ", path);
+			local_err = NULL;
+		}
+
+		g_clear_error(&local_err);
+
+		if (copies)
+			g_ptr_array_add(copies, copy);
+	}
+
+	if (first_err) {
+		g_propagate_error(err, first_err);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// }}}
+// {{{ mega_session_new_node_attribute
+
+gchar *mega_session_new_node_attribute(struct mega_session *s, const guchar *data, gsize len, const gchar *type,
+				       const guchar *key, GError **err)
+{
+	GError *local_err = NULL;
+	AES_KEY k;
+	guchar iv[AES_BLOCK_SIZE] = { 0 };
+	gsize pad = len % 16 ? 16 - (len % 16) : 0;
+
+	g_return_val_if_fail(s != NULL, NULL);
+	g_return_val_if_fail(data != NULL, NULL);
+	g_return_val_if_fail(len > 0, NULL);
+	g_return_val_if_fail(type != NULL, NULL);
+	g_return_val_if_fail(key != NULL, NULL);
+	g_return_val_if_fail(err == NULL || *err == NULL, NULL);
+
+	gc_free gchar *ufa_node = api_call(s, 'o', NULL, &local_err, "[{a:ufa, s:%i, ssl:0}]", (gint64)len + pad);
+	if (!ufa_node) {
+		g_propagate_error(err, local_err);
+		return NULL;
+	}
+
+	gc_free gchar *p_url = s_json_get_member_string(ufa_node, "p");
+
+	// encrypt
+	AES_set_encrypt_key(key, 128, &k);
+	gc_free guchar *plain = g_memdup2(data, len);
+	plain = g_realloc(plain, len + pad);
+	memset(plain + len, 0, pad);
+	gc_free guchar *cipher = g_malloc0(len + pad);
+	AES_cbc_encrypt(plain, cipher, len + pad, &k, iv, 1);
+
+	// upload
+	gc_http_free struct http *h = http_new();
+	http_set_proxy(h, s->proxy);
+	http_set_content_type(h, "application/octet-stream");
+	gc_string_free GString *handle = http_post(h, p_url, cipher, len + pad, &local_err);
+
+	if (!handle) {
 		g_propagate_prefixed_error(err, local_err, "Node attribute data upload failed: ");
 		return NULL;
 	}
 
-	if (handle->len != 8) {
-		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Node attribute handle is invalid");
-		return NULL;
+	if (handle->len != 8) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Node attribute handle is invalid");
+		return NULL;
+	}
+
+	gc_free gchar *b64_handle = base64urlencode(handle->str, handle->len);
+
+	return g_strdup_printf("%s*%s", type, b64_handle);
+}
+
+// }}}
+
+// {{{ Data transfer manager
+// ---------------------
+//
+// This supports parallel chunked transfer of data for any number of
+// concurrent transfers. Blocking upload calls are built on top of the
+// asynchronous upload API (see mega_session_upload_submit).
+//
+// How it works:
+//
+// - It uses threaded design where threads communicate by passing messages to
+//   each other. Threads never modify other threads' data while the other
+//   threads are running.
+// - Main thread issues transfer requests to the transfer manager thread and
+//   receives messages about progress/completion on the submitter_mailbox,
+//   which is part of the transfer. Uploads of one session share a single
+//   mailbox, messages carry a pointer to the transfer they are about.
+// - Manager thread picks up a manager_mailbox and processes transfer
+//   submissions from the main thread, prepares incomming transfer submissions
+//   by splitting transfers into chunks and by keeping the list of queued
+//   transfers. It also schedules chunk transfers by passing chunks for
+//   actual download or upload to the worker pool. It also listens for messages
+//   about chunk status changes from the worker threads and schedules
+//   new trasnfers or processes transfer completions.
+// - Scheduling is event driven. Chunks that can be started right away sit
+//   in their transfer's ready queue and transfers with ready chunks sit in
+//   the ready_transfers heap, ordered by priority and the scheduling
+//   policy (see transfer_schedule_compare). Chunks deferred to a later time (staggered
+//   start, retry backoff) sit in the timers heap ordered by start_at. The
+//   manager sleeps on its mailbox until the next message or the earliest
+//   timer, so an idle manager doesn't wake up at all.
+// - Worker threads are started to download or upload the chunk and report
+//   the progress and the final result to the manager.
+//
+// Memory:
+//
+// - Messages are taken from the manager's free-lists by the sender and
+//   returned there by the receiver.
+// - Transfer is allocated by the main thread as a part of the upload and
+//   must stay alive until the manager reports its completion.
+// - Chunks are allocated and freed by the manager thread.
+// - Worker threads allocate and free the http client. Buffers for the chunk
+//   data are borrowed from the manager's buffer pool and returned after
+//   the chunk is sent. Each worker holds at most one buffer, so pool size
+//   is bounded by workers * max chunk size.
+//
+// Locking:
+//
+// - When the upload stream is backed by a regular file, workers read their
+//   chunks with positional reads (pread) on the file descriptor, which
+//   doesn't touch the shared file offset and needs no locking.
+// - Otherwise it is necessary to serialize access to the file data stream
+//   via stream_lock.
+// - Streams that can't seek (pipes) are read strictly in order into the
+//   transfer's ring buffer under stream_lock. The manager releases ring
+//   space as chunks complete and dispatches only chunks that fit, so
+//   workers never wait for space. The start of the ring is published under
+//   ring_lock, which is never held during I/O, so that a slow stream
+//   doesn't block the manager.
+// - Workers need to sycnhronize access to transfer data:
+//   - upload_handle
+// - Chunk progress is written by workers into the chunk's progress counter
+//   using atomic operations. The manager samples counters of chunks in
+//   flight every progress_interval and sends at most one progress message
+//   per transfer per interval.
+// - Other than that, all synchronization is handled by the message queues.
+
+#define tman_debug(fmt, args...)                                                                                       \
+	G_STMT_START                                                                                                   \
+	{                                                                                                              \
+		if (mega_debug & MEGA_DEBUG_TMAN)                                                                     \
+			g_print("%" G_GINT64_FORMAT ": " fmt, g_get_monotonic_time(), ##args);                         \
+	}                                                                                                              \
+	G_STMT_END
+
+enum { 
+	CHUNK_STATE_QUEUED = 0,
+	CHUNK_STATE_IN_PROGRESS,
+	CHUNK_STATE_DONE,
+};
+
+struct transfer_chunk_mac {
+	guchar mac[16];
+	guint off;
+	guint size;
+};
+
+struct transfer_chunk {
+	gint status;
+	gint failures_count; // number of failures when retrying
+	struct transfer *transfer;
+
+	goffset offset;
+	goffset size;
+	goffset transfered_size;
+	guint index;
+
+	gint64 start_at;
+	gint heap_index; // position in the timers heap, or -1
+
+	// bytes sent so far, written by the worker and sampled by the manager
+	gint progress;
+
+	int n_macs;
+	struct transfer_chunk_mac macs[];
+};
+
+// {{{ chunk cipher (CBC-MAC + aes128 ctr + upload checksum)
+//
+// Long-lived cipher contexts for upload chunk processing. Contexts are keyed
+// once per file key and only re-IV'd per chunk. CBC-MAC is computed using
+// aes-128-cbc whose last output block is the MAC. Data are processed in
+// cache sized slices, each slice is MAC'ed, encrypted and added to the
+// upload checksum while it's still hot in the cache, so the buffer is
+// effectively traversed only once. AES is left to OpenSSL, which uses
+// AES-NI when the CPU has it. The result is checked against the simple
+// implementations by chunk_cipher_selftest() before the first upload.
+
+#define CHUNK_CIPHER_SLICE (64 * 1024)
+
+struct chunk_cipher {
+	EVP_CIPHER_CTX *ctr;
+	EVP_CIPHER_CTX *mac;
+	guchar key[16];
+	gboolean keyed;
+
+	// receives CBC output, only the last block of which is interesting
+	guchar *scratch;
+};
+
+static gboolean chunk_cipher_init(struct chunk_cipher *cc)
+{
+	memset(cc, 0, sizeof(*cc));
+
+	cc->ctr = EVP_CIPHER_CTX_new();
+	cc->mac = EVP_CIPHER_CTX_new();
+	cc->scratch = g_malloc(CHUNK_CIPHER_SLICE);
+
+	return cc->ctr && cc->mac;
+}
+
+static void chunk_cipher_clear(struct chunk_cipher *cc)
+{
+	if (cc->ctr)
+		EVP_CIPHER_CTX_free(cc->ctr);
+	if (cc->mac)
+		EVP_CIPHER_CTX_free(cc->mac);
+	g_free(cc->scratch);
+	memset(cc, 0, sizeof(*cc));
+}
+
+static gboolean chunk_cipher_set_key(struct chunk_cipher *cc, const guchar key[16])
+{
+	if (cc->keyed && !memcmp(cc->key, key, 16))
+		return TRUE;
+
+	cc->keyed = FALSE;
+
+	if (!EVP_EncryptInit_ex(cc->ctr, EVP_aes_128_ctr(), NULL, key, NULL))
+		return FALSE;
+	if (!EVP_EncryptInit_ex(cc->mac, EVP_aes_128_cbc(), NULL, key, NULL))
+		return FALSE;
+
+	EVP_CIPHER_CTX_set_padding(cc->ctr, 0);
+	EVP_CIPHER_CTX_set_padding(cc->mac, 0);
+
+	memcpy(cc->key, key, 16);
+	cc->keyed = TRUE;
+	return TRUE;
+}
+
+// mac is computed over the plaintext, so each piece must be mac'ed before
+// it's encrypted in place
+static gboolean chunk_cipher_mac_update(struct chunk_cipher *cc, const guchar *data, gsize len, guchar mac[16])
+{
+	int out_len;
+
+	if (len == 0)
+		return TRUE;
+
+	if (!EVP_EncryptUpdate(cc->mac, cc->scratch, &out_len, data, len) || out_len != len)
+		return FALSE;
+
+	memcpy(mac, cc->scratch + len - 16, 16);
+	return TRUE;
+}
+
+// upload checksum is the ciphertext XOR-ed into 12 bytes; 48 bytes (4 x 12)
+// are accumulated at a time using 64-bit words and folded at the end
+struct upload_chksum {
+	guint64 acc[6];
+	gsize pos;
+};
+
+static void upload_chksum_update(struct upload_chksum *cs, const guchar *data, gsize len)
+{
+	guchar *acc = (guchar *)cs->acc;
+
+	while (len > 0 && cs->pos % 48) {
+		acc[cs->pos++ % 48] ^= *data++;
+		len--;
+	}
+
+	for (; len >= 48; len -= 48, data += 48) {
+		guint64 w[6];
+
+		memcpy(w, data, 48);
+		for (int i = 0; i < 6; i++)
+			cs->acc[i] ^= w[i];
+
+		cs->pos += 48;
+	}
+
+	while (len > 0) {
+		acc[cs->pos++ % 48] ^= *data++;
+		len--;
+	}
+}
+
+static void upload_chksum_finish(struct upload_chksum *cs, guchar sum[12])
+{
+	const guchar *acc = (const guchar *)cs->acc;
+
+	for (int i = 0; i < 12; i++)
+		sum[i] = acc[i] ^ acc[i + 12] ^ acc[i + 24] ^ acc[i + 36];
+}
+
+// calculates chunk macs for the n_macs mac chunks covering the buffer,
+// encrypts the buffer in place and calculates the upload checksum of the
+// ciphertext, offset is position of the buffer in the file
+static gboolean chunk_cipher_process(struct chunk_cipher *cc, const guchar nonce[8], guint64 offset, guchar *buf,
+				     gsize len, struct transfer_chunk_mac *macs, int n_macs, guchar sum[12])
+{
+	struct upload_chksum cs = { { 0 }, 0 };
+	guchar iv[16];
+	int out_len;
+
+	// CTR counter continues across all mac chunks
+	memcpy(iv, nonce, 8);
+	*((guint64 *)&iv[8]) = GUINT64_TO_BE(offset / 16); // this is ok, because chunks are 16b aligned
+	if (!EVP_EncryptInit_ex(cc->ctr, NULL, NULL, NULL, iv))
+		return FALSE;
+
+	memcpy(iv + 8, nonce, 8);
+
+	for (int i = 0; i < n_macs; i++) {
+		guchar *data = buf + macs[i].off;
+		gsize remaining = macs[i].size;
+
+		if (!EVP_EncryptInit_ex(cc->mac, NULL, NULL, NULL, iv))
+			return FALSE;
+
+		memcpy(macs[i].mac, iv, 16);
+
+		while (remaining > 0) {
+			gsize slice = MIN(remaining, CHUNK_CIPHER_SLICE);
+			gsize full = slice & ~(gsize)15;
+
+			if (!chunk_cipher_mac_update(cc, data, full, macs[i].mac))
+				return FALSE;
+
+			// zero pad the last partial block
+			if (full < slice) {
+				guchar last[16] = { 0 };
+
+				memcpy(last, data + full, slice - full);
+				if (!chunk_cipher_mac_update(cc, last, 16, macs[i].mac))
+					return FALSE;
+			}
+
+			if (!EVP_EncryptUpdate(cc->ctr, data, &out_len, data, slice) || out_len != slice)
+				return FALSE;
+
+			upload_chksum_update(&cs, data, slice);
+
+			data += slice;
+			remaining -= slice;
+		}
+	}
+
+	upload_chksum_finish(&cs, sum);
+	return TRUE;
+}
+
+// simple byte-wise upload checksum, reference for the self-test
+static void upload_checksum(const guchar *data, gsize len, guchar sum[12])
+{
+	gsize i;
+
+	memset(sum, 0, 12);
+	for (i = 0; i < len; i++)
+		sum[i % 12] ^= data[i];
+}
+
+// compares chunk_cipher_process() with chunk_mac_calculate(),
+// encrypt_aes128_ctr() and upload_checksum() on mac chunks with unaligned
+// sizes and slice boundaries
+static gboolean chunk_cipher_selftest(void)
+{
+	static const guint sizes[] = { 128 * 1024, 256 * 1024 + 16, 100003, 16, 5 };
+	struct transfer_chunk_mac macs[G_N_ELEMENTS(sizes)];
+	struct chunk_cipher cc;
+	guchar key[16], nonce[8], iv[16], mac[16], sum[12], ref_sum[12];
+	guint64 offset = 3 * 128 * 1024;
+	gsize len = 0;
+	gboolean ok = FALSE;
+
+	GRand *rand = g_rand_new_with_seed(0x6d656761);
+	for (int i = 0; i < 16; i++)
+		key[i] = g_rand_int(rand);
+	for (int i = 0; i < 8; i++)
+		nonce[i] = g_rand_int(rand);
+
+	for (guint i = 0; i < G_N_ELEMENTS(sizes); i++) {
+		macs[i].off = len;
+		macs[i].size = sizes[i];
+		len += sizes[i];
+	}
+
+	gc_free guchar *plain = g_malloc(len);
+	gc_free guchar *buf = g_malloc(len);
+	gc_free guchar *ref = g_malloc(len);
+	for (gsize i = 0; i < len; i++)
+		plain[i] = g_rand_int(rand);
+	g_rand_free(rand);
+
+	memcpy(buf, plain, len);
+	if (!chunk_cipher_init(&cc) || !chunk_cipher_set_key(&cc, key) ||
+	    !chunk_cipher_process(&cc, nonce, offset, buf, len, macs, G_N_ELEMENTS(macs), sum))
+		goto out;
+
+	for (guint i = 0; i < G_N_ELEMENTS(sizes); i++) {
+		if (!chunk_mac_calculate(nonce, key, plain + macs[i].off, macs[i].size, mac) ||
+		    memcmp(mac, macs[i].mac, 16))
+			goto out;
+	}
+
+	memcpy(iv, nonce, 8);
+	*((guint64 *)&iv[8]) = GUINT64_TO_BE(offset / 16);
+	if (!encrypt_aes128_ctr(ref, plain, len, key, iv) || memcmp(ref, buf, len))
+		goto out;
+
+	upload_checksum(ref, len, ref_sum);
+	ok = !memcmp(sum, ref_sum, 12);
+
+out:
+	chunk_cipher_clear(&cc);
+	return ok;
+}
+
+// }}}
+
+enum {
+	TRANSFER_WORKER_MSG_STOP = 1,
+	TRANSFER_WORKER_MSG_UPLOAD_CHUNK,
+};
+
+struct transfer_worker_msg {
+	gint type;
+
+	struct transfer_chunk* chunk;
+	//GError *error;
+};
+
+struct transfer_worker {
+	gint index;
+	gboolean busy;
+	GThread* thread;
+	GAsyncQueue* mailbox;
+	struct transfer_chunk *chunk; // chunk in flight, owned by the manager
+
+	// reused for building chunk URLs
+	GString *url;
+
+	// owned by the worker thread
+	struct chunk_cipher cipher;
+};
+
+enum {
+	TRANSFER_MSG_DONE = 1,
+	TRANSFER_MSG_PROGRESS,
+	TRANSFER_MSG_ERROR,
+	TRANSFER_MSG_WAKEUP, // no transfer, wakes up the submitter
+};
+
+// mac of a completed mac chunk, reported to the submitter so that it can
+// be journaled and used to resume the upload later
+struct transfer_done_mac {
+	goffset off;
+	guchar mac[16];
+};
+
+struct transfer_msg {
+	gint type;
+	struct transfer *transfer;
+
+	// newly completed mac chunks (for journaled transfers)
+	GArray *done_macs;
+
+	gchar *upload_handle;
+	guchar meta_mac[16];
+
+	goffset total_size;
+	goffset transfered_size;
+
+	GError *error;
+};
+
+// Coalesced ("boost") upload chunks
+//
+// Upload chunks may cover several mac chunks, so that each POST carries
+// 4-16 MiB of data instead of 128 kiB - 1 MiB. Some upload servers respond
+// with EFAILED/ETOOMANY to big requests when there are many connections,
+// so chunk sizes are negotiated per upload host: failing chunks are split
+// in half and retried and the host's limit is lowered, while a streak of
+// successful chunks at the limit raises it again.
+
+#define TRANSFER_CHUNK_SIZE_MIN (1024 * 1024)
+#define TRANSFER_CHUNK_SIZE_START (4 * 1024 * 1024)
+#define TRANSFER_CHUNK_SIZE_MAX (16 * 1024 * 1024)
+#define TRANSFER_CHUNK_SIZE_GROW_AFTER 32
+
+enum {
+	UPLOAD_EFAILED = -4,
+	UPLOAD_ETOOMANY = -6,
+};
+
+struct transfer_host_limit {
+	gchar *host;
+	guint max_chunk_size;
+	guint successes;
+
+	// connections to the host, transfers that have ready chunks but hit
+	// the per-host cap wait in the blocked queue
+	guint n_in_flight;
+	GQueue blocked;
+};
+
+struct transfer {
+	// queue for sending mesages to a submitter
+	GAsyncQueue *submitter_mailbox;
+	// submitter's data, not touched by the manager
+	gpointer user_data;
+
+	// chunks ordered by offset, owned by the manager
+	GPtrArray *chunks;
+	goffset total_size;
+	goffset transfered_size;
+
+	// scheduling state, owned by the manager
+	GQueue ready; // chunks that can be started right away
+	gint heap_index; // position in the ready_transfers heap, or -1
+	guint seq; // submission order
+	guint64 vtime; // data sent divided by weight, for round-robin
+	gboolean host_blocked; // waits in the host's blocked queue
+	guint n_unfinished; // chunks that are not done yet
+	guint n_in_progress; // chunks being transfered by workers
+	gboolean progress_dirty; // transfered_size changed since the last report
+
+	guchar file_key[16];
+	guchar nonce[16];
+
+	// scheduling parameters set by the submitter
+	gint priority; // higher goes first
+	guint weight; // share of connections for round-robin, 0 means 1
+	gint64 deadline; // monotonic time, 0 means none
+
+	// file access is serialized with this mutex (not used for fd reads)
+	GMutex stream_lock;
+
+	// upload host's chunk size limit, owned by the manager
+	struct transfer_host_limit *host_limit;
+
+	// for upload
+	GInputStream *istream;
+	// descriptor for lock-free positional reads, or -1
+	int fd;
+	// stream can't seek, data is read strictly in order
+	gboolean sequential;
+	// data of sequential streams between the first unfinished chunk
+	// (ring_start) and the read position (ring_end) is kept in a ring
+	// buffer, so that failed chunks can be re-sent; ring_start is
+	// written by the manager under ring_lock and ring_end by the workers
+	// under stream_lock
+	GMutex ring_lock;
+	guchar *ring;
+	gsize ring_size;
+	goffset ring_start;
+	goffset ring_end;
+	guint first_unfinished; // index of the chunk at ring_start
+	const gchar *upload_url;
+	gchar *upload_handle;
+
+	// for download
+	GFileOutputStream *ostream;
+	const gchar *download_url;
+
+	// HTTP options
+	gint max_ul;
+	gint max_dl;
+	gchar *proxy;
+
+	// resume support: completed mac chunks are collected in done_macs
+	// and reported with progress if journal is set; chunks covered by
+	// resume_macs (owned by the submitter) were uploaded before and are
+	// not sent again
+	gboolean journal;
+	GArray *done_macs;
+	GArray *resume_macs;
+
+	// transfer is in error state, will be aborted
+	GError *error;
+};
+
+enum { 
+	TRANSFER_MANAGER_MSG_SUBMIT_TRANSFER = 1,
+	TRANSFER_MANAGER_MSG_CHUNK_FAILED,
+	TRANSFER_MANAGER_MSG_CHUNK_DONE,
+	TRANSFER_MANAGER_MSG_STOP,
+};
+
+struct transfer_manager_msg {
+	gint type;
+	struct transfer *transfer;
+	struct transfer_chunk *chunk;
+	struct transfer_worker* worker;
+	gchar *upload_handle; // can be sent with the last chunk update
+	gint server_code; // numeric error code returned by the upload server
+	GError *error;
+};
+
+// thread-safe free-list of fixed size objects
+struct tman_pool {
+	GAsyncQueue *free;
+	gsize obj_size;
+	guint max_free;
+};
+
+#define TRANSFER_BUFFER_ALIGN 64
+#define TRANSFER_BUFFER_ROUNDING (1024 * 1024)
+
+struct transfer_buffer {
+	gsize size;
+	guchar *data;
+};
+
+// binary heap of items that remember their position in the heap, so that
+// they can be removed from the middle in O(log n)
+struct tman_heap {
+	GPtrArray *items;
+	GCompareFunc compare;
+	glong index_offset; // offset of the gint position member in the item
+};
+
+struct transfer_manager {
+	GAsyncQueue *manager_mailbox;
+	GThread *manager_thread;
+
+	// free-lists shared by all threads
+	struct tman_pool manager_msgs;
+	struct tman_pool worker_msgs;
+	struct tman_pool transfer_msgs;
+	GAsyncQueue *buffers;
+
+	// only manager thread accesses these after it is started:
+	struct transfer_worker *workers;
+	int max_workers;
+	int current_workers;
+	GQueue idle_workers;
+
+	// chunks waiting for their start_at time
+	struct tman_heap timers;
+	// transfers that have ready chunks, ordered by the policy
+	struct tman_heap ready_transfers;
+	guint next_seq;
+	gint policy;
+	guint max_host_connections; // 0 means unlimited
+	guint64 vtime; // virtual time of the last round-robin dispatch
+
+	// progress of chunks in flight is sampled every progress_interval
+	// microseconds while there's something to report
+	gint64 progress_interval;
+	gint64 next_progress_at; // 0 when not scheduled
+	GPtrArray *progress_dirty; // transfers with unreported progress
+
+	// upload host -> struct transfer_host_limit
+	GHashTable *host_limits;
+};
+
+static struct transfer_manager tman;
+
+// {{{ heap
+
+#define TMAN_HEAP_INDEX(heap, item) G_STRUCT_MEMBER(gint, (item), (heap)->index_offset)
+
+static void tman_heap_init(struct tman_heap *heap, GCompareFunc compare, glong index_offset)
+{
+	heap->items = g_ptr_array_new();
+	heap->compare = compare;
+	heap->index_offset = index_offset;
+}
+
+static void tman_heap_clear(struct tman_heap *heap)
+{
+	g_ptr_array_free(heap->items, TRUE);
+	heap->items = NULL;
+}
+
+static void tman_heap_set(struct tman_heap *heap, guint i, gpointer item)
+{
+	heap->items->pdata[i] = item;
+	TMAN_HEAP_INDEX(heap, item) = i;
+}
+
+static void tman_heap_sift_up(struct tman_heap *heap, guint i)
+{
+	gpointer item = heap->items->pdata[i];
+
+	while (i > 0) {
+		guint parent = (i - 1) / 2;
+		gpointer parent_item = heap->items->pdata[parent];
+
+		if (heap->compare(item, parent_item) >= 0)
+			break;
+
+		tman_heap_set(heap, i, parent_item);
+		i = parent;
+	}
+
+	tman_heap_set(heap, i, item);
+}
+
+static void tman_heap_sift_down(struct tman_heap *heap, guint i)
+{
+	gpointer item = heap->items->pdata[i];
+	guint len = heap->items->len;
+
+	while (TRUE) {
+		guint child = 2 * i + 1;
+
+		if (child >= len)
+			break;
+
+		if (child + 1 < len && heap->compare(heap->items->pdata[child + 1], heap->items->pdata[child]) < 0)
+			child++;
+
+		if (heap->compare(heap->items->pdata[child], item) >= 0)
+			break;
+
+		tman_heap_set(heap, i, heap->items->pdata[child]);
+		i = child;
+	}
+
+	tman_heap_set(heap, i, item);
+}
+
+static void tman_heap_push(struct tman_heap *heap, gpointer item)
+{
+	g_ptr_array_add(heap->items, item);
+	tman_heap_sift_up(heap, heap->items->len - 1);
+}
+
+static gpointer tman_heap_peek(struct tman_heap *heap)
+{
+	return heap->items->len > 0 ? heap->items->pdata[0] : NULL;
+}
+
+static void tman_heap_remove(struct tman_heap *heap, gpointer item)
+{
+	gint i = TMAN_HEAP_INDEX(heap, item);
+	guint last = heap->items->len - 1;
+
+	g_return_if_fail(i >= 0 && heap->items->pdata[i] == item);
+
+	if (i != last) {
+		tman_heap_set(heap, i, heap->items->pdata[last]);
+		g_ptr_array_set_size(heap->items, last);
+		tman_heap_sift_down(heap, i);
+		tman_heap_sift_up(heap, i);
+	} else {
+		g_ptr_array_set_size(heap->items, last);
+	}
+
+	TMAN_HEAP_INDEX(heap, item) = -1;
+}
+
+// restores the heap order after the item's key changed
+static void tman_heap_update(struct tman_heap *heap, gpointer item)
+{
+	gint i = TMAN_HEAP_INDEX(heap, item);
+
+	g_return_if_fail(i >= 0 && heap->items->pdata[i] == item);
+
+	tman_heap_sift_down(heap, i);
+	tman_heap_sift_up(heap, TMAN_HEAP_INDEX(heap, item));
+}
+
+static gint chunk_start_at_compare(gconstpointer a, gconstpointer b)
+{
+	const struct transfer_chunk *ca = a, *cb = b;
+
+	// chunks due at the same time fire in order of offset
+	if (ca->start_at != cb->start_at)
+		return ca->start_at < cb->start_at ? -1 : 1;
+
+	return ca->offset < cb->offset ? -1 : ca->offset > cb->offset;
+}
+
+static gint chunk_offset_compare(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const struct transfer_chunk *ca = a, *cb = b;
+
+	return ca->offset < cb->offset ? -1 : ca->offset > cb->offset;
+}
+
+static gint transfer_schedule_compare(gconstpointer a, gconstpointer b)
+{
+	const struct transfer *ta = a, *tb = b;
+
+	if (ta->priority != tb->priority)
+		return ta->priority > tb->priority ? -1 : 1;
+
+	switch (tman.policy) {
+	case MEGA_SCHEDULE_SMALL_FIRST:
+		if (ta->total_size != tb->total_size)
+			return ta->total_size < tb->total_size ? -1 : 1;
+		break;
+
+	case MEGA_SCHEDULE_ROUND_ROBIN:
+		if (ta->vtime != tb->vtime)
+			return ta->vtime < tb->vtime ? -1 : 1;
+		break;
+
+	case MEGA_SCHEDULE_DEADLINE:
+		if (ta->deadline != tb->deadline) {
+			if (!ta->deadline || !tb->deadline)
+				return ta->deadline ? -1 : 1;
+
+			return ta->deadline < tb->deadline ? -1 : 1;
+		}
+		break;
+	}
+
+	return ta->seq < tb->seq ? -1 : ta->seq > tb->seq;
+}
+
+// }}}
+// {{{ pools
+
+static void tman_pool_init(struct tman_pool *pool, gsize obj_size, guint max_free)
+{
+	pool->free = g_async_queue_new();
+	pool->obj_size = obj_size;
+	pool->max_free = max_free;
+}
+
+static void tman_pool_clear(struct tman_pool *pool)
+{
+	gpointer obj;
+
+	while ((obj = g_async_queue_try_pop(pool->free)))
+		g_free(obj);
+
+	g_async_queue_unref(pool->free);
+	pool->free = NULL;
+}
+
+static gpointer tman_pool_alloc(struct tman_pool *pool)
+{
+	gpointer obj = g_async_queue_try_pop(pool->free);
+
+	if (obj) {
+		memset(obj, 0, pool->obj_size);
+		return obj;
+	}
+
+	return g_malloc0(pool->obj_size);
+}
+
+static void tman_pool_release(struct tman_pool *pool, gpointer obj)
+{
+	if (g_async_queue_length(pool->free) < (gint)pool->max_free)
+		g_async_queue_push(pool->free, obj);
+	else
+		g_free(obj);
+}
+
+#define tman_manager_msg_new() ((struct transfer_manager_msg *)tman_pool_alloc(&tman.manager_msgs))
+#define tman_manager_msg_free(msg) tman_pool_release(&tman.manager_msgs, msg)
+#define tman_worker_msg_new() ((struct transfer_worker_msg *)tman_pool_alloc(&tman.worker_msgs))
+#define tman_worker_msg_free(msg) tman_pool_release(&tman.worker_msgs, msg)
+#define tman_transfer_msg_new() ((struct transfer_msg *)tman_pool_alloc(&tman.transfer_msgs))
+#define tman_transfer_msg_free(msg) tman_pool_release(&tman.transfer_msgs, msg)
+
+static void transfer_buffer_free(struct transfer_buffer *b)
+{
+	if (!b)
+		return;
+
+#ifdef G_OS_WIN32
+	_aligned_free(b->data);
+#else
+	free(b->data);
+#endif
+	g_free(b);
+}
+
+// returns a buffer at least size bytes large, reusing pooled buffers when
+// possible
+static struct transfer_buffer *tman_buffer_get(gsize size)
+{
+	struct transfer_buffer *b = g_async_queue_try_pop(tman.buffers);
+
+	if (b && b->size >= size)
+		return b;
+
+	transfer_buffer_free(b);
+
+	b = g_new0(struct transfer_buffer, 1);
+	b->size = (size + TRANSFER_BUFFER_ROUNDING - 1) / TRANSFER_BUFFER_ROUNDING * TRANSFER_BUFFER_ROUNDING;
+#ifdef G_OS_WIN32
+	b->data = _aligned_malloc(b->size, TRANSFER_BUFFER_ALIGN);
+	if (!b->data)
+		g_error("Failed to allocate %" G_GSIZE_FORMAT " bytes", b->size);
+#else
+	if (posix_memalign((void **)&b->data, TRANSFER_BUFFER_ALIGN, b->size))
+		g_error("Failed to allocate %" G_GSIZE_FORMAT " bytes", b->size);
+#endif
+
+	return b;
+}
+
+static void tman_buffer_put(struct transfer_buffer *b)
+{
+	// there's at most one buffer per worker in circulation
+	g_async_queue_push(tman.buffers, b);
+}
+
+// }}}
+
+// progress is only recorded here, the manager samples it periodically
+static gboolean tman_transfer_progress(goffset dltotal, goffset dlnow, goffset ultotal, goffset ulnow,
+				       gpointer user_data)
+{
+	struct transfer_chunk *c = user_data;
+
+	g_atomic_int_set(&c->progress, MIN(ulnow, c->size));
+
+	return TRUE;
+}
+
+// reads plaintext data of the chunk from the source file
+// reads the stream in order into the ring buffer up to the end of the chunk
+// and copies the chunk out of it; the manager dispatches only chunks that
+// fit into the ring
+static gboolean transfer_read_chunk_sequential(struct transfer *t, struct transfer_chunk *c, guchar *buf, GError **err)
+{
+	GError *local_err = NULL;
+	goffset end = c->offset + c->size;
+	gsize bytes_read;
+
+	// ring_start only grows, so a snapshot is enough for the check
+	g_mutex_lock(&t->ring_lock);
+	goffset ring_start = t->ring_start;
+	g_mutex_unlock(&t->ring_lock);
+
+	g_assert(c->offset >= ring_start && end <= ring_start + (goffset)t->ring_size);
+
+	g_mutex_lock(&t->stream_lock);
+
+	while (t->ring_end < end) {
+		gsize pos = t->ring_end % t->ring_size;
+		gsize len = MIN(end - t->ring_end, t->ring_size - pos);
+
+		if (!g_input_stream_read_all(t->istream, t->ring + pos, len, &bytes_read, NULL, &local_err)) {
+			g_mutex_unlock(&t->stream_lock);
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Failed reading from the stream: %s",
+				    local_err->message);
+			g_clear_error(&local_err);
+			return FALSE;
+		}
+
+		t->ring_end += bytes_read;
+
+		if (bytes_read < len) {
+			g_mutex_unlock(&t->stream_lock);
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER,
+				    "Stream ended after %" G_GOFFSET_FORMAT " bytes, before the declared size",
+				    t->ring_end);
+			return FALSE;
+		}
+
+		// make sure the stream doesn't have more data than declared
+		if (t->ring_end == t->total_size) {
+			guchar extra;
+
+			if (g_input_stream_read(t->istream, &extra, 1, NULL, NULL) > 0) {
+				g_mutex_unlock(&t->stream_lock);
+				g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Stream is longer than the declared size");
+				return FALSE;
+			}
+		}
+	}
+
+	for (goffset off = c->offset; off < end;) {
+		gsize pos = off % t->ring_size;
+		gsize len = MIN(end - off, t->ring_size - pos);
+
+		memcpy(buf + (off - c->offset), t->ring + pos, len);
+		off += len;
+	}
+
+	g_mutex_unlock(&t->stream_lock);
+	return TRUE;
+}
+
+static gboolean transfer_read_chunk(struct transfer *t, struct transfer_chunk *c, guchar *buf, GError **err)
+{
+	GError *local_err = NULL;
+	gsize bytes_read;
+
+#ifndef G_OS_WIN32
+	if (t->fd >= 0) {
+		bytes_read = 0;
+		while (bytes_read < c->size) {
+			ssize_t rv = pread(t->fd, buf + bytes_read, c->size - bytes_read, c->offset + bytes_read);
+			if (rv < 0) {
+				if (errno == EINTR)
+					continue;
+
+				g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Failed reading from the file: %s",
+					    g_strerror(errno));
+				return FALSE;
+			}
+
+			if (rv == 0)
+				break;
+
+			bytes_read += rv;
+		}
+
+		goto check_size;
+	}
+#endif
+
+	if (t->sequential)
+		return transfer_read_chunk_sequential(t, c, buf, err);
+
+	g_mutex_lock(&t->stream_lock);
+
+	if (!g_seekable_seek(G_SEEKABLE(t->istream), c->offset, G_SEEK_SET, NULL, &local_err)) {
+		g_mutex_unlock(&t->stream_lock);
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Failed seeking in the stream: %s", local_err->message);
+		g_clear_error(&local_err);
+		return FALSE;
+	}
+
+	if (!g_input_stream_read_all(t->istream, buf, c->size, &bytes_read, NULL, &local_err)) {
+		g_mutex_unlock(&t->stream_lock);
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Failed reading from the stream: %s",
+			    local_err->message);
+		g_clear_error(&local_err);
+		return FALSE;
+	}
+
+	g_mutex_unlock(&t->stream_lock);
+
+#ifndef G_OS_WIN32
+check_size:
+#endif
+	if (bytes_read != c->size) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Failed reading from the stream (premature end)");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// accesses:
+// - chunk: size, index, offset, mac
+// - transfer: fd, stream_lock, istream, ring, nonce, file_key, upload_url, max_ul, max_dl, proxy
+static void tman_worker_upload_chunk(struct transfer_chunk *c, struct transfer_worker* worker, struct http* h)
+{
+	struct transfer *t = c->transfer;
+	struct transfer_manager_msg *msg;
+	GError *err = NULL;
+	GError *local_err = NULL;
+	gc_string_free GString *response = NULL;
+	gc_free gchar* chksum = NULL;
+	guchar sum[12];
+	gint server_code = 0;
+
+	tman_debug("W[%d]: started for chunk %d\n", worker->index, c->index);
+
+	// load plaintext data into a buffer from the file
+
+	struct transfer_buffer *tbuf = tman_buffer_get(c->size);
+	guchar *buf = tbuf->data;
+
+	if (!transfer_read_chunk(t, c, buf, &err))
+		goto err;
+
+	// perform encryption, chunk mac and checksum calculation
+	if (!chunk_cipher_set_key(&worker->cipher, t->file_key)
+	    || !chunk_cipher_process(&worker->cipher, t->nonce, c->offset, buf, c->size, c->macs, c->n_macs, sum)) {
+		err = g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Failed to encrypt data");
+		goto err;
+	}
+
+	// prepare URL including chunk offset
+	chksum = base64urlencode(sum, sizeof sum);
+	g_string_printf(worker->url, "%s/%" G_GOFFSET_FORMAT "?c=%s", t->upload_url, c->offset, chksum);
+
+	// perform upload POST
+	http_set_content_type(h, "application/octet-stream");
+	http_set_progress_callback(h, tman_transfer_progress, c);
+	http_set_speed(h, t->max_ul, t->max_dl);
+	http_set_proxy(h, t->proxy);
+	response = http_post(h, worker->url->str, buf, c->size, &local_err);
+
+	// data are no longer needed
+	tman_buffer_put(tbuf);
+	tbuf = NULL;
+
+	if (!response) {
+		g_propagate_prefixed_error(&err, local_err, "Chunk upload failed: ");
+		goto err;
+	}
+
+	gchar *upload_handle = NULL;
+
+	if (response->len > 0) {
+		// check for numeric error code
+		if (response->len < 10 && g_regex_match_simple("^-(\\d+)$", response->str, 0, 0)) {
+			int code = atoi(response->str);
+			server_code = code;
+			const char* err_str = "???";
+
+			switch (code) {
+				case -3:
+					err_str = "EAGAIN";
+					break;
+				case -4:
+					err_str = "EFAILED";
+					break;
+				case -5:
+					err_str = "ENOTFOUND";
+					break;
+				case -6:
+					err_str = "ETOOMANY";
+					break;
+				case -7:
+					err_str = "ERANGE";
+					break;
+				case -8:
+					err_str = "EEXPIRED";
+					break;
+				case -14:
+					err_str = "EKEY";
+					break;
+			}
+
+			err = g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned error code %d (%s)", code, err_str);
+			goto err;
+		}
+
+		if (response->len == 36) {
+			upload_handle = base64urlencode(response->str, response->len);
+
+			// we've got the handle
+			tman_debug("W[%d]: got upload data handle with chunk %d: '%s'\n", worker->index, c->index, upload_handle);
+		} else {
+			err = g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned something that does not look like upload handle");
+			goto err;
+		}
+	}
+
+	tman_debug("W[%d]: success for chunk %d\n", worker->index, c->index);
+
+	// send success to the manager
+	msg = tman_manager_msg_new();
+	msg->type = TRANSFER_MANAGER_MSG_CHUNK_DONE;
+	msg->chunk = c;
+	msg->worker = worker;
+	msg->upload_handle = upload_handle;
+	g_async_queue_push(tman.manager_mailbox, msg);
+	return;
+
+err:
+	tman_debug("W[%d]: error for chunk %d: %s\n", worker->index, c->index, err->message);
+
+	if (tbuf)
+		tman_buffer_put(tbuf);
+
+	// send error to the manager
+	msg = tman_manager_msg_new();
+	msg->type = TRANSFER_MANAGER_MSG_CHUNK_FAILED;
+	msg->chunk = c;
+	msg->worker = worker;
+	msg->error = err;
+	msg->server_code = server_code;
+	g_async_queue_push(tman.manager_mailbox, msg);
+}
+
+// performs single http send operation
+static gpointer tman_worker_thread_fn(gpointer data)
+{
+	struct transfer_worker* w = data;
+	gc_http_free struct http *h = NULL;
+
+	h = http_new();
+	http_expect_short_running(h);
+	http_set_max_connects(h, 2);
+
+	if (!chunk_cipher_init(&w->cipher))
+		g_error("Failed to allocate cipher contexts");
+
+	while (TRUE) {
+		struct transfer_worker_msg *msg = g_async_queue_pop(w->mailbox);
+
+		switch (msg->type) {
+		case TRANSFER_WORKER_MSG_STOP:
+			tman_worker_msg_free(msg);
+			chunk_cipher_clear(&w->cipher);
+			return NULL;
+
+		case TRANSFER_WORKER_MSG_UPLOAD_CHUNK:
+			tman_worker_upload_chunk(msg->chunk, w, h);
+			tman_worker_msg_free(msg);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void tman_schedule_progress(void)
+{
+	if (tman.next_progress_at == 0)
+		tman.next_progress_at = g_get_monotonic_time() + tman.progress_interval;
+}
+
+static void tman_mark_progress_dirty(struct transfer *t)
+{
+	if (!t->progress_dirty) {
+		t->progress_dirty = TRUE;
+		g_ptr_array_add(tman.progress_dirty, t);
+		tman_schedule_progress();
+	}
+}
+
+static void tman_set_chunk_progress(struct transfer_chunk *c, goffset size)
+{
+	struct transfer *t = c->transfer;
+
+	if (size == c->transfered_size)
+		return;
+
+	t->transfered_size += size - c->transfered_size;
+	c->transfered_size = size;
+
+	tman_mark_progress_dirty(t);
+}
+
+// remembers macs of the completed chunk for the submitter's journal
+static void tman_journal_chunk(struct transfer *t, struct transfer_chunk *c)
+{
+	if (!t->done_macs)
+		t->done_macs = g_array_new(FALSE, FALSE, sizeof(struct transfer_done_mac));
+
+	for (int i = 0; i < c->n_macs; i++) {
+		struct transfer_done_mac dm;
+
+		dm.off = c->offset + c->macs[i].off;
+		memcpy(dm.mac, c->macs[i].mac, 16);
+		g_array_append_val(t->done_macs, dm);
+	}
+
+	tman_mark_progress_dirty(t);
+}
+
+static void tman_send_progress(struct transfer *t)
+{
+	struct transfer_msg *tmsg;
+
+	if (!t->progress_dirty)
+		return;
+
+	t->progress_dirty = FALSE;
+
+	tmsg = tman_transfer_msg_new();
+	tmsg->type = TRANSFER_MSG_PROGRESS;
+	tmsg->transfer = t;
+	tmsg->total_size = t->total_size;
+	tmsg->transfered_size = t->transfered_size;
+	tmsg->done_macs = t->done_macs;
+	t->done_macs = NULL;
+	g_async_queue_push(t->submitter_mailbox, tmsg);
+}
+
+// samples progress of chunks in flight and sends at most one progress
+// report per transfer
+static void tman_sample_progress(gint64 now)
+{
+	for (int i = 0; i < tman.max_workers; i++) {
+		struct transfer_worker *w = &tman.workers[i];
+
+		if (w->busy)
+			tman_set_chunk_progress(w->chunk, g_atomic_int_get(&w->chunk->progress));
+	}
+
+	for (guint i = 0; i < tman.progress_dirty->len; i++)
+		tman_send_progress(tman.progress_dirty->pdata[i]);
+	g_ptr_array_set_size(tman.progress_dirty, 0);
+
+	tman.next_progress_at = tman.current_workers > 0 ? now + tman.progress_interval : 0;
+}
+
+// puts the transfer with ready chunks into the ready_transfers heap
+static void tman_ready_transfer(struct transfer *t)
+{
+	if (t->heap_index >= 0)
+		return;
+
+	// idle transfers don't get to catch up on their round-robin share
+	t->vtime = MAX(t->vtime, tman.vtime);
+	tman_heap_push(&tman.ready_transfers, t);
+}
+
+// queues the chunk for transfer right away or when its start_at time comes
+static void tman_queue_chunk(struct transfer_chunk *c, gint64 now)
+{
+	struct transfer *t = c->transfer;
+
+	c->status = CHUNK_STATE_QUEUED;
+
+	if (c->start_at > now) {
+		tman_heap_push(&tman.timers, c);
+		return;
+	}
+
+	// sequential streams must not skip over the first unfinished chunk,
+	// which keeps the ring from advancing
+	struct transfer_chunk *tail = g_queue_peek_tail(&t->ready);
+	if (t->sequential && tail && tail->offset > c->offset)
+		g_queue_insert_sorted(&t->ready, c, chunk_offset_compare, NULL);
+	else
+		g_queue_push_tail(&t->ready, c);
+
+	tman_ready_transfer(t);
+}
+
+// discards data of the finished chunks from the ring of a sequential
+// stream and lets the transfer continue if it was waiting for space
+static void tman_advance_ring(struct transfer *t)
+{
+	struct transfer_chunk *c;
+	goffset start;
+
+	if (!t->ring)
+		return;
+
+	while (t->first_unfinished < t->chunks->len) {
+		c = t->chunks->pdata[t->first_unfinished];
+		if (c->status != CHUNK_STATE_DONE)
+			break;
+
+		t->first_unfinished++;
+	}
+
+	if (t->first_unfinished < t->chunks->len)
+		start = ((struct transfer_chunk *)t->chunks->pdata[t->first_unfinished])->offset;
+	else
+		start = t->total_size;
+
+	if (start == t->ring_start)
+		return;
+
+	g_mutex_lock(&t->ring_lock);
+	t->ring_start = start;
+	g_mutex_unlock(&t->ring_lock);
+
+	if (!g_queue_is_empty(&t->ready))
+		tman_ready_transfer(t);
+}
+
+// moves chunks whose time has come to the ready queues
+static void tman_fire_timers(gint64 now)
+{
+	struct transfer_chunk *c;
+
+	while ((c = tman_heap_peek(&tman.timers)) && c->start_at <= now) {
+		tman_heap_remove(&tman.timers, c);
+		tman_queue_chunk(c, now);
+	}
+}
+
+// returns how long the manager can sleep in microseconds, -1 means forever
+static gint64 tman_get_timeout(gint64 now)
+{
+	struct transfer_chunk *c = tman_heap_peek(&tman.timers);
+	gint64 wake_at = tman.next_progress_at;
+
+	if (c && (wake_at == 0 || c->start_at < wake_at))
+		wake_at = c->start_at;
+
+	if (wake_at == 0)
+		return -1;
+
+	return MAX(wake_at - now, 0);
+}
+
+// removes all queued chunks of the transfer from the ready queue and timers
+static void tman_unqueue_transfer(struct transfer *t)
+{
+	if (t->heap_index >= 0)
+		tman_heap_remove(&tman.ready_transfers, t);
+
+	if (t->host_blocked) {
+		g_queue_remove(&t->host_limit->blocked, t);
+		t->host_blocked = FALSE;
+	}
+
+	g_queue_clear(&t->ready);
+
+	for (guint i = 0; i < t->chunks->len; i++) {
+		struct transfer_chunk *c = t->chunks->pdata[i];
+
+		if (c->heap_index >= 0)
+			tman_heap_remove(&tman.timers, c);
+	}
+}
+
+// passes ready chunks to idle workers
+static void tman_dispatch_chunks(void)
+{
+	while (!g_queue_is_empty(&tman.idle_workers)) {
+		struct transfer *t = tman_heap_peek(&tman.ready_transfers);
+		if (!t)
+			break;
+
+		// chunk of a sequential stream doesn't fit into the ring yet,
+		// wait until the chunks before it are done
+		struct transfer_chunk *c = g_queue_peek_head(&t->ready);
+		if (t->ring && c->offset + c->size > t->ring_start + (goffset)t->ring_size) {
+			tman_heap_remove(&tman.ready_transfers, t);
+			continue;
+		}
+
+		// upload host has too many connections, wait until one of
+		// them is done
+		struct transfer_host_limit *host = t->host_limit;
+		if (tman.max_host_connections > 0 && host->n_in_flight >= tman.max_host_connections) {
+			tman_heap_remove(&tman.ready_transfers, t);
+			if (!t->host_blocked) {
+				t->host_blocked = TRUE;
+				g_queue_push_tail(&host->blocked, t);
+			}
+			continue;
+		}
+
+		g_queue_pop_head(&t->ready);
+		host->n_in_flight++;
+
+		// advance the transfer's virtual time by the data it was given
+		tman.vtime = t->vtime;
+		t->vtime += c->size / MAX(t->weight, 1);
+
+		if (g_queue_is_empty(&t->ready))
+			tman_heap_remove(&tman.ready_transfers, t);
+		else if (tman.policy == MEGA_SCHEDULE_ROUND_ROBIN)
+			tman_heap_update(&tman.ready_transfers, t);
+
+		struct transfer_worker *w = g_queue_pop_head(&tman.idle_workers);
+
+		tman_debug("M: chunk %d pushed to worker %d\n", c->index, w->index);
+
+		w->busy = TRUE;
+		w->chunk = c;
+		c->status = CHUNK_STATE_IN_PROGRESS;
+		g_atomic_int_set(&c->progress, 0);
+		t->n_in_progress++;
+		tman.current_workers++;
+		tman_schedule_progress();
+
+		struct transfer_worker_msg *msg = tman_worker_msg_new();
+		msg->type = TRANSFER_WORKER_MSG_UPLOAD_CHUNK;
+		msg->chunk = c;
+		g_async_queue_push(w->mailbox, msg);
+	}
+}
+
+static void tman_worker_done(struct transfer_worker *w, struct transfer *t)
+{
+	struct transfer_host_limit *host = t->host_limit;
+	struct transfer *bt;
+
+	w->busy = FALSE;
+	w->chunk = NULL;
+	tman.current_workers--;
+	t->n_in_progress--;
+	g_queue_push_head(&tman.idle_workers, w);
+
+	// transfers waiting for a connection to the host compete again
+	host->n_in_flight--;
+	while ((bt = g_queue_pop_head(&host->blocked))) {
+		bt->host_blocked = FALSE;
+		if (!g_queue_is_empty(&bt->ready))
+			tman_ready_transfer(bt);
+	}
+}
+
+// notifies the submitter if the transfer is complete or if it was aborted
+// and no chunks are in flight anymore
+static void tman_check_transfer_finished(struct transfer *t)
+{
+	struct transfer_msg *tmsg;
+
+	// if some chunks are in flight or queued and transfer is not
+	// aborted, we are not done yet
+	if (t->n_in_progress > 0 || (t->n_unfinished > 0 && !t->error))
+		return;
+
+	if (!t->error && !t->upload_handle) {
+		// mega did not return upload handle with the last
+		// uploaded chunk, WTF?
+		t->error = g_error_new(MEGA_ERROR, MEGA_ERROR_NO_HANDLE, "Mega didn't return an upload handle");
+	}
+
+	tman_unqueue_transfer(t);
+
+	// report final progress before completion
+	if (t->progress_dirty) {
+		tman_send_progress(t);
+		g_ptr_array_remove(tman.progress_dirty, t);
+	}
+
+	tmsg = tman_transfer_msg_new();
+	tmsg->transfer = t;
+
+	if (t->error) {
+		tman_debug("M: transfer %s failed\n", t->upload_url);
+
+		tmsg->type = TRANSFER_MSG_ERROR;
+		tmsg->error = t->error;
+		t->error = NULL;
+	} else {
+		tman_debug("M: transfer %s succeeded\n", t->upload_url);
+
+		tmsg->type = TRANSFER_MSG_DONE;
+
+		// calculate meta_mac
+		GSList *macs = NULL;
+		for (guint i = t->chunks->len; i > 0; i--) {
+			struct transfer_chunk *c = t->chunks->pdata[i - 1];
+			for (int j = c->n_macs - 1; j >= 0; j--)
+				macs = g_slist_prepend(macs, c->macs[j].mac);
+		}
+		meta_mac_calculate(macs, t->file_key, tmsg->meta_mac);
+		g_slist_free(macs);
+
+		tmsg->upload_handle = t->upload_handle;
+	}
+
+	g_ptr_array_free(t->chunks, TRUE);
+	t->chunks = NULL;
+	g_clear_pointer(&t->ring, g_free);
+	if (t->done_macs) {
+		g_array_free(t->done_macs, TRUE);
+		t->done_macs = NULL;
+	}
+
+	g_async_queue_push(t->submitter_mailbox, tmsg);
+}
+
+static int get_n_chunks(guint idx, guint size, guint* rounded_size)
+{
+	if (idx < 7) {
+		// special algo
+		guint i = 0;
+		guint csize = 0;
+
+		while (csize < size) {
+			csize += get_chunk_size(idx);
+			idx++;
+			i++;
+		}
+
+		*rounded_size = csize;
+		return i;
+	} else {
+		guint rem = size % (1024 * 1024);
+		int n = size / (1024 * 1024) + (rem > 0 ? 1 : 0);
+
+		*rounded_size = n * 1024 * 1024;
+
+		return n;
+	}
+}
+
+static gchar *get_url_host(const gchar *url)
+{
+	const gchar *start = strstr(url, "://");
+	const gchar *end;
+
+	start = start ? start + 3 : url;
+	end = strchr(start, '/');
+
+	return end ? g_strndup(start, end - start) : g_strdup(start);
+}
+
+static struct transfer_host_limit *tman_get_host_limit(const gchar *url)
+{
+	gc_free gchar *host = get_url_host(url);
+	struct transfer_host_limit *limit = g_hash_table_lookup(tman.host_limits, host);
+
+	if (!limit) {
+		limit = g_new0(struct transfer_host_limit, 1);
+		limit->host = g_strdup(host);
+		limit->max_chunk_size = TRANSFER_CHUNK_SIZE_MAX;
+		g_hash_table_insert(tman.host_limits, limit->host, limit);
+	}
+
+	return limit;
+}
+
+static void transfer_host_limit_free(struct transfer_host_limit *limit)
+{
+	g_queue_clear(&limit->blocked);
+	g_free(limit->host);
+	g_free(limit);
+}
+
+static void prepare_transfer(struct transfer *t)
+{
+	// create list of chunks and initialize it
+	// get number of chunks from total size
+	gint64 now = g_get_monotonic_time();
+	goffset off = 0;
+	guint chunk_idx = 0, mac_idx = 0;
+
+	// Here we create a list of chunks that will be used for transfer.
+	// For bigger files, we can create bigger chunks. When creating
+	// bigger chunks we need to account for a fact that chunk mac is
+	// calculated from a fixed pattern of chunk sizes that we can't modify.
+	//
+	// First 8 chunks are 128 kiB * index sized, the rest is 1 MiB sized.
+	//
+	// We pre-define this pattern in the macs array of n_macs size.
+	//
+	// Upload chunks are coalesced up to the limit negotiated with the
+	// upload host.
+
+	t->chunks = g_ptr_array_new_with_free_func(g_free);
+	g_queue_init(&t->ready);
+	t->heap_index = -1;
+	t->seq = tman.next_seq++;
+	t->host_limit = tman_get_host_limit(t->upload_url);
+
+	guint host_max_size = t->host_limit->max_chunk_size;
+	guint max_chunk_size = 0;
+	guint n_resumed = 0;
+	gc_hash_table_unref GHashTable *resumed = NULL;
+
+	// index mac chunks uploaded before by their offset
+	if (t->resume_macs && t->resume_macs->len > 0) {
+		resumed = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+		for (guint i = 0; i < t->resume_macs->len; i++) {
+			struct transfer_done_mac *dm = &g_array_index(t->resume_macs, struct transfer_done_mac, i);
+
+			g_hash_table_insert(resumed, &dm->off, dm);
+		}
+	}
+
+	t->transfered_size = 0;
+
+	// sequential streams keep the data of unfinished chunks in a ring
+	// buffer, keep chunks small so that the ring is small too
+	if (t->sequential) {
+		host_max_size = MIN(host_max_size, TRANSFER_CHUNK_SIZE_START);
+		t->ring_size = MIN(t->total_size, (goffset)tman.max_workers * 2 * TRANSFER_CHUNK_SIZE_START);
+		t->ring = t->ring_size > 0 ? g_malloc(t->ring_size) : NULL;
+		t->ring_start = t->ring_end = 0;
+		t->first_unfinished = 0;
+	}
+
+	while (off < t->total_size) {
+		goffset max_size = MIN(host_max_size, chunk_idx < 3 ? TRANSFER_CHUNK_SIZE_START : TRANSFER_CHUNK_SIZE_MAX);
+
+		guint size = MIN(t->total_size - off, max_size);
+		guint rounded_size;
+		int num_mac_chunks = get_n_chunks(mac_idx, size, &rounded_size);
+
+		// don't overshoot the limit when rounding to mac chunks
+		if (num_mac_chunks > 1 && rounded_size > max_size) {
+			rounded_size -= get_chunk_size(mac_idx + num_mac_chunks - 1);
+			num_mac_chunks--;
+		}
+
+		// don't mix mac chunks that were uploaded before with those
+		// that were not
+		gboolean done = FALSE;
+		if (resumed) {
+			goffset mac_off = get_chunk_size(mac_idx);
+
+			done = g_hash_table_contains(resumed, &off);
+
+			for (int i = 1; i < num_mac_chunks; i++) {
+				goffset o = off + mac_off;
+
+				if (g_hash_table_contains(resumed, &o) != done) {
+					num_mac_chunks = i;
+					rounded_size = mac_off;
+					break;
+				}
+
+				mac_off += get_chunk_size(mac_idx + i);
+			}
+		}
+
+		size = MIN(t->total_size - off, rounded_size);
+
+		struct transfer_chunk *c = g_malloc0(sizeof(struct transfer_chunk) + sizeof(struct transfer_chunk_mac) * num_mac_chunks);
+
+		c->offset = off;
+		c->size = size;
+		c->index = chunk_idx;
+		c->status = CHUNK_STATE_QUEUED;
+		c->transfer = t;
+		c->start_at = now + (chunk_idx < 4 ? chunk_idx : 4) * 200000;
+		c->heap_index = -1;
+
+		c->n_macs = num_mac_chunks;
+
+		guint mac_off = 0;
+		for (int i = 0; i < num_mac_chunks; i++) {
+			c->macs[i].off = mac_off;
+			c->macs[i].size = MIN(get_chunk_size(mac_idx), size - mac_off);
+
+			mac_idx++;
+			mac_off += c->macs[i].size;
+		}
+
+		g_ptr_array_add(t->chunks, c);
+
+		chunk_idx++;
+		off += c->size;
+
+		// curiously, I found that if the last chunk
+		// is not coalesced, mega will not hang
+		if (off == t->total_size && c->n_macs > 1) {
+			off -= c->macs[c->n_macs - 1].size;
+			c->size -= c->macs[c->n_macs - 1].size;
+			c->n_macs--;
+			mac_idx--;
+		}
+
+		if (done) {
+			for (int i = 0; i < c->n_macs; i++) {
+				goffset o = c->offset + c->macs[i].off;
+				struct transfer_done_mac *dm = g_hash_table_lookup(resumed, &o);
+
+				memcpy(c->macs[i].mac, dm->mac, 16);
+			}
+
+			c->status = CHUNK_STATE_DONE;
+			c->transfered_size = c->size;
+			t->transfered_size += c->size;
+			n_resumed++;
+		}
+
+		max_chunk_size = MAX(max_chunk_size, c->size);
+	}
+
+	t->n_unfinished = t->chunks->len - n_resumed;
+	for (guint i = 0; i < t->chunks->len; i++) {
+		struct transfer_chunk *c = t->chunks->pdata[i];
+
+		if (c->status != CHUNK_STATE_DONE)
+			tman_queue_chunk(c, now);
+	}
+
+	if (n_resumed > 0) {
+		tman_debug("M: transfer %s resumed, %u chunks (%" G_GOFFSET_FORMAT " bytes) were uploaded before\n",
+			   t->upload_url, n_resumed, t->transfered_size);
+		tman_mark_progress_dirty(t);
+	}
+
+	tman_debug("M: transfer %s split into %u chunks, max chunk size %u (host %s limit %u)\n", t->upload_url,
+		   chunk_idx, max_chunk_size, t->host_limit->host, host_max_size);
+
+#if 0
+	for (guint i = 0; i < t->chunks->len; i++) {
+		struct transfer_chunk *c = t->chunks->pdata[i];
+
+		g_print("CH[%d] = { off=%" G_GOFFSET_FORMAT " size=%" G_GOFFSET_FORMAT " macs=%d }\n", c->index, c->offset, c->size, c->n_macs);
+		for (int i = 0; i < c->n_macs; i++)
+			g_print("  CMAC { off=%u size=%u }\n", c->macs[i].off, c->macs[i].size);
+	}
+#endif
+}
+
+// replaces the chunk with two queued chunks covering halves of its mac chunks
+static void transfer_split_chunk(struct transfer *t, struct transfer_chunk *c, gint64 now)
+{
+	struct transfer_chunk *parts[2];
+	int first_n = c->n_macs / 2;
+	guint idx;
+
+	for (idx = 0; idx < t->chunks->len; idx++)
+		if (t->chunks->pdata[idx] == c)
+			break;
+
+	g_return_if_fail(idx < t->chunks->len);
+	g_return_if_fail(c->n_macs > 1);
+
+	for (int p = 0; p < 2; p++) {
+		int first = p ? first_n : 0;
+		int n = p ? c->n_macs - first_n : first_n;
+		struct transfer_chunk *nc = g_malloc0(sizeof(struct transfer_chunk) + sizeof(struct transfer_chunk_mac) * n);
+
+		nc->offset = c->offset + c->macs[first].off;
+		nc->index = c->index;
+		nc->status = CHUNK_STATE_QUEUED;
+		nc->transfer = t;
+		nc->start_at = c->start_at;
+		nc->heap_index = -1;
+		nc->failures_count = c->failures_count;
+		nc->n_macs = n;
+
+		for (int i = 0; i < n; i++) {
+			nc->macs[i] = c->macs[first + i];
+			nc->macs[i].off -= c->macs[first].off;
+			nc->size += nc->macs[i].size;
+		}
+
+		parts[p] = nc;
+	}
+
+	t->chunks->pdata[idx] = parts[0];
+	g_ptr_array_insert(t->chunks, idx + 1, parts[1]);
+	t->n_unfinished++;
+	g_free(c);
+
+	tman_queue_chunk(parts[0], now);
+	tman_queue_chunk(parts[1], now);
+}
+
+// handles EFAILED/ETOOMANY responses to big chunks, returns TRUE if the
+// chunk was split and re-queued
+static gboolean tman_shrink_chunk(struct transfer *t, struct transfer_chunk *c, gint server_code, gint64 now)
+{
+	struct transfer_host_limit *limit = t->host_limit;
+
+	if (server_code != UPLOAD_EFAILED && server_code != UPLOAD_ETOOMANY)
+		return FALSE;
+
+	if (c->n_macs < 2 || c->size <= TRANSFER_CHUNK_SIZE_MIN)
+		return FALSE;
+
+	guint new_limit = MAX(c->size / 2, TRANSFER_CHUNK_SIZE_MIN);
+	if (new_limit < limit->max_chunk_size) {
+		limit->max_chunk_size = new_limit;
+		tman_debug("M: host %s chunk size limit lowered to %u\n", limit->host, new_limit);
+	}
+	limit->successes = 0;
+
+	tman_debug("M: chunk %d (%" G_GOFFSET_FORMAT " bytes) rejected with %d, splitting\n", c->index, c->size,
+		   server_code);
+
+	transfer_split_chunk(t, c, now);
+	return TRUE;
+}
+
+// successful big chunks let the host's limit grow back
+static void tman_chunk_succeeded(struct transfer *t, struct transfer_chunk *c)
+{
+	struct transfer_host_limit *limit = t->host_limit;
+
+	if (limit->max_chunk_size >= TRANSFER_CHUNK_SIZE_MAX || c->size < limit->max_chunk_size)
+		return;
+
+	if (++limit->successes >= TRANSFER_CHUNK_SIZE_GROW_AFTER) {
+		limit->max_chunk_size = MIN(limit->max_chunk_size * 2, TRANSFER_CHUNK_SIZE_MAX);
+		limit->successes = 0;
+		tman_debug("M: host %s chunk size limit raised to %u\n", limit->host, limit->max_chunk_size);
+	}
+}
+
+static gpointer tman_manager_thread_fn(gpointer data)
+{
+	// keeps track of the workers
+	//  - submits transfer_chunks to the workers
+	// keeps tab on the individual trasnfers and
+	//  - notifies transfer submitter when done
+	//  - sends progress updates
+
+	while (TRUE) {
+		struct transfer_manager_msg *msg;
+		struct transfer_msg *tmsg;
+		struct transfer *t;
+		struct transfer_chunk *c;
+		gint64 now = g_get_monotonic_time();
+		gint64 timeout;
+
+		if (tman.next_progress_at && tman.next_progress_at <= now)
+			tman_sample_progress(now);
+
+		tman_fire_timers(now);
+		tman_dispatch_chunks();
+
+		// sleep until the next message or timer
+		timeout = tman_get_timeout(now);
+		if (timeout < 0)
+			msg = g_async_queue_pop(tman.manager_mailbox);
+		else
+			msg = g_async_queue_timeout_pop(tman.manager_mailbox, timeout);
+
+		if (!msg)
+			continue;
+
+		now = g_get_monotonic_time();
+
+		switch (msg->type) {
+		case TRANSFER_MANAGER_MSG_STOP:
+			tman_manager_msg_free(msg);
+			return NULL;
+
+		case TRANSFER_MANAGER_MSG_SUBMIT_TRANSFER:
+			t = msg->transfer;
+
+			tman_debug("M: transfer submitted %s\n", t->upload_url);
+
+			prepare_transfer(t);
+			tman_check_transfer_finished(t);
+			break;
+
+		case TRANSFER_MANAGER_MSG_CHUNK_DONE:
+			c = msg->chunk;
+			t = c->transfer;
+
+			tman_debug("M: chunk done %d\n", c->index);
+
+			tman_worker_done(msg->worker, t);
+			tman_set_chunk_progress(c, c->size);
+
+			c->status = CHUNK_STATE_DONE;
+			t->n_unfinished--;
+			tman_chunk_succeeded(t, c);
+			tman_advance_ring(t);
+			if (t->journal)
+				tman_journal_chunk(t, c);
+			if (msg->upload_handle) {
+				g_free(t->upload_handle);
+				t->upload_handle = msg->upload_handle;
+			}
+
+			tman_check_transfer_finished(t);
+			break;
+		case TRANSFER_MANAGER_MSG_CHUNK_FAILED: {
+			c = msg->chunk;
+			t = c->transfer;
+
+			tman_debug("M: chunk fail %d\n", c->index);
+
+			tman_worker_done(msg->worker, t);
+
+			// we failed to transfer the chunk
+			tman_set_chunk_progress(c, 0);
+			c->status = CHUNK_STATE_QUEUED;
+
+			if (t->error) {
+				// transfer is in error state and is being aborted
+				tman_debug("M: transfer is being aborted, chunk %d fail ignored\n", c->index);
+			} else if (tman_shrink_chunk(t, c, msg->server_code, now)) {
+				// chunk was replaced by smaller ones
+			} else {
+				if (g_error_matches(msg->error, HTTP_ERROR, HTTP_ERROR_COMM_FAILURE)
+						|| g_error_matches(msg->error, HTTP_ERROR, HTTP_ERROR_TIMEOUT)
+						|| g_error_matches(msg->error, HTTP_ERROR, HTTP_ERROR_SERVER_BUSY)
+						|| g_error_matches(msg->error, HTTP_ERROR, HTTP_ERROR_NO_RESPONSE)) {
+					if (c->failures_count > 8) {
+						g_printerr("WARNING: chunk upload failed too many times (%s), aborting transfer\n", msg->error->message);
+
+						// mark transfer as aborted
+						t->error = msg->error;
+						msg->error = NULL;
+					} else {
+						g_printerr("WARNING: chunk upload failed (%s), re-trying after %d seconds\n", msg->error->message, (1 << c->failures_count));
+						c->start_at = now + 1000 * 1000 * ((1 << c->failures_count));
+						c->failures_count++;
+
+						// re-queue chunk
+						tman_queue_chunk(c, now);
+					}
+				} else if (g_error_matches(msg->error, HTTP_ERROR, HTTP_ERROR_BANDWIDTH_LIMIT)) {
+					// we need to defer all further
+					// transfers by a lot
+					g_printerr("WARNING: over upload quota, delaying all transfers by 5 minutes\n");
+					tman_unqueue_transfer(t);
+					for (guint i = 0; i < t->chunks->len; i++) {
+						struct transfer_chunk *c = t->chunks->pdata[i];
+
+						if (c->status != CHUNK_STATE_QUEUED)
+							continue;
+
+						c->start_at = now + 1000 * (5*60*1000 + g_random_int_range(0, 2000));
+						tman_queue_chunk(c, now);
+					}
+				} else {
+					g_printerr("WARNING: chunk upload failed (%s), aborting transfer\n", msg->error->message);
+
+					// mark transfer as aborted
+					t->error = msg->error;
+					msg->error = NULL;
+				}
+			}
+
+			if (t->error)
+				tman_unqueue_transfer(t);
+
+			tman_check_transfer_finished(t);
+			break;
+		}
+
+		default:
+			g_assert_not_reached();
+			break;
+		}
+
+		g_clear_error(&msg->error);
+		tman_manager_msg_free(msg);
+	}
+
+	return NULL;
+}
+
+static void tman_init(int max_workers, gint progress_interval, gint policy, gint max_host_connections)
+{
+	GError *local_err = NULL;
+
+	// check if we are already initialized
+	if (tman.manager_thread)
+		return;
+
+	memset(&tman, 0, sizeof tman);
+
+	// uploads would be corrupted silently
+	if (!chunk_cipher_selftest())
+		g_error("Upload cipher self-test failed");
+
+	tman.manager_mailbox = g_async_queue_new();
+
+	tman_pool_init(&tman.manager_msgs, sizeof(struct transfer_manager_msg), 256);
+	tman_pool_init(&tman.worker_msgs, sizeof(struct transfer_worker_msg), max_workers);
+	tman_pool_init(&tman.transfer_msgs, sizeof(struct transfer_msg), 64);
+	tman.buffers = g_async_queue_new();
+	tman.host_limits = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)transfer_host_limit_free);
+	tman_heap_init(&tman.timers, chunk_start_at_compare, G_STRUCT_OFFSET(struct transfer_chunk, heap_index));
+	tman_heap_init(&tman.ready_transfers, transfer_schedule_compare, G_STRUCT_OFFSET(struct transfer, heap_index));
+	tman.policy = policy;
+	tman.max_host_connections = max_host_connections;
+	g_queue_init(&tman.idle_workers);
+	tman.progress_interval = (gint64)MAX(progress_interval, 10) * 1000;
+	tman.progress_dirty = g_ptr_array_new();
+
+	// start workers
+	tman.max_workers = max_workers;
+	tman.workers = g_new0(struct transfer_worker, max_workers);
+	for (int i = 0; i < max_workers; i++) {
+		tman.workers[i].index = i;
+		tman.workers[i].url = g_string_sized_new(256);
+		tman.workers[i].mailbox = g_async_queue_new();
+		tman.workers[i].thread = g_thread_new("transfer worker", tman_worker_thread_fn, &tman.workers[i]);
+		g_queue_push_tail(&tman.idle_workers, &tman.workers[i]);
 	}
 
-	gc_free gchar *b64_handle = base64urlencode(handle->str, handle->len);
+	// start manager
+	tman.manager_thread = g_thread_new("transfer manager", tman_manager_thread_fn, &tman);
+}
 
-	return g_strdup_printf("%s*%s", type, b64_handle);
+static void tman_fini(void)
+{
+	if (tman.manager_thread) {
+		// ask manager to stop
+		struct transfer_manager_msg *msg = tman_manager_msg_new();
+		msg->type = TRANSFER_MANAGER_MSG_STOP;
+		g_async_queue_push(tman.manager_mailbox, msg);
+
+		g_thread_join(tman.manager_thread);
+
+		for (int i = 0; i < tman.max_workers; i++) {
+			struct transfer_worker_msg *msg = tman_worker_msg_new();
+			msg->type = TRANSFER_WORKER_MSG_STOP;
+			g_async_queue_push(tman.workers[i].mailbox, msg);
+		}
+
+		for (int i = 0; i < tman.max_workers; i++) {
+			g_thread_join(tman.workers[i].thread);
+			g_async_queue_unref(tman.workers[i].mailbox);
+			g_string_free(tman.workers[i].url, TRUE);
+		}
+
+		g_free(tman.workers);
+		g_async_queue_unref(tman.manager_mailbox);
+
+		struct transfer_buffer *b;
+		while ((b = g_async_queue_try_pop(tman.buffers)))
+			transfer_buffer_free(b);
+		g_async_queue_unref(tman.buffers);
+		g_hash_table_unref(tman.host_limits);
+		tman_heap_clear(&tman.timers);
+		tman_heap_clear(&tman.ready_transfers);
+		g_queue_clear(&tman.idle_workers);
+		g_ptr_array_free(tman.progress_dirty, TRUE);
+
+		tman_pool_clear(&tman.manager_msgs);
+		tman_pool_clear(&tman.worker_msgs);
+		tman_pool_clear(&tman.transfer_msgs);
+
+		memset(&tman, 0, sizeof tman);
+	}
 }
 
-// }}}
+// returns a descriptor usable for positional reads if the stream is backed
+// by a regular file, otherwise -1
+static int transfer_get_fd(GInputStream *istream)
+{
+#ifndef G_OS_WIN32
+	struct stat st;
+	int fd;
 
-// {{{ Data transfer manager
-// ---------------------
-//
-// ATM this supports parallel chunked transfer of data without breaking the
-// assumptions of the original code about upload/downlad call being a blocking
-// operation.
-//
-// How it works:
-//
-// - It uses threaded design where threads communicate by passing messages to
-//   each other. Threads never modify other threads' data while the other
-//   threads are running.
-// - Main thread issues transfer requests to the transfer manager thread and
-//   waits for messages about progress/completion on the submitter_mailbox,
-//   which is part of the transfer. When it gets a message about transfer
-//   completion it returns.
-// - Manager thread picks up a manager_mailbox and processes transfer
-//   submissions from the main thread, prepares incomming transfer submissions
-//   by splitting transfers into chunks and by keeping the list of queued
-//   transfers. It also schedules chunk transfers by passing chunks for
-//   actual download or upload to the worker pool. It also listens for messages
-//   about chunk status changes from the worker threads and schedules
-//   new trasnfers or processes transfer completions.
-// - Worker threads are started to download or upload the chunk and report
-//   the progress and the final result to the manager.
-//
-// Memory:
-//
-// - Messages are allocated by the sender and freed by the receiver.
-// - Transfer is allocated on the stack of the main thread ATM.
-// - Chunks are allocated and freed by the manager thread.
-// - Worker threads allocate and free the http client and temporary
-//   buffer for the chunk data.
-//
-// Locking:
-//
-// - It is necessary to serialize access to the file data stream via stream_lock.
-// - Workers need to sycnhronize access to transfer data:
-//   - upload_handle
-//   - transfered_size
-// - Other than that, all synchronization is handled by the message queues.
+	if (!G_IS_FILE_DESCRIPTOR_BASED(istream))
+		return -1;
 
-#define tman_debug(fmt, args...)                                                                                       \
-	G_STMT_START                                                                                                   \
-	{                                                                                                              \
-		if (mega_debug & MEGA_DEBUG_TMAN)                                                                     \
-			g_print("%" G_GINT64_FORMAT ": " fmt, g_get_monotonic_time(), ##args);                         \
-	}                                                                                                              \
-	G_STMT_END
+	fd = g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(istream));
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return -1;
 
-enum { 
-	CHUNK_STATE_QUEUED = 0,
-	CHUNK_STATE_IN_PROGRESS,
-	CHUNK_STATE_DONE,
-};
+#ifdef POSIX_FADV_SEQUENTIAL
+	// chunks are read mostly in order, let the kernel read ahead
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-struct transfer_chunk_mac {
-	guchar mac[16];
-	guint off;
-	guint size;
-};
+	return fd;
+#else
+	return -1;
+#endif
+}
 
-struct transfer_chunk {
-	gint status;
-	gint failures_count; // number of failures when retrying
-	struct transfer *transfer;
+// starts the transfer, progress and completion are reported to the
+// transfer's submitter_mailbox
+static void tman_submit_transfer(struct transfer *t)
+{
+	struct transfer_manager_msg *msg = tman_manager_msg_new();
 
-	goffset offset;
-	goffset size;
-	goffset transfered_size;
-	guint index;
+	msg->type = TRANSFER_MANAGER_MSG_SUBMIT_TRANSFER;
+	msg->transfer = t;
+	g_async_queue_push(tman.manager_mailbox, msg);
+}
 
-	gint64 start_at;
+// }}}
 
-	int n_macs;
-	struct transfer_chunk_mac macs[];
-};
+// Download/upload:
+
+// {{{ create_preview
+
+static gint has_convert = -1;
+static gint has_ffmpegthumbnailer = -1;
 
 enum {
-	TRANSFER_WORKER_MSG_STOP = 1,
-	TRANSFER_WORKER_MSG_UPLOAD_CHUNK,
+	PREVIEW_NONE,
+	PREVIEW_VIDEO,
+	PREVIEW_IMAGE,
 };
 
-struct transfer_worker_msg {
-	gint type;
+// decides how to create a preview for the file, must be called from the
+// main thread
+static gint preview_get_kind(const gchar *local_path)
+{
+#ifndef G_OS_WIN32
+	if (has_ffmpegthumbnailer < 0) {
+		gc_free gchar *prg = g_find_program_in_path("ffmpegthumbnailer");
 
-	struct transfer_chunk* chunk;
-	//GError *error;
-};
+		has_ffmpegthumbnailer = prg ? 1 : 0;
+	}
 
-struct transfer_worker {
-	gint index;
-	gboolean busy;
-	GThread* thread;
-	GAsyncQueue* mailbox;
-};
+	if (has_convert < 0) {
+		gc_free gchar *prg = g_find_program_in_path("convert");
 
-enum {
-	TRANSFER_MSG_DONE = 1,
-	TRANSFER_MSG_PROGRESS,
-	TRANSFER_MSG_ERROR,
-};
+		has_convert = prg ? 1 : 0;
+	}
 
-struct transfer_msg {
-	gint type;
+	if (has_ffmpegthumbnailer && g_regex_match_simple("\\.(mpg|mpeg|avi|mkv|flv|rm|mp4|wmv|asf|ram|mov)$",
+							  local_path, G_REGEX_CASELESS, 0))
+		return PREVIEW_VIDEO;
 
-	gchar *upload_handle;
-	guchar meta_mac[16];
+	if (has_convert && g_regex_match_simple("\\.(jpe?g|png|gif|bmp|tiff|svg|pnm|eps|ico|pdf)$", local_path,
+						G_REGEX_CASELESS, 0))
+		return PREVIEW_IMAGE;
+#endif
 
-	goffset total_size;
-	goffset transfered_size;
+	return PREVIEW_NONE;
+}
 
-	GError *error;
-};
+static gchar *create_preview(struct mega_session *s, const gchar *local_path, gint kind, const guchar *key, GError **err)
+{
+	gchar *handle = NULL;
+#ifndef G_OS_WIN32
+	GError *local_err = NULL;
+	gc_free gchar *tmp1 = NULL, *tmp2 = NULL;
 
-struct transfer {
-	// queue for sending mesages to a submitter
-	GAsyncQueue *submitter_mailbox;
+	if (kind == PREVIEW_VIDEO) {
+		gchar buf[50] = "/tmp/megatools.XXXXXX";
+		gchar *dir = g_mkdtemp(buf);
+		if (dir) {
+			gint status = 1;
+			gc_free gchar *thumb_path = g_strdup_printf("%s/thumb.jpg", dir);
+			gc_free gchar *qpath = g_shell_quote(local_path);
+			gc_free gchar *tmp = g_strdup_printf(
+				"ffmpegthumbnailer -t 5 -i %s -o %s/thumb.jpg -s 128 -f -a", qpath, dir);
 
-	GSList *chunks;
-	goffset total_size;
-	goffset transfered_size;
+			if (g_spawn_command_line_sync(tmp, &tmp1, &tmp2, &status, &local_err)) {
+				if (g_file_test(thumb_path, G_FILE_TEST_IS_REGULAR)) {
+					gc_free gchar *thumb_data = NULL;
+					gsize thumb_len;
+
+					if (g_file_get_contents(thumb_path, &thumb_data, &thumb_len, NULL)) {
+						handle = mega_session_new_node_attribute(s, thumb_data, thumb_len, "0",
+											 key, &local_err);
+						if (!handle)
+							g_propagate_error(err, local_err);
+					}
+
+					g_unlink(thumb_path);
+				}
+			} else {
+				g_propagate_error(err, local_err);
+			}
+
+			g_rmdir(dir);
+		}
+	} else if (kind == PREVIEW_IMAGE) {
+		gchar buf[50] = "/tmp/megatools.XXXXXX";
+		gchar *dir = g_mkdtemp(buf);
+		if (dir) {
+			gint status = 1;
+			gc_free gchar *thumb_path = g_strdup_printf("%s/thumb.jpg", dir);
+			gc_free gchar *qpath = NULL;
+
+			if (g_regex_match_simple("\\.pdf$", local_path, G_REGEX_CASELESS, 0)) {
+				gc_free gchar *local_path_page = g_strdup_printf("%s[0]", local_path);
+
+				qpath = g_shell_quote(local_path_page);
+			} else {
+				qpath = g_shell_quote(local_path);
+			}
+
+			gc_free gchar *tmp = g_strdup_printf(
+				"convert %s -strip -background white -flatten -resize 128x128^ -gravity center -crop 128x128+0+0 +repage %s/thumb.jpg",
+				qpath, dir);
+
+			if (g_spawn_command_line_sync(tmp, &tmp1, &tmp2, &status, &local_err)) {
+				if (g_file_test(thumb_path, G_FILE_TEST_IS_REGULAR)) {
+					gc_free gchar *thumb_data = NULL;
+					gsize thumb_len;
+
+					if (g_file_get_contents(thumb_path, &thumb_data, &thumb_len, NULL)) {
+						handle = mega_session_new_node_attribute(s, thumb_data, thumb_len, "0",
+											 key, &local_err);
+						if (!handle)
+							g_propagate_error(err, local_err);
+					}
+
+					g_unlink(thumb_path);
+				}
+			} else {
+				g_propagate_error(err, local_err);
+			}
 
-	AES_KEY k;
-	guchar file_key[16];
-	guchar nonce[16];
+			g_rmdir(dir);
+		}
+	} else {
+		return NULL;
+	}
 
-	// file access is serialized with this mutex
-	GMutex stream_lock;
+	if (!handle && err && !*err)
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't create preview");
 
-	// for upload
-	GFileInputStream *istream;
-	const gchar *upload_url;
-	gchar *upload_handle;
+#endif
+	return handle;
+}
 
-	// for download
-	GFileOutputStream *ostream;
-	const gchar *download_url;
+// }}}
+// {{{ preview jobs
+//
+// Previews are created on a small thread pool while the data of the file
+// is being uploaded. The job is shared by the upload and the pool: the
+// upload waits for the result at most preview_timeout ms after its data
+// is uploaded, then it creates the node without the preview and drops
+// its reference. Jobs that nobody waits for anymore are skipped.
 
-	// HTTP options
-	gint max_ul;
-	gint max_dl;
-	gchar *proxy;
+#define PREVIEW_WORKERS 2
 
-	// transfer is in error state, will be aborted
-	GError *error;
+struct preview_job {
+	gint ref_count;
+	struct mega_session *s;
+	gchar *local_path;
+	gint kind;
+	guchar key[16];
+
+	// result, guarded by the lock
+	GMutex lock;
+	gboolean done;
+	gchar *fa;
 };
 
-enum { 
-	TRANSFER_MANAGER_MSG_SUBMIT_TRANSFER = 1,
-	TRANSFER_MANAGER_MSG_CHUNK_PROGRESS,
-	TRANSFER_MANAGER_MSG_CHUNK_FAILED,
-	TRANSFER_MANAGER_MSG_CHUNK_DONE,
-	TRANSFER_MANAGER_MSG_STOP,
-};
+static void preview_job_unref(struct preview_job *job)
+{
+	if (g_atomic_int_dec_and_test(&job->ref_count)) {
+		g_free(job->local_path);
+		g_free(job->fa);
+		g_mutex_clear(&job->lock);
+		g_free(job);
+	}
+}
 
-struct transfer_manager_msg {
-	gint type;
-	struct transfer *transfer;
-	struct transfer_chunk *chunk;
-	struct transfer_worker* worker;
-	goffset transfered_size; // how many bytes of a chunk have been transfered
-	gchar *upload_handle; // can be sent with the last chunk update
-	GError *error;
-};
+static void preview_job_run(gpointer data, gpointer user_data)
+{
+	struct preview_job *job = data;
+	struct mega_session *s = job->s;
+	gchar *fa = NULL;
 
-struct transfer_manager {
-	GAsyncQueue *manager_mailbox;
-	GThread *manager_thread;
+	// the upload gave up on us
+	if (g_atomic_int_get(&job->ref_count) > 1)
+		fa = create_preview(s, job->local_path, job->kind, job->key, NULL);
 
-	// only manager thread accesses these after it is started:
-	struct transfer_worker *workers;
-	int max_workers;
-	int current_workers;
-	GList *transfers;
-};
+	g_mutex_lock(&job->lock);
+	job->fa = fa;
+	job->done = TRUE;
+	g_mutex_unlock(&job->lock);
 
-static struct transfer_manager tman;
+	// wake up the submitter if it's waiting for the preview
+	struct transfer_msg *msg = tman_transfer_msg_new();
+	msg->type = TRANSFER_MSG_WAKEUP;
+	g_async_queue_push(s->upload_mailbox, msg);
 
-static gboolean tman_transfer_progress(goffset dltotal, goffset dlnow, goffset ultotal, goffset ulnow,
-				       gpointer user_data)
+	preview_job_unref(job);
+}
+
+static struct preview_job *preview_job_start(struct mega_session *s, const gchar *local_path, gint kind,
+					     const guchar *key)
 {
-	struct transfer_chunk *c = user_data;
-	struct transfer_manager_msg *msg;
+	struct preview_job *job = g_new0(struct preview_job, 1);
 
-	//tman_debug("W: progress for chunk %d (status=%d)\n", c->index, c->status);
+	job->ref_count = 2; // upload and the pool
+	job->s = s;
+	job->local_path = g_strdup(local_path);
+	job->kind = kind;
+	memcpy(job->key, key, 16);
+	g_mutex_init(&job->lock);
 
-	msg = g_new0(struct transfer_manager_msg, 1);
-	msg->type = TRANSFER_MANAGER_MSG_CHUNK_PROGRESS;
-	msg->chunk = c;
-	msg->transfered_size = MIN(ulnow, c->size);
-	g_async_queue_push(tman.manager_mailbox, msg);
+	if (!s->preview_pool)
+		s->preview_pool = g_thread_pool_new(preview_job_run, NULL, PREVIEW_WORKERS, FALSE, NULL);
 
-	return TRUE;
+	g_thread_pool_push(s->preview_pool, job, NULL);
+	return job;
 }
 
-static gchar* upload_checksum(const guchar* data, gsize len)
+static gboolean preview_job_is_done(struct preview_job *job)
 {
-	guchar crc[12] = {0};
-	gsize i;
+	gboolean done;
 
-	for (i = 0; i < len; i++)
-		crc[i % sizeof crc] ^= data[i];
+	g_mutex_lock(&job->lock);
+	done = job->done;
+	g_mutex_unlock(&job->lock);
 
-	return base64urlencode(crc, sizeof crc);
+	return done;
 }
 
-// accesses:
-// - chunk: size, index, offset, mac
-// - transfer: stream_lock, istream, nonce, file_key, upload_url, max_ul, max_dl, proxy
-static void tman_worker_upload_chunk(struct transfer_chunk *c, struct transfer_worker* worker, struct http* h)
+// returns the preview attribute if the job is done, and releases the job
+static gchar *preview_job_finish(struct preview_job *job)
 {
-	struct transfer *t = c->transfer;
-	struct transfer_manager_msg *msg;
-	gsize bytes_read;
-	GError *err = NULL;
-	GError *local_err = NULL;
-	gc_free gchar *url = NULL;
-	gc_string_free GString *response = NULL;
-	gc_free gchar* chksum = NULL;
+	gchar *fa = NULL;
 
-	tman_debug("W[%d]: started for chunk %d\n", worker->index, c->index);
+	g_mutex_lock(&job->lock);
+	if (job->done) {
+		fa = job->fa;
+		job->fa = NULL;
+	}
+	g_mutex_unlock(&job->lock);
 
-	// load plaintext data into a buffer from the file
+	preview_job_unref(job);
+	return fa;
+}
 
-	gc_free guchar *buf = g_malloc(c->size);
+// }}}
+// {{{ asynchronous uploads
+//
+// Uploads are submitted to the session and advanced by
+// mega_session_upload_poll(), which must be called from the thread that
+// uses the session. Each upload goes through these states:
+//
+// - NEW: waiting for an upload url (a:u)
+// - TRANSFER: data is being uploaded by the transfer manager
+// - FINISH: data is uploaded or an existing file with the same content was
+//   found, node needs to be created (a:p) once the preview is ready or
+//   preview_timeout expires
+// - DONE: completed, waiting to be collected by mega_session_upload_wait()
+//
+// Node is created as soon as the upload handle arrives, so that many files
+// can be in flight at once. Upload urls and nodes are requested for up to
+// UPLOAD_BATCH_SIZE uploads in one API request, so that small files don't
+// pay two API round trips each. Progress is reported for all pending uploads
+// together: done == -1 when the first upload is submitted and done == -2
+// when the last one completes.
+//
+// Uploads of local files are journaled in the user's cache directory, so
+// that an upload interrupted by a crash or ^C can be resumed by another
+// process. Journal records the upload url, keys, identity of the local
+// file, the macs of completed mac chunks and the upload handle once the
+// data is uploaded. It is encrypted with the master key, new records are
+// appended at most once per UPLOAD_JOURNAL_INTERVAL, the journal is
+// rewritten only when the upload url changes or when it's loaded, and it's
+// removed when the node is created.
 
-	g_mutex_lock(&t->stream_lock);
+enum {
+	UPLOAD_STATE_NEW,
+	UPLOAD_STATE_TRANSFER,
+	UPLOAD_STATE_FINISH,
+	UPLOAD_STATE_DONE,
+};
 
-	if (!g_seekable_seek(G_SEEKABLE(t->istream), c->offset, G_SEEK_SET, NULL, &local_err)) {
-		g_mutex_unlock(&t->stream_lock);
-		err = g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Failed seeking in the stream: %s", local_err->message);
-		g_clear_error(&local_err);
-		goto err;
-	}
+#define UPLOAD_RETRIES 3
+#define UPLOAD_BATCH_SIZE 64
+#define UPLOAD_BATCH_DELAY (50 * 1000) // us
+#define UPLOAD_JOURNAL_VERSION 2
+#define UPLOAD_JOURNAL_INTERVAL (1000 * 1000) // us
 
-	if (!g_input_stream_read_all(G_INPUT_STREAM(t->istream), buf, c->size, &bytes_read, NULL, &local_err)) {
-		g_mutex_unlock(&t->stream_lock);
-		err = g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Failed reading from the stream: %s",
-				  local_err->message);
-		g_clear_error(&local_err);
-		goto err;
-	}
+struct mega_upload {
+	gint state;
+	gint retries;
 
-	g_mutex_unlock(&t->stream_lock);
+	gchar *parent_handle;
+	gchar *remote_name;
+	gchar *local_path;
+	GInputStream *stream;
+	goffset file_size;
+	gboolean sequential; // stream can't be re-read
 
-	if (bytes_read != c->size) {
-		err = g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Failed reading from the stream (premature end)");
-		goto err;
-	}
+	guchar aes_key[16];
+	guchar nonce[16];
+	gchar *upload_url;
+	struct transfer transfer;
+	goffset transfered_size;
 
-	// perform encryption and chunk mac calculation
-	guchar iv[AES_BLOCK_SIZE] = { 0 };
-	memcpy(iv, t->nonce, 8);
-	*((guint64 *)&iv[8]) = GUINT64_TO_BE((guint64)(c->offset / 16)); // this is ok, because chunks are 16b aligned
+	gchar *upload_handle;
+	guchar meta_mac[16];
+	gchar *fingerprint; // NULL for streams
+	gint64 submitted_at; // monotonic time
+
+	// existing file with the same content, see upload_dedup()
+	gboolean dedup_tried;
+	gchar *copy_handle;
+	guchar copy_key[32];
+
+	// preview, created concurrently with the data upload
+	gint preview_kind;
+	struct preview_job *preview;
+	gint64 preview_deadline; // monotonic time
+
+	// journal, journal_path is NULL if the upload is not journaled
+	gchar *journal_path;
+	GArray *journal_macs; // struct transfer_done_mac
+	guint journal_macs_saved; // journal_macs already in the file
+	gboolean journal_handle_saved;
+	gboolean journal_written; // header is in the file, append only
+	gint64 journal_saved_at;
+	guint64 mtime;
+	guint64 inode;
+
+	// scheduling, see mega_upload_set_priority()
+	gint priority;
+	guint weight;
+	gint64 deadline;
+
+	mega_upload_callback callback;
+	gpointer userdata;
+
+	// result
+	struct mega_node *node;
+	GError *error;
+};
 
-	for (int i = 0; i < c->n_macs; i++)
-		chunk_mac_calculate(t->nonce, t->file_key, buf + c->macs[i].off, c->macs[i].size, c->macs[i].mac);
+static void upload_free(struct mega_upload *up)
+{
+	g_free(up->parent_handle);
+	g_free(up->remote_name);
+	g_free(up->local_path);
+	g_clear_object(&up->stream);
+	g_free(up->upload_url);
+	g_free(up->transfer.upload_handle);
+	g_mutex_clear(&up->transfer.stream_lock);
+	g_mutex_clear(&up->transfer.ring_lock);
+	g_free(up->upload_handle);
+	g_free(up->fingerprint);
+	g_free(up->copy_handle);
+	g_free(up->journal_path);
+	if (up->journal_macs)
+		g_array_free(up->journal_macs, TRUE);
+	if (up->preview)
+		preview_job_unref(up->preview);
+	g_clear_error(&up->error);
+	g_free(up);
+}
 
-	if (!encrypt_aes128_ctr(buf, buf, c->size, t->file_key, iv)) {
-		err = g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Failed to encrypt data");
-		goto err;
-	}
+static void upload_msg_free(struct transfer_msg *msg)
+{
+	tman_transfer_msg_free(msg);
+}
 
-	// prepare URL including chunk offset
-	chksum = upload_checksum(buf, c->size);
-	url = g_strdup_printf("%s/%" G_GOFFSET_FORMAT "?c=%s", t->upload_url, c->offset, chksum);
+static gchar *upload_journal_get_path(struct mega_session *s, struct mega_upload *up)
+{
+	gc_object_unref GFile *file = g_file_new_for_path(up->local_path);
+	gc_free gchar *abs_path = g_file_get_path(file);
+	gc_checksum_free GChecksum *cs = g_checksum_new(G_CHECKSUM_SHA1);
 
-	// perform upload POST
-	http_set_content_type(h, "application/octet-stream");
-	http_set_progress_callback(h, tman_transfer_progress, c);
-	http_set_speed(h, t->max_ul, t->max_dl);
-	http_set_proxy(h, t->proxy);
-	response = http_post(h, url, buf, c->size, &local_err);
-	if (!response) {
-		g_propagate_prefixed_error(&err, local_err, "Chunk upload failed: ");
-		goto err;
-	}
+	g_checksum_update(cs, s->user_handle, -1);
+	g_checksum_update(cs, "\n", 1);
+	g_checksum_update(cs, abs_path, -1);
+	g_checksum_update(cs, "\n", 1);
+	g_checksum_update(cs, up->parent_handle, -1);
+	g_checksum_update(cs, "\n", 1);
+	g_checksum_update(cs, up->remote_name, -1);
 
-	gchar *upload_handle = NULL;
+	gc_free gchar *filename = g_strconcat(g_checksum_get_string(cs), ".megatools.upload", NULL);
 
-	if (response->len > 0) {
-		// check for numeric error code
-		if (response->len < 10 && g_regex_match_simple("^-(\\d+)$", response->str, 0, 0)) {
-			int code = atoi(response->str);
-			const char* err_str = "???";
+	return g_build_filename(g_get_user_cache_dir(), "megatools", "uploads", filename, NULL);
+}
 
-			switch (code) {
-				case -3:
-					err_str = "EAGAIN";
-					break;
-				case -4:
-					err_str = "EFAILED";
-					break;
-				case -5:
-					err_str = "ENOTFOUND";
-					break;
-				case -6:
-					err_str = "ETOOMANY";
-					break;
-				case -7:
-					err_str = "ERANGE";
-					break;
-				case -8:
-					err_str = "EEXPIRED";
-					break;
-				case -14:
-					err_str = "EKEY";
-					break;
-			}
+// journal is a list of records, one per line, each encrypted separately:
+// the header with the upload url, keys and identity of the local file
+// comes first, followed by records of completed mac chunks and of the
+// upload handle, that are appended as the upload progresses
+static gchar *upload_journal_encrypt(struct mega_session *s, SJsonGen *gen)
+{
+	gc_free gchar *record = s_json_gen_done(gen);
+	gc_free gchar *tmp = g_strconcat("MEGA", record, NULL);
 
-			err = g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned error code %d (%s)", code, err_str);
-			goto err;
-		}
+	return b64_aes128_cbc_encrypt_str(tmp, s->master_key);
+}
 
-		if (response->len == 36) {
-			upload_handle = base64urlencode(response->str, response->len);
+// decrypts one record, returns NULL if it's damaged (torn write)
+static gchar *upload_journal_decrypt(struct mega_session *s, const gchar *line)
+{
+	gsize len = 0;
 
-			// we've got the handle
-			tman_debug("W[%d]: got upload data handle with chunk %d: '%s'\n", worker->index, c->index, upload_handle);
-		} else {
-			err = g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned something that does not look like upload handle");
-			goto err;
-		}
+	if (*line == '\0')
+		return NULL;
+
+	gc_free gchar *data = (gchar *)b64_aes128_cbc_decrypt(line, s->master_key, &len);
+	if (!data || len < 4 || memcmp(data, "MEGA", 4) != 0 || !s_json_is_valid(data + 4))
+		return NULL;
+
+	gchar *record = s_json_get(data + 4);
+	if (s_json_get_type(record) != S_JSON_TYPE_OBJECT) {
+		g_free(record);
+		return NULL;
 	}
 
-	tman_debug("W[%d]: success for chunk %d\n", worker->index, c->index);
+	return record;
+}
 
-	// final progress update for 100%
-	msg = g_new0(struct transfer_manager_msg, 1);
-	msg->type = TRANSFER_MANAGER_MSG_CHUNK_PROGRESS;
-	msg->chunk = c;
-	msg->transfered_size = c->size;
-	g_async_queue_push(tman.manager_mailbox, msg);
+// formats records not yet written to the journal
+static void upload_journal_format_records(struct mega_session *s, struct mega_upload *up, GString *out)
+{
+	for (guint i = up->journal_macs_saved; i < up->journal_macs->len; i++) {
+		struct transfer_done_mac *dm = &g_array_index(up->journal_macs, struct transfer_done_mac, i);
 
-	// send success to the manager
-	msg = g_new0(struct transfer_manager_msg, 1);
-	msg->type = TRANSFER_MANAGER_MSG_CHUNK_DONE;
-	msg->chunk = c;
-	msg->worker = worker;
-	msg->upload_handle = upload_handle;
-	g_async_queue_push(tman.manager_mailbox, msg);
-	return;
+		SJsonGen *gen = s_json_gen_new();
+		s_json_gen_start_object(gen);
+		s_json_gen_member_int(gen, "o", dm->off);
+		s_json_gen_member_bytes(gen, "m", dm->mac, 16);
+		s_json_gen_end_object(gen);
 
-err:
-	tman_debug("W[%d]: error for chunk %d: %s\n", worker->index, c->index, err->message);
+		gc_free gchar *line = upload_journal_encrypt(s, gen);
+		g_string_append_printf(out, "%s\n", line);
+	}
 
-	// final progress update for 0% (because we failed to transfer the chunk)
-	msg = g_new0(struct transfer_manager_msg, 1);
-	msg->type = TRANSFER_MANAGER_MSG_CHUNK_PROGRESS;
-	msg->chunk = c;
-	msg->transfered_size = 0;
-	g_async_queue_push(tman.manager_mailbox, msg);
+	if (up->upload_handle && !up->journal_handle_saved) {
+		SJsonGen *gen = s_json_gen_new();
+		s_json_gen_start_object(gen);
+		s_json_gen_member_string(gen, "handle", up->upload_handle);
+		s_json_gen_member_bytes(gen, "meta_mac", up->meta_mac, 16);
+		s_json_gen_end_object(gen);
 
-	// send error to the manager
-	msg = g_new0(struct transfer_manager_msg, 1);
-	msg->type = TRANSFER_MANAGER_MSG_CHUNK_FAILED;
-	msg->chunk = c;
-	msg->worker = worker;
-	msg->error = err;
-	g_async_queue_push(tman.manager_mailbox, msg);
+		gc_free gchar *line = upload_journal_encrypt(s, gen);
+		g_string_append_printf(out, "%s\n", line);
+	}
 }
 
-// performs single http send operation
-static gpointer tman_worker_thread_fn(gpointer data)
+// writes the whole journal, replacing the previous one
+static gboolean upload_journal_write(struct mega_session *s, struct mega_upload *up, GError **err)
 {
-	struct transfer_worker* w = data;
-	gc_http_free struct http *h = NULL;
+	gc_string_free GString *out = g_string_new(NULL);
 
-	h = http_new();
-	http_expect_short_running(h);
-	http_set_max_connects(h, 2);
+	SJsonGen *gen = s_json_gen_new();
+	s_json_gen_start_object(gen);
+	s_json_gen_member_int(gen, "version", UPLOAD_JOURNAL_VERSION);
+	s_json_gen_member_string(gen, "url", up->upload_url);
+	s_json_gen_member_bytes(gen, "key", up->aes_key, 16);
+	s_json_gen_member_bytes(gen, "nonce", up->nonce, 8);
+	s_json_gen_member_int(gen, "size", up->file_size);
+	s_json_gen_member_int(gen, "mtime", up->mtime);
+	s_json_gen_member_int(gen, "inode", up->inode);
+	s_json_gen_end_object(gen);
 
-	while (TRUE) {
-		struct transfer_worker_msg *msg = g_async_queue_timeout_pop(w->mailbox, 1000);
-		if (!msg) {
-			continue;
-		}
+	gc_free gchar *header = upload_journal_encrypt(s, gen);
+	g_string_append_printf(out, "%s\n", header);
 
-		switch (msg->type) {
-		case TRANSFER_WORKER_MSG_STOP:
-			g_free(msg);
-			return NULL;
+	up->journal_macs_saved = 0;
+	up->journal_handle_saved = FALSE;
+	upload_journal_format_records(s, up, out);
 
-		case TRANSFER_WORKER_MSG_UPLOAD_CHUNK:
-			tman_worker_upload_chunk(msg->chunk, w, h);
-			g_free(msg);
-			break;
-		}
+	gc_free gchar *dir = g_path_get_dirname(up->journal_path);
+	if (g_mkdir_with_parents(dir, 0700) != 0) {
+		g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno), "%s", g_strerror(errno));
+		return FALSE;
 	}
 
-	return NULL;
+	return g_file_set_contents(up->journal_path, out->str, out->len, err);
 }
 
-static void schedule_chunk_transfers(void)
+// appends records of newly completed mac chunks and of the upload handle
+static gboolean upload_journal_append(struct mega_session *s, struct mega_upload *up, GError **err)
 {
-	GList *ti, *ti_next;
-	GSList *ci;
-	struct transfer_msg *tmsg;
-	gint64 now = g_get_monotonic_time();
-
-	// first submit chunks to workers
-	for (ti = tman.transfers; ti; ti = ti->next) {
-		struct transfer *t = ti->data;
+	gc_string_free GString *out = g_string_new(NULL);
 
-		// skip errored out transfers
-		if (t->error)
-			continue;
-
-		for (ci = t->chunks; ci; ci = ci->next) {
-			struct transfer_chunk *c = ci->data;
-
-			// if the chunk is scheduled to be started in the
-			// future, skip it
-                        if (c->start_at > now)
-				continue;
+	upload_journal_format_records(s, up, out);
+	if (out->len == 0)
+		return TRUE;
 
-			// stop if we can't start more chunk transfers
-			if (tman.current_workers >= tman.max_workers)
-				goto check_completed;
+	FILE *f = g_fopen(up->journal_path, "ab");
+	if (!f) {
+		g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno), "%s", g_strerror(errno));
+		return FALSE;
+	}
 
-			// start chunk transfer
-			if (c->status == CHUNK_STATE_QUEUED) {
-				tman_debug("M: chunk %d pushed to worker\n", c->index);
+	gboolean ok = fwrite(out->str, 1, out->len, f) == out->len;
+	if (fclose(f) != 0)
+		ok = FALSE;
 
-				for (int i = 0; i < tman.max_workers; i++) {
-					if (!tman.workers[i].busy) {
-						tman.workers[i].busy = TRUE;
+	if (!ok) {
+		g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno), "%s", g_strerror(errno));
+		return FALSE;
+	}
 
-						c->status = CHUNK_STATE_IN_PROGRESS;
-						tman.current_workers++;
+	return TRUE;
+}
 
-						struct transfer_worker_msg *msg = g_new0(struct transfer_worker_msg, 1);
-						msg->type = TRANSFER_WORKER_MSG_UPLOAD_CHUNK;
-						msg->chunk = c;
-						g_async_queue_push(tman.workers[i].mailbox, msg);
-						goto queued;
-					}
-				}
+static void upload_journal_save(struct mega_session *s, struct mega_upload *up)
+{
+	GError *local_err = NULL;
+	gboolean ok;
 
-				goto check_completed;
+	if (up->journal_written)
+		ok = upload_journal_append(s, up, &local_err);
+	else
+		ok = upload_journal_write(s, up, &local_err);
 
-queued:;
-			}
-		}
+	if (!ok) {
+		g_printerr("WARNING: Can't write upload journal %s, upload will not be resumable: %s\n",
+			   up->journal_path, local_err->message);
+		g_clear_error(&local_err);
+		g_clear_pointer(&up->journal_path, g_free);
+		return;
 	}
 
-check_completed:
+	up->journal_written = TRUE;
+	up->journal_macs_saved = up->journal_macs->len;
+	up->journal_handle_saved = up->upload_handle != NULL;
+	up->journal_saved_at = g_get_monotonic_time();
+}
 
-	// next check for finished transfers
-	for (ti = tman.transfers; ti; ti = ti_next) {
-		struct transfer *t = ti->data;
+// loads the journal of an interrupted upload of the same file and
+// compacts it
+static gboolean upload_journal_load(struct mega_session *s, struct mega_upload *up)
+{
+	gc_free gchar *contents = NULL;
 
-		ti_next = ti->next;
+	if (!g_file_get_contents(up->journal_path, &contents, NULL, NULL))
+		return FALSE;
 
-		// if some chunks are in flight or queued and transfer is not
-		// aborted, we are not done yet
-		gboolean is_finished = TRUE;
-		for (ci = t->chunks; ci; ci = ci->next) {
-			struct transfer_chunk *c = ci->data;
+	gc_strfreev gchar **lines = g_strsplit(contents, "\n", -1);
+	gc_free gchar *journal = upload_journal_decrypt(s, lines[0]);
+	if (!journal)
+		return FALSE;
 
-			if (c->status == CHUNK_STATE_IN_PROGRESS || (c->status == CHUNK_STATE_QUEUED && !t->error)) {
-				is_finished = FALSE;
-				break;
-			}
-		}
+	// local file must not have changed since
+	if (s_json_get_member_int(journal, "version", 0) != UPLOAD_JOURNAL_VERSION ||
+	    s_json_get_member_int(journal, "size", -1) != up->file_size ||
+	    s_json_get_member_int(journal, "mtime", -1) != (gint64)up->mtime ||
+	    s_json_get_member_int(journal, "inode", -1) != (gint64)up->inode)
+		return FALSE;
 
-		if (!is_finished)
-			continue;
+	gsize key_len = 0, nonce_len = 0;
+	gc_free gchar *url = s_json_get_member_string(journal, "url");
+	gc_free guchar *key = s_json_get_member_bytes(journal, "key", &key_len);
+	gc_free guchar *nonce = s_json_get_member_bytes(journal, "nonce", &nonce_len);
 
-		if (!t->error && !t->upload_handle) {
-			// mega did not return upload handle with the last
-			// uploaded chunk, WTF?
-			t->error = g_error_new(MEGA_ERROR, MEGA_ERROR_NO_HANDLE, "Mega didn't return an upload handle");
-		}
+	if (!url || !key || key_len != 16 || !nonce || nonce_len != 8)
+		return FALSE;
+
+	gc_free gchar *handle = NULL;
+	guchar meta_mac[16];
 
-		// remove transfer from the list
-		tman.transfers = g_list_delete_link(tman.transfers, ti);
+	g_array_set_size(up->journal_macs, 0);
 
-		tmsg = g_new0(struct transfer_msg, 1);
+	// the last record may be incomplete if the process was killed
+	// while appending it
+	for (guint i = 1; lines[i]; i++) {
+		gc_free gchar *record = upload_journal_decrypt(s, lines[i]);
+		if (!record)
+			break;
 
-		if (t->error) {
-			tman_debug("M: transfer %s failed\n", t->upload_url);
+		gsize mac_len = 0;
+		gc_free gchar *record_handle = s_json_get_member_string(record, "handle");
+		gc_free guchar *mac = s_json_get_member_bytes(record, record_handle ? "meta_mac" : "m", &mac_len);
+		if (!mac || mac_len != 16)
+			continue;
 
-			tmsg->type = TRANSFER_MSG_ERROR;
-			tmsg->error = t->error;
-			t->error = NULL;
+		if (record_handle) {
+			g_free(handle);
+			handle = record_handle;
+			record_handle = NULL;
+			memcpy(meta_mac, mac, 16);
 		} else {
-			tman_debug("M: transfer %s succeeded\n", t->upload_url);
-
-			tmsg->type = TRANSFER_MSG_DONE;
+			struct transfer_done_mac dm;
 
-			// calculate meta_mac
-			GSList *macs = NULL;
-			for (ci = t->chunks; ci; ci = ci->next) {
-				struct transfer_chunk *c = ci->data;
-				for (int i = 0; i < c->n_macs; i++)
-					macs = g_slist_prepend(macs, c->macs[i].mac);
+			dm.off = s_json_get_member_int(record, "o", -1);
+			if (dm.off >= 0 && dm.off < up->file_size) {
+				memcpy(dm.mac, mac, 16);
+				g_array_append_val(up->journal_macs, dm);
 			}
-			macs = g_slist_reverse(macs);
-			meta_mac_calculate(macs, t->file_key, tmsg->meta_mac);
-                        g_slist_free(macs);
-
-			tmsg->upload_handle = t->upload_handle;
 		}
-
-		g_slist_free_full(t->chunks, g_free);
-		t->chunks = NULL;
-
-		g_async_queue_push(t->submitter_mailbox, tmsg);
 	}
-}
 
-static int get_n_chunks(guint idx, guint size, guint* rounded_size)
-{
-	if (idx < 7) {
-		// special algo
-		guint i = 0;
-		guint csize = 0;
+	memcpy(up->aes_key, key, 16);
+	memcpy(up->nonce, nonce, 8);
+	g_free(up->upload_url);
+	up->upload_url = url;
+	url = NULL;
 
-		while (csize < size) {
-			csize += get_chunk_size(idx);
-			idx++;
-			i++;
-		}
+	if (handle) {
+		g_free(up->upload_handle);
+		up->upload_handle = handle;
+		handle = NULL;
+		memcpy(up->meta_mac, meta_mac, 16);
+	}
 
-		*rounded_size = csize;
-		return i;
-	} else {
-		guint rem = size % (1024 * 1024);
-		int n = size / (1024 * 1024) + (rem > 0 ? 1 : 0);
+	// drop the records appended since the last compaction
+	up->journal_written = FALSE;
+	upload_journal_save(s, up);
 
-		*rounded_size = n * 1024 * 1024;
+	return TRUE;
+}
 
-		return n;
+static void upload_journal_remove(struct mega_upload *up)
+{
+	if (up->journal_path) {
+		g_unlink(up->journal_path);
+		g_clear_pointer(&up->journal_path, g_free);
 	}
 }
 
-static void prepare_transfer(struct transfer *t)
+// checks if the upload url of an interrupted upload still accepts data,
+// expired urls respond with a negative error code
+static gboolean upload_url_is_valid(struct mega_session *s, const gchar *url)
 {
-	// create list of chunks and initialize it
-	// get number of chunks from total size
-	gint64 now = g_get_monotonic_time();
-	goffset off = 0;
-	guint chunk_idx = 0, mac_idx = 0;
-
-	// Here we create a list of chunks that will be used for transfer.
-	// For bigger files, we can create bigger chunks. When creating
-	// bigger chunks we need to account for a fact that chunk mac is
-	// calculated from a fixed pattern of chunk sizes that we can't modify.
-	//
-	// First 8 chunks are 128 kiB * index sized, the rest is 1 MiB sized.
-	//
-	// We pre-define this pattern in the macs array of n_macs size.
-
-	//XXX: mega largely works, but craps out EFAILs on too many connections when coalescing chunks so
-	// let's disable boost for now.
-	gboolean boost = FALSE;
-        if (boost) {
-		while (off < t->total_size) {
-			goffset max_size = 16 * 1024 * 1024;
-			if (chunk_idx < 3)
-				max_size = 4 * 1024 * 1024;
-
-			guint size = MIN(t->total_size - off, max_size);
-			guint rounded_size;
-			int num_mac_chunks = get_n_chunks(mac_idx, size, &rounded_size);
-			size = MIN(t->total_size - off, rounded_size);
-
-			struct transfer_chunk *c = g_malloc0(sizeof(struct transfer_chunk) + sizeof(struct transfer_chunk_mac) * num_mac_chunks);
-
-			c->offset = off;
-			c->size = size;
-			c->index = chunk_idx;
-			c->status = CHUNK_STATE_QUEUED;
-			c->transfer = t;
-			c->start_at = now + (chunk_idx < 4 ? chunk_idx : 4) * 200000;
-
-			c->n_macs = num_mac_chunks;
+	gc_http_free struct http *h = http_new();
+	gc_free gchar *probe_url = g_strdup_printf("%s/0", url);
 
-			guint mac_off = 0;
-			for (int i = 0; i < num_mac_chunks; i++) {
-				c->macs[i].off = mac_off;
-				c->macs[i].size = MIN(get_chunk_size(mac_idx), size - mac_off);
+	http_set_content_type(h, "application/octet-stream");
+	http_set_proxy(h, s->proxy);
+	gc_string_free GString *response = http_post(h, probe_url, "", 0, NULL);
 
-				mac_idx++;
-				mac_off += c->macs[i].size;
-			}
+	return response && !(response->len > 0 && response->str[0] == '-');
+}
 
-			t->chunks = g_slist_prepend(t->chunks, c);
+static void upload_send_progress(struct mega_session *s, goffset done)
+{
+	struct mega_status_data status_data = {
+		.type = MEGA_STATUS_PROGRESS,
+		.progress.total = s->uploads_total,
+		.progress.done = done,
+	};
 
-			chunk_idx++;
-			off += c->size;
+	send_status(s, &status_data);
+}
 
-			// curiously, I found that if the last chunk
-			// is not coalesced, mega will not hang
-			if (off == t->total_size && c->n_macs > 1) {
-				off -= c->macs[c->n_macs - 1].size;
-				c->size -= c->macs[c->n_macs - 1].size;
-				c->n_macs--;
-			}
-		}
-	} else {
-		for (chunk_idx = 0; off < t->total_size; chunk_idx++) {
-			struct transfer_chunk *c = g_malloc0(sizeof(struct transfer_chunk) + sizeof(struct transfer_chunk_mac) * 1);
+static void upload_set_progress(struct mega_session *s, struct mega_upload *up, goffset transfered_size)
+{
+	s->uploads_done += transfered_size - up->transfered_size;
+	up->transfered_size = transfered_size;
+}
 
-			c->offset = off;
-			c->size = MIN(t->total_size - off, get_chunk_size(chunk_idx));
-			c->index = chunk_idx;
-			c->status = CHUNK_STATE_QUEUED;
-			c->transfer = t;
-			c->start_at = now + (chunk_idx < 4 ? chunk_idx : 4) * 200000;
+static void upload_complete(struct mega_session *s, struct mega_upload *up, struct mega_node *node, GError *error)
+{
+	up->state = UPLOAD_STATE_DONE;
+	up->node = node;
+	up->error = error;
+	upload_set_progress(s, up, up->file_size);
 
-			c->n_macs = 1;
-			c->macs[0].off = 0;
-			c->macs[0].size = c->size;
+	// don't keep files open longer than necessary
+	g_clear_object(&up->stream);
 
-			t->chunks = g_slist_prepend(t->chunks, c);
+	// keep the journal of failed uploads, so that they can be resumed
+	if (!error)
+		upload_journal_remove(up);
 
-			off += c->size;
-		}
+	if (--s->uploads_pending == 0) {
+		upload_send_progress(s, -2);
+		s->uploads_total = 0;
+		s->uploads_done = 0;
 	}
 
-	t->chunks = g_slist_reverse(t->chunks);
+	if (up->callback) {
+		g_queue_remove(&s->uploads, up);
+		up->callback(up, up->node, up->error, up->userdata);
+		upload_free(up);
+	}
+}
 
-#if 0
-	GSList* it;
-	for (it = t->chunks; it; it = it->next) {
-		struct transfer_chunk *c = it->data;
+// sets a new upload url, data uploaded to the previous one is lost
+static void upload_set_url(struct mega_session *s, struct mega_upload *up, gchar *url)
+{
+	g_free(up->upload_url);
+	up->upload_url = url;
 
-		g_print("CH[%d] = { off=%" G_GOFFSET_FORMAT " size=%" G_GOFFSET_FORMAT " macs=%d }\n", c->index, c->offset, c->size, c->n_macs);
-		for (int i = 0; i < c->n_macs; i++)
-			g_print("  CMAC { off=%u size=%u }\n", c->macs[i].off, c->macs[i].size);
+	if (up->journal_path) {
+		g_array_set_size(up->journal_macs, 0);
+		up->journal_written = FALSE;
+		upload_journal_save(s, up);
 	}
-#endif
 }
 
-static gpointer tman_manager_thread_fn(gpointer data)
+// preview is encrypted with the file key, so it can only be started once
+// the key is known for sure
+static void upload_start_preview(struct mega_session *s, struct mega_upload *up)
 {
-	// keeps track of the workers
-	//  - submits transfer_chunks to the workers
-	// keeps tab on the individual trasnfers and
-	//  - notifies transfer submitter when done
-	//  - sends progress updates
-
-	while (TRUE) {
-		struct transfer_manager_msg *msg = g_async_queue_timeout_pop(tman.manager_mailbox, 100);
-		struct transfer_msg *tmsg;
-		struct transfer *t;
-		struct transfer_chunk *c;
+	if (up->preview_kind != PREVIEW_NONE && !up->preview)
+		up->preview = preview_job_start(s, up->local_path, up->preview_kind, up->aes_key);
+}
 
-		if (!msg) {
-			schedule_chunk_transfers();
-			continue;
-		}
+static void upload_set_finish(struct mega_session *s, struct mega_upload *up)
+{
+	up->state = UPLOAD_STATE_FINISH;
+	up->preview_deadline = g_get_monotonic_time() + (gint64)s->preview_timeout * 1000;
+}
 
-		switch (msg->type) {
-		case TRANSFER_MANAGER_MSG_STOP:
-			g_free(msg);
-			return NULL;
+// a:p command creating a file node from the uploaded data (handle is the
+// upload handle) or as a copy of an existing file (handle is the file's
+// node handle)
+static gchar *upload_put_node_command(struct mega_session *s, struct mega_upload *up,
+				      struct mega_node *parent_node, const gchar *handle, guchar node_key[32],
+				      const gchar *fa)
+{
+	guchar aes_key[16];
+	unpack_node_key(node_key, aes_key, NULL, NULL);
 
-		case TRANSFER_MANAGER_MSG_SUBMIT_TRANSFER:
-			t = msg->transfer;
+	gc_free gchar *attrs = encode_node_attrs(up->remote_name, up->fingerprint, NULL);
+	gc_free gchar *attrs_enc = b64_aes128_cbc_encrypt_str(attrs, aes_key);
+	gc_free gchar *node_key_enc = b64_aes128_encrypt(node_key, 32, s->master_key);
 
-			tman_debug("M: transfer submitted %s\n", t->upload_url);
+	return s_json_build("{a:p, t:%s, n:[{h:%s, t:0, k:%s, a:%s, fa:%s}]}", parent_node->handle, handle,
+			    node_key_enc, attrs_enc, fa);
+}
 
-			prepare_transfer(t);
-			tman.transfers = g_list_append(tman.transfers, t);
-			schedule_chunk_transfers();
-			break;
+// parses the node returned by the a:p command, the caller adds it to
+// fs_nodes
+static struct mega_node *upload_put_node_result(struct mega_session *s, struct mega_node *parent_node,
+						const gchar *put_node, GError **err)
+{
+	const gchar *f_arr = s_json_get_member(put_node, "f");
+	const gchar *f_el = s_json_get_type(f_arr) == S_JSON_TYPE_ARRAY ? s_json_get_element(f_arr, 0) : NULL;
+	struct mega_node *nn = f_el && s_json_get_type(f_el) == S_JSON_TYPE_OBJECT ? mega_node_parse(s, f_el) : NULL;
+	if (!nn) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
+		return NULL;
+	}
 
-		case TRANSFER_MANAGER_MSG_CHUNK_PROGRESS:
-			c = msg->chunk;
-			t = c->transfer;
+	nn->parent = parent_node;
+	node_index_add(s, nn);
+	fingerprint_index_add(s, nn);
 
-			//tman_debug("M: chunk progress for %d\n", c->index);
-			tmsg = g_new0(struct transfer_msg, 1);
-			tmsg->type = TRANSFER_MSG_PROGRESS;
+	return nn;
+}
 
-			// update overall progress
-			t->transfered_size += msg->transfered_size - c->transfered_size;
-			c->transfered_size = msg->transfered_size;
+// checks that the local file has the same MAC as the existing file
+static gboolean upload_verify_mac(struct mega_upload *up, struct mega_node *source)
+{
+	struct chunked_cbc_mac mac;
+	guchar aes_key[16], nonce[8], meta_mac_xor[8], meta_mac_xor_calc[8];
+	gc_free guchar *buf = g_malloc(1024 * 1024);
+	goffset total = 0;
 
-			tmsg->total_size = t->total_size;
-			tmsg->transfered_size = t->transfered_size;
+	unpack_node_key(source->key, aes_key, nonce, meta_mac_xor);
 
-			g_async_queue_push(t->submitter_mailbox, tmsg);
-			break;
+	if (!chunked_cbc_mac_init8(&mac, aes_key, nonce))
+		return FALSE;
 
-		case TRANSFER_MANAGER_MSG_CHUNK_DONE:
-			c = msg->chunk;
-			t = c->transfer;
+	if (!g_seekable_seek(G_SEEKABLE(up->stream), 0, G_SEEK_SET, NULL, NULL))
+		goto err;
 
-			tman_debug("M: chunk done %d\n", c->index);
+	while (TRUE) {
+		gssize bytes_read = g_input_stream_read(up->stream, buf, 1024 * 1024, NULL, NULL);
+		if (bytes_read < 0)
+			goto err;
+		if (bytes_read == 0)
+			break;
 
-			msg->worker->busy = FALSE;
-			tman.current_workers--;
+		if (!chunked_cbc_mac_update(&mac, buf, bytes_read))
+			goto err;
 
-			c->status = CHUNK_STATE_DONE;
-			if (msg->upload_handle) {
-				g_free(t->upload_handle);
-				t->upload_handle = msg->upload_handle;
-			}
+		total += bytes_read;
+	}
 
-			schedule_chunk_transfers();
-			break;
-		case TRANSFER_MANAGER_MSG_CHUNK_FAILED: {
-			c = msg->chunk;
-			t = c->transfer;
+	if (!chunked_cbc_mac_finish8(&mac, meta_mac_xor_calc))
+		return FALSE;
 
-			tman_debug("M: chunk fail %d\n", c->index);
+	return total == up->file_size && memcmp(meta_mac_xor, meta_mac_xor_calc, 8) == 0;
 
-			msg->worker->busy = FALSE;
-			tman.current_workers--;
+err:
+	chunked_cbc_mac_finish(&mac, NULL);
+	return FALSE;
+}
 
-			// re-queue chunk
-			c->status = CHUNK_STATE_QUEUED;
+static void upload_start_transfer(struct mega_session *s, struct mega_upload *up)
+{
+	struct transfer *t = &up->transfer;
+
+	// initialize transfer data, stream_lock is kept across retries
+	t->submitter_mailbox = s->upload_mailbox;
+	t->user_data = up;
+	t->total_size = up->file_size;
+	t->transfered_size = 0;
+	t->n_in_progress = 0;
+	t->progress_dirty = FALSE;
+	memcpy(t->file_key, up->aes_key, 16);
+	memcpy(t->nonce, up->nonce, 8);
+	t->istream = up->stream;
+	t->fd = transfer_get_fd(up->stream);
+	t->sequential = up->sequential && t->fd < 0;
+	t->upload_url = up->upload_url;
+	g_clear_pointer(&t->upload_handle, g_free);
+	t->max_ul = s->max_ul;
+	t->max_dl = s->max_dl;
+	t->proxy = s->proxy;
+	t->journal = up->journal_path != NULL;
+	t->resume_macs = up->journal_macs;
+	t->priority = up->priority;
+	t->weight = up->weight;
+	t->deadline = up->deadline;
+
+	upload_start_preview(s, up);
+
+	up->state = UPLOAD_STATE_TRANSFER;
+	s->uploads_transfering++;
+	tman_submit_transfer(t);
+}
 
-			gint64 now = g_get_monotonic_time();
+// turns the upload into a server-side copy of an existing file with the
+// same size and fingerprint, the copy is created with the other nodes by
+// upload_create_nodes(), returns TRUE if the file was found
+static gboolean upload_dedup(struct mega_session *s, struct mega_upload *up)
+{
+	if (!s->dedup_enabled || !up->fingerprint || !s->fingerprints)
+		return FALSE;
 
-			if (t->error) {
-				// transfer is in error state and is being aborted
-				tman_debug("M: transfer is being aborted, chunk %d fail ignored\n", c->index);
-			} else {
-				if (g_error_matches(msg->error, HTTP_ERROR, HTTP_ERROR_COMM_FAILURE)
-						|| g_error_matches(msg->error, HTTP_ERROR, HTTP_ERROR_TIMEOUT)
-						|| g_error_matches(msg->error, HTTP_ERROR, HTTP_ERROR_SERVER_BUSY)
-						|| g_error_matches(msg->error, HTTP_ERROR, HTTP_ERROR_NO_RESPONSE)) {
-					if (c->failures_count > 8) {
-						g_printerr("WARNING: chunk upload failed too many times (%s), aborting transfer\n", msg->error->message);
+	gc_free gchar *key = fingerprint_index_key(up->file_size, up->fingerprint);
+	const gchar *handle = g_hash_table_lookup(s->fingerprints, key);
+	struct mega_node *source = handle ? mega_session_get_node_by_handle(s, handle) : NULL;
+	if (!source || source->type != MEGA_NODE_FILE || source->key_len != 32)
+		return FALSE;
 
-						// mark transfer as aborted
-						t->error = msg->error;
-						msg->error = NULL;
-					} else {
-						g_printerr("WARNING: chunk upload failed (%s), re-trying after %d seconds\n", msg->error->message, (1 << c->failures_count));
-						c->start_at = g_get_monotonic_time() + 1000 * 1000 * ((1 << c->failures_count));
-						c->failures_count++;
-					}
-				} else if (g_error_matches(msg->error, HTTP_ERROR, HTTP_ERROR_BANDWIDTH_LIMIT)) {
-					// we need to defer all further
-					// transfers by a lot
-					g_printerr("WARNING: over upload quota, delaying all transfers by 5 minutes\n");
-					GSList* ci;
-					for (ci = t->chunks; ci; ci = ci->next) {
-						struct transfer_chunk *c = ci->data;
+	if (s->dedup_verify && !upload_verify_mac(up, source))
+		return FALSE;
 
-						c->start_at = now + 1000 * (5*60*1000 + g_random_int_range(0, 2000));
-					}
-				} else {
-					g_printerr("WARNING: chunk upload failed (%s), aborting transfer\n", msg->error->message);
+	up->copy_handle = g_strdup(source->handle);
+	memcpy(up->copy_key, source->key, 32);
+	upload_set_finish(s, up);
+	return TRUE;
+}
 
-					// mark transfer as aborted
-					t->error = msg->error;
-					msg->error = NULL;
-				}
-			}
+// handles the uploads that don't need a new upload url: copies of existing
+// files and resumed uploads, returns TRUE if the upload needs a new url
+static gboolean upload_prepare(struct mega_session *s, struct mega_upload *up)
+{
+	// the same file may already exist in the account
+	if (!up->dedup_tried) {
+		up->dedup_tried = TRUE;
+		if (upload_dedup(s, up))
+			return FALSE;
+	}
 
-			schedule_chunk_transfers();
-			break;
+	// resume the interrupted upload of the same file on the first start
+	if (up->journal_path && !up->upload_url && upload_journal_load(s, up)) {
+		if (up->upload_handle) {
+			// all data was uploaded, only the node is missing
+			upload_start_preview(s, up);
+			upload_set_finish(s, up);
+			return FALSE;
 		}
 
-		default:
-			g_assert_not_reached();
-			break;
+		if (upload_url_is_valid(s, up->upload_url)) {
+			upload_start_transfer(s, up);
+			return FALSE;
 		}
-
-		g_clear_error(&msg->error);
-		g_free(msg);
 	}
 
-	return NULL;
+	return TRUE;
 }
 
-static void tman_init(int max_workers)
+// asks for upload urls of many uploads in one request and starts the
+// transfers
+static void upload_request_urls(struct mega_session *s, struct mega_upload **ups, guint n)
 {
 	GError *local_err = NULL;
+	gc_ptr_array_unref GPtrArray *commands = g_ptr_array_new_with_free_func(g_free);
 
-	// check if we are already initialized
-	if (tman.manager_thread)
-		return;
+	// ask for upload url - [{"a":"u","ssl":0,"ms":0,"s":<SIZE>,"r":0,"e":0}]
+	for (guint i = 0; i < n; i++)
+		g_ptr_array_add(commands, s_json_build("{a:u, e:0, ms:0, r:0, s:%i, ssl:0, v:2}", (gint64)ups[i]->file_size));
+
+	gc_free gchar *response = api_call_batch(s, commands, &local_err);
+
+	for (guint i = 0; i < n; i++) {
+		struct mega_upload *up = ups[i];
+		GError *err = NULL;
+		gint error_code = 0;
+		gchar *url = NULL;
+
+		if (response) {
+			gc_free gchar *up_node = api_batch_result(response, i, &error_code, &err);
+			if (up_node) {
+				url = s_json_get_member_string(up_node, "p");
+				if (!url)
+					g_set_error(&err, MEGA_ERROR, MEGA_ERROR_OTHER, "Upload url is missing");
+			}
 
-	memset(&tman, 0, sizeof tman);
+			g_prefix_error(&err, "API call 'u' failed: ");
+		} else
+			err = g_error_copy(local_err);
 
-	tman.manager_mailbox = g_async_queue_new();
+		if (url) {
+			upload_set_url(s, up, url);
+			upload_start_transfer(s, up);
+			continue;
+		}
 
-	// start workers
-	tman.max_workers = max_workers;
-	tman.workers = g_new0(struct transfer_worker, max_workers);
-	for (int i = 0; i < max_workers; i++) {
-		tman.workers[i].index = i;
-		tman.workers[i].mailbox = g_async_queue_new();
-		tman.workers[i].thread = g_thread_new("transfer worker", tman_worker_thread_fn, &tman.workers[i]);
+		// server is busy, the upload is tried again with the next batch
+		if (error_code == SRV_EAGAIN && up->retries-- > 0) {
+			g_clear_error(&err);
+			continue;
+		}
+
+		upload_complete(s, up, NULL, err);
 	}
 
-	// start manager
-	tman.manager_thread = g_thread_new("transfer manager", tman_manager_thread_fn, &tman);
+	g_clear_error(&local_err);
 }
 
-static void tman_fini(void)
+// creates nodes of many finished uploads in one request
+static void upload_create_nodes(struct mega_session *s, struct mega_upload **ups, guint n)
 {
-	if (tman.manager_thread) {
-		// ask manager to stop
-		struct transfer_manager_msg *msg = g_new0(struct transfer_manager_msg, 1);
-		msg->type = TRANSFER_MANAGER_MSG_STOP;
-		g_async_queue_push(tman.manager_mailbox, msg);
+	GError *local_err = NULL;
+	gc_ptr_array_unref GPtrArray *commands = g_ptr_array_new_with_free_func(g_free);
+	gc_ptr_array_unref GPtrArray *batch = g_ptr_array_new();
+	gc_ptr_array_unref GPtrArray *parents = g_ptr_array_new();
 
-		g_thread_join(tman.manager_thread);
+	for (guint i = 0; i < n; i++) {
+		struct mega_upload *up = ups[i];
 
-		for (int i = 0; i < tman.max_workers; i++) {
-			struct transfer_worker_msg *msg = g_new0(struct transfer_worker_msg, 1);
-			msg->type = TRANSFER_WORKER_MSG_STOP;
-			g_async_queue_push(tman.workers[i].mailbox, msg);
+		struct mega_node *parent_node = mega_session_get_node_by_handle(s, up->parent_handle);
+		if (!parent_node) {
+			upload_complete(s, up, NULL,
+					g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Parent directory doesn't exist anymore"));
+			continue;
 		}
 
-		for (int i = 0; i < tman.max_workers; i++) {
-			g_thread_join(tman.workers[i].thread);
-			g_async_queue_unref(tman.workers[i].mailbox);
+		if (up->copy_handle) {
+			g_ptr_array_add(commands,
+					upload_put_node_command(s, up, parent_node, up->copy_handle, up->copy_key, NULL));
+		} else {
+			// take the preview if it's ready, it's not waited for anymore
+			gc_free gchar *fa = NULL;
+			if (up->preview) {
+				fa = preview_job_finish(up->preview);
+				up->preview = NULL;
+			}
+
+			guchar node_key[32];
+			pack_node_key(node_key, up->aes_key, up->nonce, up->meta_mac);
+
+			g_ptr_array_add(commands,
+					upload_put_node_command(s, up, parent_node, up->upload_handle, node_key, fa));
 		}
 
-		g_free(tman.workers);
-		g_async_queue_unref(tman.manager_mailbox);
+		g_ptr_array_add(batch, up);
+		g_ptr_array_add(parents, parent_node);
+	}
+
+	if (batch->len == 0)
+		return;
+
+	gc_free gchar *response = api_call_batch(s, commands, &local_err);
+	gc_ptr_array_unref GPtrArray *created = g_ptr_array_new();
+	gc_ptr_array_unref GPtrArray *errors = g_ptr_array_new();
+	gc_array_unref GArray *error_codes = g_array_new(FALSE, TRUE, sizeof(gint));
+	GSList *added = NULL;
+
+	for (guint i = 0; i < batch->len; i++) {
+		struct mega_node *nn = NULL;
+		GError *err = NULL;
+		gint error_code = 0;
+
+		if (response) {
+			gc_free gchar *put_node = api_batch_result(response, i, &error_code, &err);
+			if (put_node)
+				nn = upload_put_node_result(s, parents->pdata[i], put_node, &err);
+			else
+				g_prefix_error(&err, "API call 'p' failed: ");
+		} else
+			err = g_error_copy(local_err);
+
+		if (nn)
+			added = g_slist_prepend(added, nn);
+
+		g_ptr_array_add(created, nn);
+		g_ptr_array_add(errors, err);
+		g_array_append_val(error_codes, error_code);
+	}
+
+	// one walk over the filesystem list for all the nodes, before the
+	// callbacks see them
+	s->fs_nodes = g_slist_concat(s->fs_nodes, g_slist_reverse(added));
 
-		memset(&tman, 0, sizeof tman);
+	for (guint i = 0; i < batch->len; i++) {
+		struct mega_upload *up = batch->pdata[i];
+		struct mega_node *nn = created->pdata[i];
+		GError *err = errors->pdata[i];
+
+		if (nn) {
+			upload_complete(s, up, nn, NULL);
+		} else if (up->copy_handle) {
+			g_printerr("WARNING: Can't copy existing file with the same content, uploading the data: %s\n",
+				   err->message);
+			g_clear_error(&err);
+			g_clear_pointer(&up->copy_handle, g_free);
+			up->state = UPLOAD_STATE_NEW;
+		} else {
+			// expired upload handle can't be tried again, after other
+			// errors the node can still be created from the journal
+			if (g_array_index(error_codes, gint, i) == SRV_EEXPIRED)
+				upload_journal_remove(up);
+			upload_complete(s, up, NULL, err);
+		}
 	}
+
+	g_clear_error(&local_err);
 }
 
-static gboolean tman_run_upload_transfer(
-	// in:
-	struct mega_session *s, guchar file_key[16], guchar nonce[8], const gchar *upload_url,
-	GFileInputStream *istream, goffset file_size,
-	// out:
-	gchar **upload_handle, guchar meta_mac[16], GError **err)
+static void upload_process_msg(struct mega_session *s, struct transfer_msg *msg)
 {
-	struct transfer t = { 0 };
-	gboolean retval = FALSE;
-	struct mega_status_data status_data;
+	struct mega_upload *up;
 
-	g_return_val_if_fail(file_key != NULL, FALSE);
-	g_return_val_if_fail(nonce != NULL, FALSE);
-	g_return_val_if_fail(upload_url != NULL, FALSE);
-	g_return_val_if_fail(istream != NULL, FALSE);
-	g_return_val_if_fail(upload_handle != NULL, FALSE);
-	g_return_val_if_fail(meta_mac != NULL, FALSE);
-	g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+	// preview job finished, uploads waiting for it are advanced later
+	if (msg->type == TRANSFER_MSG_WAKEUP) {
+		upload_msg_free(msg);
+		return;
+	}
 
-	// initialize transfer data
-	t.submitter_mailbox = g_async_queue_new();
-	t.total_size = file_size;
-	AES_set_encrypt_key(file_key, 128, &t.k);
-	memcpy(t.file_key, file_key, 16);
-	memcpy(t.nonce, nonce, 8);
-	g_mutex_init(&t.stream_lock);
-	t.istream = istream;
-	t.upload_url = upload_url;
-	t.max_ul = s->max_ul;
-	t.max_dl = s->max_dl;
-	t.proxy = s->proxy;
-
-	// tell the manager to start the transfer
-	struct transfer_manager_msg *msg = g_new0(struct transfer_manager_msg, 1);
-	msg->type = TRANSFER_MANAGER_MSG_SUBMIT_TRANSFER;
-	msg->transfer = &t;
-	g_async_queue_push(tman.manager_mailbox, msg);
+	up = msg->transfer->user_data;
 
-	// send initial progress report
-	status_data = (struct mega_status_data){
-		.type = MEGA_STATUS_PROGRESS,
-		.progress.total = file_size,
-		.progress.done = -1,
-	};
+	if (msg->done_macs) {
+		if (up->journal_path)
+			g_array_append_vals(up->journal_macs, msg->done_macs->data, msg->done_macs->len);
 
-	send_status(s, &status_data);
+		g_array_free(msg->done_macs, TRUE);
+		msg->done_macs = NULL;
+	}
 
-	// wait until the transfer finishes
-	while (TRUE) {
-		struct transfer_msg *msg = g_async_queue_pop(t.submitter_mailbox);
+	switch (msg->type) {
+	case TRANSFER_MSG_PROGRESS:
+		upload_set_progress(s, up, msg->transfered_size);
+		upload_send_progress(s, s->uploads_done);
 
-		switch (msg->type) {
-		case TRANSFER_MSG_DONE:
-			*upload_handle = msg->upload_handle;
-			memcpy(meta_mac, msg->meta_mac, 16);
-			g_free(msg);
-			retval = TRUE;
-			goto out;
+		if (up->journal_path && g_get_monotonic_time() - up->journal_saved_at >= UPLOAD_JOURNAL_INTERVAL)
+			upload_journal_save(s, up);
+		break;
 
-		case TRANSFER_MSG_ERROR:
-			g_propagate_prefixed_error(err, msg->error, "Upload transfer failed: ");
-			g_free(msg);
-			goto out;
+	case TRANSFER_MSG_DONE:
+		s->uploads_transfering--;
 
-		case TRANSFER_MSG_PROGRESS:
-			status_data = (struct mega_status_data){
-				.type = MEGA_STATUS_PROGRESS,
-				.progress.total = msg->total_size,
-				.progress.done = msg->transfered_size,
-			};
+		// upload handle is handed over to us
+		up->transfer.upload_handle = NULL;
+		g_free(up->upload_handle);
+		up->upload_handle = msg->upload_handle;
+		memcpy(up->meta_mac, msg->meta_mac, 16);
+		upload_set_finish(s, up);
 
-			send_status(s, &status_data);
-			break;
+		if (up->journal_path)
+			upload_journal_save(s, up);
+		break;
 
-		default:
-			g_assert_not_reached();
+	case TRANSFER_MSG_ERROR:
+		s->uploads_transfering--;
+		upload_set_progress(s, up, 0);
+
+		// data of sequential streams is gone, the upload can't be
+		// restarted
+		if (!up->sequential && up->retries-- > 0) {
+			g_printerr("WARNING: Mega upload failed (%s), retrying transfer (%d retries left)\n", msg->error->message, up->retries);
+			g_clear_error(&msg->error);
+			up->state = UPLOAD_STATE_NEW;
+		} else {
+			g_prefix_error(&msg->error, "Upload transfer failed: ");
+			upload_complete(s, up, NULL, msg->error);
+			msg->error = NULL;
 		}
+		break;
 
-		g_free(msg);
+	default:
+		g_assert_not_reached();
 	}
 
-out:
-	// send final progress report
-	status_data = (struct mega_status_data){
-		.type = MEGA_STATUS_PROGRESS,
-		.progress.total = file_size,
-		.progress.done = -2,
-	};
-
-	send_status(s, &status_data);
-
-	// cleanup
-	g_async_queue_unref(t.submitter_mailbox);
-	g_mutex_clear(&t.stream_lock);
-	return retval;
+	upload_msg_free(msg);
 }
 
-// }}}
-
-// Download/upload:
-
-// {{{ create_preview
-
-static gint has_convert = -1;
-static gint has_ffmpegthumbnailer = -1;
-
-static gchar *create_preview(struct mega_session *s, const gchar *local_path, const guchar *key, GError **err)
+// starts new uploads and creates nodes for the uploaded ones, returns the
+// earliest time an upload should be advanced again or 0
+//
+// New uploads are held until a batch fills up or the oldest one has waited
+// for UPLOAD_BATCH_DELAY, unless flush is set because the caller is going
+// to wait for them.
+static gint64 upload_advance(struct mega_session *s, gboolean flush)
 {
-	gchar *handle = NULL;
-#ifndef G_OS_WIN32
-	GError *local_err = NULL;
-	gc_free gchar *tmp1 = NULL, *tmp2 = NULL;
+	GList *l;
+	gint64 now = g_get_monotonic_time();
+	gint64 wake_at = 0;
+	gint64 oldest = 0;
+	guint n_new = 0;
 
-	if (has_ffmpegthumbnailer < 0) {
-		gc_free gchar *prg = g_find_program_in_path("ffmpegthumbnailer");
+	for (l = s->uploads.head; l; l = l->next) {
+		struct mega_upload *up = l->data;
 
-		has_ffmpegthumbnailer = prg ? 1 : 0;
+		if (up->state == UPLOAD_STATE_NEW) {
+			if (n_new++ == 0 || up->submitted_at < oldest)
+				oldest = up->submitted_at;
+		}
 	}
 
-	if (has_convert < 0) {
-		gc_free gchar *prg = g_find_program_in_path("convert");
+	if (n_new > 0 && !flush && n_new < UPLOAD_BATCH_SIZE && now - oldest < UPLOAD_BATCH_DELAY) {
+		wake_at = oldest + UPLOAD_BATCH_DELAY;
+	} else if (n_new > 0) {
+		gc_ptr_array_unref GPtrArray *need_url = g_ptr_array_new();
+		gc_ptr_array_unref GPtrArray *new_ups = g_ptr_array_new();
 
-		has_convert = prg ? 1 : 0;
-	}
+		for (l = s->uploads.head; l; l = l->next) {
+			struct mega_upload *up = l->data;
 
-	if (has_ffmpegthumbnailer && g_regex_match_simple("\\.(mpg|mpeg|avi|mkv|flv|rm|mp4|wmv|asf|ram|mov)$",
-							  local_path, G_REGEX_CASELESS, 0)) {
-		gchar buf[50] = "/tmp/megatools.XXXXXX";
-		gchar *dir = g_mkdtemp(buf);
-		if (dir) {
-			gint status = 1;
-			gc_free gchar *thumb_path = g_strdup_printf("%s/thumb.jpg", dir);
-			gc_free gchar *qpath = g_shell_quote(local_path);
-			gc_free gchar *tmp = g_strdup_printf(
-				"ffmpegthumbnailer -t 5 -i %s -o %s/thumb.jpg -s 128 -f -a", qpath, dir);
+			if (up->state == UPLOAD_STATE_NEW)
+				g_ptr_array_add(new_ups, up);
+		}
 
-			if (g_spawn_command_line_sync(tmp, &tmp1, &tmp2, &status, &local_err)) {
-				if (g_file_test(thumb_path, G_FILE_TEST_IS_REGULAR)) {
-					gc_free gchar *thumb_data = NULL;
-					gsize thumb_len;
+		for (guint i = 0; i < new_ups->len; i++)
+			if (upload_prepare(s, new_ups->pdata[i]))
+				g_ptr_array_add(need_url, new_ups->pdata[i]);
 
-					if (g_file_get_contents(thumb_path, &thumb_data, &thumb_len, NULL)) {
-						handle = mega_session_new_node_attribute(s, thumb_data, thumb_len, "0",
-											 key, &local_err);
-						if (!handle)
-							g_propagate_error(err, local_err);
-					}
+		for (guint i = 0; i < need_url->len; i += UPLOAD_BATCH_SIZE)
+			upload_request_urls(s, (struct mega_upload **)need_url->pdata + i,
+					    MIN(need_url->len - i, UPLOAD_BATCH_SIZE));
+	}
 
-					g_unlink(thumb_path);
-				}
-			} else {
-				g_propagate_error(err, local_err);
-			}
+	gc_ptr_array_unref GPtrArray *finished = g_ptr_array_new();
 
-			g_rmdir(dir);
-		}
-	} else if (has_convert && g_regex_match_simple("\\.(jpe?g|png|gif|bmp|tiff|svg|pnm|eps|ico|pdf)$", local_path,
-						       G_REGEX_CASELESS, 0)) {
-		gchar buf[50] = "/tmp/megatools.XXXXXX";
-		gchar *dir = g_mkdtemp(buf);
-		if (dir) {
-			gint status = 1;
-			gc_free gchar *thumb_path = g_strdup_printf("%s/thumb.jpg", dir);
-			gc_free gchar *qpath = NULL;
+	for (l = s->uploads.head; l; l = l->next) {
+		struct mega_upload *up = l->data;
 
-			if (g_regex_match_simple("\\.pdf$", local_path, G_REGEX_CASELESS, 0)) {
-				gc_free gchar *local_path_page = g_strdup_printf("%s[0]", local_path);
+		if (up->state != UPLOAD_STATE_FINISH)
+			continue;
 
-				qpath = g_shell_quote(local_path_page);
-			} else {
-				qpath = g_shell_quote(local_path);
-			}
+		if (up->preview && !preview_job_is_done(up->preview) && now < up->preview_deadline) {
+			if (wake_at == 0 || up->preview_deadline < wake_at)
+				wake_at = up->preview_deadline;
+			continue;
+		}
 
-			gc_free gchar *tmp = g_strdup_printf(
-				"convert %s -strip -background white -flatten -resize 128x128^ -gravity center -crop 128x128+0+0 +repage %s/thumb.jpg",
-				qpath, dir);
+		g_ptr_array_add(finished, up);
+	}
 
-			if (g_spawn_command_line_sync(tmp, &tmp1, &tmp2, &status, &local_err)) {
-				if (g_file_test(thumb_path, G_FILE_TEST_IS_REGULAR)) {
-					gc_free gchar *thumb_data = NULL;
-					gsize thumb_len;
+	for (guint i = 0; i < finished->len; i += UPLOAD_BATCH_SIZE)
+		upload_create_nodes(s, (struct mega_upload **)finished->pdata + i,
+				    MIN(finished->len - i, UPLOAD_BATCH_SIZE));
 
-					if (g_file_get_contents(thumb_path, &thumb_data, &thumb_len, NULL)) {
-						handle = mega_session_new_node_attribute(s, thumb_data, thumb_len, "0",
-											 key, &local_err);
-						if (!handle)
-							g_propagate_error(err, local_err);
-					}
+	return wake_at;
+}
 
-					g_unlink(thumb_path);
-				}
-			} else {
-				g_propagate_error(err, local_err);
-			}
+static struct mega_upload *upload_submit(struct mega_session *s, struct mega_node *parent_node,
+					 const gchar *remote_name, GInputStream *stream, goffset size,
+					 GFileInfo *info, const gchar *local_path, mega_upload_callback cb,
+					 gpointer userdata, GError **err)
+{
+	guchar aes_key[16], nonce[8];
 
-			g_rmdir(dir);
-		}
-	} else {
+	// setup encryption
+	if (RAND_bytes(aes_key, sizeof aes_key) != 1 || RAND_bytes(nonce, sizeof nonce) != 1) {
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't generate the file key");
 		return NULL;
 	}
 
-	if (!handle && err && !*err)
-		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't create preview");
-
-#endif
-	return handle;
+	struct mega_upload *up = g_new0(struct mega_upload, 1);
+
+	up->state = UPLOAD_STATE_NEW;
+	up->retries = UPLOAD_RETRIES;
+	up->submitted_at = g_get_monotonic_time();
+	up->parent_handle = g_strdup(parent_node->handle);
+	up->remote_name = g_strdup(remote_name);
+	up->local_path = g_strdup(local_path);
+	up->stream = g_object_ref(stream);
+	up->file_size = size;
+	up->sequential = !G_IS_SEEKABLE(stream) || !g_seekable_can_seek(G_SEEKABLE(stream));
+	up->callback = cb;
+	up->userdata = userdata;
+	up->preview_kind = s->create_preview && local_path ? preview_get_kind(local_path) : PREVIEW_NONE;
+	g_mutex_init(&up->transfer.stream_lock);
+	g_mutex_init(&up->transfer.ring_lock);
+
+	memcpy(up->aes_key, aes_key, sizeof aes_key);
+	memcpy(up->nonce, nonce, sizeof nonce);
+
+	// only local files with a known identity can be resumed
+	if (s->upload_resume_enabled && info && local_path && !up->sequential && s->master_key && s->user_handle &&
+	    g_file_info_has_attribute(info, G_FILE_ATTRIBUTE_TIME_MODIFIED)) {
+		up->mtime = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+		up->inode = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_UNIX_INODE);
+		up->journal_path = upload_journal_get_path(s, up);
+		up->journal_macs = g_array_new(FALSE, FALSE, sizeof(struct transfer_done_mac));
+	}
+
+	// fingerprint of local files, for deduplication by us and other clients
+	if (info && local_path && !up->sequential && g_file_info_has_attribute(info, G_FILE_ATTRIBUTE_TIME_MODIFIED))
+		up->fingerprint = file_fingerprint(stream, size,
+						   g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED),
+						   NULL);
+
+	tman_init(s->max_workers, s->progress_interval, s->schedule_policy, s->max_host_connections);
+	if (!s->upload_mailbox)
+		s->upload_mailbox = g_async_queue_new();
+
+	g_queue_push_tail(&s->uploads, up);
+	s->uploads_total += up->file_size;
+	if (s->uploads_pending++ == 0)
+		upload_send_progress(s, -1);
+
+	return up;
 }
 
-// }}}
-// {{{ mega_session_put
-
-struct mega_node *mega_session_put(struct mega_session *s, struct mega_node *parent_node, const gchar* remote_name, GFileInputStream *stream, const gchar* local_path, GError **err)
+struct mega_upload *mega_session_upload_submit(struct mega_session *s, struct mega_node *parent_node,
+					       const gchar *remote_name, GFileInputStream *stream,
+					       const gchar *local_path, mega_upload_callback cb, gpointer userdata,
+					       GError **err)
 {
 	GError *local_err = NULL;
-	gc_free gchar *up_handle = NULL;
-	gc_free gchar *up_node = NULL;
-	gc_free gchar *p_url = NULL;
 
 	g_return_val_if_fail(s != NULL, NULL);
 	g_return_val_if_fail(parent_node != NULL, NULL);
@@ -4146,96 +7905,118 @@ struct mega_node *mega_session_put(struct mega_session *s, struct mega_node *par
 	g_return_val_if_fail(stream != NULL, NULL);
 	g_return_val_if_fail(err == NULL || *err == NULL, NULL);
 
-	gc_object_unref GFileInfo *info =
-		g_file_input_stream_query_info(stream, G_FILE_ATTRIBUTE_STANDARD_SIZE, NULL, &local_err);
+	gc_object_unref GFileInfo *info = g_file_input_stream_query_info(
+		stream, G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_UNIX_INODE,
+		NULL, &local_err);
 	if (!info) {
 		g_propagate_prefixed_error(err, local_err, "Can't get stream info: ");
 		return NULL;
 	}
 
-	goffset file_size = g_file_info_get_size(info);
+	return upload_submit(s, parent_node, remote_name, G_INPUT_STREAM(stream), g_file_info_get_size(info), info,
+			     local_path, cb, userdata, err);
+}
 
-	// setup encryption
-	gc_free guchar *aes_key = make_random_key();
-	gc_free guchar *nonce = make_random_key();
-	guchar meta_mac[16];
-	int retries = 3;
-	gboolean transfer_ok;
+// stream must provide exactly size bytes, it is read strictly in order if
+// it can't seek
+struct mega_upload *mega_session_upload_submit_stream(struct mega_session *s, struct mega_node *parent_node,
+						      const gchar *remote_name, GInputStream *stream, goffset size,
+						      mega_upload_callback cb, gpointer userdata, GError **err)
+{
+	g_return_val_if_fail(s != NULL, NULL);
+	g_return_val_if_fail(parent_node != NULL, NULL);
+	g_return_val_if_fail(remote_name != NULL, NULL);
+	g_return_val_if_fail(stream != NULL, NULL);
+	g_return_val_if_fail(size >= 0, NULL);
+	g_return_val_if_fail(err == NULL || *err == NULL, NULL);
 
-	tman_init(s->max_workers);
+	return upload_submit(s, parent_node, remote_name, stream, size, NULL, NULL, cb, userdata, err);
+}
 
-try_again:
-	// ask for upload url - [{"a":"u","ssl":0,"ms":0,"s":<SIZE>,"r":0,"e":0}]
-	g_free(up_node);
-	up_node = api_call(s, 'o', NULL, &local_err, "[{a:u, e:0, ms:0, r:0, s:%i, ssl:0, v:2}]", (gint64)file_size);
-	if (!up_node) {
-		g_propagate_error(err, local_err);
-		return NULL;
-	}
+void mega_upload_set_priority(struct mega_upload *up, gint priority, guint weight, gint64 deadline)
+{
+	g_return_if_fail(up != NULL);
+	g_return_if_fail(up->state == UPLOAD_STATE_NEW);
 
-	g_free(p_url);
-	p_url = s_json_get_member_string(up_node, "p");
+	up->priority = priority;
+	up->weight = weight;
+	up->deadline = deadline;
+}
 
-	transfer_ok = tman_run_upload_transfer(
-		/* in: */ s, aes_key, nonce, p_url, stream, file_size,
-		/* out: */ &up_handle, meta_mac, &local_err);
+// returns TRUE if some uploads are still pending
+gboolean mega_session_upload_poll(struct mega_session *s, gboolean wait)
+{
+	struct transfer_msg *msg;
+	gint64 wake_at;
 
-	if (!transfer_ok) {
-		if (retries-- > 0) {
-			g_printerr("WARNING: Mega upload failed (%s), retrying transfer (%d retries left)\n", local_err ? local_err->message : "???", retries);
-			g_clear_error(&local_err);
-			goto try_again;
-		}
+	g_return_val_if_fail(s != NULL, FALSE);
 
-		g_propagate_prefixed_error(err, local_err, "Data upload failed: ");
-		return NULL;
+	wake_at = upload_advance(s, wait);
+
+	// when waiting, block for the first message only, but not past the
+	// preview deadline
+	while (s->uploads_transfering > 0 || wake_at > 0) {
+		if (!wait)
+			msg = g_async_queue_try_pop(s->upload_mailbox);
+		else if (wake_at > 0)
+			msg = g_async_queue_timeout_pop(s->upload_mailbox, MAX(wake_at - g_get_monotonic_time(), 0));
+		else
+			msg = g_async_queue_pop(s->upload_mailbox);
+
+		if (!msg)
+			break;
+
+		upload_process_msg(s, msg);
+		wait = FALSE;
 	}
 
-	// create preview
-	gc_free gchar *fa = NULL;
-	if (s->create_preview)
-		fa = create_preview(s, local_path, aes_key, NULL);
+	upload_advance(s, FALSE);
 
-	gc_free gchar *attrs = encode_node_attrs(remote_name);
-	gc_free gchar *attrs_enc = b64_aes128_cbc_encrypt_str(attrs, aes_key);
+	return s->uploads_pending > 0;
+}
 
-	guchar node_key[32];
-	pack_node_key(node_key, aes_key, nonce, meta_mac);
+guint mega_session_upload_pending(struct mega_session *s)
+{
+	g_return_val_if_fail(s != NULL, 0);
 
-	gc_free gchar *node_key_enc = b64_aes128_encrypt(node_key, 32, s->master_key);
+	return s->uploads_pending;
+}
 
-	// prepare request
-	gc_free gchar *put_node =
-		api_call(s, 'o', NULL, &local_err, "[{a:p, t:%s, n:[{h:%s, t:0, k:%s, a:%s, fa:%s}]}]",
-			 parent_node->handle, up_handle, node_key_enc, attrs_enc, fa);
-	if (!put_node) {
-		g_propagate_error(err, local_err);
-		return NULL;
-	}
+struct mega_node *mega_session_upload_wait(struct mega_session *s, struct mega_upload *up, GError **err)
+{
+	struct mega_node *node;
 
-	const gchar *f_arr = s_json_get_member(put_node, "f");
-	if (s_json_get_type(f_arr) != S_JSON_TYPE_ARRAY) {
-		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
-		return NULL;
-	}
+	g_return_val_if_fail(s != NULL, NULL);
+	g_return_val_if_fail(up != NULL, NULL);
+	g_return_val_if_fail(up->callback == NULL, NULL);
+	g_return_val_if_fail(err == NULL || *err == NULL, NULL);
 
-	const gchar *f_el = s_json_get_element(f_arr, 0);
-	if (!f_el || s_json_get_type(f_el) != S_JSON_TYPE_OBJECT) {
-		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
-		return NULL;
-	}
+	while (up->state != UPLOAD_STATE_DONE)
+		mega_session_upload_poll(s, TRUE);
 
-	struct mega_node *nn = mega_node_parse(s, f_el);
-	if (!nn) {
-		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
-		return NULL;
+	node = up->node;
+	if (up->error) {
+		g_propagate_error(err, up->error);
+		up->error = NULL;
 	}
 
-	// add uploaded node to the filesystem
-	s->fs_nodes = g_slist_append(s->fs_nodes, nn);
-	nn->parent = parent_node;
+	g_queue_remove(&s->uploads, up);
+	upload_free(up);
+	return node;
+}
 
-	return nn;
+// }}}
+// {{{ mega_session_put
+
+struct mega_node *mega_session_put(struct mega_session *s, struct mega_node *parent_node, const gchar* remote_name, GFileInputStream *stream, const gchar* local_path, GError **err)
+{
+	struct mega_upload *up;
+
+	up = mega_session_upload_submit(s, parent_node, remote_name, stream, local_path, NULL, NULL, err);
+	if (!up)
+		return NULL;
+
+	return mega_session_upload_wait(s, up, err);
 }
 
 // }}}
@@ -4745,7 +8526,7 @@ gboolean mega_session_dl_prepare(struct mega_session *s, struct mega_download_da
 	unpack_node_key(node_key, aes_key, NULL, NULL);
 
 	// decrypt attributes with aes_key
-	if (!decrypt_node_attrs(at, aes_key, &node_name)) {
+	if (!decrypt_node_attrs(at, aes_key, &node_name, NULL, NULL)) {
 		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid key");
 		return FALSE;
 	}
@@ -4790,15 +8571,21 @@ struct mega_node* mega_session_get_node_by_handle(struct mega_session *s, const
 	GSList *i;
 
 	g_return_val_if_fail(s != NULL, NULL);
+	g_return_val_if_fail(handle != NULL, NULL);
 
-	for (i = s->fs_nodes; i; i = i->next) {
-		struct mega_node *n = i->data;
+	if (!s->nodes_by_handle) {
+		s->nodes_by_handle = g_hash_table_new(g_str_hash, g_str_equal);
 
-		if (n->handle && g_str_equal(n->handle, handle))
-			return n;
+		// first node with the handle wins, like in a walk of the list
+		for (i = s->fs_nodes; i; i = i->next) {
+			struct mega_node *n = i->data;
+
+			if (n->handle && !g_hash_table_contains(s->nodes_by_handle, n->handle))
+				g_hash_table_insert(s->nodes_by_handle, n->handle, n);
+		}
 	}
 
-	return NULL;
+	return g_hash_table_lookup(s->nodes_by_handle, handle);
 }
 
 // }}}
@@ -4958,6 +8745,7 @@ gboolean mega_session_save(struct mega_session *s, GError **err)
 	// serialize session object
 	s_json_gen_member_int(gen, "version", CACHE_FORMAT_VERSION);
 	s_json_gen_member_int(gen, "last_refresh", s->last_refresh);
+	s_json_gen_member_string(gen, "sn", s->sn);
 
 	s_json_gen_member_string(gen, "sid", s->sid);
 	s_json_gen_member_string(gen, "password_salt_v2", s->password_salt_v2);
@@ -4987,6 +8775,8 @@ gboolean mega_session_save(struct mega_session *s, GError **err)
 		s_json_gen_member_int(gen, "size", n->size);
 		s_json_gen_member_int(gen, "timestamp", n->timestamp);
 		s_json_gen_member_string(gen, "link", n->link);
+		s_json_gen_member_string(gen, "fingerprint", n->fingerprint);
+		s_json_gen_member_string(gen, "attrs", n->attrs);
 		s_json_gen_end_object(gen);
 	}
 	s_json_gen_end_array(gen);
@@ -5107,6 +8897,7 @@ static gboolean mega_session_load(struct mega_session *s,
 		s->user_handle = s_json_get_member_string(cache_obj, "user_handle");
 		s->user_name = s_json_get_member_string(cache_obj, "user_name");
 		s->user_email = s_json_get_member_string(cache_obj, "user_email");
+		s->sn = s_json_get_member_string(cache_obj, "sn");
 
 		if (!s->sid || !s->password_key || !s->master_key || !s->user_handle || !s->user_email ||
 		    !s->rsa_key.p || !s->rsa_key.q || !s->rsa_key.d || !s->rsa_key.u) {
@@ -5153,6 +8944,10 @@ static gboolean mega_session_load(struct mega_session *s,
 				n->timestamp = s_json_get_int(v, 0);
 			else if (s_json_string_match(k, "link"))
 				n->link = s_json_get_string(v);
+			else if (s_json_string_match(k, "fingerprint"))
+				n->fingerprint = s_json_get_string(v);
+			else if (s_json_string_match(k, "attrs"))
+				n->attrs = s_json_get_string(v);
 			S_JSON_FOREACH_END()
 
 			s->fs_nodes = g_slist_prepend(s->fs_nodes, n);
@@ -5406,15 +9201,26 @@ gboolean mega_session_register_verify(struct mega_session *s, struct mega_reg_st
 
 // {{{ Compatibility: old interfaces
 
-struct mega_node *mega_session_put_compat(struct mega_session *s, const gchar *remote_path, const gchar *local_path,
-					  GError **err)
+// checks if a file is already being uploaded to the parent
+static gboolean upload_is_pending(struct mega_session *s, struct mega_node *parent_node, const gchar *name)
+{
+	for (GList *l = s->uploads.head; l; l = l->next) {
+		struct mega_upload *up = l->data;
+
+		if (up->state != UPLOAD_STATE_DONE && !strcmp(up->parent_handle, parent_node->handle) &&
+		    !strcmp(up->remote_name, name))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+// finds parent node and the name of the uploaded file, name is taken from
+// local_name if remote_path is a directory
+static struct mega_node *upload_get_target(struct mega_session *s, const gchar *remote_path, const gchar *local_name,
+					   gchar **file_name, GError **err)
 {
-	GError *local_err = NULL;
 	struct mega_node *node, *parent_node;
-	gc_object_unref GFile *file = NULL;
-	gc_free gchar *file_name = NULL;
-	gc_free gchar *file_path = NULL;
-	gc_object_unref GFileInputStream *stream = NULL;
 
 	node = mega_session_stat(s, remote_path);
 	if (node) {
@@ -5422,17 +9228,22 @@ struct mega_node *mega_session_put_compat(struct mega_session *s, const gchar *r
 		if (node->type == MEGA_NODE_FILE) {
 			g_set_error(err, MEGA_ERROR, MEGA_ERROR_EXISTS, "File already exists: %s", remote_path);
 			return NULL;
+		} else if (!local_name) {
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Remote path must include the file name: %s",
+				    remote_path);
+			return NULL;
 		} else {
 			// it's a directory, so we need to check if file with
 			// basename(local_path) already exists there
 			parent_node = node;
 
 			// remote filename will be a basename(local_path)
-			file_name = g_path_get_basename(local_path);
-			gc_free gchar *tmp = g_strconcat(remote_path, "/", file_name, NULL);
+			*file_name = g_path_get_basename(local_name);
+			gc_free gchar *tmp = g_strconcat(remote_path, "/", *file_name, NULL);
 			node = mega_session_stat(s, tmp);
-			if (node) {
+			if (node || upload_is_pending(s, parent_node, *file_name)) {
 				g_set_error(err, MEGA_ERROR, MEGA_ERROR_EXISTS, "File already exists: %s", tmp);
+				g_clear_pointer(file_name, g_free);
 				return NULL;
 			}
 		}
@@ -5440,8 +9251,6 @@ struct mega_node *mega_session_put_compat(struct mega_session *s, const gchar *r
 		// remote path doesn't exists, check the parent dir
 		gc_free gchar *tmp = path_simplify(remote_path);
 		gc_free gchar *parent_path = g_path_get_dirname(tmp);
-		// remote filename will be a basename(remote_path)
-		file_name = g_path_get_basename(tmp);
 
 		if (!strcmp(parent_path, "/")) {
 			g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't upload to toplevel dir: %s", remote_path);
@@ -5454,6 +9263,15 @@ struct mega_node *mega_session_put_compat(struct mega_session *s, const gchar *r
 				    parent_path);
 			return NULL;
 		}
+
+		// remote filename will be a basename(remote_path)
+		*file_name = g_path_get_basename(tmp);
+
+		if (upload_is_pending(s, parent_node, *file_name)) {
+			g_set_error(err, MEGA_ERROR, MEGA_ERROR_EXISTS, "File already exists: %s", remote_path);
+			g_clear_pointer(file_name, g_free);
+			return NULL;
+		}
 	}
 
 	if (!mega_node_is_writable(s, parent_node) || parent_node->type == MEGA_NODE_NETWORK ||
@@ -5463,9 +9281,27 @@ struct mega_node *mega_session_put_compat(struct mega_session *s, const gchar *r
 			snprintf(path, sizeof path, "???");
 
 		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Directory is not writable: %s", path);
+		g_clear_pointer(file_name, g_free);
 		return NULL;
 	}
 
+	return parent_node;
+}
+
+struct mega_upload *mega_session_upload_submit_compat(struct mega_session *s, const gchar *remote_path,
+						      const gchar *local_path, mega_upload_callback cb,
+						      gpointer userdata, GError **err)
+{
+	GError *local_err = NULL;
+	struct mega_node *parent_node;
+	gc_object_unref GFile *file = NULL;
+	gc_free gchar *file_name = NULL;
+	gc_object_unref GFileInputStream *stream = NULL;
+
+	parent_node = upload_get_target(s, remote_path, local_path, &file_name, err);
+	if (!parent_node)
+		return NULL;
+
 	file = g_file_new_for_path(local_path);
 	stream = g_file_read(file, NULL, &local_err);
 	if (!stream) {
@@ -5473,7 +9309,34 @@ struct mega_node *mega_session_put_compat(struct mega_session *s, const gchar *r
 		return NULL;
 	}
 
-	return mega_session_put(s, parent_node, file_name, stream, local_path, err);
+	return mega_session_upload_submit(s, parent_node, file_name, stream, local_path, cb, userdata, err);
+}
+
+struct mega_upload *mega_session_upload_submit_stream_compat(struct mega_session *s, const gchar *remote_path,
+							     GInputStream *stream, goffset size,
+							     mega_upload_callback cb, gpointer userdata,
+							     GError **err)
+{
+	struct mega_node *parent_node;
+	gc_free gchar *file_name = NULL;
+
+	parent_node = upload_get_target(s, remote_path, NULL, &file_name, err);
+	if (!parent_node)
+		return NULL;
+
+	return mega_session_upload_submit_stream(s, parent_node, file_name, stream, size, cb, userdata, err);
+}
+
+struct mega_node *mega_session_put_compat(struct mega_session *s, const gchar *remote_path, const gchar *local_path,
+					  GError **err)
+{
+	struct mega_upload *up;
+
+	up = mega_session_upload_submit_compat(s, remote_path, local_path, NULL, NULL, err);
+	if (!up)
+		return NULL;
+
+	return mega_session_upload_wait(s, up, err);
 }
 
 gboolean mega_session_get_compat(struct mega_session *s, const gchar *local_path, const gchar *remote_path,
@@ -64,6 +64,30 @@ struct mega_status_data {
 
 typedef void (*mega_status_callback)(struct mega_status_data *data, gpointer userdata);
 
+// upload completion callback
+
+struct mega_upload;
+struct mega_node;
+
+// node is owned by the session, error is freed after the callback returns
+typedef void (*mega_upload_callback)(struct mega_upload *up, struct mega_node *node, const GError *error,
+				     gpointer userdata);
+
+// transfer scheduling policies, transfers with higher priority always go
+// first, then:
+//
+// - FIFO: in order of submission
+// - SMALL_FIRST: smallest files first
+// - ROUND_ROBIN: connections are shared according to transfer weights
+// - DEADLINE: earliest deadline first, transfers without one go last
+
+enum {
+	MEGA_SCHEDULE_FIFO,
+	MEGA_SCHEDULE_SMALL_FIRST,
+	MEGA_SCHEDULE_ROUND_ROBIN,
+	MEGA_SCHEDULE_DEADLINE,
+};
+
 // session data types
 
 enum {
@@ -93,6 +117,8 @@ struct mega_node {
 	gint type;
 	guint64 size;
 	glong timestamp;
+	gchar *fingerprint; // "c" attribute of files, may be NULL
+	gchar *attrs; // other attributes as a JSON object, may be NULL
 
 	// call addlinks after refresh to get links populated
 	gchar *link;
@@ -137,8 +163,13 @@ void mega_session_free(struct mega_session *s);
 
 void mega_session_set_speed(struct mega_session *s, gint ul, gint dl);
 void mega_session_set_workers(struct mega_session *s, gint workers);
+void mega_session_set_progress_interval(struct mega_session *s, gint ms);
 void mega_session_set_proxy(struct mega_session *s, const gchar *proxy);
 void mega_session_set_resume(struct mega_session *s, gboolean enabled);
+void mega_session_set_upload_resume(struct mega_session *s, gboolean enabled);
+void mega_session_set_preview_timeout(struct mega_session *s, gint ms);
+void mega_session_set_dedup(struct mega_session *s, gboolean enabled, gboolean verify);
+void mega_session_set_scheduling(struct mega_session *s, gint policy, gint max_host_connections);
 
 void mega_session_watch_status(struct mega_session *s, mega_status_callback cb, gpointer userdata);
 void mega_session_enable_previews(struct mega_session *s, gboolean enable);
@@ -152,6 +183,10 @@ gboolean mega_session_save(struct mega_session *s, GError **err);
 
 gboolean mega_session_get_user(struct mega_session *s, GError **err);
 gboolean mega_session_refresh(struct mega_session *s, GError **err);
+// applies the changes made since the last refresh, falls back to a full
+// refresh if they can't be applied; changed is set if any node changed,
+// node pointers are invalidated in that case
+gboolean mega_session_refresh_incremental(struct mega_session *s, gboolean *changed, GError **err);
 gboolean mega_session_addlinks(struct mega_session *s, GSList *nodes, GError **err);
 struct mega_user_quota *mega_session_user_quota(struct mega_session *s, GError **err);
 
@@ -160,9 +195,51 @@ GSList *mega_session_ls(struct mega_session *s, const gchar *path, gboolean recu
 GSList *mega_session_get_node_chilren(struct mega_session *s, struct mega_node *node);
 struct mega_node *mega_session_stat(struct mega_session *s, const gchar *path);
 struct mega_node *mega_session_mkdir(struct mega_session *s, const gchar *path, GError **err);
+// creates the directories and their missing parents with a single request,
+// nodes gets the created or existing directory for each path, or NULL if it
+// couldn't be created, errors (if not NULL) gets the error message for each
+// path or NULL
+gboolean mega_session_mkdir_p(struct mega_session *s, GPtrArray *paths, GPtrArray *nodes, GPtrArray *errors,
+			      GError **err);
 gboolean mega_session_rm(struct mega_session *s, const gchar *path, GError **err);
+// removes the nodes with batched requests, removed (if not NULL) gets
+// a flag for each node that was removed, errors (if not NULL) gets the error
+// message for each node or NULL
+gboolean mega_session_rm_nodes(struct mega_session *s, GPtrArray *nodes, gboolean *removed, GPtrArray *errors,
+			       GError **err);
+// moves the nodes with their subtrees into the dest directory with batched
+// requests, errors (if not NULL) gets the error message for each node or
+// NULL, otherwise nothing is moved if any of the nodes can't be moved there
+gboolean mega_session_move(struct mega_session *s, GPtrArray *nodes, struct mega_node *dest, GPtrArray *errors,
+			   GError **err);
+// gives the nodes new names (one for each node), with batched requests
+gboolean mega_session_rename(struct mega_session *s, GPtrArray *nodes, GPtrArray *names, GError **err);
+// copies the nodes with their subtrees into the dest directory on the
+// server, name renames the copy of a single node, copies (if not NULL) gets
+// the copy of each node or NULL
+gboolean mega_session_copy(struct mega_session *s, GPtrArray *nodes, struct mega_node *dest, const gchar *name,
+			   GPtrArray *copies, GError **err);
 struct mega_node *mega_session_put(struct mega_session *s, struct mega_node *parent_node, const gchar* remote_name,
 				   GFileInputStream *stream, const gchar* local_path, GError **err);
+
+// asynchronous uploads: submitted uploads are advanced by
+// mega_session_upload_poll(); uploads submitted with a callback are freed
+// after the callback returns, others must be collected with
+// mega_session_upload_wait()
+struct mega_upload *mega_session_upload_submit(struct mega_session *s, struct mega_node *parent_node,
+					       const gchar *remote_name, GFileInputStream *stream,
+					       const gchar *local_path, mega_upload_callback cb, gpointer userdata,
+					       GError **err);
+struct mega_upload *mega_session_upload_submit_stream(struct mega_session *s, struct mega_node *parent_node,
+						      const gchar *remote_name, GInputStream *stream, goffset size,
+						      mega_upload_callback cb, gpointer userdata, GError **err);
+// must be called before the upload is started by mega_session_upload_poll(),
+// deadline is in g_get_monotonic_time() units, 0 means none
+void mega_upload_set_priority(struct mega_upload *up, gint priority, guint weight, gint64 deadline);
+gboolean mega_session_upload_poll(struct mega_session *s, gboolean wait);
+guint mega_session_upload_pending(struct mega_session *s);
+struct mega_node *mega_session_upload_wait(struct mega_session *s, struct mega_upload *up, GError **err);
+
 gchar *mega_session_new_node_attribute(struct mega_session *s, const guchar *data, gsize len, const gchar *type,
 				       const guchar *key, GError **err);
 gboolean mega_session_get(struct mega_session *s, GFile *file, struct mega_node *node, GError **err);
@@ -195,6 +272,13 @@ gboolean mega_session_register_verify(struct mega_session *s, struct mega_reg_st
 
 struct mega_node *mega_session_put_compat(struct mega_session *s, const gchar *remote_path, const gchar *local_path,
 					  GError **err);
+struct mega_upload *mega_session_upload_submit_compat(struct mega_session *s, const gchar *remote_path,
+						      const gchar *local_path, mega_upload_callback cb,
+						      gpointer userdata, GError **err);
+struct mega_upload *mega_session_upload_submit_stream_compat(struct mega_session *s, const gchar *remote_path,
+							     GInputStream *stream, goffset size,
+							     mega_upload_callback cb, gpointer userdata,
+							     GError **err);
 gboolean mega_session_get_compat(struct mega_session *s, const gchar *local_path, const gchar *remote_path,
 				 GError **err);
 gboolean mega_session_dl_compat(struct mega_session *s, const gchar *handle, const gchar *key, const gchar *local_path,
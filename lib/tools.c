@@ -56,9 +56,16 @@ static gchar *proxy;
 static gint upload_speed_limit;
 static gint download_seed_limit;
 static gint transfer_worker_count = 5;
+static gint schedule_policy = MEGA_SCHEDULE_ROUND_ROBIN;
+static gint max_host_connections = 0;
+static gint progress_interval = -1; /* -1 means library default */
+static gint preview_timeout = -1; /* -1 means library default */
 static gint cache_timout = 10 * 60;
 static gboolean opt_enable_previews = BOOLEAN_UNSET_BUT_TRUE;
 static gboolean opt_disable_resume;
+static gboolean opt_disable_upload_resume;
+static gboolean opt_disable_dedup;
+static gboolean opt_verify_dedup;
 static gchar *opt_netif;
 static gchar *opt_ipproto;
 
@@ -116,6 +123,15 @@ static GOptionEntry upload_options[] = {
         { "disable-previews", '\0',
                 G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opt_enable_previews,
                 "Never generate previews when uploading file", NULL },
+        { "disable-upload-resume", '\0',
+                0, G_OPTION_ARG_NONE, &opt_disable_upload_resume,
+                "Don't resume interrupted uploads", NULL },
+        { "disable-dedup", '\0',
+                0, G_OPTION_ARG_NONE, &opt_disable_dedup,
+                "Always upload the data, even if the same file already exists", NULL },
+        { "verify-dedup", '\0',
+                0, G_OPTION_ARG_NONE, &opt_verify_dedup,
+                "Check the whole file before copying an existing one instead of uploading", NULL },
         { NULL }
 };
 
@@ -504,14 +520,41 @@ void tool_init(gint *ac, gchar ***av, const gchar *tool_name, GOptionEntry *tool
 					g_clear_error(&local_err);
 				}
 
-				if (transfer_worker_count < 1 || transfer_worker_count > 16) {
-					transfer_worker_count = CLAMP(transfer_worker_count, 1, 16);
+				if (transfer_worker_count < 1 || transfer_worker_count > TOOL_MAX_WORKERS) {
+					transfer_worker_count = CLAMP(transfer_worker_count, 1, TOOL_MAX_WORKERS);
 					g_printerr(
 						"WARNING: Invalid number of parallel transfers set in the config file, limited to %d\n",
 						transfer_worker_count);
 				}
 			}
 
+			if (g_key_file_has_key(kf, "Network", "Scheduling", NULL)) {
+				gc_free gchar *policy = g_key_file_get_string(kf, "Network", "Scheduling", NULL);
+
+				if (!g_strcmp0(policy, "fifo"))
+					schedule_policy = MEGA_SCHEDULE_FIFO;
+				else if (!g_strcmp0(policy, "small-first"))
+					schedule_policy = MEGA_SCHEDULE_SMALL_FIRST;
+				else if (!g_strcmp0(policy, "round-robin"))
+					schedule_policy = MEGA_SCHEDULE_ROUND_ROBIN;
+				else if (!g_strcmp0(policy, "deadline"))
+					schedule_policy = MEGA_SCHEDULE_DEADLINE;
+				else
+					g_printerr("WARNING: Invalid value for Network.Scheduling set in the config file: %s\n",
+						   policy ? policy : "");
+			}
+
+			if (g_key_file_has_key(kf, "Network", "MaxConnectionsPerHost", NULL)) {
+				max_host_connections =
+					g_key_file_get_integer(kf, "Network", "MaxConnectionsPerHost", &local_err);
+				if (local_err || max_host_connections < 0) {
+					g_printerr("WARNING: Invalid value for Network.MaxConnectionsPerHost set in the config file%s%s\n",
+						   local_err ? ": " : "", local_err ? local_err->message : "");
+					g_clear_error(&local_err);
+					max_host_connections = 0;
+				}
+			}
+
 			proxy = g_key_file_get_string(kf, "Network", "Proxy", NULL);
 
 			if (opt_enable_previews == BOOLEAN_UNSET_BUT_TRUE) {
@@ -522,6 +565,26 @@ void tool_init(gint *ac, gchar ***av, const gchar *tool_name, GOptionEntry *tool
 					g_clear_error(&local_err);
 			}
 
+			if (g_key_file_has_key(kf, "Upload", "PreviewTimeout", NULL)) {
+				preview_timeout = g_key_file_get_integer(kf, "Upload", "PreviewTimeout", &local_err);
+				if (local_err || preview_timeout < 0) {
+					g_printerr("WARNING: Invalid value for Upload.PreviewTimeout set in the config file%s%s\n",
+						   local_err ? ": " : "", local_err ? local_err->message : "");
+					g_clear_error(&local_err);
+					preview_timeout = -1;
+				}
+			}
+
+			if (g_key_file_has_key(kf, "UI", "ProgressInterval", NULL)) {
+				progress_interval = g_key_file_get_integer(kf, "UI", "ProgressInterval", &local_err);
+				if (local_err || progress_interval < 10) {
+					g_printerr("WARNING: Invalid value for UI.ProgressInterval set in the config file%s%s\n",
+						   local_err ? ": " : "", local_err ? local_err->message : "");
+					g_clear_error(&local_err);
+					progress_interval = -1;
+				}
+			}
+
 			if (g_key_file_has_key(kf, "UI", "Colors", NULL) && tool_is_stdout_tty()) {
 				tool_use_colors = g_key_file_get_boolean(kf, "UI", "Colors", &local_err);
 				if (local_err) {
@@ -590,6 +653,11 @@ struct mega_session *tool_start_session(ToolSessionFlags flags)
 
 	mega_session_set_speed(s, upload_speed_limit, download_seed_limit);
 	mega_session_set_workers(s, transfer_worker_count);
+	mega_session_set_scheduling(s, schedule_policy, max_host_connections);
+	if (progress_interval > 0)
+		mega_session_set_progress_interval(s, progress_interval);
+	if (preview_timeout >= 0)
+		mega_session_set_preview_timeout(s, preview_timeout);
 
 	if (proxy)
 		mega_session_set_proxy(s, proxy);
@@ -628,6 +696,8 @@ struct mega_session *tool_start_session(ToolSessionFlags flags)
 
 	mega_session_enable_previews(s, !!opt_enable_previews);
 	mega_session_set_resume(s, !opt_disable_resume);
+	mega_session_set_upload_resume(s, !opt_disable_upload_resume);
+	mega_session_set_dedup(s, !opt_disable_dedup, opt_verify_dedup);
 
 	return s;
 
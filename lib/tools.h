@@ -49,6 +49,17 @@ void tool_show_progress(const gchar *file, const struct mega_status_data *data);
 gboolean tool_is_stdout_tty(void);
 gchar* tool_prompt_input(void);
 
+// number of files uploaded at once by the tools, when reached, the tools
+// wait until half of them complete, so that new uploads are started in
+// batches
+#define TOOL_UPLOADS_IN_FLIGHT 128
+
+// number of files downloaded at once by megacopy
+#define TOOL_DOWNLOADS_IN_FLIGHT 4
+
+// limit of Network.ParallelTransfers
+#define TOOL_MAX_WORKERS 64
+
 #define ESC_CLREOL "\x1b[0K"
 #define ESC_WHITE "\x1b[37;1m"
 #define ESC_GREEN "\x1b[32;1m"
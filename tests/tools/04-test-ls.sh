@@ -7,3 +7,4 @@ megals $ROPTS
 megals $OPTS -R --long /Root/TestDir
 megals $OPTS --long /Root/TestDir
 megals $OPTS --export /Root/TestDir
+megals $OPTS --json /Root/TestDir
@@ -0,0 +1,33 @@
+#!/bin/sh
+source ./config
+
+megacopy --help
+
+# known tree: local files are uploaded, then extra remote files are added
+rm -rf DeleteDir
+mkdir -p DeleteDir/Sub
+dd if=/dev/urandom of=DeleteDir/keep.dat bs=4096 count=1
+dd if=/dev/urandom of=DeleteDir/Sub/keep.dat bs=4096 count=1
+
+megarm $ROPTS /Root/DeleteDir
+megamkdir $OPTS /Root/DeleteDir
+megacopy $OPTS --local DeleteDir --remote /Root/DeleteDir
+megaput $OPTS --path /Root/DeleteDir/extra.dat DeleteDir/keep.dat
+megaput $OPTS --path /Root/DeleteDir/Sub/extra.dat DeleteDir/keep.dat
+
+# dry run only lists the removals
+megacopy $OPTS --delete -n --local DeleteDir --remote /Root/DeleteDir
+megatest $OPTS -f /Root/DeleteDir/extra.dat /Root/DeleteDir/Sub/extra.dat || echo "FAIL: dry run removed files"
+
+# 2 removals are over the limit, nothing is removed
+megacopy $OPTS --delete --max-delete 1 --local DeleteDir --remote /Root/DeleteDir && echo "FAIL: --max-delete was ignored"
+megatest $OPTS -f /Root/DeleteDir/extra.dat /Root/DeleteDir/Sub/extra.dat || echo "FAIL: files removed over the limit"
+
+# within the limit only the extra files are removed
+megacopy $OPTS --delete --max-delete 2 --local DeleteDir --remote /Root/DeleteDir
+megatest $OPTS /Root/DeleteDir/extra.dat && echo "FAIL: extra.dat was not removed"
+megatest $OPTS /Root/DeleteDir/Sub/extra.dat && echo "FAIL: Sub/extra.dat was not removed"
+megatest $OPTS -f /Root/DeleteDir/keep.dat /Root/DeleteDir/Sub/keep.dat || echo "FAIL: local files were removed"
+
+megarm $OPTS /Root/DeleteDir
+rm -rf DeleteDir
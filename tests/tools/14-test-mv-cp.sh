@@ -0,0 +1,30 @@
+#!/bin/sh
+source ./config
+
+megamv --help
+megacp --help
+
+dd if=/dev/urandom of=mvcp.dat bs=4096 count=1
+
+megarm $ROPTS /Root/MvCpDir
+megamkdir $OPTS --parents /Root/MvCpDir/A /Root/MvCpDir/B
+megaput $OPTS --path /Root/MvCpDir/A/file.dat mvcp.dat
+
+# copies are made on the server
+megacp $OPTS /Root/MvCpDir/A/file.dat /Root/MvCpDir/B
+megacp $OPTS /Root/MvCpDir/A /Root/MvCpDir/B
+megatest $OPTS -f /Root/MvCpDir/B/file.dat /Root/MvCpDir/B/A/file.dat || echo "FAIL: files were not copied"
+
+# rename, then move
+megamv $OPTS /Root/MvCpDir/B/file.dat /Root/MvCpDir/B/renamed.dat
+megamv $OPTS /Root/MvCpDir/B/renamed.dat /Root/MvCpDir/A
+megatest $OPTS -f /Root/MvCpDir/A/renamed.dat || echo "FAIL: file was not renamed and moved"
+megatest $OPTS /Root/MvCpDir/B/renamed.dat && echo "FAIL: moved file is still in its old directory"
+
+# names in the destination stay unique
+megamv $OPTS /Root/MvCpDir/B/A/file.dat /Root/MvCpDir/A && echo "FAIL: existing file was overwritten"
+
+megals $OPTS -R /Root/MvCpDir
+
+megarm $OPTS /Root/MvCpDir
+rm -f mvcp.dat
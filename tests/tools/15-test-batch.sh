@@ -0,0 +1,32 @@
+#!/bin/sh
+source ./config
+
+megabatch --help
+
+dd if=/dev/urandom of=batch.dat bs=4096 count=1
+
+megarm $ROPTS /Root/BatchDir
+megamkdir $OPTS /Root/BatchDir
+megaput $OPTS --path /Root/BatchDir/file.dat batch.dat
+
+# line 4 fails, the other commands must not
+megabatch $OPTS <<EOC
+mkdir /Root/BatchDir/A /Root/BatchDir/B
+mkdir /Root/BatchDir/A/Sub
+mkdir -p /Root/BatchDir/C/D
+mkdir /Root/BatchDir/A
+test -d /Root/BatchDir/A/Sub /Root/BatchDir/C/D
+mv /Root/BatchDir/B /Root/BatchDir/A
+["mv", "/Root/BatchDir/C", "/Root/BatchDir/E"]
+export /Root/BatchDir/file.dat
+["export", "/Root/BatchDir/file.dat"]
+rm /Root/BatchDir/E
+EOC
+[ $? -eq 1 ] || echo "FAIL: exit status doesn't report the failed command"
+
+megatest $OPTS -d /Root/BatchDir/A/B /Root/BatchDir/A/Sub || echo "FAIL: directories were not created or moved"
+megatest $OPTS /Root/BatchDir/C && echo "FAIL: directory was not renamed"
+megatest $OPTS /Root/BatchDir/E && echo "FAIL: directory was not removed"
+
+megarm $OPTS /Root/BatchDir
+rm -f batch.dat
@@ -0,0 +1,31 @@
+#!/bin/sh
+source ./config
+
+megashell --help
+
+dd if=/dev/urandom of=shell.dat bs=267257 count=1
+rm -f shell-copy.dat
+
+megarm $ROPTS /Root/ShellDir
+
+# commands are read from the standard input when it's not a terminal
+megashell $OPTS <<EOC
+mkdir -p /Root/ShellDir/Sub
+cd /Root/ShellDir
+pwd
+put shell.dat
+wait
+ls -l
+mv shell.dat Sub
+cd Sub
+stat shell.dat
+get shell.dat shell-copy.dat
+wait
+exit
+EOC
+
+cmp shell.dat shell-copy.dat || echo "FAIL: downloaded file differs"
+megatest $OPTS -f /Root/ShellDir/Sub/shell.dat || echo "FAIL: file was not moved"
+
+megarm $OPTS /Root/ShellDir
+rm -f shell.dat shell-copy.dat
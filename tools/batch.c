@@ -0,0 +1,725 @@
+/*
+ *  megatools - Mega.nz client library and tools
+ *  Copyright (C) 2013  Ondřej Jirman <megous@megous.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "tools.h"
+#include "shell.h"
+#include "sjson.h"
+
+static GOptionEntry entries[] = { { NULL } };
+
+struct command {
+	guint line;
+	gboolean json;
+	gchar **argv;
+	gint argc;
+	// set when the command failed
+	gchar *error;
+	// links of exported files, NULL for other commands
+	GPtrArray *links;
+};
+
+static void command_free(struct command *c)
+{
+	g_strfreev(c->argv);
+	g_free(c->error);
+	if (c->links)
+		g_ptr_array_unref(c->links);
+	g_free(c);
+}
+
+static void command_fail(struct command *c, const gchar *fmt, ...)
+{
+	va_list args;
+
+	// only the first error of a command is reported
+	if (c->error)
+		return;
+
+	va_start(args, fmt);
+	c->error = g_strdup_vprintf(fmt, args);
+	va_end(args);
+}
+
+// input
+
+static gchar **parse_json_command(const gchar *line)
+{
+	if (s_json_get_type(line) != S_JSON_TYPE_ARRAY)
+		return NULL;
+
+	GPtrArray *argv = g_ptr_array_new();
+	gboolean valid = TRUE;
+
+	S_JSON_FOREACH_ELEMENT(line, el)
+		if (s_json_get_type(el) == S_JSON_TYPE_STRING)
+			g_ptr_array_add(argv, s_json_get_string(el));
+		else
+			valid = FALSE;
+	S_JSON_FOREACH_END()
+
+	g_ptr_array_add(argv, NULL);
+
+	gchar **strv = (gchar **)g_ptr_array_free(argv, FALSE);
+	if (!valid) {
+		g_strfreev(strv);
+		return NULL;
+	}
+
+	return strv;
+}
+
+static gboolean read_commands(const gchar *path, GPtrArray *commands, GError **err)
+{
+	GIOChannel *channel;
+	GIOStatus status;
+	gchar *line;
+	guint line_no = 0;
+
+	if (path && strcmp(path, "-"))
+		channel = g_io_channel_new_file(path, "r", err);
+	else
+		channel = g_io_channel_unix_new(0);
+
+	if (!channel)
+		return FALSE;
+
+	while ((status = g_io_channel_read_line(channel, &line, NULL, NULL, err)) == G_IO_STATUS_NORMAL) {
+		gc_error_free GError *local_err = NULL;
+		gchar *cmd = g_strstrip(line);
+
+		line_no++;
+
+		if (*cmd == '\0' || *cmd == '#') {
+			g_free(line);
+			continue;
+		}
+
+		struct command *c = g_new0(struct command, 1);
+		c->line = line_no;
+		c->json = *cmd == '[';
+
+		if (c->json) {
+			c->argv = parse_json_command(cmd);
+			if (!c->argv)
+				command_fail(c, "Invalid JSON command, expected an array of strings");
+		} else if (!g_shell_parse_argv(cmd, NULL, &c->argv, &local_err)) {
+			command_fail(c, "Invalid command: %s", local_err->message);
+		}
+
+		if (c->argv)
+			c->argc = g_strv_length(c->argv);
+
+		if (c->argv && c->argc == 0)
+			command_fail(c, "Empty command");
+
+		g_ptr_array_add(commands, c);
+		g_free(line);
+	}
+
+	g_io_channel_unref(channel);
+
+	return status == G_IO_STATUS_EOF;
+}
+
+// output
+
+static void print_result(struct command *c)
+{
+	if (c->json) {
+		SJsonGen *gen = s_json_gen_new();
+
+		s_json_gen_start_object(gen);
+		s_json_gen_member_int(gen, "line", c->line);
+		s_json_gen_member_bool(gen, "ok", !c->error);
+		if (c->error)
+			s_json_gen_member_string(gen, "error", c->error);
+		if (!c->error && c->links) {
+			s_json_gen_member_array(gen, "links");
+			for (guint i = 0; i < c->links->len; i++)
+				s_json_gen_string(gen, c->links->pdata[i]);
+			s_json_gen_end_array(gen);
+		}
+		s_json_gen_end_object(gen);
+
+		gc_free gchar *json = s_json_gen_done(gen);
+		g_print("%s\n", json);
+	} else if (c->error) {
+		g_print("%u: ERROR %s\n", c->line, c->error);
+	} else if (c->links) {
+		g_ptr_array_add(c->links, NULL);
+		gc_free gchar *links = g_strjoinv(" ", (gchar **)c->links->pdata);
+		g_ptr_array_remove_index(c->links, c->links->len - 1);
+
+		g_print("%u: OK %s\n", c->line, links);
+	} else {
+		g_print("%u: OK\n", c->line);
+	}
+}
+
+// commands
+
+// whether path equals prefix or lies inside of it
+static gboolean path_is_under(const gchar *path, const gchar *prefix)
+{
+	gsize len = strlen(prefix);
+
+	while (len > 1 && prefix[len - 1] == '/')
+		len--;
+
+	return !strncmp(path, prefix, len) && (path[len] == '\0' || path[len] == '/');
+}
+
+// path without trailing slashes
+static gchar *path_strip(const gchar *path)
+{
+	gchar *tmp = g_strdup(path);
+	gsize len = strlen(tmp);
+
+	while (len > 1 && tmp[len - 1] == '/')
+		tmp[--len] = '\0';
+
+	return tmp;
+}
+
+// plain mkdir needs an existing parent, or one created by an earlier
+// command of the group
+static gboolean mkdir_check(struct mega_session *s, struct command *c, const gchar *path, GHashTable *created)
+{
+	gc_free gchar *parent_path = g_path_get_dirname(path);
+	struct mega_node *parent = mega_session_stat(s, parent_path);
+
+	if (g_hash_table_contains(created, path) || mega_session_stat(s, path)) {
+		command_fail(c, "Can't create directory %s: Directory already exists: %s", path, path);
+		return FALSE;
+	}
+
+	if (!g_hash_table_contains(created, parent_path) &&
+	    (!parent || parent->type == MEGA_NODE_FILE || parent->type == MEGA_NODE_INBOX)) {
+		command_fail(c, "Can't create directory %s: Parent directory doesn't exist: %s", path, parent_path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void exec_mkdir(struct mega_session *s, struct command **cmds, guint n)
+{
+	gc_error_free GError *local_err = NULL;
+	gc_ptr_array_unref GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+	gc_ptr_array_unref GPtrArray *path_cmds = g_ptr_array_new();
+	gc_ptr_array_unref GPtrArray *nodes = g_ptr_array_new();
+	gc_ptr_array_unref GPtrArray *errors = g_ptr_array_new_with_free_func(g_free);
+	gc_hash_table_unref GHashTable *created = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	for (guint i = 0; i < n; i++) {
+		struct command *c = cmds[i];
+		gboolean parents = FALSE;
+		gint j = 1;
+
+		for (; j < c->argc && c->argv[j][0] == '-'; j++) {
+			if (!strcmp(c->argv[j], "-p") || !strcmp(c->argv[j], "--parents"))
+				parents = TRUE;
+			else
+				command_fail(c, "Unknown option: %s", c->argv[j]);
+		}
+
+		if (j == c->argc)
+			command_fail(c, "No directories specified");
+
+		if (c->error)
+			continue;
+
+		for (; j < c->argc; j++) {
+			gchar *path = path_strip(c->argv[j]);
+
+			if (!parents) {
+				gc_free gchar *parent_path = g_path_get_dirname(path);
+				struct mega_node *parent = mega_session_stat(s, parent_path);
+
+				if (!mkdir_check(s, c, path, created)) {
+					g_free(path);
+					continue;
+				}
+
+				// contacts are added by a different request
+				if (parent && parent->type == MEGA_NODE_NETWORK) {
+					if (!mega_session_mkdir(s, path, &local_err)) {
+						command_fail(c, "Can't create directory %s: %s", path, local_err->message);
+						g_clear_error(&local_err);
+					}
+
+					g_free(path);
+					continue;
+				}
+			}
+
+			// later commands of the group may create directories inside
+			g_hash_table_add(created, g_strdup(path));
+			if (parents) {
+				gc_free gchar *p = g_path_get_dirname(path);
+
+				while (strcmp(p, "/") && strcmp(p, ".")) {
+					gchar *parent_path = g_path_get_dirname(p);
+
+					g_hash_table_add(created, p);
+					p = parent_path;
+				}
+			}
+
+			g_ptr_array_add(paths, path);
+			g_ptr_array_add(path_cmds, c);
+		}
+	}
+
+	if (paths->len == 0)
+		return;
+
+	// all directories are created with one request, parents of plain mkdir
+	// are known to exist by now
+	mega_session_mkdir_p(s, paths, nodes, errors, NULL);
+
+	for (guint k = 0; k < paths->len; k++)
+		if (errors->pdata[k])
+			command_fail(path_cmds->pdata[k], "Can't create directory %s: %s", (gchar *)paths->pdata[k],
+				     (gchar *)errors->pdata[k]);
+}
+
+static void exec_rm(struct mega_session *s, struct command **cmds, guint n)
+{
+	gc_error_free GError *local_err = NULL;
+	gc_hash_table_unref GHashTable *set = g_hash_table_new(NULL, NULL);
+	gc_hash_table_unref GHashTable *target_index = g_hash_table_new(NULL, NULL);
+	gc_ptr_array_unref GPtrArray *found = g_ptr_array_new();
+	gc_ptr_array_unref GPtrArray *targets = g_ptr_array_new();
+	gc_array_unref GArray *found_target = g_array_new(FALSE, FALSE, sizeof(gint));
+
+	// resolve all paths before anything is removed
+	for (guint i = 0; i < n; i++) {
+		if (cmds[i]->argc < 2)
+			command_fail(cmds[i], "No files specified for removal");
+
+		for (gint j = 1; j < cmds[i]->argc; j++) {
+			const gchar *path = cmds[i]->argv[j];
+			struct mega_node *node = mega_session_stat(s, path);
+
+			if (!node) {
+				command_fail(cmds[i], "File not found: %s", path);
+			} else if (node->type != MEGA_NODE_FILE && node->type != MEGA_NODE_FOLDER) {
+				// contacts and special folders go through the single removal path
+				if (!mega_session_rm(s, path, &local_err)) {
+					command_fail(cmds[i], "Can't remove %s: %s", path, local_err->message);
+					g_clear_error(&local_err);
+				}
+
+				node = NULL;
+			}
+
+			g_ptr_array_add(found, node);
+			if (node)
+				g_hash_table_add(set, node);
+		}
+	}
+
+	// nodes inside of other removed nodes go away with them
+	for (guint k = 0; k < found->len; k++) {
+		struct mega_node *node = found->pdata[k], *top = NULL;
+		gint index = -1;
+
+		for (struct mega_node *p = node; p; p = p->parent)
+			if (g_hash_table_contains(set, p))
+				top = p;
+
+		if (top) {
+			gpointer value;
+
+			if (g_hash_table_lookup_extended(target_index, top, NULL, &value)) {
+				index = GPOINTER_TO_INT(value);
+			} else {
+				index = targets->len;
+				g_hash_table_insert(target_index, top, GINT_TO_POINTER(index));
+				g_ptr_array_add(targets, top);
+			}
+		}
+
+		g_array_append_val(found_target, index);
+	}
+
+	if (targets->len == 0)
+		return;
+
+	gc_ptr_array_unref GPtrArray *errors = g_ptr_array_new_with_free_func(g_free);
+	mega_session_rm_nodes(s, targets, NULL, errors, NULL);
+
+	guint k = 0;
+	for (guint i = 0; i < n; i++) {
+		for (gint j = 1; j < cmds[i]->argc; j++, k++) {
+			gint index = g_array_index(found_target, gint, k);
+
+			if (index >= 0 && errors->pdata[index])
+				command_fail(cmds[i], "Can't remove %s: %s", cmds[i]->argv[j], (gchar *)errors->pdata[index]);
+		}
+	}
+}
+
+struct mv_dest {
+	struct mega_node *node;
+	GHashTable *names; // names in the directory, including the moved ones
+	GPtrArray *nodes;
+	GPtrArray *paths;
+	GPtrArray *cmds;
+};
+
+static struct mv_dest *mv_dest_new(struct mega_session *s, struct mega_node *node)
+{
+	struct mv_dest *d = g_new0(struct mv_dest, 1);
+	GSList *children = mega_session_get_node_chilren(s, node), *l;
+
+	d->node = node;
+	d->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	d->nodes = g_ptr_array_new();
+	d->paths = g_ptr_array_new();
+	d->cmds = g_ptr_array_new();
+
+	for (l = children; l; l = l->next)
+		g_hash_table_add(d->names, g_strdup(((struct mega_node *)l->data)->name));
+	g_slist_free(children);
+
+	return d;
+}
+
+static void mv_dest_free(struct mv_dest *d)
+{
+	g_hash_table_unref(d->names);
+	g_ptr_array_unref(d->nodes);
+	g_ptr_array_unref(d->paths);
+	g_ptr_array_unref(d->cmds);
+	g_free(d);
+}
+
+static void exec_mv(struct mega_session *s, struct command **cmds, guint n)
+{
+	gc_error_free GError *local_err = NULL;
+	gc_ptr_array_unref GPtrArray *dests = g_ptr_array_new_with_free_func((GDestroyNotify)mv_dest_free);
+	gc_hash_table_unref GHashTable *dests_by_node = g_hash_table_new(NULL, NULL);
+	gc_ptr_array_unref GPtrArray *renamed = g_ptr_array_new();
+	gc_ptr_array_unref GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+	gc_ptr_array_unref GPtrArray *renamed_cmds = g_ptr_array_new();
+
+	for (guint i = 0; i < n; i++) {
+		struct command *c = cmds[i];
+		gc_free gchar *name = NULL;
+
+		if (c->argc < 3) {
+			command_fail(c, "You must specify files to move and a destination");
+			continue;
+		}
+
+		const gchar *dest_path = c->argv[c->argc - 1];
+		struct mega_node *dest = mega_session_stat(s, dest_path);
+
+		// single file can be moved or renamed to a new name
+		if (!dest && c->argc == 3) {
+			gc_free gchar *parent_path = g_path_get_dirname(dest_path);
+
+			dest = mega_session_stat(s, parent_path);
+			name = g_path_get_basename(dest_path);
+		}
+
+		if (!dest || !mega_node_is_container(dest)) {
+			command_fail(c, "Destination directory not found: %s", dest_path);
+			continue;
+		}
+
+		struct mv_dest *d = g_hash_table_lookup(dests_by_node, dest);
+		if (!d) {
+			d = mv_dest_new(s, dest);
+			g_ptr_array_add(dests, d);
+			g_hash_table_insert(dests_by_node, dest, d);
+		}
+
+		for (gint j = 1; j < c->argc - 1; j++) {
+			struct mega_node *node = mega_session_stat(s, c->argv[j]);
+
+			if (!node) {
+				command_fail(c, "File not found: %s", c->argv[j]);
+				continue;
+			}
+
+			if (node->parent == dest && !name) {
+				command_fail(c, "%s is already in %s", c->argv[j], dest_path);
+				continue;
+			}
+
+			// names in the destination must stay unique, also among
+			// the files moved there by earlier commands
+			const gchar *new_name = name ? name : node->name;
+			if (g_hash_table_contains(d->names, new_name)) {
+				command_fail(c, "File already exists in %s: %s", dest_path, new_name);
+				continue;
+			}
+
+			g_hash_table_add(d->names, g_strdup(new_name));
+
+			if (name) {
+				g_ptr_array_add(renamed, node);
+				g_ptr_array_add(names, g_strdup(name));
+				g_ptr_array_add(renamed_cmds, c);
+
+				// a renamed file may stay in its directory
+				if (node->parent == dest)
+					continue;
+			}
+
+			g_ptr_array_add(d->nodes, node);
+			g_ptr_array_add(d->paths, c->argv[j]);
+			g_ptr_array_add(d->cmds, c);
+		}
+	}
+
+	// one request per destination directory
+	for (guint i = 0; i < dests->len; i++) {
+		struct mv_dest *d = dests->pdata[i];
+		gc_ptr_array_unref GPtrArray *errors = g_ptr_array_new_with_free_func(g_free);
+
+		if (d->nodes->len == 0)
+			continue;
+
+		mega_session_move(s, d->nodes, d->node, errors, NULL);
+
+		for (guint j = 0; j < d->nodes->len; j++)
+			if (errors->pdata[j])
+				command_fail(d->cmds->pdata[j], "Can't move %s: %s", (gchar *)d->paths->pdata[j],
+					     (gchar *)errors->pdata[j]);
+	}
+
+	// all renames go together, unless their move failed
+	for (guint i = renamed->len; i > 0; i--) {
+		struct command *c = renamed_cmds->pdata[i - 1];
+
+		if (c->error) {
+			g_ptr_array_remove_index(renamed, i - 1);
+			g_ptr_array_remove_index(names, i - 1);
+			g_ptr_array_remove_index(renamed_cmds, i - 1);
+		}
+	}
+
+	if (renamed->len > 0 && !mega_session_rename(s, renamed, names, &local_err)) {
+		for (guint j = 0; j < renamed_cmds->len; j++)
+			command_fail(renamed_cmds->pdata[j], "Can't rename %s: %s", ((struct command *)renamed_cmds->pdata[j])->argv[1],
+				     local_err->message);
+	}
+}
+
+static void exec_test(struct mega_session *s, struct command **cmds, guint n)
+{
+	for (guint i = 0; i < n; i++) {
+		struct command *c = cmds[i];
+		gboolean is_file = FALSE, is_folder = FALSE;
+		gint j = 1;
+
+		for (; j < c->argc && c->argv[j][0] == '-'; j++) {
+			if (!strcmp(c->argv[j], "-f"))
+				is_file = TRUE;
+			else if (!strcmp(c->argv[j], "-d"))
+				is_folder = TRUE;
+			else
+				command_fail(c, "Unknown option: %s", c->argv[j]);
+		}
+
+		if (is_file && is_folder)
+			command_fail(c, "You can't combine -f and -d");
+
+		if (j == c->argc)
+			command_fail(c, "You must pass at least one remote path");
+
+		for (; j < c->argc; j++) {
+			struct mega_node *node = mega_session_stat(s, c->argv[j]);
+
+			if (!node)
+				command_fail(c, "File not found: %s", c->argv[j]);
+			else if (is_file && node->type != MEGA_NODE_FILE)
+				command_fail(c, "Not a file: %s", c->argv[j]);
+			else if (is_folder && node->type != MEGA_NODE_FOLDER)
+				command_fail(c, "Not a folder: %s", c->argv[j]);
+		}
+	}
+}
+
+static void exec_export(struct mega_session *s, struct command **cmds, guint n)
+{
+	gc_error_free GError *local_err = NULL;
+	gc_hash_table_unref GHashTable *set = g_hash_table_new(NULL, NULL);
+	GSList *nodes = NULL;
+
+	for (guint i = 0; i < n; i++) {
+		struct command *c = cmds[i];
+
+		if (c->argc < 2)
+			command_fail(c, "You must pass at least one remote path");
+
+		for (gint j = 1; j < c->argc; j++) {
+			struct mega_node *node = mega_session_stat(s, c->argv[j]);
+
+			if (!node)
+				command_fail(c, "Remote file not found: %s", c->argv[j]);
+			else if (node->type != MEGA_NODE_FILE)
+				command_fail(c, "Remote path is not a file: %s", c->argv[j]);
+			else if (!g_hash_table_contains(set, node)) {
+				g_hash_table_add(set, node);
+				nodes = g_slist_prepend(nodes, node);
+			}
+		}
+	}
+
+	// links of all files of the group are read with one request
+	nodes = g_slist_reverse(nodes);
+	gboolean ok = mega_session_addlinks(s, nodes, &local_err);
+	g_slist_free(nodes);
+
+	for (guint i = 0; i < n; i++) {
+		struct command *c = cmds[i];
+
+		if (c->error)
+			continue;
+
+		if (!ok) {
+			command_fail(c, "Can't read links info from mega.nz: %s", local_err->message);
+			continue;
+		}
+
+		c->links = g_ptr_array_new_with_free_func(g_free);
+		for (gint j = 1; j < c->argc; j++) {
+			struct mega_node *node = mega_session_stat(s, c->argv[j]);
+
+			if (node->link)
+				g_ptr_array_add(c->links, mega_node_get_link(node, TRUE));
+			else
+				command_fail(c, "Missing link for %s", c->argv[j]);
+		}
+	}
+}
+
+struct batch_command {
+	const gchar *name;
+	void (*exec)(struct mega_session *s, struct command **cmds, guint n);
+};
+
+static const struct batch_command batch_commands[] = {
+	{ "mkdir", exec_mkdir },
+	{ "rm", exec_rm },
+	{ "mv", exec_mv },
+	{ "test", exec_test },
+	{ "export", exec_export },
+	{ NULL }
+};
+
+static const struct batch_command *find_command(struct command *c)
+{
+	if (c->error)
+		return NULL;
+
+	for (const struct batch_command *bc = batch_commands; bc->name; bc++)
+		if (!strcmp(bc->name, c->argv[0]))
+			return bc;
+
+	command_fail(c, "Unknown command: %s", c->argv[0]);
+	return NULL;
+}
+
+// a move can't be grouped with an earlier move of its source or destination
+static gboolean mv_depends(struct command **cmds, guint n, struct command *c)
+{
+	for (guint i = 0; i < n; i++)
+		for (gint j = 1; j < cmds[i]->argc - 1; j++)
+			for (gint k = 1; k < c->argc; k++)
+				if (path_is_under(c->argv[k], cmds[i]->argv[j]) ||
+				    path_is_under(cmds[i]->argv[j], c->argv[k]))
+					return TRUE;
+
+	return FALSE;
+}
+
+static int batch_main(int ac, char *av[])
+{
+	gc_error_free GError *local_err = NULL;
+	static struct mega_session *s;
+
+	tool_init(&ac, &av, "- run many commands with one mega.nz session", entries, TOOL_INIT_AUTH);
+
+	if (ac > 2) {
+		g_printerr("ERROR: Only one command file can be specified\n");
+		tool_fini(NULL);
+		return 1;
+	}
+
+	gc_ptr_array_unref GPtrArray *commands = g_ptr_array_new_with_free_func((GDestroyNotify)command_free);
+	if (!read_commands(ac == 2 ? av[1] : NULL, commands, &local_err)) {
+		g_printerr("ERROR: Can't read commands: %s\n", local_err->message);
+		tool_fini(NULL);
+		return 1;
+	}
+
+	s = tool_start_session(TOOL_SESSION_OPEN);
+	if (!s) {
+		tool_fini(NULL);
+		return 1;
+	}
+
+	// consecutive commands of the same kind are executed together, so that
+	// they share API requests
+	struct command **cmds = (struct command **)commands->pdata;
+	gint status = 0;
+	guint i = 0;
+
+	while (i < commands->len) {
+		const struct batch_command *bc = find_command(cmds[i]);
+		guint n = 1;
+
+		if (bc) {
+			while (i + n < commands->len && !cmds[i + n]->error && cmds[i + n]->argc > 0 &&
+			       !strcmp(cmds[i + n]->argv[0], bc->name) &&
+			       !(bc->exec == exec_mv && mv_depends(cmds + i, n, cmds[i + n])))
+				n++;
+
+			bc->exec(s, cmds + i, n);
+		}
+
+		for (guint j = i; j < i + n; j++) {
+			print_result(cmds[j]);
+			if (cmds[j]->error)
+				status = 1;
+		}
+
+		i += n;
+	}
+
+	mega_session_save(s, NULL);
+
+	tool_fini(s);
+	return status;
+}
+
+const struct shell_tool shell_tool_batch = {
+	.name = "batch",
+	.main = batch_main,
+	.usages = (char*[]){
+		"[<commandfile>]",
+		NULL
+	},
+};
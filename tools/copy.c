@@ -19,6 +19,12 @@
 
 #include "tools.h"
 #include "shell.h"
+#include <errno.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 static gchar *opt_remote_path;
 static gchar *opt_local_path;
@@ -26,6 +32,9 @@ static gboolean opt_download;
 static gboolean opt_noprogress;
 static gboolean opt_dryrun;
 static gboolean opt_nofollow;
+static gboolean opt_watch;
+static gboolean opt_delete;
+static gchar *opt_max_delete = "50%";
 static struct mega_session *s;
 
 static GOptionEntry entries[] = {
@@ -34,199 +43,1519 @@ static GOptionEntry entries[] = {
 	{ "download", 'd', 0, G_OPTION_ARG_NONE, &opt_download, "Download files from mega", NULL },
 	{ "no-progress", '\0', 0, G_OPTION_ARG_NONE, &opt_noprogress, "Disable progress bar", NULL },
 	{ "no-follow", '\0', 0, G_OPTION_ARG_NONE, &opt_nofollow, "Don't follow symbolic links", NULL },
-	{ "dryrun", 'n', 0, G_OPTION_ARG_NONE, &opt_dryrun, "Don't perform any actual changes", NULL },
+	{ "dryrun", 'n', 0, G_OPTION_ARG_NONE, &opt_dryrun, "Print the plan, don't perform any actual changes", NULL },
+	{ "watch", 'w', 0, G_OPTION_ARG_NONE, &opt_watch, "Keep running and upload local changes as they happen", NULL },
+	{ "delete", '\0', 0, G_OPTION_ARG_NONE, &opt_delete, "Remove remote files that don't exist locally", NULL },
+	{ "max-delete", '\0', 0, G_OPTION_ARG_STRING, &opt_max_delete,
+	  "Don't remove anything if more remote files would be removed (default 50%)", "N|N%" },
 	{ NULL }
 };
 
+// output and progress are shared by the main thread and download threads
+static GMutex output_lock;
 static gchar *cur_file = NULL;
+static guint downloads_active;
 
 static void status_callback(struct mega_status_data *data, gpointer userdata)
 {
-	if (!opt_noprogress && data->type == MEGA_STATUS_PROGRESS)
+	if (opt_noprogress || data->type != MEGA_STATUS_PROGRESS)
+		return;
+
+	g_mutex_lock(&output_lock);
+
+	// progress of parallel downloads can't be shown in one line
+	if (downloads_active <= 1)
 		tool_show_progress(cur_file, data);
+
+	g_mutex_unlock(&output_lock);
+}
+
+static void clear_progress(void)
+{
+	if (!opt_noprogress && tool_is_stdout_tty())
+		g_print("\r" ESC_CLREOL);
+}
+
+// Copying is done in two phases:
+//
+// - planning: the local tree is walked by a pool of threads, while the
+//   remote tree is indexed from the session, then the trees are compared
+//   and every entry of the source tree gets an operation in the plan
+// - execution: directories are created first, in path order, then all
+//   transfers run concurrently, uploads through the session's upload queue
+//   and downloads in a pool of download threads
+//
+// When uploading, both phases overlap: local entries are planned as soon as
+// the walker finds them, new directories are created in batches whenever
+// the walker falls behind, and uploads are submitted as soon as their
+// directory exists.
+//
+// Items depend on the directory item of their parent, if the directory
+// can't be created, the items in it are not executed.
+//
+// Files that were in sync at the end of the previous upload between the same
+// directories are recorded in the sync state file, see below.
+//
+// In watch mode, both trees are kept in memory after the first copy and
+// only the changed parts of the local tree are planned again, see below.
+
+// trees
+
+struct entry {
+	gchar *path; // relative to the synced directory, "" for the directory itself
+	gboolean is_dir;
+	goffset size;
+	guint64 mtime; // in microseconds, local entries only
+	guint64 inode; // local entries only
+	struct mega_node *node; // remote entries only
+};
+
+struct tree {
+	GHashTable *index; // path -> struct entry, owns the entries
+	GPtrArray *entries; // struct entry sorted by path, valid after tree_sort()
+	GHashTable *added; // paths added since it was set, if not NULL
+	gboolean ok; // all directories were read
+};
+
+static void entry_free(struct entry *e)
+{
+	g_free(e->path);
+	g_free(e);
+}
+
+static void tree_init(struct tree *t)
+{
+	t->index = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)entry_free);
+	t->entries = g_ptr_array_new();
+	t->added = NULL;
+	t->ok = TRUE;
+}
+
+static void tree_clear(struct tree *t)
+{
+	g_ptr_array_unref(t->entries);
+	g_hash_table_unref(t->index);
+}
+
+// replaces the existing entry with the same path
+static struct entry *tree_add(struct tree *t, gchar *path, gboolean is_dir, goffset size)
+{
+	struct entry *e = g_new0(struct entry, 1);
+
+	e->path = path;
+	e->is_dir = is_dir;
+	e->size = size;
+	g_hash_table_replace(t->index, e->path, e);
+	if (t->added)
+		g_hash_table_add(t->added, g_strdup(path));
+	return e;
+}
+
+static gboolean entry_is_in(const gchar *path, const gchar *dir)
+{
+	gsize len = strlen(dir);
+
+	return !strncmp(path, dir, len) && path[len] == '/';
+}
+
+// removes the entry and everything below it
+static void tree_remove(struct tree *t, const gchar *path)
+{
+	struct entry *e = g_hash_table_lookup(t->index, path);
+	GHashTableIter iter;
+
+	if (!e)
+		return;
+
+	if (e->is_dir) {
+		struct entry *child;
+
+		g_hash_table_iter_init(&iter, t->index);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&child)) {
+			if (entry_is_in(child->path, path))
+				g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	g_hash_table_remove(t->index, path);
+}
+
+static gint entry_compare(gconstpointer a, gconstpointer b)
+{
+	const struct entry *ea = *(struct entry **)a;
+	const struct entry *eb = *(struct entry **)b;
+
+	// parent directories sort before their children
+	return strcmp(ea->path, eb->path);
+}
+
+static void tree_sort(struct tree *t)
+{
+	GHashTableIter iter;
+	gpointer e;
+
+	g_ptr_array_set_size(t->entries, 0);
+	g_hash_table_iter_init(&iter, t->index);
+	while (g_hash_table_iter_next(&iter, NULL, &e))
+		g_ptr_array_add(t->entries, e);
+
+	g_ptr_array_sort(t->entries, entry_compare);
+}
+
+static gchar *path_child(const gchar *path, const gchar *name)
+{
+	return *path ? g_strconcat(path, "/", name, NULL) : g_strdup(name);
+}
+
+static gchar *path_parent(const gchar *path)
+{
+	const gchar *slash = strrchr(path, '/');
+
+	return slash ? g_strndup(path, slash - path) : g_strdup("");
+}
+
+static gchar *get_remote_path(const gchar *path)
+{
+	return *path ? g_strconcat(opt_remote_path, "/", path, NULL) : g_strdup(opt_remote_path);
+}
+
+static gchar *get_local_path(const gchar *path)
+{
+	return g_build_filename(opt_local_path, path, NULL);
+}
+
+#define LOCAL_ATTRIBUTES                                                                                               \
+	"standard::*," G_FILE_ATTRIBUTE_TIME_MODIFIED "," G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC                          \
+	"," G_FILE_ATTRIBUTE_UNIX_INODE
+
+static GFileQueryInfoFlags get_query_flags(void)
+{
+	return opt_nofollow ? G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS : G_FILE_QUERY_INFO_NONE;
+}
+
+static struct entry *tree_add_local_file(struct tree *t, gchar *path, GFileInfo *info)
+{
+	struct entry *e = tree_add(t, path, FALSE, g_file_info_get_size(info));
+
+	// files rewritten within a second are only told apart by microseconds,
+	// which matters in watch mode
+	e->mtime = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+		   g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+	e->inode = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_UNIX_INODE);
+	return e;
+}
+
+// local walker
+
+// Local tree is read by a pool of threads, one directory per task, and
+// subdirectories are pushed back to the pool as they are found. Type, size,
+// mtime and inode of the entries come from the enumeration itself. Found
+// entries can also be pushed to a queue, parents before their children, so
+// that they can be planned and uploaded while the rest of the tree is read.
+// The queue ends with walk_done.
+
+#define WALK_THREADS 8
+#define WALK_POLL_INTERVAL (10 * 1000)
+#define MKDIR_BATCH_SIZE 1000
+
+struct walker {
+	struct tree *tree;
+	GThreadPool *pool;
+	GMutex lock; // protects the tree and pending
+	GCond idle;
+	guint pending; // directories not read yet
+	GAsyncQueue *found; // struct entry, if not NULL
+};
+
+static struct entry walk_done;
+
+static void walker_found(struct walker *w, struct entry *e)
+{
+	if (w->found)
+		g_async_queue_push(w->found, e);
+}
+
+// runs in the walker threads
+static void walk_local_dir(gpointer data, gpointer userdata)
+{
+	struct entry *dir = data;
+	struct walker *w = userdata;
+	GError *local_err = NULL;
+	GFileInfo *i;
+	gc_free gchar *local_path = get_local_path(dir->path);
+	gc_object_unref GFile *file = g_file_new_for_path(local_path);
+
+	gc_object_unref GFileEnumerator *e =
+		g_file_enumerate_children(file, LOCAL_ATTRIBUTES, get_query_flags(), NULL, &local_err);
+	if (!e) {
+		g_printerr("ERROR: Can't read local directory %s: %s\n", local_path, local_err->message);
+		g_clear_error(&local_err);
+	}
+
+	while (e && (i = g_file_enumerator_next_file(e, NULL, NULL))) {
+		const gchar *name = g_file_info_get_name(i);
+		gchar *child_path = path_child(dir->path, name);
+
+		// info describes the link target, unless symlinks are not followed
+		GFileType type = g_file_info_get_file_type(i);
+
+		g_mutex_lock(&w->lock);
+
+		if (type == G_FILE_TYPE_DIRECTORY) {
+			struct entry *child = tree_add(w->tree, child_path, TRUE, 0);
+
+			walker_found(w, child);
+			w->pending++;
+			g_thread_pool_push(w->pool, child, NULL);
+		} else if (type == G_FILE_TYPE_REGULAR) {
+			walker_found(w, tree_add_local_file(w->tree, child_path, i));
+		} else {
+			gc_free gchar *child_local_path = get_local_path(child_path);
+
+			g_printerr("WARNING: Skipping special file %s\n", child_local_path);
+			g_free(child_path);
+		}
+
+		g_mutex_unlock(&w->lock);
+		g_object_unref(i);
+	}
+
+	g_mutex_lock(&w->lock);
+	if (!e)
+		w->tree->ok = FALSE;
+	if (--w->pending == 0) {
+		walker_found(w, &walk_done);
+		g_cond_signal(&w->idle);
+	}
+	g_mutex_unlock(&w->lock);
+}
+
+// starts reading the directory below dir, which is already in the tree,
+// or just ends the queue if dir is NULL
+static void walker_start(struct walker *w, struct tree *t, struct entry *dir, GAsyncQueue *found)
+{
+	w->tree = t;
+	w->found = found;
+	w->pending = 0;
+	g_mutex_init(&w->lock);
+	g_cond_init(&w->idle);
+	w->pool = g_thread_pool_new(walk_local_dir, w, WALK_THREADS, FALSE, NULL);
+
+	if (dir) {
+		w->pending = 1;
+		g_thread_pool_push(w->pool, dir, NULL);
+	} else
+		walker_found(w, &walk_done);
+}
+
+static void walker_wait(struct walker *w)
+{
+	g_mutex_lock(&w->lock);
+	while (w->pending > 0)
+		g_cond_wait(&w->idle, &w->lock);
+	g_mutex_unlock(&w->lock);
+
+	g_thread_pool_free(w->pool, FALSE, TRUE);
+	g_mutex_clear(&w->lock);
+	g_cond_clear(&w->idle);
+}
+
+// starts reading the local tree, the local directory may not exist when
+// downloading
+static void walk_local_tree(struct walker *w, struct tree *t, GAsyncQueue *found)
+{
+	gc_object_unref GFile *root = g_file_new_for_path(opt_local_path);
+	struct entry *dir = NULL;
+
+	if (g_file_query_file_type(root, 0, NULL) == G_FILE_TYPE_DIRECTORY) {
+		dir = tree_add(t, g_strdup(""), TRUE, 0);
+		if (found)
+			g_async_queue_push(found, dir);
+	} else if (g_file_query_exists(root, NULL)) {
+		tree_add(t, g_strdup(""), FALSE, 0);
+	}
+
+	walker_start(w, t, dir, found);
+}
+
+static void walk_remote_tree(struct tree *t, struct mega_node *root)
+{
+	GSList *nodes = mega_session_ls_all(s), *i;
+
+	tree_add(t, g_strdup(""), TRUE, 0)->node = root;
+
+	for (i = nodes; i; i = i->next) {
+		struct mega_node *n = i->data;
+		struct mega_node *p;
+
+		if (n == root || !mega_node_has_ancestor(n, root))
+			continue;
+
+		if (!n->name || (n->type != MEGA_NODE_FILE && n->type != MEGA_NODE_FOLDER))
+			continue;
+
+		// path relative to the root
+		GString *path = g_string_new(n->name);
+		for (p = n->parent; p && p != root; p = p->parent) {
+			g_string_prepend_c(path, '/');
+			g_string_prepend(path, p->name);
+		}
+
+		tree_add(t, g_string_free(path, FALSE), n->type == MEGA_NODE_FOLDER, n->size)->node = n;
+	}
+
+	g_slist_free(nodes);
+	tree_sort(t);
+}
+
+// sync state
+
+// State file records the files that were in sync after the previous upload
+// between the same local and remote directory: the local file's size, mtime
+// and inode, and the handle of the remote node. If the remote node is still
+// at the same path, a file that changed locally since then is uploaded again
+// and the new node replaces the recorded one, other existing files would be
+// conflicts. State is only kept for uploads of files, directories are always
+// compared.
+//
+// Format is one line per file, after a version line:
+//
+//   <size> <mtime> <inode> <handle> <escaped path>
+
+#define STATE_VERSION "megatools-sync-state 2"
+
+struct state_entry {
+	goffset size;
+	guint64 mtime;
+	guint64 inode;
+	gchar handle[16];
+};
+
+static gchar *state_path;
+static GHashTable *state; // path -> struct state_entry
+
+static gchar *state_get_path(struct mega_node *remote_dir)
+{
+	gc_object_unref GFile *file = g_file_new_for_path(opt_local_path);
+	gc_free gchar *abs_path = g_file_get_path(file);
+	gc_checksum_free GChecksum *cs = g_checksum_new(G_CHECKSUM_SHA1);
+
+	g_checksum_update(cs, abs_path, -1);
+	g_checksum_update(cs, "\n", 1);
+	g_checksum_update(cs, remote_dir->handle, -1);
+	g_checksum_update(cs, "\n", 1);
+	g_checksum_update(cs, "upload", -1);
+
+	gc_free gchar *filename = g_strconcat(g_checksum_get_string(cs), ".megatools.sync", NULL);
+
+	return g_build_filename(g_get_user_cache_dir(), "megatools", "sync", filename, NULL);
+}
+
+static void state_load(struct mega_node *remote_dir)
+{
+	gc_free gchar *data = NULL;
+	gchar *line, *next;
+
+	state_path = state_get_path(remote_dir);
+	state = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	if (!g_file_get_contents(state_path, &data, NULL, NULL))
+		return;
+
+	next = strchr(data, '\n');
+	if (!next || strncmp(data, STATE_VERSION "\n", next - data + 1))
+		return;
+
+	for (line = next + 1; *line; line = next) {
+		struct state_entry e = { 0 };
+		gint64 size;
+		gint n = 0;
+
+		next = strchr(line, '\n');
+		if (!next)
+			break;
+		*next++ = '\0';
+
+		// path is the rest of the line after a single space
+		if (sscanf(line, "%" G_GINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %15s%n", &size, &e.mtime,
+			   &e.inode, e.handle, &n) != 4 || line[n] != ' ')
+			continue;
+
+		e.size = size;
+		g_hash_table_insert(state, g_strcompress(line + n + 1), g_memdup2(&e, sizeof e));
+	}
+}
+
+// returns the remote node of the file if it is still the node that was in
+// sync after the previous upload, changed is set if the local file changed
+// since then
+static struct mega_node *state_lookup(struct entry *local, struct tree *remote, gboolean *changed)
+{
+	struct state_entry *e = g_hash_table_lookup(state, local->path);
+
+	if (!e)
+		return NULL;
+
+	// a node that was renamed or moved away is not in sync anymore
+	struct entry *r = g_hash_table_lookup(remote->index, local->path);
+	if (!r || !r->node || strcmp(r->node->handle, e->handle))
+		return NULL;
+
+	*changed = e->size != local->size || e->mtime != local->mtime || e->inode != local->inode;
+	return r->node;
+}
+
+static void state_set(struct entry *local, struct mega_node *node)
+{
+	struct state_entry *e = g_new0(struct state_entry, 1);
+
+	e->size = local->size;
+	e->mtime = local->mtime;
+	e->inode = local->inode;
+	g_strlcpy(e->handle, node->handle, sizeof e->handle);
+	g_hash_table_replace(state, g_strdup(local->path), e);
+}
+
+static gboolean state_entry_is_gone(gpointer key, gpointer value, gpointer user_data)
+{
+	struct tree *local = user_data;
+
+	return !g_hash_table_contains(local->index, key);
+}
+
+// forgets files that are no longer in the local tree
+static void state_prune(struct tree *local)
+{
+	g_hash_table_foreach_remove(state, state_entry_is_gone, local);
+}
+
+static void state_save(void)
+{
+	GError *local_err = NULL;
+	gc_string_free GString *str = g_string_new(STATE_VERSION "\n");
+	GHashTableIter iter;
+	const gchar *key;
+	struct state_entry *e;
+
+	g_hash_table_iter_init(&iter, state);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&key, (gpointer *)&e)) {
+		gc_free gchar *path = g_strescape(key, NULL);
+
+		g_string_append_printf(str, "%" G_GINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %s %s\n",
+				       (gint64)e->size, e->mtime, e->inode, e->handle, path);
+	}
+
+	gc_free gchar *dir = g_path_get_dirname(state_path);
+
+	if (g_mkdir_with_parents(dir, 0700) != 0 || !g_file_set_contents(state_path, str->str, str->len, &local_err)) {
+		g_printerr("WARNING: Can't write sync state %s: %s\n", state_path,
+			   local_err ? local_err->message : g_strerror(errno));
+		g_clear_error(&local_err);
+	}
+}
+
+// plan
+
+enum {
+	PLAN_MKDIR,
+	PLAN_UPLOAD,
+	PLAN_DOWNLOAD,
+	PLAN_SKIP,
+	PLAN_CONFLICT,
+	PLAN_DELETE,
+	PLAN_N_OPS,
+};
+
+struct plan_item {
+	gint op;
+	struct entry *src;
+	struct entry *dst; // NULL if it doesn't exist
+	gint parent; // index of the MKDIR item of the parent directory or -1
+	struct mega_node *node; // remote node of the synced file or created directory
+	struct mega_node *replaced; // remote node replaced by the uploaded file
+	gboolean failed;
+};
+
+struct plan {
+	GPtrArray *items; // struct plan_item, items don't move while the plan grows
+	GHashTable *mkdirs; // path -> index of the MKDIR item + 1
+	GHashTable *blocked; // paths of conflicting directories
+	guint count[PLAN_N_OPS];
+	goffset bytes[PLAN_N_OPS];
+};
+
+static void plan_init(struct plan *plan)
+{
+	memset(plan, 0, sizeof *plan);
+	plan->items = g_ptr_array_new_with_free_func(g_free);
+	plan->mkdirs = g_hash_table_new(g_str_hash, g_str_equal);
+	plan->blocked = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static void plan_clear(struct plan *plan)
+{
+	g_ptr_array_unref(plan->items);
+	g_hash_table_unref(plan->mkdirs);
+	g_hash_table_unref(plan->blocked);
+}
+
+static struct plan_item *plan_add(struct plan *plan, gint op, struct entry *src, struct entry *dst, gint parent,
+				  struct mega_node *node)
+{
+	struct plan_item *item = g_new0(struct plan_item, 1);
+
+	item->op = op;
+	item->src = src;
+	item->dst = dst;
+	item->parent = parent;
+	item->node = node;
+
+	g_ptr_array_add(plan->items, item);
+	plan->count[op]++;
+	plan->bytes[op] += src->is_dir ? 0 : src->size;
+	return item;
+}
+
+static gchar *get_dst_path(const gchar *path)
+{
+	return opt_download ? get_local_path(path) : get_remote_path(path);
+}
+
+// compares the source entry with the destination tree, existing files with
+// the same size are skipped, other existing files are conflicts, unless they
+// were uploaded by the previous upload and only the local file changed since
+// then; parents must be planned before their children, returns the new item
+// or NULL if there's nothing to do
+static struct plan_item *plan_build_entry(struct plan *plan, struct entry *e, struct tree *local,
+					  struct tree *remote)
+{
+	struct tree *dst = opt_download ? local : remote;
+	struct entry *d = g_hash_table_lookup(dst->index, e->path);
+	gint parent = -1;
+
+	if (*e->path) {
+		gc_free gchar *parent_path = path_parent(e->path);
+
+		// contents of conflicting directories are not copied
+		if (g_hash_table_contains(plan->blocked, parent_path)) {
+			if (e->is_dir)
+				g_hash_table_add(plan->blocked, e->path);
+			return NULL;
+		}
+
+		parent = GPOINTER_TO_INT(g_hash_table_lookup(plan->mkdirs, parent_path)) - 1;
+	}
+
+	// remote file is the one uploaded previously, so only the local file
+	// may have changed since
+	gboolean changed = FALSE;
+	struct mega_node *synced = !opt_download && !e->is_dir ? state_lookup(e, remote, &changed) : NULL;
+	if (synced && !changed) {
+		return plan_add(plan, PLAN_SKIP, e, d, parent, synced);
+	} else if (synced) {
+		struct plan_item *item = plan_add(plan, PLAN_UPLOAD, e, d, parent, NULL);
+
+		item->replaced = synced;
+		return item;
+	}
+
+	if (d && d->is_dir != e->is_dir) {
+		gc_free gchar *dst_path = get_dst_path(e->path);
+
+		g_printerr("ERROR: File already exists at %s\n", dst_path);
+		if (e->is_dir)
+			g_hash_table_add(plan->blocked, e->path);
+		return plan_add(plan, PLAN_CONFLICT, e, d, parent, NULL);
+	} else if (e->is_dir) {
+		if (d)
+			return NULL;
+
+		struct plan_item *item = plan_add(plan, PLAN_MKDIR, e, NULL, parent, NULL);
+		g_hash_table_insert(plan->mkdirs, e->path, GINT_TO_POINTER(plan->items->len));
+		return item;
+	} else if (!d) {
+		return plan_add(plan, opt_download ? PLAN_DOWNLOAD : PLAN_UPLOAD, e, NULL, parent, NULL);
+	} else if (d->size == e->size) {
+		return plan_add(plan, PLAN_SKIP, e, d, parent, opt_download ? e->node : d->node);
+	} else {
+		gc_free gchar *dst_path = get_dst_path(e->path);
+
+		g_printerr("ERROR: File already exists at %s\n", dst_path);
+		return plan_add(plan, PLAN_CONFLICT, e, d, parent, NULL);
+	}
+}
+
+static void plan_print_item(struct plan_item *item)
+{
+	gc_free gchar *dst_path = get_dst_path(item->src->path);
+
+	if (item->op == PLAN_MKDIR)
+		g_print("D %s\n", dst_path);
+	else if (item->op == PLAN_DELETE)
+		g_print("R %s\n", dst_path);
+	else if (opt_dryrun)
+		g_print("F %s (%" G_GOFFSET_FORMAT " bytes)\n", dst_path, item->src->size);
+	else
+		g_print("F %s\n", dst_path);
+}
+
+static void plan_print(struct plan *plan)
+{
+	for (guint i = 0; i < plan->items->len; i++) {
+		struct plan_item *item = plan->items->pdata[i];
+
+		if (item->op == PLAN_MKDIR || item->op == PLAN_UPLOAD || item->op == PLAN_DOWNLOAD ||
+		    item->op == PLAN_DELETE)
+			plan_print_item(item);
+	}
+
+	gint op = opt_download ? PLAN_DOWNLOAD : PLAN_UPLOAD;
+	gc_free gchar *transfer_str = g_format_size_full(plan->bytes[op], G_FORMAT_SIZE_IEC_UNITS);
+	gc_free gchar *skip_str = g_format_size_full(plan->bytes[PLAN_SKIP], G_FORMAT_SIZE_IEC_UNITS);
+
+	g_print("%u directories to create, %u files to %s (%" G_GOFFSET_FORMAT " bytes, %s), "
+		"%u files skipped (%s), %u conflicts",
+		plan->count[PLAN_MKDIR], plan->count[op], opt_download ? "download" : "upload", plan->bytes[op],
+		transfer_str, plan->count[PLAN_SKIP], skip_str, plan->count[PLAN_CONFLICT]);
+	if (opt_delete)
+		g_print(", %u files and directories to remove", plan->count[PLAN_DELETE]);
+	g_print("\n");
+}
+
+// remote entries that don't exist locally are removed, only the topmost
+// removed directory gets an item; entries below local conflicts are kept,
+// returns FALSE if the deletion limit is exceeded and nothing is removed
+static gboolean plan_build_deletes(struct plan *plan, struct tree *local, struct tree *remote)
+{
+	gc_hash_table_unref GHashTable *removed = g_hash_table_new(g_str_hash, g_str_equal);
+	gc_ptr_array_unref GPtrArray *deletes = g_ptr_array_new();
+	guint n_removed = 0, n_total = 0;
+
+	// directories that couldn't be read look empty
+	if (!local->ok) {
+		g_printerr("ERROR: Some local directories couldn't be read, not removing any remote files\n");
+		return FALSE;
+	}
+
+	for (guint i = 0; i < remote->entries->len; i++) {
+		struct entry *e = remote->entries->pdata[i];
+
+		if (!*e->path)
+			continue;
+
+		n_total++;
+
+		gc_free gchar *parent_path = path_parent(e->path);
+		if (g_hash_table_contains(removed, parent_path)) {
+			if (e->is_dir)
+				g_hash_table_add(removed, e->path);
+			n_removed++;
+			continue;
+		}
+
+		struct entry *local_parent = g_hash_table_lookup(local->index, parent_path);
+		if (!local_parent || !local_parent->is_dir || g_hash_table_contains(local->index, e->path))
+			continue;
+
+		if (e->is_dir)
+			g_hash_table_add(removed, e->path);
+		g_ptr_array_add(deletes, e);
+		n_removed++;
+	}
+
+	gchar *end;
+	gdouble limit = g_ascii_strtod(opt_max_delete, &end);
+	if (*end == '%')
+		limit = limit * n_total / 100;
+
+	if (n_removed > limit) {
+		g_printerr("ERROR: %u of %u remote files and directories would be removed, which is over the limit of "
+			   "%s, not removing anything (see --max-delete)\n",
+			   n_removed, n_total, opt_max_delete);
+		return FALSE;
+	}
+
+	for (guint i = 0; i < deletes->len; i++) {
+		struct entry *e = deletes->pdata[i];
+
+		plan_add(plan, PLAN_DELETE, e, NULL, -1, e->node);
+	}
+
+	return TRUE;
+}
+
+// execution
+
+static struct plan_item *plan_get_item(struct plan *plan, gint index)
+{
+	return index >= 0 ? plan->items->pdata[index] : NULL;
+}
+
+// items in directories that couldn't be created fail too
+static gboolean plan_parent_failed(struct plan *plan, struct plan_item *item)
+{
+	struct plan_item *parent = plan_get_item(plan, item->parent);
+
+	if (parent && parent->failed)
+		item->failed = TRUE;
+
+	return item->failed;
+}
+
+// remote directory the item is created in
+static struct mega_node *plan_get_parent_node(struct plan *plan, struct tree *remote, struct plan_item *item)
+{
+	struct plan_item *parent = plan_get_item(plan, item->parent);
+	if (parent)
+		return parent->node;
+
+	gc_free gchar *parent_path = path_parent(item->src->path);
+	struct entry *e = g_hash_table_lookup(remote->index, parent_path);
+
+	return e ? e->node : NULL;
+}
+
+static void exec_mkdir_local(struct plan_item *item)
+{
+	GError *local_err = NULL;
+	gc_free gchar *local_path = get_local_path(item->src->path);
+	gc_object_unref GFile *dir = g_file_new_for_path(local_path);
+
+	plan_print_item(item);
+
+	if (!g_file_make_directory(dir, NULL, &local_err)) {
+		g_printerr("ERROR: Can't create local directory %s: %s\n", local_path, local_err->message);
+		g_clear_error(&local_err);
+		item->failed = TRUE;
+	}
+}
+
+// creates the directories of the MKDIR items (sorted by path), remote
+// directories are all created by a single request
+static void exec_mkdirs(struct plan *plan, GPtrArray *items)
+{
+	GError *local_err = NULL;
+	gc_ptr_array_unref GPtrArray *remote_items = g_ptr_array_new();
+	gc_ptr_array_unref GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+	gc_ptr_array_unref GPtrArray *nodes = g_ptr_array_new();
+
+	for (guint i = 0; i < items->len; i++) {
+		struct plan_item *item = items->pdata[i];
+
+		if (plan_parent_failed(plan, item))
+			continue;
+
+		if (opt_download) {
+			exec_mkdir_local(item);
+		} else {
+			plan_print_item(item);
+			g_ptr_array_add(remote_items, item);
+			g_ptr_array_add(paths, get_remote_path(item->src->path));
+		}
+	}
+
+	if (paths->len == 0)
+		return;
+
+	if (!mega_session_mkdir_p(s, paths, nodes, NULL, &local_err)) {
+		g_printerr("ERROR: Can't create remote directories: %s\n", local_err->message);
+		g_clear_error(&local_err);
+	}
+
+	for (guint i = 0; i < remote_items->len; i++) {
+		struct plan_item *item = remote_items->pdata[i];
+
+		item->node = nodes->pdata[i];
+		if (!item->node)
+			item->failed = TRUE;
+	}
+}
+
+static void update_cur_file(const gchar *path)
+{
+	guint pending = opt_download ? downloads_active : mega_session_upload_pending(s);
+
+	if (pending > 1) {
+		g_free(cur_file);
+		cur_file = g_strdup_printf("%u files", pending);
+	} else if (path) {
+		g_free(cur_file);
+		cur_file = g_path_get_basename(path);
+	}
 }
 
-// upload operation
+static void up_file_done(struct mega_upload *up, struct mega_node *node, const GError *error, gpointer userdata)
+{
+	struct plan_item *item = userdata;
+
+	clear_progress();
+
+	if (error) {
+		gc_free gchar *remote_path = get_remote_path(item->src->path);
 
-static gboolean up_sync_file(GFile *root, GFile *file, const gchar *remote_path)
+		g_printerr("ERROR: Upload failed for %s: %s\n", remote_path, error->message);
+		item->failed = TRUE;
+	} else
+		item->node = node;
+
+	update_cur_file(NULL);
+}
+
+static void exec_upload(struct plan *plan, struct tree *remote, struct plan_item *item)
 {
 	GError *local_err = NULL;
+	gc_free gchar *local_path = get_local_path(item->src->path);
+	gc_free gchar *remote_path = get_remote_path(item->src->path);
+	gc_free gchar *name = g_path_get_basename(remote_path);
 
-	struct mega_node *node = mega_session_stat(s, remote_path);
-	if (node) {
-		g_printerr("ERROR: File already exists at %s\n", remote_path);
-		return FALSE;
+	struct mega_node *parent_node = plan_get_parent_node(plan, remote, item);
+	if (!parent_node) {
+		g_printerr("ERROR: Upload failed for %s: Parent directory doesn't exist\n", remote_path);
+		item->failed = TRUE;
+		return;
 	}
 
-	g_print("F %s\n", remote_path);
+	// keep a limited number of files in flight
+	if (mega_session_upload_pending(s) >= TOOL_UPLOADS_IN_FLIGHT)
+		while (mega_session_upload_pending(s) > TOOL_UPLOADS_IN_FLIGHT / 2)
+			mega_session_upload_poll(s, TRUE);
 
-	if (!opt_dryrun) {
-		g_free(cur_file);
-		cur_file = g_file_get_basename(file);
-		gc_free gchar* local_path = g_file_get_path(file);
+	plan_print_item(item);
+
+	gc_object_unref GFile *file = g_file_new_for_path(local_path);
+	gc_object_unref GFileInputStream *stream = g_file_read(file, NULL, &local_err);
+	if (!stream ||
+	    !mega_session_upload_submit(s, parent_node, name, stream, local_path, up_file_done, item, &local_err)) {
+		clear_progress();
+		g_printerr("ERROR: Upload failed for %s: %s\n", remote_path, local_err->message);
+		g_clear_error(&local_err);
+		item->failed = TRUE;
+		return;
+	}
 
-		if (!mega_session_put_compat(s, remote_path, local_path, &local_err)) {
-			if (!opt_noprogress && tool_is_stdout_tty())
-				g_print("\r" ESC_CLREOL);
+	update_cur_file(local_path);
+	mega_session_upload_poll(s, FALSE);
+}
 
-			g_printerr("ERROR: Upload failed for %s: %s\n", remote_path, local_err->message);
-			g_clear_error(&local_err);
-			return FALSE;
-		}
+static void exec_download(gpointer data, gpointer userdata)
+{
+	struct plan_item *item = data;
+	GError *local_err = NULL;
+	gc_free gchar *local_path = get_local_path(item->src->path);
+	gc_object_unref GFile *file = g_file_new_for_path(local_path);
+
+	g_mutex_lock(&output_lock);
+	downloads_active++;
+	plan_print_item(item);
+	update_cur_file(local_path);
+	g_mutex_unlock(&output_lock);
+
+	gboolean ok = mega_session_get(s, file, item->src->node, &local_err);
+
+	g_mutex_lock(&output_lock);
+	downloads_active--;
+	clear_progress();
+	if (!ok) {
+		gc_free gchar *remote_path = get_remote_path(item->src->path);
 
-		if (!opt_noprogress && tool_is_stdout_tty())
-			g_print("\r" ESC_CLREOL);
+		g_printerr("ERROR: Download failed for %s: %s\n", remote_path, local_err->message);
+		g_clear_error(&local_err);
+		item->failed = TRUE;
 	}
+	g_mutex_unlock(&output_lock);
+}
 
-	return TRUE;
+static void exec_transfers(struct plan *plan, struct tree *remote)
+{
+	GThreadPool *pool = NULL;
+
+	if (opt_download)
+		pool = g_thread_pool_new(exec_download, NULL, TOOL_DOWNLOADS_IN_FLIGHT, FALSE, NULL);
+
+	for (guint i = 0; i < plan->items->len; i++) {
+		struct plan_item *item = plan->items->pdata[i];
+
+		if ((item->op != PLAN_UPLOAD && item->op != PLAN_DOWNLOAD) || plan_parent_failed(plan, item))
+			continue;
+
+		if (pool)
+			g_thread_pool_push(pool, item, NULL);
+		else
+			exec_upload(plan, remote, item);
+	}
+
+	if (pool)
+		g_thread_pool_free(pool, FALSE, TRUE);
+
+	// wait for the rest of the uploads
+	while (mega_session_upload_poll(s, TRUE))
+		;
 }
 
-static gboolean up_sync_dir(GFile *root, GFile *file, const gchar *remote_path)
+// removes the remote entries with batched requests, after everything else
+// was uploaded
+static void exec_deletes(struct plan *plan, struct tree *remote)
 {
 	GError *local_err = NULL;
-	GFileInfo *i;
+	gc_ptr_array_unref GPtrArray *items = g_ptr_array_new();
+	gc_ptr_array_unref GPtrArray *nodes = g_ptr_array_new();
 
-	if (root != file) {
-		struct mega_node *node = mega_session_stat(s, remote_path);
-		if (node && node->type == MEGA_NODE_FILE) {
-			g_printerr("ERROR: File already exists at %s\n", remote_path);
-			return FALSE;
+	for (guint i = 0; i < plan->items->len; i++) {
+		struct plan_item *item = plan->items->pdata[i];
+
+		if (item->op == PLAN_DELETE) {
+			plan_print_item(item);
+			g_ptr_array_add(items, item);
+			g_ptr_array_add(nodes, item->node);
 		}
+	}
 
-		if (!node) {
-			g_print("D %s\n", remote_path);
+	gc_free gboolean *removed = g_new0(gboolean, nodes->len);
 
-			if (!opt_dryrun) {
-				if (!mega_session_mkdir(s, remote_path, &local_err)) {
-					g_printerr("ERROR: Can't create remote directory %s: %s\n", remote_path,
-						   local_err->message);
-					g_clear_error(&local_err);
-					return FALSE;
-				}
-			}
+	if (!mega_session_rm_nodes(s, nodes, removed, NULL, &local_err)) {
+		g_printerr("ERROR: Can't remove remote files: %s\n", local_err->message);
+		g_clear_error(&local_err);
+	}
+
+	// removed nodes are freed, so are their entries now
+	for (guint i = 0; i < items->len; i++) {
+		struct plan_item *item = items->pdata[i];
+
+		item->node = NULL;
+		if (removed[i])
+			tree_remove(remote, item->src->path);
+		else
+			item->failed = TRUE;
+	}
+}
+
+// records the files that are in sync now
+static void exec_update_state(struct plan *plan)
+{
+	for (guint i = 0; i < plan->items->len; i++) {
+		struct plan_item *item = plan->items->pdata[i];
+
+		if (item->op == PLAN_MKDIR || item->op == PLAN_DELETE)
+			continue;
+
+		if (item->failed || item->op == PLAN_CONFLICT) {
+			g_hash_table_remove(state, item->src->path);
+		} else if (item->op == PLAN_UPLOAD) {
+			if (item->node)
+				state_set(item->src, item->node);
+		} else if (item->op == PLAN_SKIP) {
+			if (item->node)
+				state_set(item->src, item->node);
 		}
 	}
+}
 
-	// sync children
-	gc_object_unref GFileEnumerator *e =
-		g_file_enumerate_children(file, "standard::*",
-					  opt_nofollow ? G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS : G_FILE_QUERY_INFO_NONE,
-					  NULL, &local_err);
-	if (!e) {
-		g_printerr("ERROR: Can't read local directory %s: %s\n", g_file_get_relative_path(root, file),
-			   local_err->message);
+// removes the remote files that were replaced by their uploaded new
+// versions, after the remote tree points to the new nodes
+static void exec_replaces(struct plan *plan)
+{
+	GError *local_err = NULL;
+	gc_ptr_array_unref GPtrArray *nodes = g_ptr_array_new();
+
+	for (guint i = 0; i < plan->items->len; i++) {
+		struct plan_item *item = plan->items->pdata[i];
+
+		if (item->op == PLAN_UPLOAD && item->replaced && !item->failed && item->node)
+			g_ptr_array_add(nodes, item->replaced);
+	}
+
+	if (nodes->len > 0 && !mega_session_rm_nodes(s, nodes, NULL, NULL, &local_err)) {
+		g_printerr("ERROR: Can't remove replaced remote files: %s\n", local_err->message);
 		g_clear_error(&local_err);
-		return FALSE;
 	}
+}
 
-	gboolean status = TRUE;
-	while ((i = g_file_enumerator_next_file(e, NULL, NULL))) {
-		const gchar *name = g_file_info_get_name(i);
-		gc_object_unref GFile *child = g_file_get_child(file, name);
-		GFileType type = g_file_query_file_type(child, 0, NULL);
-		gc_free gchar *child_remote_path = g_strconcat(remote_path, "/", name, NULL);
+// adds the uploaded files and created directories to the remote tree
+static void exec_update_remote_tree(struct plan *plan, struct tree *remote)
+{
+	for (guint i = 0; i < plan->items->len; i++) {
+		struct plan_item *item = plan->items->pdata[i];
 
-		if (type == G_FILE_TYPE_DIRECTORY) {
-			if (!up_sync_dir(root, child, child_remote_path))
-				status = FALSE;
-		} else if (type == G_FILE_TYPE_REGULAR) {
-			if (!up_sync_file(root, child, child_remote_path))
-				status = FALSE;
-		} else {
-			gc_free gchar* rel_path = g_file_get_relative_path(root, file);
+		if ((item->op != PLAN_MKDIR && item->op != PLAN_UPLOAD) || item->failed || !item->node)
+			continue;
+
+		tree_add(remote, g_strdup(item->src->path), item->op == PLAN_MKDIR, item->src->size)->node = item->node;
+	}
+}
+
+// records the results of the plan, returns FALSE if anything failed
+static gboolean sync_finish(struct plan *plan, struct tree *local, struct tree *remote)
+{
+	gboolean ok = plan->count[PLAN_CONFLICT] == 0;
+
+	if (opt_delete && !plan_build_deletes(plan, local, remote))
+		ok = FALSE;
+
+	if (opt_dryrun) {
+		plan_print(plan);
+		return ok;
+	}
+
+	if (plan->count[PLAN_DELETE] > 0)
+		exec_deletes(plan, remote);
+
+	for (guint i = 0; i < plan->items->len; i++)
+		if (((struct plan_item *)plan->items->pdata[i])->failed)
+			ok = FALSE;
+
+	if (!opt_download) {
+		exec_update_remote_tree(plan, remote);
+		exec_replaces(plan);
+		exec_update_state(plan);
+		state_prune(local);
+		state_save();
+		mega_session_save(s, NULL);
+	}
+
+	return ok;
+}
 
-			g_printerr("WARNING: Skipping special file %s\n", rel_path);
+// plans and executes the copy of the source entries (sorted by path),
+// returns FALSE if anything failed
+static gboolean sync_entries(GPtrArray *src_entries, struct tree *local, struct tree *remote)
+{
+	struct plan plan;
+	gc_ptr_array_unref GPtrArray *mkdirs = g_ptr_array_new();
+
+	plan_init(&plan);
+
+	for (guint i = 0; i < src_entries->len; i++) {
+		struct plan_item *item = plan_build_entry(&plan, src_entries->pdata[i], local, remote);
+
+		if (item && item->op == PLAN_MKDIR)
+			g_ptr_array_add(mkdirs, item);
+	}
+
+	if (!opt_dryrun) {
+		exec_mkdirs(&plan, mkdirs);
+		exec_transfers(&plan, remote);
+	}
+
+	gboolean ok = sync_finish(&plan, local, remote);
+	plan_clear(&plan);
+	return ok;
+}
+
+// creates the waiting directories, then submits the uploads that waited
+// for them
+static void exec_flush_mkdirs(struct plan *plan, struct tree *remote, GPtrArray *mkdirs, GPtrArray *uploads)
+{
+	exec_mkdirs(plan, mkdirs);
+	g_ptr_array_set_size(mkdirs, 0);
+
+	for (guint i = 0; i < uploads->len; i++) {
+		struct plan_item *item = uploads->pdata[i];
+
+		if (!plan_parent_failed(plan, item))
+			exec_upload(plan, remote, item);
+	}
+
+	g_ptr_array_set_size(uploads, 0);
+}
+
+// plans and uploads the local entries as the walker finds them, so that
+// uploads start before the whole tree is read; new directories are
+// collected while the walker keeps finding entries and are created
+// together, returns FALSE if anything failed
+static gboolean sync_found(GAsyncQueue *found, struct tree *local, struct tree *remote)
+{
+	struct plan plan;
+	struct entry *e;
+	gc_ptr_array_unref GPtrArray *mkdirs = g_ptr_array_new();
+	gc_ptr_array_unref GPtrArray *uploads = g_ptr_array_new();
+
+	plan_init(&plan);
+
+	while (TRUE) {
+		if (mkdirs->len >= MKDIR_BATCH_SIZE || (mkdirs->len > 0 && g_async_queue_length(found) <= 0))
+			exec_flush_mkdirs(&plan, remote, mkdirs, uploads);
+
+		// uploads only make progress while they're polled
+		if (mega_session_upload_pending(s) > 0) {
+			e = g_async_queue_timeout_pop(found, WALK_POLL_INTERVAL);
+			if (!e) {
+				mega_session_upload_poll(s, FALSE);
+				continue;
+			}
+		} else {
+			e = g_async_queue_pop(found);
 		}
 
-		g_object_unref(i);
+		if (e == &walk_done)
+			break;
+
+		struct plan_item *item = plan_build_entry(&plan, e, local, remote);
+		if (!item || opt_dryrun)
+			continue;
+
+		struct plan_item *parent = plan_get_item(&plan, item->parent);
+		gboolean parent_waits = parent && !parent->node && !parent->failed;
+
+		if (item->op == PLAN_MKDIR)
+			g_ptr_array_add(mkdirs, item);
+		else if (item->op == PLAN_UPLOAD && parent_waits)
+			g_ptr_array_add(uploads, item);
+		else if (item->op == PLAN_UPLOAD && !plan_parent_failed(&plan, item))
+			exec_upload(&plan, remote, item);
 	}
 
-	return status;
+	exec_flush_mkdirs(&plan, remote, mkdirs, uploads);
+
+	// wait for the rest of the uploads
+	while (mega_session_upload_poll(s, TRUE))
+		;
+
+	gboolean ok = sync_finish(&plan, local, remote);
+	plan_clear(&plan);
+	return ok;
+}
+
+// watch mode
+
+// Local tree is watched with inotify, one watch per directory. Changed
+// paths are collected until no event arrives for WATCH_DEBOUNCE (or for at
+// most WATCH_MAX_DELAY), then the changed files and directories are read
+// again and only they are planned and uploaded. Changed files that were
+// uploaded before are uploaded again and replace their remote nodes, see
+// the sync state. If the kernel drops events or the watches can't be added,
+// the whole local tree is walked again, every WATCH_RESCAN_INTERVAL in the
+// latter case. Remote changes are read
+// every WATCH_REFRESH_INTERVAL by an incremental refresh of the session and
+// if there are any, all local files are compared again, without reading
+// the local tree.
+
+#define WATCH_DEBOUNCE (2 * G_USEC_PER_SEC)
+#define WATCH_MAX_DELAY (30 * G_USEC_PER_SEC)
+#define WATCH_RESCAN_INTERVAL (5 * 60 * G_USEC_PER_SEC)
+#define WATCH_REFRESH_INTERVAL (60 * G_USEC_PER_SEC)
+
+struct watcher {
+	gint fd; // -1 if inotify is not available
+	GHashTable *wd_paths; // watch descriptor -> path of the directory
+	gboolean overflow; // events were lost, the tree must be walked again
+};
+
+#ifdef __linux__
+
+#define WATCH_MASK                                                                                                     \
+	(IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR |   \
+	 IN_EXCL_UNLINK)
+
+static void watcher_add_dir(struct watcher *w, const gchar *path)
+{
+	gc_free gchar *local_path = get_local_path(path);
+
+	if (w->fd < 0)
+		return;
+
+	gint wd = inotify_add_watch(w->fd, local_path, WATCH_MASK);
+	if (wd < 0) {
+		if (errno == ENOENT || errno == ENOTDIR)
+			return;
+
+		g_printerr("WARNING: Can't watch local directory %s (%s), changes will be found by walking the directory "
+			   "tree every %d minutes\n",
+			   local_path, g_strerror(errno), (gint)(WATCH_RESCAN_INTERVAL / G_USEC_PER_SEC / 60));
+		close(w->fd);
+		w->fd = -1;
+		return;
+	}
+
+	g_hash_table_replace(w->wd_paths, GINT_TO_POINTER(wd), g_strdup(path));
+}
+
+static void watcher_init(struct watcher *w)
+{
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	w->wd_paths = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+	w->overflow = FALSE;
+
+	if (w->fd < 0)
+		g_printerr("WARNING: Can't use inotify (%s), changes will be found by walking the directory tree every %d "
+			   "minutes\n",
+			   g_strerror(errno), (gint)(WATCH_RESCAN_INTERVAL / G_USEC_PER_SEC / 60));
 }
 
-// download operation
+static void watcher_fini(struct watcher *w)
+{
+	if (w->fd >= 0)
+		close(w->fd);
+	g_hash_table_unref(w->wd_paths);
+}
 
-static gboolean dl_sync_file(struct mega_node *node, GFile *file, const gchar *remote_path)
+// waits for events until timeout, changed paths are added to the dirty set,
+// returns TRUE if there were any
+static gboolean watcher_wait(struct watcher *w, gint64 timeout, GHashTable *dirty)
 {
-	GError *local_err = NULL;
-	gchar *local_path = g_file_get_path(file);
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+	gchar buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	gboolean changed = FALSE;
+	gssize len;
 
-	if (g_file_query_exists(file, NULL)) {
-		g_printerr("ERROR: File already exists at %s\n", local_path);
+	if (w->fd < 0) {
+		g_usleep(MAX(timeout, 0));
 		return FALSE;
 	}
 
-	g_print("F %s\n", local_path);
+	if (poll(&pfd, 1, MAX(timeout, 0) / 1000) <= 0)
+		return FALSE;
 
-	if (!opt_dryrun) {
-		g_free(cur_file);
-		cur_file = g_file_get_basename(file);
+	while ((len = read(w->fd, buf, sizeof buf)) > 0) {
+		for (gchar *p = buf; p < buf + len;) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			const gchar *dir_path = g_hash_table_lookup(w->wd_paths, GINT_TO_POINTER(ev->wd));
+
+			p += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				w->overflow = TRUE;
+			} else if (ev->mask & IN_IGNORED) {
+				g_hash_table_remove(w->wd_paths, GINT_TO_POINTER(ev->wd));
+			} else if (dir_path && ev->len > 0) {
+				g_hash_table_add(dirty, path_child(dir_path, ev->name));
+				changed = TRUE;
+			}
+		}
+	}
+
+	return changed || w->overflow;
+}
+
+#else
 
-		if (!mega_session_get_compat(s, g_file_get_path(file), remote_path, &local_err)) {
-			if (!opt_noprogress && tool_is_stdout_tty())
-				g_print("\r" ESC_CLREOL);
+static void watcher_add_dir(struct watcher *w, const gchar *path)
+{
+}
+
+static void watcher_init(struct watcher *w)
+{
+	w->fd = -1;
+	w->wd_paths = NULL;
+	w->overflow = FALSE;
+}
+
+static void watcher_fini(struct watcher *w)
+{
+}
+
+static gboolean watcher_wait(struct watcher *w, gint64 timeout, GHashTable *dirty)
+{
+	g_usleep(MAX(timeout, 0));
+	return FALSE;
+}
+
+#endif
+
+static void watcher_add_tree(struct watcher *w, struct tree *local)
+{
+	for (guint i = 0; i < local->entries->len && w->fd >= 0; i++) {
+		struct entry *e = local->entries->pdata[i];
+
+		if (e->is_dir)
+			watcher_add_dir(w, e->path);
+	}
+}
+
+// reads the changed paths again, returns the changed entries with their
+// parent directories, sorted by path
+static GPtrArray *watch_read_changes(struct watcher *w, struct tree *local, GHashTable *dirty)
+{
+	gc_hash_table_unref GHashTable *added = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GPtrArray *changed = g_ptr_array_new();
+	GHashTableIter iter;
+	const gchar *path;
+
+	local->added = added;
+
+	g_hash_table_iter_init(&iter, dirty);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&path, NULL)) {
+		gc_free gchar *local_path = get_local_path(path);
+		gc_object_unref GFile *file = g_file_new_for_path(local_path);
+		gc_object_unref GFileInfo *info = g_file_query_info(file, LOCAL_ATTRIBUTES, get_query_flags(), NULL, NULL);
+		GFileType type = info ? g_file_info_get_file_type(info) : G_FILE_TYPE_UNKNOWN;
+
+		// the parent directory may have been removed after the event
+		gc_free gchar *parent_path = path_parent(path);
+		struct entry *parent = g_hash_table_lookup(local->index, parent_path);
+		if (!parent || !parent->is_dir)
+			type = G_FILE_TYPE_UNKNOWN;
+
+		tree_remove(local, path);
+
+		if (type == G_FILE_TYPE_DIRECTORY) {
+			struct walker walker;
 
-			g_printerr("ERROR: Download failed for %s: %s\n", remote_path, local_err->message);
-			g_clear_error(&local_err);
-			return FALSE;
+			walker_start(&walker, local, tree_add(local, g_strdup(path), TRUE, 0), NULL);
+			walker_wait(&walker);
+		} else if (type == G_FILE_TYPE_REGULAR) {
+			tree_add_local_file(local, g_strdup(path), info);
 		}
+	}
+
+	local->added = NULL;
 
-		if (!opt_noprogress && tool_is_stdout_tty())
-			g_print("\r" ESC_CLREOL);
+	g_hash_table_iter_init(&iter, added);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&path, NULL)) {
+		struct entry *e = g_hash_table_lookup(local->index, path);
+
+		if (!e)
+			continue;
+
+		// new directories need their own watches
+		if (e->is_dir)
+			watcher_add_dir(w, path);
+
+		g_ptr_array_add(changed, e);
 	}
 
-	return TRUE;
+	// parents are needed to find where the entries go
+	gc_hash_table_unref GHashTable *parents = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	for (guint i = 0, len = changed->len; i < len; i++) {
+		struct entry *e = changed->pdata[i];
+		gchar *parent_path = *e->path ? path_parent(e->path) : NULL;
+
+		while (parent_path) {
+			if (g_hash_table_contains(added, parent_path) || g_hash_table_contains(parents, parent_path)) {
+				g_free(parent_path);
+				break;
+			}
+
+			struct entry *parent = g_hash_table_lookup(local->index, parent_path);
+			if (parent)
+				g_ptr_array_add(changed, parent);
+
+			g_hash_table_add(parents, parent_path);
+			parent_path = *parent_path ? path_parent(parent_path) : NULL;
+		}
+	}
+
+	g_ptr_array_sort(changed, entry_compare);
+	return changed;
+}
+
+static void watch_rescan(struct watcher *w, struct tree *local)
+{
+	struct walker walker;
+
+	tree_clear(local);
+	tree_init(local);
+	walk_local_tree(&walker, local, NULL);
+	walker_wait(&walker);
+	tree_sort(local);
+	watcher_add_tree(w, local);
 }
 
-static gboolean dl_sync_dir(struct mega_node *node, GFile *file, const gchar *remote_path)
+// returns TRUE if the remote filesystem may have changed
+static gboolean watch_refresh(struct tree *remote, struct mega_node **remote_dir)
 {
 	GError *local_err = NULL;
-	gc_free gchar *local_path = g_file_get_path(file);
+	gboolean changed = FALSE;
+
+	if (!mega_session_refresh_incremental(s, &changed, &local_err)) {
+		g_printerr("WARNING: Can't refresh remote filesystem: %s\n", local_err->message);
+		g_clear_error(&local_err);
+		changed = TRUE;
+	}
 
-	if (!g_file_query_exists(file, NULL)) {
-		g_print("D %s\n", local_path);
+	if (!changed)
+		return FALSE;
 
-		if (!opt_dryrun) {
-			if (!g_file_make_directory(file, NULL, &local_err)) {
-				g_printerr("ERROR: Can't create local directory %s: %s\n", local_path,
-					   local_err->message);
-				g_clear_error(&local_err);
-				return FALSE;
-			}
+	// node pointers in the remote tree may be gone
+	*remote_dir = mega_session_stat(s, opt_remote_path);
+	tree_clear(remote);
+	tree_init(remote);
+	if (*remote_dir && mega_node_is_container(*remote_dir))
+		walk_remote_tree(remote, *remote_dir);
+	else
+		*remote_dir = NULL;
+
+	return TRUE;
+}
+
+static void watch_loop(struct tree *local, struct tree *remote, struct mega_node *remote_dir)
+{
+	struct watcher w;
+	gc_hash_table_unref GHashTable *dirty = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	gint64 first_event = 0, last_event = 0;
+	gint64 now = g_get_monotonic_time();
+	gint64 next_refresh = now + WATCH_REFRESH_INTERVAL;
+	gint64 next_rescan = now + WATCH_RESCAN_INTERVAL;
+
+	watcher_init(&w);
+	watcher_add_tree(&w, local);
+
+	g_print("Watching %s for changes\n", opt_local_path);
+
+	while (TRUE) {
+		gint64 wake_at = next_refresh;
+
+		if (first_event)
+			wake_at = MIN(wake_at, MIN(last_event + WATCH_DEBOUNCE, first_event + WATCH_MAX_DELAY));
+		if (w.fd < 0)
+			wake_at = MIN(wake_at, next_rescan);
+
+		if (watcher_wait(&w, wake_at - g_get_monotonic_time(), dirty)) {
+			last_event = g_get_monotonic_time();
+			if (!first_event)
+				first_event = last_event;
 		}
-	} else {
-		if (g_file_query_file_type(file, 0, NULL) != G_FILE_TYPE_DIRECTORY) {
-			g_printerr("ERROR: Can't create local directory %s: file exists\n", local_path);
-			return FALSE;
+
+		now = g_get_monotonic_time();
+
+		if (w.overflow || (w.fd < 0 && now >= next_rescan)) {
+			if (w.overflow)
+				g_printerr("WARNING: Too many changes at once, walking the local tree again\n");
+
+			w.overflow = FALSE;
+			g_hash_table_remove_all(dirty);
+			first_event = 0;
+			next_rescan = now + WATCH_RESCAN_INTERVAL;
+
+			watch_rescan(&w, local);
+			if (remote_dir)
+				sync_entries(local->entries, local, remote);
+		} else if (first_event && (now >= last_event + WATCH_DEBOUNCE || now >= first_event + WATCH_MAX_DELAY)) {
+			gc_ptr_array_unref GPtrArray *changed = watch_read_changes(&w, local, dirty);
+
+			g_hash_table_remove_all(dirty);
+			first_event = 0;
+
+			if (remote_dir && changed->len > 0)
+				sync_entries(changed, local, remote);
 		}
-	}
 
-	// sync children
-	gboolean status = TRUE;
-	GSList *children = mega_session_get_node_chilren(s, node), *i;
-	for (i = children; i; i = i->next) {
-		struct mega_node *child = i->data;
-		gc_free gchar *child_remote_path = g_strconcat(remote_path, "/", child->name, NULL);
-		gc_object_unref GFile *child_file = g_file_get_child(file, child->name);
+		if (now >= next_refresh) {
+			next_refresh = now + WATCH_REFRESH_INTERVAL;
 
-		if (child->type == MEGA_NODE_FILE) {
-			if (!dl_sync_file(child, child_file, child_remote_path))
-				status = FALSE;
-		} else {
-			if (!dl_sync_dir(child, child_file, child_remote_path))
-				status = FALSE;
+			if (!watch_refresh(remote, &remote_dir))
+				continue;
+
+			if (!remote_dir) {
+				g_printerr("WARNING: Remote directory not found %s, waiting for it to reappear\n",
+					   opt_remote_path);
+				continue;
+			}
+
+			tree_sort(local);
+			sync_entries(local->entries, local, remote);
 		}
 	}
 
-	g_slist_free(children);
-	return status;
+	watcher_fini(&w);
 }
 
 // main program
 
 static int copy_main(int ac, char *av[])
 {
-	gc_object_unref GFile *local_file = NULL;
+	struct tree local = { 0 }, remote = { 0 };
+	struct walker walker;
+	GAsyncQueue *found = NULL;
 	gint status = 0;
 
 	tool_init(&ac, &av, "- synchronize local and remote mega.nz directories", entries,
@@ -237,6 +1566,26 @@ static int copy_main(int ac, char *av[])
 		goto err;
 	}
 
+	if (opt_watch && (opt_download || opt_dryrun)) {
+		g_printerr("ERROR: --watch can't be used with --download or --dryrun\n");
+		goto err;
+	}
+
+	if (opt_delete && (opt_download || opt_watch)) {
+		g_printerr("ERROR: --delete can't be used with --download or --watch\n");
+		goto err;
+	}
+
+	if (opt_delete) {
+		gchar *end;
+		gdouble limit = g_ascii_strtod(opt_max_delete, &end);
+
+		if (end == opt_max_delete || limit < 0 || (*end && strcmp(end, "%"))) {
+			g_printerr("ERROR: Invalid --max-delete value: %s\n", opt_max_delete);
+			goto err;
+		}
+	}
+
 	s = tool_start_session(TOOL_SESSION_OPEN);
 	if (!s)
 		goto err;
@@ -254,23 +1603,45 @@ static int copy_main(int ac, char *av[])
 	}
 
 	// check local dir existence
-	local_file = g_file_new_for_path(opt_local_path);
+	if (!opt_download && !g_file_test(opt_local_path, G_FILE_TEST_IS_DIR)) {
+		g_printerr("ERROR: Local directory not found %s\n", opt_local_path);
+		goto err;
+	}
 
+	// walk both trees at once
+	tree_init(&local);
+	tree_init(&remote);
+	if (!opt_download)
+		found = g_async_queue_new();
+	walk_local_tree(&walker, &local, found);
+	walk_remote_tree(&remote, remote_dir);
+	if (!opt_download)
+		state_load(remote_dir);
+
+	// uploads start while the local tree is being read
 	if (opt_download) {
-		if (!dl_sync_dir(remote_dir, local_file, opt_remote_path))
-			goto err;
+		walker_wait(&walker);
+		if (!sync_entries(remote.entries, &local, &remote))
+			status = 1;
 	} else {
-		if (g_file_query_file_type(local_file, 0, NULL) != G_FILE_TYPE_DIRECTORY) {
-			g_printerr("ERROR: Local directory not found %s\n", opt_local_path);
-			goto err;
-		}
-
-		if (!up_sync_dir(local_file, local_file, opt_remote_path))
+		if (!sync_found(found, &local, &remote))
 			status = 1;
-
-		mega_session_save(s, NULL);
+		walker_wait(&walker);
+		g_async_queue_unref(found);
 	}
 
+	tree_sort(&local);
+	if (!local.ok)
+		status = 1;
+
+	if (opt_watch)
+		watch_loop(&local, &remote, remote_dir);
+
+	if (state)
+		g_hash_table_unref(state);
+	g_free(state_path);
+	tree_clear(&local);
+	tree_clear(&remote);
 	g_free(cur_file);
 	tool_fini(s);
 	return status;
@@ -287,8 +1658,8 @@ const struct shell_tool shell_tool_copy = {
 	.usages = (char*[]){
 		"[-n] [--no-progress] --local <path> --remote <remotepath>",
 		"[-n] [--no-progress] --download --local <path> --remote <remotepath>",
+		"[-n] [--no-progress] --delete [--max-delete <N|N%>] --local <path> --remote <remotepath>",
+		"[--no-progress] --watch --local <path> --remote <remotepath>",
 		NULL
 	},
 };
-
-
@@ -0,0 +1,108 @@
+/*
+ *  megatools - Mega.nz client library and tools
+ *  Copyright (C) 2013  Ondřej Jirman <megous@megous.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "tools.h"
+#include "shell.h"
+
+static GOptionEntry entries[] = { { NULL } };
+
+static int cp_main(int ac, char *av[])
+{
+	gc_error_free GError *local_err = NULL;
+	static struct mega_session *s;
+	gc_free gchar *name = NULL;
+
+	tool_init(&ac, &av, "- copy files and folders within mega.nz", entries, TOOL_INIT_AUTH);
+
+	if (ac < 3) {
+		g_printerr("ERROR: You must specify files to copy and a destination!\n");
+		tool_fini(NULL);
+		return 1;
+	}
+
+	s = tool_start_session(TOOL_SESSION_OPEN);
+	if (!s) {
+		tool_fini(NULL);
+		return 1;
+	}
+
+	gint i, status = 0;
+	const gchar *dest_path = av[ac - 1];
+
+	// copy of a single file can be given a new name
+	struct mega_node *dest = mega_session_stat(s, dest_path);
+	if (!dest && ac == 3) {
+		gc_free gchar *parent_path = g_path_get_dirname(dest_path);
+
+		dest = mega_session_stat(s, parent_path);
+		name = g_path_get_basename(dest_path);
+	}
+
+	if (!dest || !mega_node_is_container(dest)) {
+		g_printerr("ERROR: Destination directory not found: %s\n", dest_path);
+		tool_fini(s);
+		return 1;
+	}
+
+	// names in the destination must stay unique
+	gc_hash_table_unref GHashTable *names = g_hash_table_new(g_str_hash, g_str_equal);
+	GSList *children = mega_session_get_node_chilren(s, dest), *l;
+	for (l = children; l; l = l->next)
+		g_hash_table_add(names, ((struct mega_node *)l->data)->name);
+	g_slist_free(children);
+
+	// all subtrees are copied with one request
+	gc_ptr_array_unref GPtrArray *nodes = g_ptr_array_new();
+	for (i = 1; i < ac - 1; i++) {
+		struct mega_node *n = mega_session_stat(s, av[i]);
+		const gchar *copy_name = name ? name : (n ? n->name : NULL);
+
+		if (!n) {
+			g_printerr("ERROR: File not found: %s\n", av[i]);
+			status = 1;
+		} else if (g_hash_table_contains(names, copy_name)) {
+			g_printerr("ERROR: File already exists in %s: %s\n", dest_path, copy_name);
+			status = 1;
+		} else {
+			g_hash_table_add(names, (gpointer)copy_name);
+			g_ptr_array_add(nodes, n);
+		}
+	}
+
+	if (nodes->len > 0 && !mega_session_copy(s, nodes, dest, name, NULL, &local_err)) {
+		g_printerr("ERROR: Can't copy files: %s\n", local_err->message);
+		g_clear_error(&local_err);
+		status = 1;
+	}
+
+	mega_session_save(s, NULL);
+
+	tool_fini(s);
+	return status;
+}
+
+const struct shell_tool shell_tool_cp = {
+	.name = "cp",
+	.main = cp_main,
+	.usages = (char*[]){
+		"<remotepaths>... <remotedir>",
+		"<remotepath> <newremotepath>",
+		NULL
+	},
+};
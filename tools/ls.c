@@ -19,6 +19,7 @@
 
 #include "tools.h"
 #include "shell.h"
+#include <stdio.h>
 
 static gboolean opt_names;
 static gboolean opt_recursive;
@@ -28,6 +29,7 @@ static gboolean opt_export;
 //static gboolean opt_color;
 static gboolean opt_header;
 static gboolean opt_print0;
+static gboolean opt_json;
 
 static GOptionEntry entries[] = {
 	{ "names", 'n', 0, G_OPTION_ARG_NONE, &opt_names,
@@ -37,27 +39,310 @@ static GOptionEntry entries[] = {
 	{ "header", '\0', 0, G_OPTION_ARG_NONE, &opt_header, "Show columns header in long listing", NULL },
 	{ "human", 'h', 0, G_OPTION_ARG_NONE, &opt_human, "Human readable sizes", NULL },
 	{ "print0", '0', 0, G_OPTION_ARG_NONE, &opt_print0, "Separate file paths with NULs", NULL },
+	{ "json", '\0', 0, G_OPTION_ARG_NONE, &opt_json, "Print one JSON object per file (JSON Lines)", NULL },
 	//{ "color",         'c',   0, G_OPTION_ARG_NONE,    &opt_color,        "Use color highlighting of node types",        NULL },
 	{ "export", 'e', 0, G_OPTION_ARG_NONE, &opt_export, "Show mega.nz download links (export)", NULL },
 	{ NULL }
 };
 
-static gint compare_node(struct mega_node *a, struct mega_node *b)
+// Nodes are listed in tree order, children sorted by name, straight from
+// an index of children built in one pass over the nodes. Paths are built
+// incrementally while descending and the output is collected in a single
+// buffer that's written out in large chunks.
+
+// output is written out when the buffer gets bigger than this
+#define OUTPUT_FLUSH_SIZE (64 * 1024)
+
+// timestamps are formatted once per 15 minutes, local time offsets and
+// their changes are all aligned to 15 minutes
+#define TIME_CACHE_PERIOD (15 * 60)
+
+static struct mega_session *s;
+static GHashTable *children;
+static GString *out;
+static gboolean header_printed;
+static gboolean collecting;
+static GSList *collected;
+
+static void output_flush(void)
 {
-	gchar path1[4096];
-	gchar path2[4096];
+	if (out->len == 0)
+		return;
 
-	if (mega_node_get_path(a, path1, 4096) && mega_node_get_path(b, path2, 4096))
-		return strcmp(path1, path2);
-	return 0;
+	// NULs and JSON are written as is, text goes through the print handler
+	if (opt_print0 || opt_json)
+		fwrite(out->str, 1, out->len, stdout);
+	else
+		g_print("%s", out->str);
+
+	g_string_truncate(out, 0);
+}
+
+static void append_time(glong timestamp)
+{
+	static gint64 cached_period = -1;
+	static gchar cached_prefix[32];
+	static gint cached_minute;
+
+	gint64 period = timestamp / TIME_CACHE_PERIOD;
+	if (period != cached_period) {
+		GDateTime *dt = g_date_time_new_from_unix_local(period * TIME_CACHE_PERIOD);
+		gc_free gchar *prefix = g_date_time_format(dt, "%Y-%m-%d %H");
+
+		g_strlcpy(cached_prefix, prefix, sizeof cached_prefix);
+		cached_minute = g_date_time_get_minute(dt);
+		cached_period = period;
+		g_date_time_unref(dt);
+	}
+
+	gint offset = timestamp - period * TIME_CACHE_PERIOD;
+	g_string_append_printf(out, "%s:%02d:%02d", cached_prefix, cached_minute + offset / 60, offset % 60);
+}
+
+static void append_json_string(const gchar *str)
+{
+	g_string_append_c(out, '"');
+
+	for (const guchar *p = (const guchar *)str; *p; p++) {
+		if (*p == '"' || *p == '\\') {
+			g_string_append_c(out, '\\');
+			g_string_append_c(out, *p);
+		} else if (*p < 0x20) {
+			g_string_append_printf(out, "\\u%04x", *p);
+		} else {
+			g_string_append_c(out, *p);
+		}
+	}
+
+	g_string_append_c(out, '"');
+}
+
+static void append_json_member(const gchar *name, const gchar *value)
+{
+	g_string_append_printf(out, ",\"%s\":", name);
+	if (value)
+		append_json_string(value);
+	else
+		g_string_append(out, "null");
+}
+
+static void print_json(struct mega_node *n, const gchar *path)
+{
+	g_string_append(out, "{\"path\":");
+	append_json_string(path);
+	append_json_member("name", n->name);
+	append_json_member("handle", n->handle);
+	append_json_member("parent", n->parent_handle);
+	append_json_member("owner", n->user_handle);
+	g_string_append_printf(out, ",\"type\":%d,\"size\":%" G_GUINT64_FORMAT ",\"mtime\":%ld", n->type, n->size,
+			       n->timestamp);
+
+	if (opt_export) {
+		gc_free gchar *link = n->link ? mega_node_get_link(n, TRUE) : NULL;
+
+		append_json_member("link", link);
+	}
+
+	g_string_append(out, "}\n");
+}
+
+static void print_node(struct mega_node *n, const gchar *path)
+{
+	if (opt_json) {
+		print_json(n, path);
+		goto flush;
+	}
+
+	if (opt_long && opt_header && !opt_export && !header_printed) {
+		g_string_append(out, "===================================================================================\n");
+		g_string_append_printf(out, "%-11s %-11s %-1s %13s %-19s %s\n", "Handle", "Owner", "T", "Size",
+				       "Mod. Date", opt_names ? "Filename" : "Path");
+		g_string_append(out, "===================================================================================\n");
+		header_printed = TRUE;
+	}
+
+	if (opt_export) {
+		gc_free gchar *link = n->link ? mega_node_get_link(n, TRUE) : NULL;
+
+		g_string_append_printf(out, "%-70s ", link ? link : "");
+	}
+
+	if (opt_long) {
+		g_string_append_printf(out, "%-11s %-11s %d ", n->handle, n->user_handle ? n->user_handle : "", n->type);
+
+		if (n->size == 0) {
+			g_string_append_printf(out, "%13s ", "-");
+		} else if (opt_human) {
+			gc_free gchar *size_str = g_format_size_full(n->size, G_FORMAT_SIZE_IEC_UNITS);
+
+			g_string_append_printf(out, "%13s ", size_str);
+		} else {
+			g_string_append_printf(out, "%13" G_GUINT64_FORMAT " ", n->size);
+		}
+
+		if (n->timestamp > 0)
+			append_time(n->timestamp);
+		else
+			g_string_append_printf(out, "%19s", "");
+
+		g_string_append_c(out, ' ');
+	}
+
+	g_string_append(out, opt_names ? n->name : path);
+	g_string_append_c(out, opt_print0 ? '\0' : '\n');
+
+flush:
+	if (out->len >= OUTPUT_FLUSH_SIZE)
+		output_flush();
+}
+
+// listed nodes are only collected when links need to be loaded first
+static void visit_node(struct mega_node *n, const gchar *path)
+{
+	if (collecting)
+		collected = g_slist_prepend(collected, n);
+	else
+		print_node(n, path);
+}
+
+static gint compare_node_name(gconstpointer a, gconstpointer b)
+{
+	const struct mega_node *n1 = *(struct mega_node **)a;
+	const struct mega_node *n2 = *(struct mega_node **)b;
+
+	return strcmp(n1->name, n2->name);
+}
+
+static void sort_children(gpointer key, gpointer value, gpointer userdata)
+{
+	g_ptr_array_sort(value, compare_node_name);
+}
+
+static void index_children(void)
+{
+	GSList *nodes = mega_session_ls_all(s), *i;
+
+	children = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)g_ptr_array_unref);
+
+	for (i = nodes; i; i = i->next) {
+		struct mega_node *n = i->data;
+
+		if (!n->name)
+			continue;
+
+		// top level nodes are children of the NULL key
+		GPtrArray *list = g_hash_table_lookup(children, n->parent);
+		if (!list) {
+			list = g_ptr_array_new();
+			g_hash_table_insert(children, n->parent, list);
+		}
+
+		g_ptr_array_add(list, n);
+	}
+
+	g_slist_free(nodes);
+	g_hash_table_foreach(children, sort_children, NULL);
+}
+
+static struct mega_node *find_child(struct mega_node *parent, const gchar *name)
+{
+	GPtrArray *list = g_hash_table_lookup(children, parent);
+
+	for (guint i = 0; list && i < list->len; i++) {
+		struct mega_node *n = list->pdata[i];
+
+		if (!strcmp(n->name, name))
+			return n;
+	}
+
+	return NULL;
+}
+
+// finds the node by path, path gets the node's path, node is NULL for /
+static gboolean find_node(const gchar *remote_path, struct mega_node **node, GString *path)
+{
+	gc_strfreev gchar **parts = g_strsplit(remote_path, "/", -1);
+	struct mega_node *n = NULL;
+	GPtrArray *stack = g_ptr_array_new();
+
+	for (gchar **p = parts; *p; p++) {
+		if (**p == '\0' || !strcmp(*p, "."))
+			continue;
+
+		if (!strcmp(*p, "..")) {
+			if (stack->len > 0)
+				g_ptr_array_remove_index(stack, stack->len - 1);
+			n = stack->len > 0 ? stack->pdata[stack->len - 1] : NULL;
+			continue;
+		}
+
+		n = find_child(n, *p);
+		if (!n) {
+			g_ptr_array_unref(stack);
+			return FALSE;
+		}
+
+		g_ptr_array_add(stack, n);
+	}
+
+	for (guint i = 0; i < stack->len; i++) {
+		g_string_append_c(path, '/');
+		g_string_append(path, ((struct mega_node *)stack->pdata[i])->name);
+	}
+
+	g_ptr_array_unref(stack);
+	*node = n;
+	return TRUE;
+}
+
+static void list_children(struct mega_node *parent, GString *path, gboolean recursive)
+{
+	GPtrArray *list = g_hash_table_lookup(children, parent);
+	gsize len = path->len;
+
+	for (guint i = 0; list && i < list->len; i++) {
+		struct mega_node *n = list->pdata[i];
+
+		g_string_append_c(path, '/');
+		g_string_append(path, n->name);
+
+		visit_node(n, path->str);
+		if (recursive)
+			list_children(n, path, TRUE);
+
+		g_string_truncate(path, len);
+	}
+}
+
+static void list_all(gint ac, char *av[])
+{
+	GString *path = g_string_sized_new(1024);
+
+	if (ac == 1) {
+		list_children(NULL, path, TRUE);
+		g_string_free(path, TRUE);
+		return;
+	}
+
+	for (gint j = 1; j < ac; j++) {
+		struct mega_node *n;
+
+		g_string_truncate(path, 0);
+		if (!find_node(av[j], &n, path))
+			continue;
+
+		if (n && (n->type == MEGA_NODE_FILE || !opt_names))
+			visit_node(n, path->str);
+
+		list_children(n, path, opt_recursive);
+	}
+
+	g_string_free(path, TRUE);
 }
 
 static int ls_main(int ac, char *av[])
 {
-	struct mega_session *s;
 	gc_error_free GError *local_err = NULL;
-	GSList *l = NULL, *i;
-	gint j;
 
 	tool_init(&ac, &av, "- list files stored at mega.nz", entries, TOOL_INIT_AUTH);
 	
@@ -67,79 +352,48 @@ static int ls_main(int ac, char *av[])
 		return 1;
 	}
 
+	if (opt_json && (opt_long || opt_print0)) {
+		g_printerr("ERROR: You can't combine --json with --long or --print0\n");
+		tool_fini(NULL);
+		return 1;
+	}
+
 	s = tool_start_session(TOOL_SESSION_OPEN);
 	if (!s) {
 		tool_fini(NULL);
 		return 1;
 	}
 
-	// gather nodes
-	if (ac == 1) {
-		l = mega_session_ls_all(s);
+	if (ac == 1 || ac > 2 || opt_recursive)
 		opt_names = FALSE;
-	} else {
-		if (ac > 2 || opt_recursive)
-			opt_names = FALSE;
 
-		for (j = 1; j < ac; j++) {
-			gchar *path = av[j];
+	index_children();
+	out = g_string_sized_new(OUTPUT_FLUSH_SIZE + 4096);
 
-			struct mega_node *n = mega_session_stat(s, path);
-			if (n && (n->type == MEGA_NODE_FILE || !opt_names))
-				l = g_slist_append(l, n);
+	// export if requested
+	if (opt_export) {
+		collecting = TRUE;
+		list_all(ac, av);
+		collecting = FALSE;
 
-			l = g_slist_concat(l, mega_session_ls(s, path, opt_recursive));
+		if (!mega_session_addlinks(s, collected, &local_err)) {
+			g_printerr("ERROR: Can't read links info from mega.nz: %s\n", local_err->message);
+			g_slist_free(collected);
+			g_hash_table_unref(children);
+			g_string_free(out, TRUE);
+			tool_fini(s);
+			return 1;
 		}
-	}
-
-	l = g_slist_sort(l, (GCompareFunc)compare_node);
-
-	// export if requested
-	if (opt_export && !mega_session_addlinks(s, l, &local_err)) {
-		g_printerr("ERROR: Can't read links info from mega.nz: %s\n", local_err->message);
-		g_slist_free(l);
-		tool_fini(s);
-		return 1;
-	}
 
-	if (l && opt_long && opt_header && !opt_export) {
-		g_print("===================================================================================\n");
-		g_print("%-11s %-11s %-1s %13s %-19s %s\n", "Handle", "Owner", "T", "Size", "Mod. Date",
-			opt_names ? "Filename" : "Path");
-		g_print("===================================================================================\n");
+		g_slist_free(collected);
 	}
 
-	for (i = l; i; i = i->next) {
-		struct mega_node *n = i->data;
-		gc_free gchar *node_path = mega_node_get_path_dup(n);
-
-		if (opt_export)
-			g_print("%-70s ", n->link ? mega_node_get_link(n, TRUE) : "");
-
-		if (opt_long) {
-			GDateTime *dt = g_date_time_new_from_unix_local(n->timestamp);
-			gc_free gchar *time_str = g_date_time_format(dt, "%Y-%m-%d %H:%M:%S");
-			g_date_time_unref(dt);
-
-			gc_free gchar *size_str = NULL;
-			if (opt_human)
-				size_str = n->size > 0 ? g_format_size_full(n->size, G_FORMAT_SIZE_IEC_UNITS) :
-							 g_strdup("-");
-			else
-				size_str = n->size > 0 ? g_strdup_printf("%" G_GUINT64_FORMAT, n->size) : g_strdup("-");
-
-			g_print("%-11s %-11s %d %13s %19s %s\n", n->handle, n->user_handle ? n->user_handle : "",
-				n->type, size_str, n->timestamp > 0 ? time_str : "", opt_names ? n->name : node_path);
-		} else {
-			g_print("%s", opt_names ? n->name : node_path);
-			if (opt_print0)
-				putchar('\0');
-			else
-				g_print("\n");
-		}
-	}
+	list_all(ac, av);
+	output_flush();
+	fflush(stdout);
 
-	g_slist_free(l);
+	g_hash_table_unref(children);
+	g_string_free(out, TRUE);
 	tool_fini(s);
 	return 0;
 }
@@ -148,7 +402,7 @@ const struct shell_tool shell_tool_ls = {
 	.name = "ls",
 	.main = ls_main,
 	.usages = (char*[]){
-		"[-e] [-h] [--header] [-l] [-R] [-n] [<remotepaths>...]",
+		"[-e] [-h] [--header] [-l] [-R] [-n] [--json] [<remotepaths>...]",
 		NULL
 	},
 };
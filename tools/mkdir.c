@@ -21,8 +21,13 @@
 #include "shell.h"
 
 static struct mega_session *s;
+static gboolean opt_parents;
 
-static GOptionEntry entries[] = { { NULL } };
+static GOptionEntry entries[] = {
+	{ "parents", 0, 0, G_OPTION_ARG_NONE, &opt_parents, "Create parent directories as needed, no error if existing",
+	  NULL },
+	{ NULL }
+};
 
 static int mkdir_main(int ac, char *av[])
 {
@@ -43,6 +48,26 @@ static int mkdir_main(int ac, char *av[])
 	}
 
 	gint i, status = 0;
+
+	// all directories are created at once
+	if (opt_parents) {
+		gc_ptr_array_unref GPtrArray *paths = g_ptr_array_new();
+		gc_ptr_array_unref GPtrArray *nodes = g_ptr_array_new();
+
+		for (i = 1; i < ac; i++)
+			g_ptr_array_add(paths, av[i]);
+
+		if (!mega_session_mkdir_p(s, paths, nodes, NULL, &local_err)) {
+			g_printerr("ERROR: Can't create directories: %s\n", local_err->message);
+			g_clear_error(&local_err);
+			status = 1;
+		}
+
+		mega_session_save(s, NULL);
+		tool_fini(s);
+		return status;
+	}
+
 	for (i = 1; i < ac; i++) {
 		gchar *path = av[i];
 
@@ -63,7 +88,7 @@ const struct shell_tool shell_tool_mkdir = {
 	.name = "mkdir",
 	.main = mkdir_main,
 	.usages = (char*[]){
-		"<remotepaths>...",
+		"[--parents] <remotepaths>...",
 		"/Contacts/<contactemail>",
 		NULL
 	},
@@ -19,17 +19,24 @@
 
 #include "tools.h"
 #include "shell.h"
+#ifndef G_OS_WIN32
+#include <gio/gunixinputstream.h>
+#endif
 
 static gchar *opt_path = "/Root";
 static gboolean opt_noprogress = FALSE;
+static gint64 opt_size = -1;
 
 static GOptionEntry entries[] = {
 	{ "path", '\0', 0, G_OPTION_ARG_STRING, &opt_path, "Remote path to save files to", "PATH" },
 	{ "no-progress", '\0', 0, G_OPTION_ARG_NONE, &opt_noprogress, "Disable progress bar", NULL },
+	{ "size", '\0', 0, G_OPTION_ARG_INT64, &opt_size, "Size of the data uploaded from standard input", "BYTES" },
 	{ NULL }
 };
 
 static gchar *cur_file = NULL;
+static struct mega_session *s;
+static gint status = 0;
 
 static void status_callback(struct mega_status_data *data, gpointer userdata)
 {
@@ -37,10 +44,107 @@ static void status_callback(struct mega_status_data *data, gpointer userdata)
 		tool_show_progress(cur_file, data);
 }
 
+// standard input of unknown size is read into memory up to this size
+#define STDIN_SPOOL_MAX (16 * 1024 * 1024)
+
+static GInputStream *open_stdin(goffset *size, GError **err)
+{
+#ifndef G_OS_WIN32
+	gc_object_unref GInputStream *stream = g_unix_input_stream_new(0, FALSE);
+	gsize len;
+
+	if (opt_size >= 0) {
+		*size = opt_size;
+		return g_object_ref(stream);
+	}
+
+	guchar *buf = g_malloc(STDIN_SPOOL_MAX + 1);
+	if (!g_input_stream_read_all(stream, buf, STDIN_SPOOL_MAX + 1, &len, NULL, err)) {
+		g_free(buf);
+		return NULL;
+	}
+
+	if (len > STDIN_SPOOL_MAX) {
+		g_free(buf);
+		g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER,
+			    "Standard input is bigger than 16 MiB, specify its size with --size");
+		return NULL;
+	}
+
+	*size = len;
+	return g_memory_input_stream_new_from_data(buf, len, g_free);
+#else
+	g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Upload from standard input is not supported on this platform");
+	return NULL;
+#endif
+}
+
+// remote file name used in messages
+static gchar *get_file_name(const gchar *path)
+{
+	return g_path_get_basename(strcmp(path, "-") ? path : opt_path);
+}
+
+// progress is reported for all files in flight together
+static void update_cur_file(const gchar *path)
+{
+	guint pending = mega_session_upload_pending(s);
+
+	if (pending > 1) {
+		g_free(cur_file);
+		cur_file = g_strdup_printf("%u files", pending);
+	} else if (path) {
+		g_free(cur_file);
+		cur_file = get_file_name(path);
+	}
+}
+
+static void upload_done(struct mega_upload *up, struct mega_node *node, const GError *error, gpointer userdata)
+{
+	const gchar *path = userdata;
+
+	if (error) {
+		if (!opt_noprogress && tool_is_stdout_tty())
+			g_print("\r" ESC_CLREOL "\n");
+
+		if (g_error_matches(error, MEGA_ERROR, MEGA_ERROR_EXISTS)) {
+			status = 2;
+		} else {
+			status = 1;
+		}
+
+		g_printerr("ERROR: Upload failed for '%s': %s\n", path, error->message);
+	} else {
+		if (!opt_noprogress) {
+			gc_free gchar *name = get_file_name(path);
+
+			if (tool_is_stdout_tty())
+				g_print("\r" ESC_CLREOL);
+			g_print("Uploaded %s\n", name);
+		}
+	}
+
+	update_cur_file(NULL);
+}
+
+static struct mega_upload *submit_upload(const gchar *path, GError **err)
+{
+	gc_object_unref GInputStream *stream = NULL;
+	goffset size;
+
+	if (strcmp(path, "-"))
+		return mega_session_upload_submit_compat(s, opt_path, path, upload_done, (gpointer)path, err);
+
+	stream = open_stdin(&size, err);
+	if (!stream)
+		return NULL;
+
+	return mega_session_upload_submit_stream_compat(s, opt_path, stream, size, upload_done, (gpointer)path, err);
+}
+
 static int put_main(int ac, char *av[])
 {
 	gc_error_free GError *local_err = NULL;
-	struct mega_session *s;
 
 	tool_init(&ac, &av, "- upload files to mega.nz", entries, TOOL_INIT_AUTH | TOOL_INIT_UPLOAD_OPTS);
 
@@ -50,6 +154,17 @@ static int put_main(int ac, char *av[])
 		return 1;
 	}
 
+	gint i, n_stdin = 0;
+	for (i = 1; i < ac; i++)
+		if (!strcmp(av[i], "-"))
+			n_stdin++;
+
+	if (n_stdin > 1) {
+		g_printerr("ERROR: Standard input can be uploaded only once!\n");
+		tool_fini(NULL);
+		return 1;
+	}
+
 	s = tool_start_session(TOOL_SESSION_OPEN);
 	if (!s) {
 		tool_fini(NULL);
@@ -58,16 +173,16 @@ static int put_main(int ac, char *av[])
 
 	mega_session_watch_status(s, status_callback, NULL);
 
-	gint status = 0;
-	gint i;
 	for (i = 1; i < ac; i++) {
 		gchar *path = av[i];
 
-		g_free(cur_file);
-		cur_file = g_path_get_basename(path);
+		// keep a limited number of files in flight
+		if (mega_session_upload_pending(s) >= TOOL_UPLOADS_IN_FLIGHT)
+			while (mega_session_upload_pending(s) > TOOL_UPLOADS_IN_FLIGHT / 2)
+				mega_session_upload_poll(s, TRUE);
 
-		// perform download
-		if (!mega_session_put_compat(s, opt_path, path, &local_err)) {
+		// submit upload
+		if (!submit_upload(path, &local_err)) {
 			if (!opt_noprogress && tool_is_stdout_tty())
 				g_print("\r" ESC_CLREOL "\n");
 
@@ -79,17 +194,20 @@ static int put_main(int ac, char *av[])
 
 			g_printerr("ERROR: Upload failed for '%s': %s\n", path, local_err->message);
 			g_clear_error(&local_err);
-		} else {
-			if (!opt_noprogress) {
-				if (tool_is_stdout_tty())
-					g_print("\r" ESC_CLREOL);
-				g_print("Uploaded %s\n", cur_file);
-			}
+			continue;
 		}
+
+		update_cur_file(path);
+		mega_session_upload_poll(s, FALSE);
 	}
 
+	// wait for the rest of the uploads
+	while (mega_session_upload_poll(s, TRUE))
+		;
+
 	mega_session_save(s, NULL);
 
+	g_free(cur_file);
 	tool_fini(s);
 	return status;
 }
@@ -99,6 +217,7 @@ const struct shell_tool shell_tool_put = {
 	.main = put_main,
 	.usages = (char*[]){
 		"[--no-progress] [--path <remotepath>] <paths>...",
+		"[--no-progress] [--size <bytes>] --path <remotepath> -",
 		NULL
 	},
 };
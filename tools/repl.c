@@ -0,0 +1,913 @@
+/*
+ *  megatools - Mega.nz client library and tools
+ *  Copyright (C) 2013  Ondřej Jirman <megous@megous.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "tools.h"
+#include "shell.h"
+#include <stdio.h>
+#ifdef G_OS_UNIX
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+static GOptionEntry entries[] = { { NULL } };
+
+// how often uploads are advanced while waiting for input, in ms
+#define INPUT_POLL_INTERVAL 100
+
+static struct mega_session *s;
+static gchar *cwd;
+
+// node index
+//
+// Paths and children of all nodes are indexed once and reused by the
+// following commands. Commands that change the filesystem drop the index,
+// it's rebuilt by the next lookup.
+
+static GHashTable *index_paths;
+static GHashTable *index_children;
+
+static void index_invalidate(void)
+{
+	g_clear_pointer(&index_paths, g_hash_table_unref);
+	g_clear_pointer(&index_children, g_hash_table_unref);
+}
+
+static gint compare_node_name(gconstpointer a, gconstpointer b)
+{
+	const struct mega_node *n1 = *(struct mega_node **)a;
+	const struct mega_node *n2 = *(struct mega_node **)b;
+
+	return g_strcmp0(n1->name_collate_key, n2->name_collate_key);
+}
+
+static void sort_children(gpointer key, gpointer value, gpointer userdata)
+{
+	g_ptr_array_sort(value, compare_node_name);
+}
+
+static void index_build(void)
+{
+	GSList *nodes, *i;
+	gchar path[4096];
+
+	if (index_paths)
+		return;
+
+	index_paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	index_children = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)g_ptr_array_unref);
+
+	nodes = mega_session_ls_all(s);
+	for (i = nodes; i; i = i->next) {
+		struct mega_node *n = i->data;
+
+		if (!mega_node_get_path(n, path, sizeof path))
+			continue;
+
+		g_hash_table_insert(index_paths, g_strdup(path), n);
+
+		// top level nodes are children of the NULL key
+		GPtrArray *children = g_hash_table_lookup(index_children, n->parent);
+		if (!children) {
+			children = g_ptr_array_new();
+			g_hash_table_insert(index_children, n->parent, children);
+		}
+
+		g_ptr_array_add(children, n);
+	}
+
+	g_slist_free(nodes);
+	g_hash_table_foreach(index_children, sort_children, NULL);
+}
+
+// resolves path relative to the current directory, without . and ..
+static gchar *resolve_path(const gchar *path)
+{
+	gc_free gchar *full = path[0] == '/' ? g_strdup(path) : g_strconcat(cwd, "/", path, NULL);
+	gc_strfreev gchar **parts = g_strsplit(full, "/", -1);
+	GString *out = g_string_new(NULL);
+
+	for (gchar **p = parts; *p; p++) {
+		if (**p == '\0' || !strcmp(*p, "."))
+			continue;
+
+		if (!strcmp(*p, "..")) {
+			gchar *slash = strrchr(out->str, '/');
+			if (slash)
+				g_string_truncate(out, slash - out->str);
+			continue;
+		}
+
+		g_string_append_c(out, '/');
+		g_string_append(out, *p);
+	}
+
+	if (out->len == 0)
+		g_string_append_c(out, '/');
+
+	return g_string_free(out, FALSE);
+}
+
+static struct mega_node *lookup(const gchar *path)
+{
+	index_build();
+
+	return g_hash_table_lookup(index_paths, path);
+}
+
+static GPtrArray *lookup_children(struct mega_node *n)
+{
+	index_build();
+
+	return g_hash_table_lookup(index_children, n);
+}
+
+// transfers
+//
+// Downloads run in a pool of threads, uploads are advanced by the session's
+// upload queue while the shell waits for input. Both keep running while
+// other commands are executed. Finished transfers are reported before the
+// next prompt.
+
+enum {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+};
+
+static const gchar *job_states[] = { "queued", "running", "done", "failed" };
+
+struct job {
+	guint id;
+	gboolean upload;
+	gchar *local_path;
+	gchar *remote_path;
+	gint state;
+	gchar *error;
+
+	// downloads work with a copy of the node, so that the node can be
+	// removed from the session while the file is downloaded
+	struct mega_node node;
+};
+
+static GPtrArray *jobs;
+static GMutex jobs_lock;
+static GThreadPool *download_pool;
+static guint next_job_id = 1;
+
+static struct job *job_new(gboolean upload, const gchar *local_path, const gchar *remote_path)
+{
+	struct job *job = g_new0(struct job, 1);
+
+	job->id = next_job_id++;
+	job->upload = upload;
+	job->local_path = g_strdup(local_path);
+	job->remote_path = g_strdup(remote_path);
+	g_ptr_array_add(jobs, job);
+
+	return job;
+}
+
+static void job_free(struct job *job)
+{
+	g_free(job->local_path);
+	g_free(job->remote_path);
+	g_free(job->error);
+	g_free(job->node.name);
+	g_free(job->node.handle);
+	g_free(job->node.key);
+	g_free(job);
+}
+
+static void job_finish(struct job *job, const GError *error)
+{
+	g_mutex_lock(&jobs_lock);
+	if (error)
+		job->error = g_strdup(error->message);
+	job->state = error ? JOB_FAILED : JOB_DONE;
+	g_mutex_unlock(&jobs_lock);
+}
+
+static void job_print(struct job *job)
+{
+	if (job->upload)
+		g_print("[%u] %s put %s -> %s", job->id, job_states[job->state], job->local_path, job->remote_path);
+	else
+		g_print("[%u] %s get %s -> %s", job->id, job_states[job->state], job->remote_path, job->local_path);
+
+	if (job->error)
+		g_print(": %s", job->error);
+
+	g_print("\n");
+}
+
+static void exec_download(gpointer data, gpointer userdata)
+{
+	struct job *job = data;
+	GError *local_err = NULL;
+	gc_object_unref GFile *file = g_file_new_for_path(job->local_path);
+
+	g_mutex_lock(&jobs_lock);
+	job->state = JOB_RUNNING;
+	g_mutex_unlock(&jobs_lock);
+
+	mega_session_get(s, file, &job->node, &local_err);
+	job_finish(job, local_err);
+	g_clear_error(&local_err);
+}
+
+static void upload_done(struct mega_upload *up, struct mega_node *node, const GError *error, gpointer userdata)
+{
+	job_finish(userdata, error);
+
+	// the uploaded file is a new node
+	index_invalidate();
+}
+
+// reports and forgets finished jobs, returns FALSE if some of them failed
+static gboolean report_jobs(void)
+{
+	gboolean ok = TRUE;
+
+	g_mutex_lock(&jobs_lock);
+
+	for (guint i = 0; i < jobs->len;) {
+		struct job *job = jobs->pdata[i];
+
+		if (job->state == JOB_DONE || job->state == JOB_FAILED) {
+			if (job->state == JOB_FAILED)
+				ok = FALSE;
+
+			job_print(job);
+			g_ptr_array_remove_index(jobs, i);
+			job_free(job);
+		} else {
+			i++;
+		}
+	}
+
+	g_mutex_unlock(&jobs_lock);
+	return ok;
+}
+
+static void wait_jobs(void)
+{
+	while (mega_session_upload_poll(s, TRUE))
+		;
+
+	// the pool is recreated for further downloads
+	g_thread_pool_free(download_pool, FALSE, TRUE);
+	download_pool = g_thread_pool_new(exec_download, NULL, TOOL_DOWNLOADS_IN_FLIGHT, FALSE, NULL);
+}
+
+// input
+
+static GString *input;
+static gboolean input_eof;
+
+static gchar *read_line(void)
+{
+	while (TRUE) {
+		gchar *nl = memchr(input->str, '\n', input->len);
+
+		if (nl) {
+			gchar *line = g_strndup(input->str, nl - input->str);
+
+			g_string_erase(input, 0, nl - input->str + 1);
+			return line;
+		}
+
+		if (input_eof) {
+			gchar *line = input->len > 0 ? g_strdup(input->str) : NULL;
+
+			g_string_truncate(input, 0);
+			return line;
+		}
+
+		gchar buf[4096];
+		gssize len;
+
+#ifdef G_OS_UNIX
+		// uploads only advance when the session is polled
+		struct pollfd pfd = { .fd = 0, .events = POLLIN };
+		gint timeout = mega_session_upload_pending(s) > 0 ? INPUT_POLL_INTERVAL : -1;
+
+		gint rv = poll(&pfd, 1, timeout);
+		mega_session_upload_poll(s, FALSE);
+		if (rv <= 0)
+			continue;
+
+		len = read(0, buf, sizeof buf);
+#else
+		len = fgets(buf, sizeof buf, stdin) ? strlen(buf) : 0;
+#endif
+		if (len <= 0)
+			input_eof = TRUE;
+		else
+			g_string_append_len(input, buf, len);
+	}
+}
+
+// commands
+
+static void print_node(struct mega_node *n, gboolean long_format)
+{
+	gboolean is_dir = mega_node_is_container(n);
+
+	if (long_format) {
+		gc_free gchar *size_str = n->size > 0 ? g_format_size_full(n->size, G_FORMAT_SIZE_IEC_UNITS) : g_strdup("-");
+		gc_free gchar *time_str = NULL;
+
+		if (n->timestamp > 0) {
+			GDateTime *dt = g_date_time_new_from_unix_local(n->timestamp);
+			time_str = g_date_time_format(dt, "%Y-%m-%d %H:%M:%S");
+			g_date_time_unref(dt);
+		}
+
+		g_print("%-11s %d %13s %19s %s%s\n", n->handle, n->type, size_str, time_str ? time_str : "", n->name,
+			is_dir ? "/" : "");
+	} else {
+		g_print("%s%s\n", n->name, is_dir ? "/" : "");
+	}
+}
+
+static gboolean cmd_cd(gint ac, gchar **av)
+{
+	gc_free gchar *path = resolve_path(ac > 1 ? av[1] : "/Root");
+
+	if (strcmp(path, "/")) {
+		struct mega_node *n = lookup(path);
+
+		if (!n || !mega_node_is_container(n)) {
+			g_printerr("ERROR: Directory not found: %s\n", path);
+			return FALSE;
+		}
+	}
+
+	g_free(cwd);
+	cwd = path;
+	path = NULL;
+	return TRUE;
+}
+
+static gboolean cmd_pwd(gint ac, gchar **av)
+{
+	g_print("%s\n", cwd);
+	return TRUE;
+}
+
+static gboolean cmd_ls(gint ac, gchar **av)
+{
+	gboolean long_format = FALSE, ok = TRUE;
+	gint i = 1;
+
+	if (i < ac && !strcmp(av[i], "-l")) {
+		long_format = TRUE;
+		i++;
+	}
+
+	gint n_paths = ac - i;
+	gchar *cur_dir[] = { ".", NULL };
+	gchar **paths = n_paths > 0 ? av + i : cur_dir;
+
+	for (; *paths; paths++) {
+		gc_free gchar *path = resolve_path(*paths);
+		struct mega_node *n = strcmp(path, "/") ? lookup(path) : NULL;
+
+		if (!n && strcmp(path, "/")) {
+			g_printerr("ERROR: File not found: %s\n", path);
+			ok = FALSE;
+			continue;
+		}
+
+		if (n && !mega_node_is_container(n)) {
+			print_node(n, long_format);
+			continue;
+		}
+
+		if (n_paths > 1)
+			g_print("%s:\n", path);
+
+		GPtrArray *children = lookup_children(n);
+		for (guint j = 0; children && j < children->len; j++)
+			print_node(children->pdata[j], long_format);
+	}
+
+	return ok;
+}
+
+static const gchar *node_type_name(struct mega_node *n)
+{
+	switch (n->type) {
+	case MEGA_NODE_FILE:
+		return "file";
+	case MEGA_NODE_FOLDER:
+		return "folder";
+	case MEGA_NODE_ROOT:
+		return "root";
+	case MEGA_NODE_INBOX:
+		return "inbox";
+	case MEGA_NODE_TRASH:
+		return "trash";
+	case MEGA_NODE_NETWORK:
+		return "contacts";
+	case MEGA_NODE_CONTACT:
+		return "contact";
+	default:
+		return "unknown";
+	}
+}
+
+static gboolean cmd_stat(gint ac, gchar **av)
+{
+	gboolean ok = TRUE;
+
+	if (ac < 2) {
+		g_printerr("ERROR: No files specified\n");
+		return FALSE;
+	}
+
+	for (gint i = 1; i < ac; i++) {
+		gc_free gchar *path = resolve_path(av[i]);
+		struct mega_node *n = lookup(path);
+
+		if (!n) {
+			g_printerr("ERROR: File not found: %s\n", path);
+			ok = FALSE;
+			continue;
+		}
+
+		g_print("Path:     %s\n", path);
+		g_print("Handle:   %s\n", n->handle);
+		g_print("Type:     %s\n", node_type_name(n));
+		if (n->type == MEGA_NODE_FILE)
+			g_print("Size:     %" G_GUINT64_FORMAT "\n", n->size);
+		if (n->timestamp > 0) {
+			GDateTime *dt = g_date_time_new_from_unix_local(n->timestamp);
+			gc_free gchar *time_str = g_date_time_format(dt, "%Y-%m-%d %H:%M:%S");
+
+			g_date_time_unref(dt);
+			g_print("Modified: %s\n", time_str);
+		}
+	}
+
+	return ok;
+}
+
+static gboolean cmd_mkdir(gint ac, gchar **av)
+{
+	gc_error_free GError *local_err = NULL;
+	gboolean parents = ac > 1 && !strcmp(av[1], "-p");
+	gint first = parents ? 2 : 1;
+
+	if (ac <= first) {
+		g_printerr("ERROR: No directories specified\n");
+		return FALSE;
+	}
+
+	gc_ptr_array_unref GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+	for (gint i = first; i < ac; i++)
+		g_ptr_array_add(paths, resolve_path(av[i]));
+
+	index_invalidate();
+
+	if (parents) {
+		gc_ptr_array_unref GPtrArray *nodes = g_ptr_array_new();
+
+		if (!mega_session_mkdir_p(s, paths, nodes, NULL, &local_err)) {
+			g_printerr("ERROR: Can't create directories: %s\n", local_err->message);
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	for (guint i = 0; i < paths->len; i++) {
+		if (!mega_session_mkdir(s, paths->pdata[i], &local_err)) {
+			g_printerr("ERROR: Can't create directory %s: %s\n", (gchar *)paths->pdata[i], local_err->message);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean cmd_rm(gint ac, gchar **av)
+{
+	gc_error_free GError *local_err = NULL;
+	gboolean ok = TRUE;
+
+	if (ac < 2) {
+		g_printerr("ERROR: No files specified for removal\n");
+		return FALSE;
+	}
+
+	gc_ptr_array_unref GPtrArray *nodes = g_ptr_array_new();
+	gc_hash_table_unref GHashTable *set = g_hash_table_new(NULL, NULL);
+	for (gint i = 1; i < ac; i++) {
+		gc_free gchar *path = resolve_path(av[i]);
+		struct mega_node *n = lookup(path);
+
+		if (!n) {
+			g_printerr("ERROR: File not found: %s\n", path);
+			ok = FALSE;
+		} else if (n->type != MEGA_NODE_FILE && n->type != MEGA_NODE_FOLDER) {
+			g_printerr("ERROR: Can't remove %s\n", path);
+			ok = FALSE;
+		} else if (!g_hash_table_contains(set, n)) {
+			g_hash_table_add(set, n);
+			g_ptr_array_add(nodes, n);
+		}
+	}
+
+	// nodes inside of other removed nodes go away with them
+	gc_ptr_array_unref GPtrArray *top = g_ptr_array_new();
+	for (guint i = 0; i < nodes->len; i++) {
+		struct mega_node *n = nodes->pdata[i], *p;
+
+		for (p = n->parent; p && !g_hash_table_contains(set, p); p = p->parent)
+			;
+
+		if (!p)
+			g_ptr_array_add(top, n);
+	}
+
+	if (top->len == 0)
+		return ok;
+
+	index_invalidate();
+
+	if (!mega_session_rm_nodes(s, top, NULL, NULL, &local_err)) {
+		g_printerr("ERROR: Can't remove files: %s\n", local_err->message);
+		return FALSE;
+	}
+
+	return ok;
+}
+
+static gboolean cmd_mv(gint ac, gchar **av)
+{
+	gc_error_free GError *local_err = NULL;
+	gc_free gchar *name = NULL;
+	gboolean ok = TRUE;
+
+	if (ac < 3) {
+		g_printerr("ERROR: You must specify files to move and a destination\n");
+		return FALSE;
+	}
+
+	gc_free gchar *dest_path = resolve_path(av[ac - 1]);
+	struct mega_node *dest = lookup(dest_path);
+
+	// single file can be moved or renamed to a new name
+	if (!dest && ac == 3) {
+		gc_free gchar *parent_path = g_path_get_dirname(dest_path);
+
+		dest = lookup(parent_path);
+		name = g_path_get_basename(dest_path);
+	}
+
+	if (!dest || !mega_node_is_container(dest)) {
+		g_printerr("ERROR: Destination directory not found: %s\n", dest_path);
+		return FALSE;
+	}
+
+	gc_ptr_array_unref GPtrArray *nodes = g_ptr_array_new();
+	gc_ptr_array_unref GPtrArray *moved = g_ptr_array_new();
+	for (gint i = 1; i < ac - 1; i++) {
+		gc_free gchar *path = resolve_path(av[i]);
+		struct mega_node *n = lookup(path);
+
+		if (!n) {
+			g_printerr("ERROR: File not found: %s\n", path);
+			ok = FALSE;
+			continue;
+		}
+
+		if (n->parent == dest && !name) {
+			g_printerr("ERROR: %s is already in %s\n", path, dest_path);
+			ok = FALSE;
+			continue;
+		}
+
+		// names in the destination must stay unique
+		gc_free gchar *target = name ? g_strdup(dest_path) : g_strconcat(dest_path, "/", n->name, NULL);
+		if (lookup(target)) {
+			g_printerr("ERROR: File already exists: %s\n", target);
+			ok = FALSE;
+			continue;
+		}
+
+		g_ptr_array_add(nodes, n);
+		if (n->parent != dest)
+			g_ptr_array_add(moved, n);
+	}
+
+	if (nodes->len == 0)
+		return ok;
+
+	index_invalidate();
+
+	if (moved->len > 0 && !mega_session_move(s, moved, dest, NULL, &local_err)) {
+		g_printerr("ERROR: Can't move files: %s\n", local_err->message);
+		return FALSE;
+	}
+
+	if (name) {
+		gc_ptr_array_unref GPtrArray *names = g_ptr_array_new();
+
+		g_ptr_array_add(names, name);
+		if (!mega_session_rename(s, nodes, names, &local_err)) {
+			g_printerr("ERROR: Can't rename %s: %s\n", av[1], local_err->message);
+			return FALSE;
+		}
+	}
+
+	return ok;
+}
+
+static gboolean cmd_get(gint ac, gchar **av)
+{
+	if (ac < 2 || ac > 3) {
+		g_printerr("ERROR: Usage: get <remotefile> [<localpath>]\n");
+		return FALSE;
+	}
+
+	gc_free gchar *path = resolve_path(av[1]);
+	struct mega_node *n = lookup(path);
+
+	if (!n || n->type != MEGA_NODE_FILE) {
+		g_printerr("ERROR: Remote file not found: %s\n", path);
+		return FALSE;
+	}
+
+	const gchar *local = ac > 2 ? av[2] : ".";
+	gc_free gchar *local_path = g_file_test(local, G_FILE_TEST_IS_DIR) ? g_build_filename(local, n->name, NULL) :
+									       g_strdup(local);
+
+	if (g_file_test(local_path, G_FILE_TEST_EXISTS)) {
+		g_printerr("ERROR: Local file already exists: %s\n", local_path);
+		return FALSE;
+	}
+
+	g_mutex_lock(&jobs_lock);
+	struct job *job = job_new(FALSE, local_path, path);
+	g_mutex_unlock(&jobs_lock);
+
+	job->node.name = g_strdup(n->name);
+	job->node.handle = g_strdup(n->handle);
+	job->node.key = g_memdup2(n->key, n->key_len);
+	job->node.key_len = n->key_len;
+	job->node.size = n->size;
+	job->node.type = n->type;
+
+	job_print(job);
+	g_thread_pool_push(download_pool, job, NULL);
+	return TRUE;
+}
+
+static gboolean cmd_put(gint ac, gchar **av)
+{
+	gc_error_free GError *local_err = NULL;
+
+	if (ac < 2 || ac > 3) {
+		g_printerr("ERROR: Usage: put <localfile> [<remotepath>]\n");
+		return FALSE;
+	}
+
+	if (!g_file_test(av[1], G_FILE_TEST_IS_REGULAR)) {
+		g_printerr("ERROR: Local file not found: %s\n", av[1]);
+		return FALSE;
+	}
+
+	gc_free gchar *path = resolve_path(ac > 2 ? av[2] : ".");
+	gc_free gchar *name = NULL;
+	struct mega_node *parent = lookup(path);
+
+	if (parent && mega_node_is_container(parent)) {
+		gchar *dir_path = path;
+
+		name = g_path_get_basename(av[1]);
+		path = g_strconcat(strcmp(dir_path, "/") ? dir_path : "", "/", name, NULL);
+		g_free(dir_path);
+	} else {
+		gc_free gchar *parent_path = g_path_get_dirname(path);
+
+		parent = lookup(parent_path);
+		name = g_path_get_basename(path);
+	}
+
+	if (!parent || !mega_node_is_container(parent)) {
+		g_printerr("ERROR: Remote directory not found for %s\n", path);
+		return FALSE;
+	}
+
+	if (lookup(path)) {
+		g_printerr("ERROR: File already exists: %s\n", path);
+		return FALSE;
+	}
+
+	gc_object_unref GFile *file = g_file_new_for_path(av[1]);
+	gc_object_unref GFileInputStream *stream = g_file_read(file, NULL, &local_err);
+	if (!stream) {
+		g_printerr("ERROR: Can't open %s: %s\n", av[1], local_err->message);
+		return FALSE;
+	}
+
+	g_mutex_lock(&jobs_lock);
+	struct job *job = job_new(TRUE, av[1], path);
+	job->state = JOB_RUNNING;
+	g_mutex_unlock(&jobs_lock);
+
+	if (!mega_session_upload_submit(s, parent, name, stream, av[1], upload_done, job, &local_err)) {
+		job_finish(job, local_err);
+		return FALSE;
+	}
+
+	job_print(job);
+	mega_session_upload_poll(s, FALSE);
+	return TRUE;
+}
+
+static gboolean cmd_jobs(gint ac, gchar **av)
+{
+	g_mutex_lock(&jobs_lock);
+	for (guint i = 0; i < jobs->len; i++)
+		job_print(jobs->pdata[i]);
+	g_mutex_unlock(&jobs_lock);
+
+	return TRUE;
+}
+
+static gboolean cmd_wait(gint ac, gchar **av)
+{
+	wait_jobs();
+	return TRUE;
+}
+
+static gboolean cmd_refresh(gint ac, gchar **av)
+{
+	gc_error_free GError *local_err = NULL;
+	gboolean changed = FALSE;
+
+	if (!mega_session_refresh_incremental(s, &changed, &local_err)) {
+		g_printerr("ERROR: Can't refresh the filesystem: %s\n", local_err->message);
+		return FALSE;
+	}
+
+	if (changed)
+		index_invalidate();
+
+	return TRUE;
+}
+
+static gboolean cmd_help(gint ac, gchar **av);
+
+struct command {
+	const gchar *name;
+	gboolean (*exec)(gint ac, gchar **av);
+	const gchar *usage;
+};
+
+static const struct command commands[] = {
+	{ "cd", cmd_cd, "cd [<remotedir>]" },
+	{ "pwd", cmd_pwd, "pwd" },
+	{ "ls", cmd_ls, "ls [-l] [<remotepaths>...]" },
+	{ "stat", cmd_stat, "stat <remotepaths>..." },
+	{ "get", cmd_get, "get <remotefile> [<localpath>]" },
+	{ "put", cmd_put, "put <localfile> [<remotepath>]" },
+	{ "rm", cmd_rm, "rm <remotepaths>..." },
+	{ "mkdir", cmd_mkdir, "mkdir [-p] <remotedirs>..." },
+	{ "mv", cmd_mv, "mv <remotepaths>... <remotedir> | mv <remotepath> <newremotepath>" },
+	{ "jobs", cmd_jobs, "jobs" },
+	{ "wait", cmd_wait, "wait" },
+	{ "refresh", cmd_refresh, "refresh" },
+	{ "help", cmd_help, "help" },
+	{ NULL }
+};
+
+static gboolean cmd_help(gint ac, gchar **av)
+{
+	for (const struct command *c = commands; c->name; c++)
+		g_print("  %s\n", c->usage);
+	g_print("  exit\n");
+
+	return TRUE;
+}
+
+static int repl_main(int ac, char *av[])
+{
+	gboolean interactive = TRUE;
+	gint status = 0;
+
+	tool_init(&ac, &av, "- interactive shell for mega.nz", entries,
+		  TOOL_INIT_AUTH | TOOL_INIT_UPLOAD_OPTS | TOOL_INIT_DOWNLOAD_OPTS);
+
+	s = tool_start_session(TOOL_SESSION_OPEN);
+	if (!s) {
+		tool_fini(NULL);
+		return 1;
+	}
+
+#ifdef G_OS_UNIX
+	interactive = isatty(0);
+#endif
+
+	cwd = g_strdup("/Root");
+	input = g_string_new(NULL);
+	jobs = g_ptr_array_new();
+	download_pool = g_thread_pool_new(exec_download, NULL, TOOL_DOWNLOADS_IN_FLIGHT, FALSE, NULL);
+
+	while (TRUE) {
+		gc_error_free GError *local_err = NULL;
+		gc_strfreev gchar **argv = NULL;
+		gint argc = 0;
+
+		if (!report_jobs())
+			status = 1;
+
+		if (interactive)
+			g_print("mega:%s> ", cwd);
+
+		gc_free gchar *line = read_line();
+		if (!line) {
+			if (interactive)
+				g_print("\n");
+			break;
+		}
+
+		if (!g_shell_parse_argv(line, &argc, &argv, &local_err)) {
+			// empty lines are not an error
+			if (!g_error_matches(local_err, G_SHELL_ERROR, G_SHELL_ERROR_EMPTY_STRING)) {
+				g_printerr("ERROR: %s\n", local_err->message);
+				status = 1;
+			}
+			continue;
+		}
+
+		if (!strcmp(argv[0], "exit") || !strcmp(argv[0], "quit"))
+			break;
+
+		const struct command *c;
+		for (c = commands; c->name; c++)
+			if (!strcmp(c->name, argv[0]))
+				break;
+
+		if (!c->name) {
+			g_printerr("ERROR: Unknown command: %s, try help\n", argv[0]);
+			status = 1;
+		} else if (!c->exec(argc, argv)) {
+			status = 1;
+		}
+	}
+
+	// transfers are finished before the session is closed
+	g_mutex_lock(&jobs_lock);
+	guint pending = jobs->len;
+	g_mutex_unlock(&jobs_lock);
+
+	if (pending > 0)
+		g_print("Waiting for %u transfers to finish\n", pending);
+
+	while (mega_session_upload_poll(s, TRUE))
+		;
+	g_thread_pool_free(download_pool, FALSE, TRUE);
+
+	if (!report_jobs())
+		status = 1;
+
+	index_invalidate();
+	g_ptr_array_unref(jobs);
+	g_string_free(input, TRUE);
+	g_free(cwd);
+
+	mega_session_save(s, NULL);
+
+	tool_fini(s);
+	return status;
+}
+
+const struct shell_tool shell_tool_shell = {
+	.name = "shell",
+	.main = repl_main,
+	.usages = (char*[]){
+		"",
+		NULL
+	},
+};
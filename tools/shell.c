@@ -36,7 +36,11 @@ extern struct shell_tool shell_tool_mkdir;
 extern struct shell_tool shell_tool_put;
 extern struct shell_tool shell_tool_reg;
 extern struct shell_tool shell_tool_rm;
+extern struct shell_tool shell_tool_mv;
+extern struct shell_tool shell_tool_cp;
 extern struct shell_tool shell_tool_copy;
+extern struct shell_tool shell_tool_batch;
+extern struct shell_tool shell_tool_shell;
 extern struct shell_tool shell_tool_test;
 extern struct shell_tool shell_tool_export;
 
@@ -51,6 +55,10 @@ static struct shell_tool* tools[] = {
 	&shell_tool_copy,
 	&shell_tool_mkdir,
 	&shell_tool_rm,
+	&shell_tool_mv,
+	&shell_tool_cp,
+	&shell_tool_batch,
+	&shell_tool_shell,
 	&shell_tool_reg,
 };
 